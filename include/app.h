@@ -15,6 +15,9 @@
 #include <ui_window.h>
 #include <ui_manager.h>
 #include <prot_main.h>
+#include <prot_pool.h>
+#include <worker_pool.h>
+#include <crypto_pool.h>
 #include <db_message.h>
 
 // Log message to info UI window
@@ -30,6 +33,13 @@ struct app_data {
 
     // Libevent event base
     struct event_base *base;
+    // Pool of outgoing connections to contacts and mailboxes
+    struct prot_pool *pool;
+    // Threads handling incomming connections (mailbox only), NULL
+    // if connections are handled by the main thread
+    struct worker_pool *workers;
+    // Threads doing expensive crypto operations for the main event loop
+    struct crypto_pool *crypto;
 
     // Contacts array
     int n_contacts;
@@ -74,6 +84,17 @@ struct app_data {
         int manual_mode;
         // Send all messages to mailboxes instead of sending directlly
         int mb_direct;
+        // Seconds unused outgoing connection is kept open
+        int pool_idle;
+        // Maximum number of outgoing connections kept open
+        int pool_max_conns;
+        // Number of threads handling mailbox connections
+        int n_workers;
+        // Number of threads doing crypto operations, 0 does them in the main thread
+        int n_crypto_threads;
+        // Also accept connections without Tor on this address ("tcp:<host>:<port>"
+        // or "unix:<path>"), used on trusted networks, NULL if disabled
+        char *direct_listen;
     } cf;
 
     // Global UI related data
@@ -150,7 +171,8 @@ void app_ui_chat_refresh(struct app_data *app, int keep_position);
 // Refresh displayed contacts list
 void app_update_contacts(struct app_data *app);
 
-// Add hooks to main protocol handler for incomming connection (app_actions.c)
+// Add hooks to main protocol handler for incomming connection, or outgoing one
+// to a contact (app_actions.c)
 void app_pmain_add_hooks(struct app_data *app, struct prot_main *pmain);
 
 // Sync messages with given contact
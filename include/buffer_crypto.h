@@ -4,6 +4,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <event2/buffer.h>
+#include <openssl/evp.h>
+#include <constants.h>
+
+// Maximum number of nested signed sections in the writer
+#define ED25519_WRITER_MAX_DEPTH 2
 
 // Take first len bytes in the given buffer, sign them using provided ed25519
 // private key and add signature to the end of buffer
@@ -13,6 +18,67 @@ int ed25519_buffer_sign(struct evbuffer *buff, size_t len, uint8_t *priv_key);
 // it against other data using provided ed25519 public key
 int ed25519_buffer_validate(struct evbuffer *buff, size_t len, uint8_t *pub_key);
 
+// Start new SHA-512 prehash, used to validate signature of the data which
+// is processed as it arrives, returns NULL on failure
+EVP_MD_CTX * ed25519_prehash_new(void);
+
+// Add first len bytes from the given buffer to the prehash, data is
+// not removed from the buffer, returns 0 on success and 1 on failure
+int ed25519_prehash_update(EVP_MD_CTX *hashctx, struct evbuffer *buff, size_t len);
+
+// Add len bytes from the given buffer starting at given offset to the prehash, data
+// is not removed from the buffer, returns 0 on success and 1 on failure
+int ed25519_prehash_update_at(EVP_MD_CTX *hashctx, struct evbuffer *buff, size_t offset, size_t len);
+
+// Finish the prehash and store hash of the data (ED25519_PREHASH_LEN bytes)
+// into hash, returns 0 on success and 1 on failure
+int ed25519_prehash_final(EVP_MD_CTX *hashctx, uint8_t *hash);
+
+// Finish the prehash and validate given ed25519 signature of hashed data
+// using provided public key, returns 1 if signature is valid and 0 otherwise
+int ed25519_prehash_validate(EVP_MD_CTX *hashctx, const uint8_t *sig, uint8_t *pub_key);
+
+// Validate given ed25519 signature of the data with given prehash (finished by
+// ed25519_prehash_final), returns 1 if signature is valid and 0 otherwise
+int ed25519_hash_validate(const uint8_t *hash, const uint8_t *sig, uint8_t *pub_key);
+
+// Finish the prehash and sign hashed data using provided ed25519 private
+// key, signature is stored into sig, returns 0 on success and 1 on failure
+int ed25519_prehash_sign(EVP_MD_CTX *hashctx, uint8_t *sig, uint8_t *priv_key);
+
+// Free given prehash context
+void ed25519_prehash_free(EVP_MD_CTX *hashctx);
+
+// Used to build signed data in a single pass, everything written is added to the
+// end of the buffer and hashed by all open sections, so signature of the section
+// can be added without reading the data again, sections can be nested
+struct ed25519_writer {
+    struct evbuffer *buff;
+    int err;   // Set to 1 once any operation fails
+    int depth; // Number of open sections
+    EVP_MD_CTX *hash[ED25519_WRITER_MAX_DEPTH];
+};
+
+// Initialize writer which adds data to the end of given buffer
+void ed25519_writer_init(struct ed25519_writer *w, struct evbuffer *buff);
+
+// Open new signed section, returns 0 on success and 1 on failure
+int ed25519_writer_begin(struct ed25519_writer *w);
+
+// Add data to the buffer and hash it
+void ed25519_writer_add(struct ed25519_writer *w, const void *data, size_t len);
+
+// Add data already written to the end of the buffer (for example using reserved
+// space) to the hash, data must be len bytes long
+void ed25519_writer_hash(struct ed25519_writer *w, const void *data, size_t len);
+
+// Close innermost section and add its signature created using given ed25519
+// private key, returns 0 on success and 1 if this or any previous operation failed
+int ed25519_writer_end(struct ed25519_writer *w, uint8_t *priv_key);
+
+// Free sections which were not closed, used on error
+void ed25519_writer_cleanup(struct ed25519_writer *w);
+
 enum rsa_buffer_errors {
     RSA_BUFFER_ERR_NONE,
     RSA_BUFFER_ERR_KEY,
@@ -45,4 +111,72 @@ enum rsa_buffer_errors rsa_buffer_encrypt(struct evbuffer *plain, uint8_t *der_p
 //
 enum rsa_buffer_errors rsa_buffer_decrypt(struct evbuffer *enc_buff, uint8_t *der_priv_key, struct evbuffer *plain_buff, int *enc_len);
 
+// Returns length of the format created by rsa_buffer_encrypt for plain text of given length
+size_t rsa_buffer_sealed_len(size_t plain_len);
+
+// Encryption in progress, plain text is passed in parts and encrypted straight into
+// reserved space at the end of the writer buffer, in rsa_buffer_encrypt format
+struct rsa_seal {
+    EVP_PKEY *pkey;
+    EVP_CIPHER_CTX *cipctx;
+    int ek_len;
+    uint8_t ek[AES_ENC_KEY_LENGTH];
+    uint8_t iv[AES_IV_LENGTH];
+};
+
+// Start encryption of plain_len bytes using RSA 2048bit key in DER format,
+// returns rsa buffer error code, seal is freed on error
+enum rsa_buffer_errors rsa_seal_begin(struct rsa_seal *seal, struct ed25519_writer *w, uint8_t *der_pub_key, size_t plain_len);
+
+// Encrypt next part of the plain text, returns rsa buffer error code, seal is freed on error
+enum rsa_buffer_errors rsa_seal_update(struct rsa_seal *seal, struct ed25519_writer *w, const void *plain, size_t len);
+
+// Finish encryption and add keys, returns rsa buffer error code, seal is always freed
+enum rsa_buffer_errors rsa_seal_end(struct rsa_seal *seal, struct ed25519_writer *w);
+
+// Build signed envelope in a single pass, first prefix_len bytes of the plain buffer are
+// added to the enc buffer as they are, the rest is encrypted (rsa_buffer_encrypt format),
+// and ed25519 signature of everything is added, returns rsa buffer error code
+enum rsa_buffer_errors rsa_buffer_seal_signed(
+    struct evbuffer *plain,
+    size_t prefix_len,
+    uint8_t *der_pub_key,
+    uint8_t *sig_priv_key,
+    struct evbuffer *enc
+);
+
+
+// Encryption using symmetric session key (AES-256-GCM) in progress, plain text is passed
+// in parts and encrypted straight into reserved space at the end of the writer buffer,
+// nonce must never be used twice with the same key, following format is created
+//
+//  >> DATA LEN (4 bytes)
+//  >> DATA
+//  >> TAG (16 bytes)
+//
+struct aead_seal {
+    EVP_CIPHER_CTX *cipctx;
+};
+
+// Returns length of the format created by aead seal for plain text of given length
+size_t aead_buffer_sealed_len(size_t plain_len);
+
+// Start encryption of plain_len bytes using given session key and nonce,
+// returns 0 on success and 1 on failure, seal is freed on error
+int aead_seal_begin(struct aead_seal *seal, struct ed25519_writer *w,
+    const uint8_t *key, const uint8_t *nonce, size_t plain_len);
+
+// Encrypt next part of the plain text, returns 0 on success and 1 on failure, seal is freed on error
+int aead_seal_update(struct aead_seal *seal, struct ed25519_writer *w, const void *plain, size_t len);
+
+// Finish encryption and add authentication tag, returns 0 on success and 1 on failure,
+// seal is always freed
+int aead_seal_end(struct aead_seal *seal, struct ed25519_writer *w);
+
+// Decrypt data in aead seal format, starting at given offset of the enc buffer, into plain
+// buffer using given session key and nonce, enc buffer is not modified, returns 0 on success
+// and 1 if data is incomplete or it was not encrypted using given key and nonce
+int aead_buffer_decrypt(struct evbuffer *enc, size_t offset,
+    const uint8_t *key, const uint8_t *nonce, struct evbuffer *plain);
+
 #endif
\ No newline at end of file
@@ -11,7 +11,10 @@
 // Onion service will expose this port
 #define DEEP_MESSENGER_PORT "20425"
 // Globaly used protocol version
-#define DEEP_MESSENGER_PROTOCOL_VER 1
+#define DEEP_MESSENGER_PROTOCOL_VER 2
+// Oldest protocol version we still talk, peers speaking it get only
+// the message types known to that version
+#define DEEP_MESSENGER_PROTOCOL_VER_MIN 1
 // Onion service will expose this port when running mailbox
 #define DEEP_MESSENGER_MAILBOX_PORT "20426"
 
@@ -40,10 +43,19 @@
 #define ED25519_PUB_KEY_LEN   32
 #define ED25519_PRIV_KEY_LEN  32
 #define ED25519_SIGNATURE_LEN 64
+// SHA-512 hash of the data, signed instead of the data itself
+#define ED25519_PREHASH_LEN   64
 
 #define AES_IV_LENGTH  16
 #define AES_ENC_KEY_LENGTH 256
 
+// Per contact session keys (AES-256-GCM), nonce is session ID followed by message counter
+#define SESSION_KEY_LEN   32
+#define SESSION_NONCE_LEN 12
+#define SESSION_TAG_LEN   16
+// Session key sealed using contact's RSA key (rsa_buffer_encrypt format, one padding block)
+#define SESSION_WRAP_LEN (4 + SESSION_KEY_LEN + AES_IV_LENGTH + AES_ENC_KEY_LENGTH + AES_IV_LENGTH)
+
 /**
  * Mailbox service specific constants
  */
@@ -0,0 +1,56 @@
+#ifndef _INCLUDE_CRYPTO_CTX_H_
+#define _INCLUDE_CRYPTO_CTX_H_
+
+#include <openssl/evp.h>
+
+// Maximum number of unused contexts of each kind kept by a single thread,
+// contexts put back once the thread already has that many are freed
+#define CRYPTO_CTX_ARENA_SIZE 8
+
+// Digest algorithms fetched at startup
+enum crypto_ctx_mds {
+    CRYPTO_CTX_SHA256,
+    CRYPTO_CTX_SHA512,
+    CRYPTO_CTX_SHA3_256,
+    CRYPTO_CTX_MD_N,
+};
+
+// Cipher algorithms fetched at startup
+enum crypto_ctx_ciphers {
+    CRYPTO_CTX_AES_256_CBC,
+    CRYPTO_CTX_AES_256_GCM,
+    CRYPTO_CTX_CIPHER_N,
+};
+
+// Fetch all algorithms from the default provider, so operations don't have to
+// look them up each time, called once at startup, if it's not called algorithms
+// are fetched once they are needed for the first time
+void crypto_ctx_init(void);
+
+// Get fetched digest algorithm
+const EVP_MD * crypto_ctx_md(enum crypto_ctx_mds md);
+
+// Get fetched cipher algorithm
+const EVP_CIPHER * crypto_ctx_cipher(enum crypto_ctx_ciphers cipher);
+
+// Get digest context of the current thread, unused contexts are reused instead of
+// being allocated, context must be initialized and given back using crypto_ctx_md_put
+EVP_MD_CTX * crypto_ctx_md_get(void);
+
+// Give back digest context taken by crypto_ctx_md_get, context is reset, so
+// it can be reused by the next operation, it may be given back by other thread
+void crypto_ctx_md_put(EVP_MD_CTX *ctx);
+
+// Get cipher context of the current thread, unused contexts are reused instead of
+// being allocated, context must be initialized and given back using crypto_ctx_cipher_put
+EVP_CIPHER_CTX * crypto_ctx_cipher_get(void);
+
+// Give back cipher context taken by crypto_ctx_cipher_get, context is reset (key
+// material is wiped), so it can be reused by the next operation
+void crypto_ctx_cipher_put(EVP_CIPHER_CTX *ctx);
+
+// Get ED25519 key generation context of the current thread, context is kept by
+// the thread and initialized only once, it must not be freed
+EVP_PKEY_CTX * crypto_ctx_ed25519_keygen(void);
+
+#endif
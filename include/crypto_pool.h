@@ -0,0 +1,118 @@
+#ifndef _INCLUDE_CRYPTO_POOL_H_
+#define _INCLUDE_CRYPTO_POOL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <constants.h>
+
+// Default number of crypto worker threads
+#define CRYPTO_POOL_DEFAULT_THREADS 2
+// Maximum number of crypto worker threads
+#define CRYPTO_POOL_MAX_THREADS 16
+// Maximum length of the key used by a crypto job
+#define CRYPTO_JOB_MAX_KEY_LEN CLIENT_ENC_KEY_PRIV_LEN
+
+// Operations which can be offloaded to the crypto pool
+enum crypto_job_types {
+    CRYPTO_JOB_SIGN,        // ed25519_buffer_sign, signature is added to the end of in buffer
+    CRYPTO_JOB_VERIFY,      // ed25519_buffer_validate, result is 1 if signature is valid
+    CRYPTO_JOB_SEAL,        // rsa_buffer_encrypt, in buffer is encrypted into out buffer
+    CRYPTO_JOB_OPEN,        // rsa_buffer_decrypt, in buffer is decrypted into out buffer
+    CRYPTO_JOB_SEAL_SIGN,   // rsa_buffer_seal_signed, first len bytes of in are not encrypted
+    CRYPTO_JOB_VERIFY_HASH, // ed25519_hash_validate, in holds prehash of the data followed by signature
+};
+
+// Struct predefinition
+struct crypto_job;
+struct crypto_pool;
+
+// Called from the event loop thread once job is done
+typedef void (*crypto_job_cb)(struct crypto_job *job, void *arg);
+
+// Single crypto operation, job owns all of its data so worker thread
+// never touches memory of the object which submitted it
+struct crypto_job {
+    enum crypto_job_types type;
+
+    // Input data and output buffer, see job types for meaning
+    struct evbuffer *in;
+    struct evbuffer *out;
+    // Number of bytes from the in buffer to sign or verify (0 = all),
+    // or length of unencrypted prefix when sealing and signing
+    size_t len;
+    // Copy of the key used by the operation
+    uint8_t key[CRYPTO_JOB_MAX_KEY_LEN];
+    // Ed25519 private key used to sign sealed data
+    uint8_t sign_key[ED25519_PRIV_KEY_LEN];
+
+    // Result of the operation, for sign 0 on success, for verify 1 if
+    // signature is valid, for others rsa buffer error code
+    int result;
+    // Length of the encrypted data (seal and open)
+    int enc_len;
+
+    crypto_job_cb cb;
+    void *arg;
+
+    // Used internally, only accessed from the event loop thread
+    int in_flight;  // Job is submitted and callback was not called yet
+    int freed;      // Job was freed while in flight, pool will free it once done
+
+    struct crypto_job *next;
+};
+
+// Pool of threads running crypto jobs, completed jobs are passed back
+// to the event loop thread using an eventfd
+struct crypto_pool {
+    struct event_base *base;
+
+    int n_threads;
+    pthread_t *threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;      // Signaled once new job is queued or pool is stopped
+    int stop;
+
+    // Jobs waiting for worker thread
+    struct crypto_job *queue_head;
+    struct crypto_job *queue_tail;
+    // Completed jobs waiting for the event loop
+    struct crypto_job *done_head;
+    struct crypto_job *done_tail;
+
+    int done_fd;              // Eventfd written by workers once jobs complete
+    struct event *done_ev;
+
+    struct crypto_pool *next; // Next pool in the list of pools
+};
+
+// Allocate new crypto job of given type, key_len bytes of the key are
+// copied into the job, in and out buffers are empty, freed jobs are
+// reused together with their buffers
+struct crypto_job * crypto_job_new(enum crypto_job_types type, const uint8_t *key, size_t key_len);
+
+// Run given job in the current thread
+void crypto_job_run(struct crypto_job *job);
+
+// Free given job, if job is in flight its callback will not be called
+// and it will be freed once worker is done with it
+void crypto_job_free(struct crypto_job *job);
+
+// Allocate new crypto pool with n_threads threads, completion callbacks are
+// called from given event base, pool is used by everyone using this base,
+// libevent thread support must be enabled before the base is created
+struct crypto_pool * crypto_pool_new(struct event_base *base, int n_threads);
+
+// Get pool associated with given event base, returns NULL if there is none
+struct crypto_pool * crypto_pool_get(struct event_base *base);
+
+// Submit job to the pool, once job is done callback is called from the
+// event loop thread, job is still owned by the caller which must free it
+void crypto_pool_submit(struct crypto_pool *pool, struct crypto_job *job, crypto_job_cb cb, void *arg);
+
+// Stop all threads and free the pool, jobs not yet done are discarded
+void crypto_pool_free(struct crypto_pool *pool);
+
+#endif
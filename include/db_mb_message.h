@@ -30,6 +30,10 @@ void db_mb_message_free(struct db_mb_message *msg);
 // Set message content
 void db_mb_message_set_data(struct db_mb_message *msg, const uint8_t *data, int data_len);
 
+// Resize message content to given length and return pointer to it, used
+// to fill the content in place without an intermediate copy
+uint8_t * db_mb_message_data_reserve(struct db_mb_message *msg, int data_len);
+
 // Save changes on given object to database
 void db_mb_message_save(sqlite3 *db, struct db_mb_message *msg);
 
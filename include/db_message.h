@@ -97,4 +97,23 @@ struct db_message ** db_message_get_all(sqlite3 *db, struct db_contact *cont, en
 // Free previously fetched message list
 void db_message_free_all(struct db_message **msgs, int n_msgs);
 
+// Messages can be saved provisionally as a part of a batch, changes made by
+// the batch are kept only if batch is committed, otherwise they are reverted
+
+// Start new provisional batch, returns batch ID
+int db_message_batch_begin(sqlite3 *db);
+// Save message as a part of given batch
+void db_message_batch_save(sqlite3 *db, int batch, struct db_message *msg);
+// Keep all changes made within given batch
+void db_message_batch_commit(sqlite3 *db, int batch);
+// Revert all changes made within given batch, if batch is 0 changes
+// made by all unfinished batches are reverted (used on startup)
+void db_message_batch_rollback(sqlite3 *db, int batch);
+
+// Start write transaction, everything saved until it ends is written
+// to the disk at once, transactions can be nested
+void db_message_write_begin(sqlite3 *db);
+// End write transaction started by begin, keeping all changes
+void db_message_write_end(sqlite3 *db);
+
 #endif
\ No newline at end of file
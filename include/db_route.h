@@ -0,0 +1,46 @@
+#ifndef _INCLUDE_DB_ROUTE_H_
+#define _INCLUDE_DB_ROUTE_H_
+
+#include <sqlite3.h>
+#include <onion.h>
+#include <helpers.h>
+
+// Maximum length of the route address (host name or unix socket path)
+#define DB_ROUTE_ADDR_MAX_LEN 107
+
+// Route used to reach given onion address (contact or mailbox), peers without
+// route are reached over Tor using the default socks server
+struct db_route {
+    int id;
+    char onion_address[ONION_ADDRESS_LEN + 1];
+
+    int transport;                           // One of prot_transport_types
+    char address[DB_ROUTE_ADDR_MAX_LEN + 1]; // Host, socks server host or unix socket path
+    char port[MAX_PORT_STR_LEN];             // Empty for unix sockets
+};
+
+// Create new empty route object
+struct db_route * db_route_new(void);
+
+// Free given route object, if you want to save it call the
+// save function first
+void db_route_free(struct db_route *route);
+
+// Save changes on given object to database
+void db_route_save(sqlite3 *db, struct db_route *route);
+
+// Remove given route from the database
+void db_route_delete(sqlite3 *db, struct db_route *route);
+
+// Get route for given onion address
+struct db_route * db_route_get_by_onion(sqlite3 *db, const char *onion_address, struct db_route *dest);
+
+// Get all routes from the db, they are returned as array of pointers to
+// route structures, n will be set to length of the array, if there are
+// no routes in the db NULL will be returned
+struct db_route ** db_route_get_all(sqlite3 *db, int *n);
+
+// Free route list fetched using db_route_get_all()
+void db_route_free_all(struct db_route **routes, int n);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef _INCLUDE_DB_SESSION_H_
+#define _INCLUDE_DB_SESSION_H_
+
+#include <stdint.h>
+#include <sqlite3.h>
+#include <constants.h>
+
+enum db_session_directions {
+    DB_SESSION_LOCAL,  // Used to encrypt messages we send to the contact
+    DB_SESSION_REMOTE, // Used to decrypt messages contact sends to us
+};
+
+// Symmetric key messages to or from the contact are encrypted with, local
+// session is replaced once too many messages are sent using it, remote
+// sessions are kept so messages still waiting in the mailbox can be read
+struct db_session {
+    int id;
+    int contact_id;
+    enum db_session_directions direction;
+
+    uint32_t session_id;          // Counted per contact by the sender, part of every nonce
+    uint8_t key[SESSION_KEY_LEN];
+
+    // Key sealed using contact's RSA key, sent with messages until
+    // contact confirms it has the key (local sessions only), key is
+    // sealed after session is created, until then wrap is not stored
+    uint8_t wrap[SESSION_WRAP_LEN];
+    int wrapped;
+    int confirmed;
+
+    // Counter used by the next message (local sessions only)
+    uint64_t counter;
+};
+
+// Create new empty session object
+struct db_session * db_session_new(void);
+
+// Free given session object, key is wiped, if you want to save
+// it call the save function first
+void db_session_free(struct db_session *sess);
+
+// Save changes on given object to database
+void db_session_save(sqlite3 *db, struct db_session *sess);
+
+// Remove given session from the database
+void db_session_delete(sqlite3 *db, struct db_session *sess);
+
+// Store sealed key of the session with given database ID, other fields are not changed
+void db_session_set_wrap(sqlite3 *db, int id, const uint8_t *wrap);
+
+// Mark local session with given ID as known by the contact
+void db_session_confirm(sqlite3 *db, int contact_id, uint32_t session_id);
+
+// Get current local session of the contact
+struct db_session * db_session_get_local(sqlite3 *db, int contact_id, struct db_session *dest);
+
+// Get remote session of the contact with given ID
+struct db_session * db_session_get_remote(sqlite3 *db, int contact_id, uint32_t session_id, struct db_session *dest);
+
+#endif
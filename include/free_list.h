@@ -0,0 +1,50 @@
+#ifndef _INCLUDE_FREE_LIST_H_
+#define _INCLUDE_FREE_LIST_H_
+
+#include <stdlib.h>
+#include <pthread.h>
+
+// Default maximum number of unused objects kept in the list
+#define FREE_LIST_MAX_FREE 64
+
+// Initializer for statically allocated free list of objects of given type
+#define FREE_LIST_INIT(type, max_free) \
+    { sizeof(type), (max_free), 0, NULL, PTHREAD_MUTEX_INITIALIZER }
+
+// Unused object kept in the list (used internally)
+struct free_list_item {
+    struct free_list_item *next;
+};
+
+// List of unused objects of the same size, objects put back into the list
+// are reused by next allocation instead of being freed, list can be shared
+// between threads
+struct free_list {
+    size_t item_size; // Size of a single object
+    int max_free;     // Maximum number of unused objects kept in the list
+    int n_free;       // Number of unused objects currently in the list
+
+    struct free_list_item *head;
+    pthread_mutex_t lock;
+};
+
+// Get object from the list, allocates new object if list is empty,
+// returned memory is not initialized
+void * free_list_get(struct free_list *fl);
+
+// Put object back into the list, object is freed if list is full
+void free_list_put(struct free_list *fl, void *item);
+
+// Take object from the list, returns NULL if list is empty, used for objects
+// which keep their resources while they are in the list, list itself uses the
+// first pointer of the object so it must not hold any of these resources
+void * free_list_take(struct free_list *fl);
+
+// Put object back into the list, returns 1 if object is kept and 0 if
+// list is full, in which case caller must free the object
+int free_list_keep(struct free_list *fl, void *item);
+
+// Free all unused objects kept in the list
+void free_list_clear(struct free_list *fl);
+
+#endif
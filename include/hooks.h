@@ -23,9 +23,15 @@ struct hook_list * hook_list_new(void);
 // Free the hook list and all it's hooks
 void hook_list_free(struct hook_list *list);
 
+// Remove all hooks from the list
+void hook_list_clear(struct hook_list *list);
+
 // Add new hook to the hook list
 void hook_add(struct hook_list *list, int hevent, hook_callback cb, void *cbarg);
 
+// Add new hook to the hook list, unless the same hook is already in the list
+void hook_add_unique(struct hook_list *list, int hevent, hook_callback cb, void *cbarg);
+
 // Remove hook with given data from the list
 void hook_remove(struct hook_list *list, int hevent, hook_callback cb, void *cbarg);
 
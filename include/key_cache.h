@@ -0,0 +1,30 @@
+#ifndef _INCLUDE_KEY_CACHE_H_
+#define _INCLUDE_KEY_CACHE_H_
+
+#include <stdint.h>
+#include <openssl/evp.h>
+
+// Maximum number of decoded keys kept in the cache, least recently
+// used key is evicted once cache is full
+#define KEY_CACHE_SIZE 64
+// Length of the key fingerprint (SHA-256)
+#define KEY_CACHE_FINGERPRINT_LEN 32
+
+// Kinds of keys cache can decode
+enum key_cache_types {
+    KEY_CACHE_ED25519_PUB,  // Raw ed25519 public key
+    KEY_CACHE_ED25519_PRIV, // Raw ed25519 private key
+    KEY_CACHE_RSA_PUB,      // RSA 2048bit public key in DER format
+    KEY_CACHE_RSA_PRIV,     // RSA 2048bit private key in DER format
+};
+
+// Get decoded key of given type, key is decoded only if it's not in the cache
+// already, cache is shared by all threads, returned key must be freed using
+// EVP_PKEY_free once it's not needed anymore, returns NULL if key is invalid
+EVP_PKEY * key_cache_get(enum key_cache_types type, const uint8_t *key);
+
+// Remove all keys from the cache, keys still used by someone are
+// freed once they are released
+void key_cache_clear(void);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <prot_main.h>
+#include <prot_codec.h>
 #include <constants.h>
 
 typedef void (*prot_ack_ed25519_cb)(int ack_success, struct prot_main *pmain, void *cbarg);
@@ -15,6 +16,8 @@ struct prot_ack_ed25519 {
     void *cbarg;
     prot_ack_ed25519_cb cb;
     enum prot_message_codes msg_code;
+    // Parse state of incomming ACK
+    struct prot_codec codec;
 
     struct prot_tran_handler htran;
     struct prot_recv_handler hrecv;
@@ -32,4 +35,73 @@ struct prot_ack_ed25519 * prot_ack_ed25519_new(
 // Free memory for given ack
 void prot_ack_ed25519_free(struct prot_ack_ed25519 *msg);
 
+
+/**
+ * Batched ACK message, acknowledges a set of messages with a single signature
+ *
+ *  >> HEADER
+ *  >> TRANSACTION ID
+ *  >> NUMBER OF MESSAGES (2 bytes)
+ *  >> MESSAGE GLOBAL ID (for each message)
+ *  >> SIGNATURE
+ */
+
+// Maximum number of messages acknowledged by a single batched ACK
+#define PROT_ACK_BATCH_MAX 256
+
+// Message acknowledged by the batched ACK
+struct prot_ack_batch_item {
+    uint8_t gid[MESSAGE_ID_LEN];
+    int acked;
+
+    prot_ack_ed25519_cb cb;
+    void *cbarg;
+};
+
+struct prot_ack_batch {
+    uint8_t pub_key[ED25519_PUB_KEY_LEN];
+    uint8_t priv_key[ED25519_PRIV_KEY_LEN];
+    enum prot_message_codes msg_code;
+
+    // Dynamic array of acknowledged messages
+    struct prot_ack_batch_item *items;
+    int n_items;
+    // Number of items not acknowledged yet, and index of the first one (receiver)
+    int n_pending;
+    int first_pending;
+    // Parse state of incomming batch, reset after each one
+    struct prot_codec codec;
+
+    struct prot_tran_handler htran;
+    struct prot_recv_handler hrecv;
+};
+
+// Send ACK for message with given global ID, ACK is added to the batch waiting
+// to be sent if there is one, new batch is pushed into transmission queue otherwise,
+// callback is called once ACK is sent or sending failed
+void prot_ack_batch_send(
+    struct prot_main *pmain,
+    enum prot_message_codes msg_code,
+    uint8_t *priv_key,
+    const uint8_t *gid,
+    prot_ack_ed25519_cb cb,
+    void *cbarg
+);
+
+// Expect ACK for message with given global ID, message is added to the last batch
+// in receiver queue if there is one, new batch is pushed otherwise, callback is
+// called once ACK arrives or connection fails, single batch can be acknowledged
+// by multiple batched ACK messages
+void prot_ack_batch_expect(
+    struct prot_main *pmain,
+    enum prot_message_codes msg_code,
+    uint8_t *pub_key,
+    const uint8_t *gid,
+    prot_ack_ed25519_cb cb,
+    void *cbarg
+);
+
+// Free given batched ACK handler
+void prot_ack_batch_free(struct prot_ack_batch *ack);
+
 #endif
\ No newline at end of file
@@ -9,11 +9,16 @@ enum prot_client_fetch_events {
     PROT_CLIENT_FETCH_EV_OK        = 0x8B01,
     PROT_CLIENT_FETCH_EV_FAIL      = 0x8B02,
     PROT_CLIENT_FETCH_EV_INCOMMING = 0x8B03,
+    // Peer refused protocol version we offered, fetch can be sent again
+    // using the oldest one, event data is the contact
+    PROT_CLIENT_FETCH_EV_RETRY     = 0x8B04,
 };
 
 struct prot_client_fetch {
     sqlite3 *db;
     struct db_contact *cont;
+    // Parse state of incomming request
+    struct prot_codec codec;
 
     struct prot_tran_handler htran;
     struct prot_recv_handler hrecv;
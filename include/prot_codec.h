@@ -0,0 +1,136 @@
+#ifndef _INCLUDE_PROT_CODEC_H_
+#define _INCLUDE_PROT_CODEC_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <event2/buffer.h>
+
+// Maximum number of fields in a single message layout
+#define PROT_CODEC_MAX_FIELDS 12
+// Number of buffer chunks view can hold without allocating
+#define PROT_VIEW_INLINE_VECS 4
+
+// Types of fields message layout consists of, integers are big endian
+enum prot_field_types {
+    PROT_FIELD_BYTES, // Fixed number of bytes
+    PROT_FIELD_U8,    // 8 bit unsigned integer
+    PROT_FIELD_U16,   // 16 bit unsigned integer
+    PROT_FIELD_U32,   // 32 bit unsigned integer
+    PROT_FIELD_VAR,   // Items of fixed size, number of items is given by earlier integer field
+};
+
+// Single field of the message layout, meaning of len and arg depends on field type:
+//   BYTES  len = number of bytes
+//   U*     arg = maximum allowed value, 0 if not limited
+//   VAR    len = size of a single item, arg = index of the field holding number of items
+struct prot_field {
+    const char *name;
+    enum prot_field_types type;
+    size_t len;
+    uint32_t arg;
+};
+
+// Wire layout of a message, fields follow each other without padding
+struct prot_layout {
+    int n_fields;
+    const struct prot_field *fields;
+};
+
+/**
+ * Message layouts are described by X-macros listing their fields, each entry
+ * is X(name, type, len, arg) where type is a suffix of prot_field_types:
+ *
+ *   #define PROT_ACK_FIELDS(X) \
+ *       X(ACK_HEADER, BYTES, PROT_HEADER_LEN, 0) \
+ *       X(ACK_TXN,    BYTES, TRANSACTION_ID_LEN, 0) \
+ *       X(ACK_SIG,    BYTES, ED25519_SIGNATURE_LEN, 0)
+ *
+ *   enum prot_ack_fields { PROT_ACK_FIELDS(PROT_FIELD_NAME) };
+ *   static const struct prot_layout ack_layout = PROT_LAYOUT(PROT_ACK_FIELDS);
+ */
+
+// Expands layout entry into field index (enum constant)
+#define PROT_FIELD_NAME(name, type, len, arg) name,
+// Expands layout entry into field description
+#define PROT_FIELD_DESC(name, type, len, arg) { #name, PROT_FIELD_##type, (len), (arg) },
+// Initializer of the layout described by given X-macro
+#define PROT_LAYOUT(fields) { \
+    sizeof((const struct prot_field[]){ fields(PROT_FIELD_DESC) }) / sizeof(struct prot_field), \
+    (const struct prot_field[]){ fields(PROT_FIELD_DESC) } \
+}
+
+// Results of parsing
+enum prot_codec_results {
+    PROT_CODEC_MORE,    // Not all data arrived yet
+    PROT_CODEC_DONE,    // Whole message is in the buffer
+    PROT_CODEC_INVALID, // Value of integer field exceeds its maximum
+};
+
+// Parse state kept by the handler between calls, fields are parsed once,
+// next call continues from the first field which was not parsed yet
+struct prot_codec {
+    int n_parsed;                                // Number of parsed fields
+    size_t offset[PROT_CODEC_MAX_FIELDS + 1];    // Offset of each field from the message start
+    uint32_t value[PROT_CODEC_MAX_FIELDS];       // Values of integer fields
+    size_t frame_len;                            // Length of the message, 0 until it's known
+};
+
+// Read-only view of a range of the input buffer, it points straight into buffer
+// chunks, so data is not copied or made contiguous, view is valid only until the
+// buffer is modified, so it must not be kept across callbacks
+struct prot_view {
+    size_t len;                                          // Number of bytes in the view
+    int n_vec;                                           // Number of chunks range spans
+    struct evbuffer_iovec *vec;                          // Chunks, trimmed to the range
+    struct evbuffer_iovec inline_vec[PROT_VIEW_INLINE_VECS];
+};
+
+// Reset parse state, used before parsing next message
+void prot_codec_reset(struct prot_codec *codec);
+
+// Parse fields of the message at the start of the input buffer, fields which
+// were parsed by the previous call are skipped, integer fields are decoded
+// straight from the buffer memory, frame length is known as soon as the last
+// integer field arrives, even if result is PROT_CODEC_MORE
+enum prot_codec_results prot_codec_parse(struct prot_codec *codec,
+    const struct prot_layout *layout, struct evbuffer *input);
+
+// Get value of parsed integer field
+uint32_t prot_codec_value(struct prot_codec *codec, int field);
+
+// Get offset of parsed field from the message start
+size_t prot_codec_offset(struct prot_codec *codec, int field);
+
+// Get length of parsed field
+size_t prot_codec_len(struct prot_codec *codec, int field);
+
+// Copy parsed field from the input buffer into dst
+void prot_codec_copy(struct prot_codec *codec, struct evbuffer *input, int field, void *dst);
+
+// Get pointer to parsed field in the input buffer, buffer is made
+// contiguous only up to the end of the field
+uint8_t * prot_codec_pullup(struct prot_codec *codec, struct evbuffer *input, int field);
+
+// Set view to parsed fields from first to last (inclusive), view must be freed
+void prot_codec_view(struct prot_codec *codec, struct evbuffer *input,
+    int first, int last, struct prot_view *view);
+
+// Get pointer to parsed field without copying it, if field is split between
+// buffer chunks it's copied into scratch, which must be big enough to hold it,
+// pointer is valid only until the buffer is modified
+uint8_t * prot_codec_field(struct prot_codec *codec, struct evbuffer *input,
+    int field, uint8_t *scratch);
+
+// Set view to len bytes of the buffer starting at given offset, view must be freed
+void prot_view_set(struct prot_view *view, struct evbuffer *input, size_t offset, size_t len);
+
+// Copy data from the view into dst, which must be big enough to hold it
+void prot_view_copy(struct prot_view *view, void *dst);
+
+// Add data from the view to the end of given buffer, used to give crypto job its own copy
+void prot_view_add(struct prot_view *view, struct evbuffer *dst);
+
+// Free chunk list of the view, if it was allocated
+void prot_view_free(struct prot_view *view);
+
+#endif
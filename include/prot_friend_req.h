@@ -15,6 +15,8 @@ enum prot_friend_req_events {
 struct prot_friend_req {
     sqlite3 *db;
     struct db_contact *friend;
+    // Parse state of incomming request
+    struct prot_codec codec;
     struct prot_tran_handler htran;
     struct prot_recv_handler hrecv;
 };
@@ -5,17 +5,50 @@
 #include <stdint.h>
 #include <sqlite3.h>
 #include <sys/socket.h>
+#include <openssl/evp.h>
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <constants.h>
 #include <hooks.h>
+#include <timer_wheel.h>
+#include <crypto_pool.h>
+#include <prot_codec.h>
+#include <prot_transport.h>
 
 #define PROT_QUEUE_LEN 32
 #define PROT_ERROR_MAX_LEN 127
 
 #define PROT_HEADER_LEN 2
 
+// Default number of bytes transmitters can put into the output buffer before
+// waiting for it to drain, 0 means only one message is sent at the time
+#define PROT_TRAN_HIGH_WATER (64 * 1024)
+
+// Default number of bytes single connection can hold in its buffers, must be
+// larger than the largest message which is not processed as it arrives
+#define PROT_MEM_BUDGET (4 * 1024 * 1024)
+// Default number of bytes all connections together can hold in their buffers
+// before new connections are refused
+#define PROT_MEM_GLOBAL_BUDGET (256 * 1024 * 1024)
+// Number of transmitters waiting to be set up after which connection stops
+// reading new requests until they are sent
+#define PROT_TRAN_MAX_PENDING 32
+// Number of times waiting transmitter can be passed over by transmitters
+// of higher priority classes, after that it is set up before them
+#define PROT_TRAN_AGING 8
+
+// Default number of messages processed by single read callback, the rest is
+// processed in the next round of the event loop so other events are not
+// delayed by a burst of incomming messages, 0 means there is no limit
+#define PROT_READ_BUDGET 64
+
+// Default deadlines (in seconds), 0 disables the deadline
+#define PROT_TIMEOUT_CONNECT   60  // Connecting to the peer (onion through the socks server)
+#define PROT_TIMEOUT_HANDSHAKE 60  // Connection is ready but transaction is not started
+#define PROT_TIMEOUT_RESPONSE  120 // Waiting for expected message (response, ACK) to arrive
+#define PROT_TIMEOUT_IDLE      600 // Nothing was sent or received
+
 // Application can work in one of following modes, some packets will be
 // handled differently based on the choosen mode
 enum prot_modes {
@@ -23,10 +56,13 @@ enum prot_modes {
     PROT_MODE_MAILBOX,
 };
 
-// All message types defined by the Deep Messenger protocol
+// All message types defined by the Deep Messenger protocol, types added
+// by protocol version 2 are 0x03, 0x04 and 0x8D and above
 enum prot_message_codes {
     PROT_TRANSACTION_REQUEST  = 0x01,
     PROT_TRANSACTION_RESPONSE = 0x02,
+    PROT_TRANSACTION_0RTT     = 0x03,
+    PROT_STREAM_DATA          = 0x04,
     PROT_FRIEND_REQUEST       = 0x81,
     PROT_ACK_ONION            = 0x82,
     PROT_ACK_SIGNATURE        = 0x83,
@@ -39,6 +75,20 @@ enum prot_message_codes {
     PROT_MAILBOX_DEL_MESSAGES = 0x8A,
     PROT_CLIENT_FETCH         = 0x8B,
     PROT_MESSAGE_LIST         = 0x8C,
+    PROT_ACK_BATCH_ONION      = 0x8D,
+    PROT_ACK_BATCH_SIGNATURE  = 0x8E,
+    PROT_CONTACT_SYNC         = 0x8F,
+    PROT_MESSAGE_SESSION      = 0x90,
+};
+
+// Priority classes of transmitters, higher classes (lower values) are set up
+// first, order of transmitters within the same class is preserved
+enum prot_tran_priorities {
+    PROT_PRIO_CONTROL,     // Transaction requests and responses
+    PROT_PRIO_ACK,         // ACKs and other responses peer is waiting for
+    PROT_PRIO_INTERACTIVE, // Single messages and requests
+    PROT_PRIO_BULK,        // Message lists and stream data
+    PROT_PRIO_N,
 };
 
 enum prot_status_codes {
@@ -50,17 +100,34 @@ enum prot_status_codes {
     PROT_ERR_INVALID_MSG,
     PROT_ERR_UNEXPECTED_MSG,
     PROT_ERR_TRANSACTION,
+    PROT_ERR_MEM_LIMIT,
+    PROT_ERR_REFUSED,
+};
+
+// Deadlines tracked for each connection, connection fails with
+// PROT_ERR_TIMEOUT once any of them expires
+enum prot_deadlines {
+    PROT_DEADLINE_CONNECT,
+    PROT_DEADLINE_HANDSHAKE,
+    PROT_DEADLINE_RESPONSE,
+    PROT_DEADLINE_IDLE,
+    PROT_DEADLINE_N,
 };
 
 enum prot_main_events {
-    PROT_MAIN_EV_DONE  = 0x0001,
-    PROT_MAIN_EV_CLOSE = 0x0002,
+    PROT_MAIN_EV_DONE   = 0x0001,
+    PROT_MAIN_EV_CLOSE  = 0x0002,
+    PROT_MAIN_EV_STREAM = 0x0003,
+    PROT_MAIN_EV_PEER   = 0x0004, // Contact on the other side is known, data is db_contact
 };
 
 // Struct predefinition
 struct prot_main;
 struct prot_recv_handler;
 struct prot_tran_handler;
+struct prot_registry_entry;
+struct prot_stream;
+struct db_contact;
 
 // Callback used to free handle memory after it's done processing input
 typedef void (*prot_recv_cleanup_cb)(struct prot_main *pmain, struct prot_recv_handler *phand);
@@ -92,11 +159,16 @@ typedef void (*prot_tran_setup_cb)(struct prot_main *pmain, struct prot_tran_han
 struct prot_tran_handler {
     enum prot_message_codes msg_code;
     void *msg;
+    // Priority class, transmitter is set up after the ones of higher classes
+    enum prot_tran_priorities priority;
     // Cleanup functions can read this value to determine if message has been
     // processed successfully (1 = success, 0 = failure)
     int success;
-    // Buffer filled with protocol message
+    // Buffer filled with protocol message, if NULL protocol handler
+    // provides the buffer before setup callback is called
     struct evbuffer *buffer;
+    // Used internally, position in the output stream where this message ends
+    uint64_t tran_end;
     // Callback to call once message is transmitted
     prot_tran_done_cb done_cb;
     prot_tran_setup_cb setup_cb;
@@ -106,10 +178,9 @@ struct prot_tran_handler {
 // Main connection handler, attached to bufferevent connection
 // to handle communication
 struct prot_main {
-    struct hook_list *hooks;
-
     int run_free;     // Protocol main should be freed after all hooks are executed
     int free_on_done; // Handler will free itself when done processing messages
+    struct hook_list *hooks;
     enum prot_modes mode;
     enum prot_status_codes status;
 
@@ -121,18 +192,105 @@ struct prot_main {
 
     int transaction_started;                          // Indicates if transaction has started
     uint8_t transaction_id[TRANSACTION_ID_LEN];  // Transaction ID associated with this connection
+    // Set to 1 if this side chose the transaction ID, or it was derived from 0RTT
+    // nonce seen for the first time, so it can't come from an older connection
+    int transaction_fresh;
+    // Protocol version both sides speak, 0 while it's not known, it's agreed on
+    // by the transaction, side which connects offers version (version_offered)
+    // and other side answers with the one it speaks, if it's older
+    int version;
+    int version_offered;
+    // Set to 1 once first message from the other side arrived, connection closed
+    // before that after offering newer version than the oldest one fails with
+    // PROT_ERR_REFUSED, peer probably doesn't speak it
+    int peer_seen;
 
     // Set to 1 by the cb function when receiver processed the message
     int current_recv_done;
-    // Used internally to know if there are active trasmitters
+    // Set to 1 by the cb function when receiver processed the message but
+    // expects more messages of the same type, it stays in the queue
+    int current_recv_more;
+    // Used internally, number of transmitters (from the front of the queue)
+    // whose data is in the output buffer but not yet sent
     int tran_in_progress;
+    // Used internally, index of the receiver handling current message
+    int recv_current;
+    // Total number of bytes written to and drained from the output buffer
+    uint64_t tran_written;
+    uint64_t tran_drained;
+    // Output buffer size up to which next messages are set up without waiting
+    // for the previous ones to be sent, 0 disables pipelining
+    size_t tran_high_water;
+    // Output buffer callback used to track drained bytes
+    struct evbuffer_cb_entry *tran_drain_cb;
+    // Buffer used by transmitters which don't have their own
+    struct evbuffer *tran_buffer;
     // Must be set to 1 if we want to transmit
     int tran_enabled;
+    // Set while incomming messages are processed, transmitters pushed meanwhile
+    // are set up once processing is done so they can be merged
+    int tran_hold;
     // Indicates that header of the current message has been checked and is OK
     // header includes version, message type and transaction id (if type requires it)
     int message_check_done;
-
-    struct queue *tran_q; // Transmmitter queue
+    // Registry entry for the message currently being received
+    struct prot_registry_entry *recv_entry;
+
+    // Maximum number of bytes this connection can hold in its buffers
+    size_t mem_budget;
+    // Number of bytes currently held in input and output buffers
+    size_t mem_used;
+    // Buffer callbacks used to track memory usage
+    struct evbuffer_cb_entry *mem_in_cb;
+    struct evbuffer_cb_entry *mem_out_cb;
+    // Set to 1 while reading is paused, because transmitters are behind
+    int read_paused;
+    // Maximum number of messages processed by single read callback, and event
+    // used to process the rest once budget is used up
+    int read_budget;
+    struct event *read_ev;
+
+    // Timer wheel used for deadlines, shared with other connections
+    struct timer_wheel *wheel;
+    // Timeout (in seconds) and timer for each deadline
+    int timeouts[PROT_DEADLINE_N];
+    struct timer_wheel_entry deadlines[PROT_DEADLINE_N];
+
+    // Crypto pool used by handlers to offload expensive operations, if NULL
+    // operations are done synchronously
+    struct crypto_pool *crypto;
+    // Crypto jobs current receiver and transmitter are waiting for, while set
+    // handler is suspended and the connection doesn't process its messages
+    struct crypto_job *recv_job;
+    struct crypto_job *tran_job;
+    // Receiver job is done, handler is called again even if no new data arrived
+    int recv_resumed;
+
+    // Prehash of the signed message being received, message is hashed as it
+    // arrives, so only the signature is left to check once all of it is here
+    EVP_MD_CTX *recv_hash;
+    size_t recv_hashed;  // Number of bytes from the message start which are hashed
+    int recv_hash_done;  // Hash is finished
+
+    // Logical streams multiplexed over this connection, their number, and ID
+    // of the next stream opened by this side
+    struct prot_stream *streams;
+    int n_streams;
+    uint16_t stream_next_id;
+    // Stream chunk is left in the input buffer and reading is off until streams
+    // take their data, because connection holds too much of it
+    int stream_blocked;
+    // Stream this handler belongs to, NULL if handler owns the connection
+    struct prot_stream *stream;
+
+    // Transmitters waiting to be set up, one queue for each priority class,
+    // number of times head of each queue was passed over, and class of
+    // the last pushed transmitter
+    struct queue *tran_wait[PROT_PRIO_N];
+    int tran_skipped[PROT_PRIO_N];
+    enum prot_tran_priorities tran_last_prio;
+
+    struct queue *tran_q; // Transmitters being set up or sent, in output order
     struct queue *recv_q; // Receiver queue
 };
 
@@ -155,8 +313,9 @@ void prot_main_free_on_done(struct prot_main *pmain, int yes);
 // object that current receiver is done receiving
 void prot_main_recv_done(struct prot_main *pmain);
 
-// Connect to given TOR client socks server and try to contact
-// deep messenger instance on given onion address
+// Connect to deep messenger instance on given onion address, if there is a route
+// for the address in the database its transport is used, otherwise connection
+// is made through given TOR client socks server
 void prot_main_connect(
     struct prot_main *pmain,
     const char *onion_address,
@@ -165,12 +324,31 @@ void prot_main_connect(
     const char *socks_server_port
 );
 
+// Connect to deep messenger instance on given onion address over given route
+void prot_main_connect_route(
+    struct prot_main *pmain,
+    const struct prot_route *route,
+    const char *onion_address,
+    const char *onion_port
+);
+
 // Assign protocol connection handler to given bufferevent
 void prot_main_assign(struct prot_main *pmain, struct bufferevent *bev);
 
-// Push new message into transmission queue, returns zero on success
+// Push new message into transmission queue of its priority class, returns zero on success
 void prot_main_push_tran(struct prot_main *pmain, struct prot_tran_handler *phand);
 
+// Get last pushed transmitter if it is not set up yet, used to add more
+// data to it, returns NULL if there is no such transmitter
+struct prot_tran_handler * prot_main_tran_last(struct prot_main *pmain);
+
+// Returns 1 if protocol handler has transmitters or receivers which
+// are not done, and 0 otherwise
+int prot_main_busy(struct prot_main *pmain);
+
+// Get last receiver in the queue, returns NULL if queue is empty
+struct prot_recv_handler * prot_main_recv_last(struct prot_main *pmain);
+
 // Push new message receiver into receiver queue, this is done when you are
 // expecting message to arrive (response), returns zero on success
 void prot_main_push_recv(struct prot_main *pmain, struct prot_recv_handler *phand);
@@ -178,6 +356,89 @@ void prot_main_push_recv(struct prot_main *pmain, struct prot_recv_handler *phan
 // Used to enable/disable transmission on main protocol handler
 void prot_main_tran_enable(struct prot_main *pmain, int yes);
 
+// Set output buffer size up to which messages are transmitted back to back,
+// 0 means next message is set up only once previous one is completely sent
+void prot_main_tran_high_water(struct prot_main *pmain, size_t high_water);
+
+// Set maximum number of messages processed by single read callback before
+// processing is continued in the next round of the event loop, 0 means no limit
+void prot_main_read_budget(struct prot_main *pmain, int budget);
+
+// Set event priority of bufferevents used by all protocol handlers created
+// from now on, ignored on event bases which don't have that many priorities
+void prot_main_ev_priority(int priority);
+
+// Set timeout (in seconds) for given deadline, 0 disables it, if deadline
+// is currently running it is restarted with the new timeout
+void prot_main_timeout(struct prot_main *pmain, enum prot_deadlines deadline, int seconds);
+
+// Called from within recv handler to run given crypto job, returns 0 if job is
+// already done (no crypto pool) and 1 if handler is suspended, handler must then
+// return leaving the message in the input buffer, and it will be called again
+// once the job is done, handler owns the job and must free it in its cleanup
+int prot_main_recv_await(struct prot_main *pmain, struct crypto_job *job);
+
+// Called from within recv handler to start given crypto job without suspending
+// the handler, so it can start more of them, returns 0 if job is already done
+// (no crypto pool) and 1 if it's running, handler owns the job and must free it
+int prot_main_recv_submit(struct prot_main *pmain, struct crypto_job *job);
+
+// Called from within recv handler to wait for crypto job started by submit,
+// returns 0 if job is already done and 1 if handler is suspended, handler must
+// then return and it will be called again once the job is done, even if all
+// of its data was already removed from the input buffer
+int prot_main_recv_wait(struct prot_main *pmain, struct crypto_job *job);
+
+// Called from within tran setup callback to run given crypto job, returns 0 if
+// job is already done and 1 if transmitter is suspended, setup callback must
+// then return and it will be called again with the same buffer once the job
+// is done, handler owns the job and must free it in its cleanup
+int prot_main_tran_await(struct prot_main *pmain, struct crypto_job *job);
+
+// Set maximum number of bytes connection can hold in its buffers, once input
+// buffer is full reading is paused, and connection fails if current message
+// can't fit into it
+void prot_main_mem_budget(struct prot_main *pmain, size_t budget);
+
+// Set maximum number of bytes all connections together can hold in their buffers
+void prot_main_mem_global_budget(size_t budget);
+
+// Returns 1 if all connections together hold more memory than global budget
+// allows, used to refuse new connections, and 0 otherwise
+int prot_main_mem_pressure(void);
+
+// Charge memory held by the connection outside of its own buffers (data waiting
+// for streams multiplexed over it), it counts against connection and global budget
+void prot_main_mem_charge(struct prot_main *pmain, size_t added, size_t deleted);
+
+// Called from within recv handler once it knows the full length of the message,
+// if it exceeds maximum for the message type error is set and 1 is returned,
+// handler should return immediately in that case, otherwise returns 0
+int prot_main_frame_len_check(struct prot_main *pmain, size_t frame_len);
+
+// Called from within recv handler to parse incomming message described by given
+// layout, parse state is kept in codec between calls, returns 1 once whole message
+// is in the input buffer and 0 otherwise, error is set if message is invalid or
+// exceeds maximum for its type, handler should return immediately in that case
+int prot_main_recv_parse(struct prot_main *pmain, struct prot_codec *codec, const struct prot_layout *layout);
+
+// Same as prot_main_recv_parse, used for messages which end with ed25519 signature,
+// everything before the signature is hashed as it arrives, so once whole message
+// is in the buffer its signature is checked without reading it again
+int prot_main_recv_parse_signed(struct prot_main *pmain, struct prot_codec *codec, const struct prot_layout *layout);
+
+// Finish hash of the whole message parsed by prot_main_recv_parse_signed and store
+// it into hash (ED25519_PREHASH_LEN bytes), returns 0 on success and 1 on failure
+int prot_main_recv_hash(struct prot_main *pmain, struct prot_codec *codec, uint8_t *hash);
+
+// Check signature of the whole message parsed by prot_main_recv_parse_signed using
+// given ed25519 public key, returns 1 if signature is valid and 0 otherwise
+int prot_main_recv_verify(struct prot_main *pmain, struct prot_codec *codec, uint8_t *pub_key);
+
+// Forget hash of the signed message, it's done once message is handled, handler
+// taking multiple signed messages out of the buffer must call it after each of them
+void prot_main_recv_hash_reset(struct prot_main *pmain);
+
 // Allocate new receive handler for given message type, returns prot_recv_handler (on client)
 struct prot_recv_handler *prot_handler_autogen_client(enum prot_message_codes code, sqlite3 *db);
 
@@ -188,11 +449,37 @@ struct prot_recv_handler *prot_handler_autogen_mailbox(enum prot_message_codes c
 const char * prot_main_error_string(enum prot_status_codes err_code);
 
 // Returns pointer to protocol header generated for given message type
-// length of the header is equal to PROT_HEADER_LEN
+// length of the header is equal to PROT_HEADER_LEN, header carries version
+// which introduced the message type, so older peers can read it
 const uint8_t * prot_header(enum prot_message_codes msg_code);
 
+// Same as prot_header, but header carries given protocol version, used by
+// transaction messages which agree on the version
+const uint8_t * prot_header_version(enum prot_message_codes msg_code, int version);
+
+// Returns protocol version which introduced given message type
+int prot_code_version(enum prot_message_codes msg_code);
+
+// Returns 1 if peer on the other side of the connection knows given message
+// type, according to the version agreed on by the transaction, and 0 otherwise
+int prot_main_peer_knows(struct prot_main *pmain, enum prot_message_codes msg_code);
+
+// Close the connection from outside of handler callbacks, close hooks are
+// called with given status and protocol handler is freed
+void prot_main_close(struct prot_main *pmain, enum prot_status_codes status);
+
+// Start transaction with given ID, called by transaction handlers once
+// transaction ID is known, streams of the connection share the transaction
+void prot_main_transaction_start(struct prot_main *pmain, const uint8_t *txn_id);
+
 // Called from within tran/recv handler callbacks in case of error, main protocol
 // handler will then free itself and close the connection
 void prot_main_set_error(struct prot_main *pmain, enum prot_status_codes err_code);
 
+// Called by receive handlers once signed message proved which contact is on the
+// other side, signature covers the transaction ID, but it only proves that contact
+// is live if the ID is fresh, event is reported on the connection stream belongs
+// to, and only if that is the case, otherwise signed message could be replayed
+void prot_main_peer_auth(struct prot_main *pmain, struct db_contact *cont);
+
 #endif
\ No newline at end of file
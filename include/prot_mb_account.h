@@ -34,6 +34,8 @@ struct prot_mb_acc {
     struct db_mb_account *mb_acc;
     // Used when sending request (on client)
     struct prot_mb_acc_data *cl_acc;
+    // Parse state of incomming message
+    struct prot_codec codec;
 
     struct prot_tran_handler htran;
     struct prot_recv_handler hrecv;
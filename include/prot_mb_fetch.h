@@ -10,6 +10,8 @@
 enum prot_mb_fetch_events {
     PROT_MB_FETCH_EV_OK   = 0x8701,
     PROT_MB_FETCH_EV_FAIL = 0x8702,
+    // Mailbox refused protocol version we offered, fetch can be sent again
+    PROT_MB_FETCH_EV_RETRY = 0x8703,
 };
 
 struct prot_mb_fetch {
@@ -21,6 +23,8 @@ struct prot_mb_fetch {
     uint8_t mb_onion_key[ONION_ADDRESS_LEN];
     uint8_t mb_pub_sig_key[MAILBOX_ACCOUNT_KEY_PUB_LEN];
     uint8_t mb_priv_sig_key[MAILBOX_ACCOUNT_KEY_PRIV_LEN];
+    // Parse state of incomming request
+    struct prot_codec codec;
 
     struct prot_tran_handler htran;
     struct prot_recv_handler hrecv;
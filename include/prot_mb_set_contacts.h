@@ -31,6 +31,7 @@ struct prot_mb_set_contacts {
     struct db_contact **cl_conts;    // Contacts to send (client side)
     int n_mb_conts;                  // Number of received contacts (mailbox side)
     struct db_mb_contact **mb_conts; // Array of received contacts (mailbox side)
+    struct prot_codec codec;         // Parse state of incomming request
 
     struct prot_tran_handler htran;  // Standard transmission handler
     struct prot_recv_handler hrecv;  // Standard receive handler
@@ -5,8 +5,62 @@
 #include <sqlite3.h>
 #include <db_message.h>
 #include <db_mb_message.h>
+#include <db_contact.h>
+#include <db_session.h>
 #include <prot_main.h>
 #include <hooks.h>
+#include <crypto_pool.h>
+#include <buffer_crypto.h>
+
+// Length of the unencrypted part of the message container
+#define PROT_MESSAGE_HEADER_LEN (PROT_HEADER_LEN + TRANSACTION_ID_LEN + \
+    MAILBOX_ID_LEN + CLIENT_SIG_KEY_PUB_LEN + MESSAGE_ID_LEN)
+// Maximum number of parts plain text of the message consists of
+#define PROT_MESSAGE_PLAIN_MAX_PARTS 3
+
+// Layout of message container, message list carries containers one after another
+#define PROT_MESSAGE_FIELDS(X) \
+    X(PROT_MESSAGE_F_HEADER,   BYTES, PROT_HEADER_LEN,        0) \
+    X(PROT_MESSAGE_F_TXN,      BYTES, TRANSACTION_ID_LEN,     0) \
+    X(PROT_MESSAGE_F_MB_ID,    BYTES, MAILBOX_ID_LEN,         0) \
+    X(PROT_MESSAGE_F_SIG_KEY,  BYTES, CLIENT_SIG_KEY_PUB_LEN, 0) \
+    X(PROT_MESSAGE_F_GID,      BYTES, MESSAGE_ID_LEN,         0) \
+    X(PROT_MESSAGE_F_DATA_LEN, U32,   0,                      PROT_MESSAGE_MAX_DATA_LEN) \
+    X(PROT_MESSAGE_F_DATA,     VAR,   1,                      PROT_MESSAGE_F_DATA_LEN) \
+    X(PROT_MESSAGE_F_DATA_KEY, BYTES, AES_ENC_KEY_LENGTH,     0) \
+    X(PROT_MESSAGE_F_DATA_IV,  BYTES, AES_IV_LENGTH,          0) \
+    X(PROT_MESSAGE_F_SIG,      BYTES, ED25519_SIGNATURE_LEN,  0)
+
+enum prot_message_fields { PROT_MESSAGE_FIELDS(PROT_FIELD_NAME) };
+
+// Layout of message container encrypted using contact's session key, first five fields
+// are the same as in the message container above, so they have the same indices, nonce
+// is session ID (4 bytes) followed by message counter (8 bytes), session key sealed
+// using contact's RSA key is carried only until contact confirms it has the key
+#define PROT_SESSION_FIELDS(X) \
+    X(PROT_SESSION_F_HEADER,   BYTES, PROT_HEADER_LEN,        0) \
+    X(PROT_SESSION_F_TXN,      BYTES, TRANSACTION_ID_LEN,     0) \
+    X(PROT_SESSION_F_MB_ID,    BYTES, MAILBOX_ID_LEN,         0) \
+    X(PROT_SESSION_F_SIG_KEY,  BYTES, CLIENT_SIG_KEY_PUB_LEN, 0) \
+    X(PROT_SESSION_F_GID,      BYTES, MESSAGE_ID_LEN,         0) \
+    X(PROT_SESSION_F_NONCE,    BYTES, SESSION_NONCE_LEN,      0) \
+    X(PROT_SESSION_F_WRAP_LEN, U16,   0,                      SESSION_WRAP_LEN) \
+    X(PROT_SESSION_F_WRAP,     VAR,   1,                      PROT_SESSION_F_WRAP_LEN) \
+    X(PROT_SESSION_F_DATA_LEN, U32,   0,                      PROT_MESSAGE_MAX_DATA_LEN) \
+    X(PROT_SESSION_F_DATA,     VAR,   1,                      PROT_SESSION_F_DATA_LEN) \
+    X(PROT_SESSION_F_TAG,      BYTES, SESSION_TAG_LEN,        0) \
+    X(PROT_SESSION_F_SIG,      BYTES, ED25519_SIGNATURE_LEN,  0)
+
+enum prot_session_fields { PROT_SESSION_FIELDS(PROT_FIELD_NAME) };
+
+// Number of messages encrypted using one local session, new session
+// key is created (and sealed using RSA) once it's reached
+#define PROT_SESSION_REKEY_AFTER (1 << 20)
+
+// Layout of message container
+extern const struct prot_layout prot_message_layout;
+// Layout of message container encrypted using session key
+extern const struct prot_layout prot_session_layout;
 
 enum prot_message_to {
     PROT_MESSAGE_TO_CLIENT,
@@ -17,6 +71,9 @@ enum prot_message_events {
     PROT_MESSAGE_EV_OK        = 0x8401,
     PROT_MESSAGE_EV_FAIL      = 0x8402,
     PROT_MESSAGE_EV_INCOMMING = 0x8403,
+    // Message was not sent because peer refused the connection, data is the message,
+    // it should be sent again, next connection to the peer offers the oldest version
+    PROT_MESSAGE_EV_RETRY     = 0x8404,
 };
 
 struct prot_message {
@@ -29,6 +86,15 @@ struct prot_message {
 
     struct db_mb_message *mailbox_msg;
 
+    // Local session message is encrypted with, confirmed once contact ACKs the message
+    uint32_t session_id;
+    struct db_session *sess;
+
+    // Crypto job handler is waiting for, or whose result is not yet processed
+    struct crypto_job *job;
+    // Parse state of incomming message
+    struct prot_codec codec;
+
     struct prot_tran_handler htran;
     struct prot_recv_handler hrecv;
 };
@@ -39,6 +105,72 @@ struct prot_message * prot_message_to_client_new(sqlite3 *db, struct db_message
 // Allocate new message handler for sending message between client and mailbox
 struct prot_message * prot_message_to_mailbox_new(sqlite3 *db, struct db_message *dbmsg);
 
+// Get layout of the message container with given message code, returns
+// NULL if code doesn't belong to a message container
+const struct prot_layout * prot_message_layout_get(uint8_t msg_code);
+
+// Get local session used to encrypt messages to the contact and reserve nonces for
+// n messages, session is created if there is none, or replaced if it was used too
+// many times, counter of the returned session is the first reserved one, key of
+// the new session is not sealed yet (see prot_message_session_wrap_job), returns
+// NULL on failure, session must be freed
+struct db_session * prot_message_session_reserve(sqlite3 *db, struct db_contact *cont, int n);
+
+// Create crypto job which seals key of the session using contact's RSA key, returns
+// NULL if session doesn't need it (key is sealed already, or contact has it),
+// messages reserved while the job runs seal the key again, any of the seals works
+struct crypto_job * prot_message_session_wrap_job(struct db_session *sess, struct db_contact *cont);
+
+// Store key sealed by given job into the session and the database, returns
+// 0 on success and 1 on failure
+int prot_message_session_wrap_done(sqlite3 *db, struct db_session *sess, struct crypto_job *job);
+
+// Returns length of the message container carrying given client message, encrypted
+// using given session, or using contact's RSA key if session is NULL
+size_t prot_message_container_len(struct db_session *sess, struct db_message *dbmsg);
+
+// Write signed message container carrying given client message to the writer in
+// a single pass, message is encrypted straight into the buffer using the next
+// reserved nonce of the session, or using contact's RSA key if session is NULL,
+// returns 0 on success and 1 on failure, in which case writer is left with open
+// sections
+int prot_message_write(
+    struct ed25519_writer *w,
+    const uint8_t *transaction_id,
+    struct db_contact *cont,
+    struct db_session *sess,
+    struct db_message *dbmsg
+);
+
+// Get ID of the session used by the message container encrypted using session key,
+// parsed by the codec at the start of given buffer
+uint32_t prot_message_session_id(struct prot_codec *codec, struct evbuffer *buff);
+
+// Save remote session of the contact with key unwrapped from the message container,
+// returns 0 on success and 1 if unwrapped data is not a session key
+int prot_message_session_add(
+    sqlite3 *db,
+    struct db_contact *cont,
+    uint32_t session_id,
+    struct evbuffer *key,
+    struct db_session *sess
+);
+
+// Decrypt body of the message container encrypted using given session key, parsed by
+// the codec at the start of given buffer, into plain buffer, buffer is not modified,
+// returns 0 on success and 1 on failure
+int prot_message_session_open(
+    struct prot_codec *codec,
+    struct evbuffer *buff,
+    struct db_session *sess,
+    struct evbuffer *plain
+);
+
+// Wait for ACK of given client message which has been sent to the contact as a part of
+// another message (contact sync), message is saved and message events are called once
+// ACK arrives or fails to arrive, just like for the message container, message is freed
+void prot_message_ack_expect(struct prot_main *pmain, sqlite3 *db, struct db_contact *cont, struct db_message *dbmsg);
+
 // Free given handler and message model given to the new method
 void prot_message_free(struct prot_message *msg);
 
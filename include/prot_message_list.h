@@ -2,13 +2,23 @@
 #define _INCLUDE_PROT_MESSAGE_LIST_H_
 
 #include <sqlite3.h>
+#include <openssl/evp.h>
 #include <prot_main.h>
+#include <prot_codec.h>
+#include <crypto_pool.h>
 #include <db_message.h>
 #include <db_mb_message.h>
+#include <db_contact.h>
+
+// Maximum number of messages from the list verified and decrypted at the same time
+#define PROT_MESSAGE_LIST_MAX_PENDING 64
+// Maximum number of bytes held by messages verified and decrypted at the same time,
+// next message is taken out of the buffer only once earlier ones are processed
+#define PROT_MESSAGE_LIST_MAX_PENDING_LEN (1024 * 1024)
 
 // Message list can be sent as response to CLIENT FETCH and MAILBOX FETCH
 // and will act a bit differentlly when processing the response depending
-// on it's source
+// on it's source, client can also send it as CONTACT SYNC request
 enum prot_message_list_from {
     PROT_MESSAGE_LIST_FROM_CLIENT,
     PROT_MESSAGE_LIST_FROM_MAILBOX,
@@ -20,11 +30,27 @@ struct prot_message_list_ev_data {
     struct db_message **messages;
 };
 
+// Message from the list whose signature check and decryption are running on the
+// crypto pool while the messages after it are taken out of the buffer, messages
+// are processed in the order they arrived, once their jobs are done
+struct prot_message_list_entry {
+    const struct prot_layout *layout;
+    struct prot_codec codec;   // Parse state, offsets point into the copy held by verify job
+    int invalid;               // Message failed before its jobs were started
+    int contact_id;            // Sender of the message
+    uint32_t session_id;       // Session used by the message (protocol v2 envelope)
+    struct crypto_job *verify; // Signature check, its input is the copy of the message
+    struct crypto_job *open;   // Decryption of the body or of the session key, NULL if not needed
+};
+
 // Message list data
 struct prot_message_list {
     uint8_t length;
     sqlite3 *db;
     enum prot_message_list_from from;
+    // List is sent as CONTACT SYNC request, it carries our messages for the contact
+    // and asks for theirs, contact responds with ACK and the message list
+    int sync;
 
     struct db_contact *client_cont;
 
@@ -33,6 +59,31 @@ struct prot_message_list {
     int n_mailbox_msgs;
     struct db_mb_message **mailbox_msgs;
 
+    // Session messages are encrypted with, and job sealing its key if it's new
+    struct db_session *tran_sess;
+    struct crypto_job *tran_job;
+
+    // Receive state, messages from the list are taken out of the buffer as they arrive
+    int recv_started;                       // List header is processed
+    uint32_t recv_remaining;                // Unprocessed bytes of the list body
+    EVP_MD_CTX *recv_hash;                  // Prehash of the list received so far
+    uint8_t recv_key[ED25519_PUB_KEY_LEN];  // Key used to check list signature
+    int recv_batch;                         // Provisional batch of saved messages
+    struct prot_message_list_ev_data recv_evdata;
+    uint8_t *recv_acks;                     // Global IDs of messages to acknowledge (sync)
+    int n_recv_acks;
+    struct prot_codec recv_codec;           // Parse state of the list header or current message
+    const struct prot_layout *recv_layout;  // Layout of the current message
+    // Messages whose jobs are running, ring buffer in the order messages arrived
+    struct prot_message_list_entry recv_entries[PROT_MESSAGE_LIST_MAX_PENDING];
+    int recv_first;                         // Index of the oldest pending message
+    int n_recv_entries;                     // Number of pending messages
+    size_t recv_pending_len;                // Number of bytes held by pending messages
+    struct db_contact *recv_cont;           // Sender of the last message taken out of the buffer
+    // Contacts changed by received messages, they are saved only once the list is committed
+    struct db_contact **recv_updates;
+    int n_recv_updates;
+
     struct prot_tran_handler htran;
     struct prot_recv_handler hrecv;
 };
@@ -44,11 +95,17 @@ struct prot_message_list * prot_message_list_client_new(
 // Allocate new message list handler (when in the mailbox mode)
 struct prot_message_list * prot_message_list_mailbox_new(sqlite3 *db, struct db_mb_message **msgs, int n_msgs);
 
+// Allocate new contact sync handler, given messages are sent to the contact
+// together with the fetch request, contact responds with cumulative ACK for
+// them and the list of its messages for us, all in a single round trip
+struct prot_message_list * prot_message_list_sync_new(
+    sqlite3 *db, struct db_contact *cont, struct db_message **msgs, int n_msgs);
+
 // When creating message receive handler use this function to set where is the
 // message list comming from, is it from CLIENT or the MAILBOX, this is irelevant for transmission
 void prot_message_list_from(struct prot_message_list *msg, enum prot_message_list_from from);
 
-// Free given message list handler and messages given to new method
+// Free given message list handler, contact and messages given to new method
 void prot_message_list_free(struct prot_message_list *msg);
 
 #endif
\ No newline at end of file
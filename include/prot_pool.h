@@ -0,0 +1,106 @@
+#ifndef _INCLUDE_PROT_POOL_H_
+#define _INCLUDE_PROT_POOL_H_
+
+#include <sqlite3.h>
+#include <time.h>
+#include <sys/time.h>
+#include <event2/event.h>
+#include <onion.h>
+#include <helpers.h>
+#include <prot_main.h>
+
+// Default number of seconds unused connection is kept open
+#define PROT_POOL_IDLE_TIMEOUT 60
+// Default maximum number of connections kept in the pool
+#define PROT_POOL_MAX_CONNS 16
+
+#define PROT_POOL_SOCKS_ADDR_MAX_LEN 64
+
+struct prot_pool;
+
+// Single connection kept in the pool (used internally)
+struct prot_pool_entry {
+    struct prot_pool *pool;
+    struct prot_main *pmain;
+
+    // Entry will not be reused, protocol handler frees itself once done
+    int transient;
+    // Connection was made by the other side, it's reused only once signed
+    // message proves who is on the other side (onion address is set)
+    int inbound;
+    // Last time connection was handed out or finished processing
+    struct timeval last_used;
+    // Connection started with 0RTT transaction
+    int zrtt;
+
+    char onion_address[ONION_ADDRESS_LEN + 1];
+    char onion_port[MAX_PORT_STR_LEN];
+    char socks_addr[PROT_POOL_SOCKS_ADDR_MAX_LEN];
+    char socks_port[MAX_PORT_STR_LEN];
+
+    struct event *idle_ev;    // Closes the connection if it stays unused
+    struct event *connect_ev; // Connect is deferred until handlers are pushed
+
+    struct prot_pool_entry *next;
+};
+
+// Peer pool made outgoing connection to, remembered for the pool's lifetime
+struct prot_pool_peer {
+    char onion_address[ONION_ADDRESS_LEN + 1];
+    // Protocol version peer answered with, or the oldest one if peer closed
+    // the connection without answering newer one
+    int version;
+    // Peer closed 0RTT connection without answering it (it may not be able
+    // to check it for replay), normal transaction request is used from now on
+    int no_zrtt;
+
+    struct prot_pool_peer *next;
+};
+
+// Pool of outgoing connections, connections are keyed by onion address and port,
+// incomming connections from contacts are kept as well and used as reverse channels
+struct prot_pool {
+    sqlite3 *db;
+    struct event_base *base;
+
+    int n_conns;      // Number of connections currently kept in the pool
+    int max_conns;    // Maximum number of connections kept in the pool
+    int idle_timeout; // Seconds after which unused connection is closed
+
+    struct prot_pool_entry *head;
+    struct prot_pool_peer *peers;
+};
+
+// Allocate new connection pool
+struct prot_pool * prot_pool_new(struct event_base *base, sqlite3 *db, int max_conns, int idle_timeout);
+
+// Close all pooled connections and free the pool
+void prot_pool_free(struct prot_pool *pool);
+
+// Offer incomming connection for reuse, once signed message proves that contact
+// is live on the other side traffic to the contact's onion address goes over this
+// connection instead of dialing a new one, connection is not closed by the pool
+void prot_pool_attach(struct prot_pool *pool, struct prot_main *pmain);
+
+// Get connection to the given onion service, if there is established connection
+// in the pool (outgoing, or incomming from the contact with given address) it is
+// returned, otherwise new one is created and 0RTT transaction is queued if peer
+// answered with version which has it before (normal transaction request if peer
+// ever closed 0RTT connection unanswered), unknown peer is offered our version,
+// version of known peer is set on the new connection right away, connection is
+// made once control returns to the event loop so caller can push handlers onto
+// returned object right away, if peer closes the connection without answering
+// offered version, connection fails with PROT_ERR_REFUSED and the next one
+// offers the oldest version
+struct prot_main * prot_pool_get(
+    struct prot_pool *pool,
+    const char *onion_address,
+    const char *onion_port,
+    const char *socks_server_addr,
+    const char *socks_server_port
+);
+
+// Close all connections in the pool that are not currently in use
+void prot_pool_flush(struct prot_pool *pool);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef _INCLUDE_PROT_REGISTRY_H_
+#define _INCLUDE_PROT_REGISTRY_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sqlite3.h>
+#include <prot_main.h>
+
+// Number of protocol modes and message codes covered by the registry
+#define PROT_REGISTRY_MODES 2
+#define PROT_REGISTRY_CODES 256
+
+// Max length of message data (ciphertext) inside of message container
+#define PROT_MESSAGE_MAX_DATA_LEN (1024 * 1024)
+
+// Constructor used to allocate receive handler for unsolicited message
+typedef struct prot_recv_handler * (*prot_registry_ctor)(sqlite3 *db);
+
+// Registry entry describing how given message type is handled
+struct prot_registry_entry {
+    int registered;
+    // Creates handler for incomming message of this type, NULL if this
+    // message can only arrive as a response (handler is pushed by us)
+    prot_registry_ctor ctor;
+    // Handler is not called until at least this many bytes arrive
+    size_t min_len;
+    // Maximum size of the message, 0 if not limited
+    size_t max_len;
+
+    unsigned long n_received; // Number of messages of this type received
+    unsigned long n_failed;   // Number of messages that failed processing
+};
+
+// Increment one of the entry counters, safe to use from multiple threads
+#define prot_registry_count(counter) \
+    __atomic_add_fetch(&(counter), 1, __ATOMIC_RELAXED)
+
+// Register handler for given message type in given mode, replaces
+// existing entry if there is one, must not be called while connections
+// are handled by other threads
+void prot_registry_add(
+    enum prot_modes mode,
+    enum prot_message_codes code,
+    prot_registry_ctor ctor,
+    size_t min_len,
+    size_t max_len
+);
+
+// Get registry entry for given message type, returns NULL
+// if message type is not registered in given mode
+struct prot_registry_entry * prot_registry_get(enum prot_modes mode, uint8_t code);
+
+// Allocate new receive handler for given incomming message type,
+// returns NULL if message of this type is not expected to arrive
+struct prot_recv_handler * prot_registry_autogen(enum prot_modes mode, uint8_t code, sqlite3 *db);
+
+#endif
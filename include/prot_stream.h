@@ -0,0 +1,69 @@
+#ifndef _INCLUDE_PROT_STREAM_H_
+#define _INCLUDE_PROT_STREAM_H_
+
+#include <stdint.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <prot_main.h>
+
+// Maximum number of stream bytes carried by a single chunk, streams take turns
+// in sending chunks, so message on one stream waits for at most one chunk
+// of each other stream
+#define PROT_STREAM_CHUNK_LEN (16 * 1024)
+// Length of the chunk header (protocol header, stream ID, flags and length)
+#define PROT_STREAM_HEADER_LEN (PROT_HEADER_LEN + sizeof(uint16_t) + 1 + sizeof(uint16_t))
+
+// Maximum number of streams multiplexed over a single connection, chunk
+// which would open more streams fails the connection
+#define PROT_STREAM_MAX 16
+
+// Chunk flags
+#define PROT_STREAM_FLAG_RESET 0x01 // Sender's stream handler failed
+
+// Logical stream multiplexed over a connection, stream has its own protocol
+// handler (with its own queues) which talks to the connection through a pair
+// of bufferevents, connection interleaves data of all streams in chunks
+struct prot_stream {
+    uint16_t id;
+    struct prot_main *conn;  // Connection stream is multiplexed over
+    struct prot_main *pmain; // Stream protocol handler, NULL once it's done
+
+    struct bufferevent *end; // Bufferevent used by stream protocol handler
+    struct bufferevent *mux; // Other end of the pair, used by the connection
+    // Tracks data waiting for the stream handler, it's charged to the connection
+    struct evbuffer_cb_entry *mux_mem_cb;
+
+    int reset;        // 1 if reset should be sent, 2 once it is sent
+    int tran_pending; // Chunk transmitter is in the connection queue
+
+    struct prot_tran_handler htran; // Chunk transmitter
+    struct prot_stream *next;
+};
+
+// Open new logical stream over given connection, returns protocol handler
+// of the stream, handlers pushed to it are processed independently from the
+// ones on the connection and on other streams, stream handler frees itself
+// once it's done, and it's closed together with the connection, streams can
+// be opened only if peer's version knows them (PROT_STREAM_DATA)
+struct prot_main * prot_stream_open(struct prot_main *conn);
+
+// Called by the connection once chunk header arrives, chunk data is passed
+// to the stream, stream is created if it doesn't exist, returns 1 once chunk
+// is processed and 0 if not all data arrived yet, or if connection holds too
+// much stream data (it's processed once streams take their data), sets error
+// on connection if chunk is invalid or stream can't be opened
+int prot_stream_recv(struct prot_main *conn, struct evbuffer *input);
+
+// Called once transaction on the connection starts, streams are allowed
+// to transmit from now on
+void prot_stream_transaction(struct prot_main *conn);
+
+// Called once stream protocol handler is freed, remaining stream data is
+// sent, reset is sent instead if handler failed (reset = 1)
+void prot_stream_detach(struct prot_stream *stream, int reset);
+
+// Close protocol handlers of all streams and free the streams, called
+// once connection is freed
+void prot_stream_free_all(struct prot_main *conn);
+
+#endif
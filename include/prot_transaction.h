@@ -13,10 +13,14 @@
 struct prot_txn_req {
     struct prot_recv_handler hrecv;
     struct prot_tran_handler htran;
+
+    int version; // Protocol version offered by the request
 };
 
-// Allocate new prot transaction request handler
-struct prot_txn_req * prot_txn_req_new(void);
+// Allocate new prot transaction request handler, request offers given protocol
+// version, peer which speaks older one answers with it, version is ignored by
+// handler receiving the request
+struct prot_txn_req * prot_txn_req_new(int version);
 
 // Free given transaction request handler
 void prot_txn_req_free(struct prot_txn_req *msg);
@@ -41,4 +45,34 @@ struct prot_txn_res * prot_txn_res_new(void);
 void prot_txn_res_free(struct prot_txn_res *msg);
 
 
+/**
+ * Transaction 0RTT message
+ */
+
+// Maximum difference in seconds between 0RTT timestamp and local time
+#define PROT_TXN_0RTT_WINDOW 120
+// Maximum number of 0RTT nonces remembered within the window (power of 2), once
+// there are more the oldest are forgotten, and nonces as old as them are refused
+#define PROT_TXN_0RTT_MAX_NONCES 65536
+// Length of the 0RTT message
+#define PROT_TXN_0RTT_LEN (PROT_HEADER_LEN + TRANSACTION_ID_LEN + sizeof(uint64_t))
+
+// Zero round trip transaction data structure, transaction ID is derived from
+// client nonce and timestamp, so messages can be sent right after it without
+// waiting for the response, nonce is accepted only once within the time window
+struct prot_txn_0rtt {
+    struct prot_recv_handler hrecv;
+    struct prot_tran_handler htran;
+
+    uint8_t nonce[TRANSACTION_ID_LEN];
+    uint64_t timestamp;
+};
+
+// Allocate new prot zero round trip transaction handler
+struct prot_txn_0rtt * prot_txn_0rtt_new(void);
+
+// Free given zero round trip transaction handler
+void prot_txn_0rtt_free(struct prot_txn_0rtt *msg);
+
+
 #endif
\ No newline at end of file
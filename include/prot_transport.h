@@ -0,0 +1,57 @@
+#ifndef _INCLUDE_PROT_TRANSPORT_H_
+#define _INCLUDE_PROT_TRANSPORT_H_
+
+#include <stdlib.h>
+#include <event2/bufferevent.h>
+
+// Transport backends used to reach the other side, whichever is used peers
+// are authenticated by the signed frames they exchange, not by the transport
+enum prot_transport_types {
+    PROT_TRANSPORT_TOR,  // Onion service through Tor socks server
+    PROT_TRANSPORT_TCP,  // Plain TCP to given host and port (trusted networks)
+    PROT_TRANSPORT_UNIX, // Unix domain socket at given path
+    PROT_TRANSPORT_N,
+};
+
+// Where to connect, for Tor address and port are of the socks server,
+// port is not used for unix sockets
+struct prot_route {
+    enum prot_transport_types type;
+    const char *address;
+    const char *port;
+};
+
+// Called once transport is done connecting, on failure err is 1 and bev is NULL
+typedef void (*prot_transport_cb)(struct bufferevent *bev, int err, void *attr);
+
+// Transport backend
+struct prot_transport {
+    const char *name;
+    // Start connecting given bufferevent (without socket) to the peer with given
+    // onion address, callback is called once done, returns 0 if connecting started
+    // and 1 if it failed right away, in which case callback is not called
+    int (*connect)(
+        struct bufferevent *bev,
+        const struct prot_route *route,
+        const char *onion_address,
+        const char *onion_port,
+        prot_transport_cb cb,
+        void *attr
+    );
+};
+
+// Get backend for given transport type
+const struct prot_transport * prot_transport_get(enum prot_transport_types type);
+
+// Parse route specification, one of "tor", "tor:<host>:<port>", "tcp:<host>:<port>"
+// or "unix:<path>", address and port are copied into given buffers (port buffer
+// must hold MAX_PORT_STR_LEN bytes), returns 0 on success and 1 if spec is invalid
+int prot_transport_parse(
+    const char *spec,
+    enum prot_transport_types *type,
+    char *address,
+    size_t address_len,
+    char *port
+);
+
+#endif
@@ -3,6 +3,9 @@
 
 #include <stdlib.h>
 
+// Maximum number of unused nodes kept by the queue for reuse
+#define QUEUE_MAX_SPARE 16
+
 struct queue_node;
 
 struct queue {
@@ -11,6 +14,10 @@ struct queue {
 
     struct queue_node *rear;
     struct queue_node *front;
+
+    // Unused nodes, reused by next insert
+    int n_spare;
+    struct queue_node *spare;
 };
 
 // Allocate new queue
@@ -26,9 +33,16 @@ void queue_enqueue(struct queue *q, void *data);
 // queue node will be deleted, returns 0 on success and 1 on failure
 int queue_dequeue(struct queue *q, void *data);
 
+// Remove element at given index from the queue, returns 0 on success
+// and 1 if there is no such element
+int queue_remove(struct queue *q, int index);
+
 // Get a pointer to the queue element at given index
 void * queue_peek(struct queue *q, int index);
 
+// Get a pointer to the last element in the queue, NULL if queue is empty
+void * queue_peek_last(struct queue *q);
+
 // Get the number of elements in the queue
 int queue_get_length(struct queue *q);
 
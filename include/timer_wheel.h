@@ -0,0 +1,57 @@
+#ifndef _INCLUDE_TIMER_WHEEL_H_
+#define _INCLUDE_TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <event2/event.h>
+
+// Number of slots in the wheel and duration of a single slot
+#define TIMER_WHEEL_SLOTS 512
+#define TIMER_WHEEL_TICK_MS 100
+
+// Called once timer expires, timer is not active when this is called
+typedef void (*timer_wheel_cb)(void *arg);
+
+// Timer, embedded into the object which uses it
+struct timer_wheel_entry {
+    int active;          // Set to 1 while timer is in the wheel
+    uint64_t expires;    // Tick at which timer expires
+    timer_wheel_cb cb;
+    void *arg;
+
+    struct timer_wheel_entry *next;
+    struct timer_wheel_entry *prev;
+};
+
+// Hashed timer wheel, all timers are driven by a single libevent timer
+// which is active only while there are timers in the wheel
+struct timer_wheel {
+    struct event_base *base;
+    struct event *tick_ev;   // Event fired on every tick
+    uint64_t current_tick;   // Last processed tick
+    int n_entries;           // Number of active timers
+
+    struct timer_wheel_entry *slots[TIMER_WHEEL_SLOTS];
+    struct timer_wheel *next; // Next wheel in the list of shared wheels
+};
+
+// Allocate new timer wheel which uses given event base
+struct timer_wheel * timer_wheel_new(struct event_base *base);
+
+// Free given timer wheel, timers in the wheel are left inactive
+void timer_wheel_free(struct timer_wheel *wheel);
+
+// Get wheel shared by everyone using given event base, wheel
+// is created on first use
+struct timer_wheel * timer_wheel_get(struct event_base *base);
+
+// Initialize timer, must be called before timer is used
+void timer_wheel_entry_init(struct timer_wheel_entry *entry, timer_wheel_cb cb, void *arg);
+
+// Start given timer, it will expire after timeout_ms milliseconds,
+// if timer is already active it is restarted
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_wheel_entry *entry, unsigned int timeout_ms);
+
+// Stop given timer, nothing happens if timer is not active
+void timer_wheel_del(struct timer_wheel *wheel, struct timer_wheel_entry *entry);
+
+#endif
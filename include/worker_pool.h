@@ -0,0 +1,79 @@
+#ifndef _INCLUDE_WORKER_POOL_H_
+#define _INCLUDE_WORKER_POOL_H_
+
+#include <pthread.h>
+#include <sqlite3.h>
+#include <event2/event.h>
+
+// Maximum number of worker threads
+#define WORKER_POOL_MAX_WORKERS 64
+
+// Ways to choose worker which will handle new connection
+enum worker_pool_balance {
+    WORKER_POOL_ROUND_ROBIN,
+    WORKER_POOL_LEAST_LOAD,
+};
+
+// Struct predefinition
+struct worker;
+struct worker_pool;
+
+// Called from the worker thread for each connection handed to it
+typedef void (*worker_pool_conn_cb)(struct worker *worker, evutil_socket_t sock, void *arg);
+
+// Single worker thread with its own event loop and database connection
+struct worker {
+    int id;
+    pthread_t thread;
+    struct worker_pool *pool;
+
+    struct event_base *base;
+    sqlite3 *db;
+
+    // Sockets handed over by the listener, waiting to be picked up
+    pthread_mutex_t lock;
+    int n_pending;
+    evutil_socket_t *pending;
+    // Activated to notify worker that new sockets are pending
+    struct event *notify_ev;
+
+    // Number of connections currently handled by the worker
+    int n_conns;
+};
+
+// Pool of worker threads used to handle incomming connections
+struct worker_pool {
+    int n_workers;
+    struct worker *workers;
+    enum worker_pool_balance balance;
+    int next; // Next worker to use (round robin)
+
+    char *db_path;
+    worker_pool_conn_cb conn_cb;
+    void *cb_arg;
+};
+
+// Allocate new worker pool with n_workers threads, each thread opens its
+// own connection to the database at db_path, threads are not started yet,
+// libevent thread support must be enabled before any event base is created
+struct worker_pool * worker_pool_new(
+    int n_workers,
+    const char *db_path,
+    enum worker_pool_balance balance,
+    worker_pool_conn_cb conn_cb,
+    void *cb_arg
+);
+
+// Start all worker threads
+void worker_pool_start(struct worker_pool *pool);
+
+// Hand given socket to one of the workers, called from the listener thread
+void worker_pool_dispatch(struct worker_pool *pool, evutil_socket_t sock);
+
+// Called from the worker thread once connection it handled is closed
+void worker_pool_conn_done(struct worker *worker);
+
+// Stop all worker threads and free the pool
+void worker_pool_free(struct worker_pool *pool);
+
+#endif
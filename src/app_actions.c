@@ -8,7 +8,9 @@
 #include <prot_message_list.h>
 #include <prot_client_fetch.h>
 #include <prot_mb_fetch.h>
-#include <prot_transaction.h>
+#include <prot_pool.h>
+#include <prot_stream.h>
+#include <sys_memory.h>
 #include <debug.h>
 #include <app.h>
 
@@ -73,14 +75,25 @@ static void hook_client_fetch(int ev, void *data, void *cbarg) {
     }
 }
 
-// Add hooks to main protocol handler for incomming connection
+// Handle stream opened by the other side, it gets the same hooks as connection
+static void hook_stream(int ev, void *data, void *cbarg) {
+    app_pmain_add_hooks(cbarg, data);
+}
+
+// Add hooks to main protocol handler for incomming connection, also used for
+// outgoing connections to contacts, since contact can send its requests back
+// over them, hooks are added only once so it's safe to call it again
 void app_pmain_add_hooks(struct app_data *app, struct prot_main *pmain) {
     // Add all hooks above
-    hook_add(pmain->hooks, PROT_FRIEND_REQ_EV_INCOMMING, hook_friend_req, app);
-    hook_add(pmain->hooks, PROT_MESSAGE_EV_INCOMMING, hook_message, app);
-    hook_add(pmain->hooks, PROT_CLIENT_FETCH_EV_INCOMMING, hook_client_fetch, app);
+    hook_add_unique(pmain->hooks, PROT_FRIEND_REQ_EV_INCOMMING, hook_friend_req, app);
+    hook_add_unique(pmain->hooks, PROT_MESSAGE_EV_INCOMMING, hook_message, app);
+    hook_add_unique(pmain->hooks, PROT_CLIENT_FETCH_EV_INCOMMING, hook_client_fetch, app);
+    hook_add_unique(pmain->hooks, PROT_MAIN_EV_STREAM, hook_stream, app);
 }
 
+// Fetch messages from the contact using the legacy CLIENT FETCH request
+static void app_contact_fetch(struct app_data *app, struct db_contact *cont);
+
 // Handle contact sync response
 static void hook_contact_sync(int ev, void *data, void *cbarg) {
     int i, ref_chat = 0, ref_contacts = 0;
@@ -91,6 +104,13 @@ static void hook_contact_sync(int ev, void *data, void *cbarg) {
     if (ev == PROT_CLIENT_FETCH_EV_FAIL)
         return;
 
+    // Contact refused protocol version we offered, next connection offers older one
+    if (ev == PROT_CLIENT_FETCH_EV_RETRY) {
+        if (cont = db_contact_get_by_pk(app->db, ((struct db_contact *)data)->id, NULL))
+            app_contact_fetch(app, cont);
+        return;
+    }
+
     if (evdata->n_messages == 0)
         return;
 
@@ -120,37 +140,44 @@ static void hook_contact_sync(int ev, void *data, void *cbarg) {
     db_contact_free(cont);
 }
 
-// Sync messages with given contact
-void app_contact_sync(struct app_data *app, struct db_contact *cont) {
-    int n_msgs, i;
-    struct db_message **msgs;
+// Fetch messages from the contact using the legacy CLIENT FETCH request
+static void app_contact_fetch(struct app_data *app, struct db_contact *cont) {
     struct prot_main *pmain;
-    struct prot_txn_req *treq;
-    struct prot_client_fetch *clfet;
 
-    pmain = prot_main_new(app->base, app->db);
-    treq = prot_txn_req_new();
-    clfet = prot_client_fetch_new(app->db, cont);
+    pmain = prot_pool_get(app->pool, cont->onion_address,
+        app->cf.app_port, "127.0.0.1", app->cf.tor_port);
+    app_pmain_add_hooks(app, pmain);
+
+    hook_add_unique(pmain->hooks, PROT_CLIENT_FETCH_EV_OK, hook_contact_sync, app);
+    hook_add_unique(pmain->hooks, PROT_CLIENT_FETCH_EV_FAIL, hook_contact_sync, app);
+    hook_add_unique(pmain->hooks, PROT_CLIENT_FETCH_EV_RETRY, hook_contact_sync, app);
+    prot_main_push_tran(pmain, &(prot_client_fetch_new(app->db, cont)->htran));
+}
 
-    prot_main_free_on_done(pmain, 1);
-    hook_add(pmain->hooks, PROT_CLIENT_FETCH_EV_OK, hook_contact_sync, app);
-    hook_add(pmain->hooks, PROT_CLIENT_FETCH_EV_FAIL, hook_contact_sync, app);
-    prot_main_push_tran(pmain, &(treq->htran));
+// Sync messages with given contact, undelivered messages and receipts are sent
+// together with the fetch request in a single CONTACT SYNC exchange, if contact's
+// version doesn't know it (or isn't known yet), they are sent one by one followed
+// by the legacy CLIENT FETCH request
+void app_contact_sync(struct app_data *app, struct db_contact *cont) {
+    int n_msgs, n_recv, i;
+    struct db_message **msgs, **recv_msgs;
+    struct prot_main *pmain, *stream;
+    struct prot_message_list *msg_list;
+
+    pmain = prot_pool_get(app->pool, cont->onion_address,
+        app->cf.app_port, "127.0.0.1", app->cf.tor_port);
+    app_pmain_add_hooks(app, pmain);
 
-    // Send all undelivered messages
     msgs = db_message_get_all(app->db, cont, DB_MESSAGE_STATUS_UNDELIVERED, &n_msgs);
-    for (i = 0; i < n_msgs; i++) {
-        struct prot_message *msg;
-        msg = prot_message_to_client_new(app->db, msgs[i]);
-        prot_main_push_tran(pmain, &(msg->htran));
+    recv_msgs = db_message_get_all(app->db, cont, DB_MESSAGE_STATUS_RECV, &n_recv);
+    if (n_recv > 0) {
+        msgs = safe_realloc(msgs, (n_msgs + n_recv) * sizeof(struct db_message *),
+            "Failed to allocate memory for contact sync message list");
     }
-    free(msgs);  // Free just array, not messages
 
     // Send RECV for all unconfirmed messages
-    msgs = db_message_get_all(app->db, cont, DB_MESSAGE_STATUS_RECV, &n_msgs);
-    for (i = 0; i < n_msgs; i++) {
+    for (i = 0; i < n_recv; i++) {
         struct db_message *recvmsg;
-        struct prot_message *msg;
 
         recvmsg = db_message_new();
         recvmsg->type = DB_MESSAGE_RECV;
@@ -158,16 +185,31 @@ void app_contact_sync(struct app_data *app, struct db_contact *cont) {
         recvmsg->sender = DB_MESSAGE_SENDER_ME;
         recvmsg->status = DB_MESSAGE_STATUS_UNDELIVERED;
         db_message_gen_id(recvmsg);
-        memcpy(recvmsg->body_recv_id, msgs[i]->global_id, MESSAGE_ID_LEN);
+        memcpy(recvmsg->body_recv_id, recv_msgs[i]->global_id, MESSAGE_ID_LEN);
 
-        msg = prot_message_to_client_new(app->db, recvmsg);
-        prot_main_push_tran(pmain, &(msg->htran));
+        msgs[n_msgs++] = recvmsg;
     }
-    db_message_free_all(msgs, n_msgs);
+    db_message_free_all(recv_msgs, n_recv);
+    free(recv_msgs);
 
-    prot_main_push_tran(pmain, &(clfet->htran));
-    prot_main_connect(pmain, cont->onion_address,
-        app->cf.app_port, "127.0.0.1", app->cf.tor_port);
+    if (!prot_main_peer_knows(pmain, PROT_CONTACT_SYNC)) {
+        for (i = 0; i < n_msgs; i++)
+            app_message_send(app, msgs[i]);
+        free(msgs);  // Free just array, messages are freed by the handlers
+
+        app_contact_fetch(app, cont);
+        return;
+    }
+
+    // Sync can carry many messages, so it doesn't hold back messages sent
+    // over the same connection meanwhile, if contact's version has streams
+    stream = prot_main_peer_knows(pmain, PROT_STREAM_DATA) ? prot_stream_open(pmain) : pmain;
+
+    hook_add_unique(stream->hooks, PROT_CLIENT_FETCH_EV_OK, hook_contact_sync, app);
+    hook_add_unique(stream->hooks, PROT_CLIENT_FETCH_EV_FAIL, hook_contact_sync, app);
+
+    msg_list = prot_message_list_sync_new(app->db, cont, msgs, n_msgs);
+    prot_main_push_tran(stream, &(msg_list->htran));
 }
 
 // Handle mb sync response
@@ -180,6 +222,12 @@ static void hook_mb_sync(int ev, void *data, void *cbarg) {
         return;
     }
 
+    // Mailbox refused protocol version we offered, next connection offers older one
+    if (ev == PROT_MB_FETCH_EV_RETRY) {
+        app_mailbox_sync(app);
+        return;
+    }
+
     app_ui_info(app, "[Message] Fetched %d new messages from the mailbox", evdata->n_messages);
 
     for (i = 0; i < evdata->n_messages; i++) {
@@ -204,23 +252,22 @@ static void hook_mb_sync(int ev, void *data, void *cbarg) {
 
 // Sync messages from your mailbox account
 void app_mailbox_sync(struct app_data *app) {
-    struct prot_main *pmain;
-    struct prot_txn_req *treq;
+    struct prot_main *pmain, *stream;
     struct prot_mb_fetch *mbfet;
 
     if (!db_options_is_defined(app->db, "mailbox_onion_address", DB_OPTIONS_TEXT))
         return;
 
-    pmain = prot_main_new(app->base, app->db);
-    treq = prot_txn_req_new();
     mbfet = prot_mb_fetch_new(app->db);
-
-    prot_main_free_on_done(pmain, 1);
-    hook_add(pmain->hooks, PROT_MB_FETCH_EV_OK, hook_mb_sync, app);
-    hook_add(pmain->hooks, PROT_MB_FETCH_EV_FAIL, hook_mb_sync, app);
-    prot_main_push_tran(pmain, &(treq->htran));
-    prot_main_push_tran(pmain, &(mbfet->htran));
-
-    prot_main_connect(pmain, mbfet->mb_onion_address,
+    pmain = prot_pool_get(app->pool, mbfet->mb_onion_address,
         app->cf.mailbox_port, "127.0.0.1", app->cf.tor_port);
+    // Fetched messages are sent on their own stream, so they don't hold back
+    // deposits to the mailbox, if mailbox is known to speak version with streams,
+    // otherwise fetch runs on the connection itself
+    stream = prot_main_peer_knows(pmain, PROT_STREAM_DATA) ? prot_stream_open(pmain) : pmain;
+
+    hook_add_unique(stream->hooks, PROT_MB_FETCH_EV_OK, hook_mb_sync, app);
+    hook_add_unique(stream->hooks, PROT_MB_FETCH_EV_FAIL, hook_mb_sync, app);
+    hook_add_unique(stream->hooks, PROT_MB_FETCH_EV_RETRY, hook_mb_sync, app);
+    prot_main_push_tran(stream, &(mbfet->htran));
 }
\ No newline at end of file
@@ -9,9 +9,16 @@
 #include <event2/event.h>
 #include <event2/bufferevent.h>
 #include <event2/listener.h>
+#include <event2/thread.h>
 #include <sys_crash.h>
 #include <prot_main.h>
+#include <prot_pool.h>
+#include <worker_pool.h>
+#include <db_init.h>
+#include <db_route.h>
+#include <prot_transport.h>
 
+#include <sys/un.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -28,6 +35,10 @@ static void app_sigint_handle_cb(evutil_socket_t fd, short what, void *arg);
 // Accept incomming connection
 static void app_accept_connection(struct evconnlistener *listener, 
     evutil_socket_t sock, struct sockaddr *addr, int len, void *ptr);
+// Handle connection handed to the worker thread
+static void app_worker_connection(struct worker *worker, evutil_socket_t sock, void *arg);
+// Start listener accepting connections without Tor
+static void app_direct_listen(struct app_data *app);
 
 // Init libevent and standard input event
 void app_event_init(struct app_data *app) {
@@ -36,8 +47,31 @@ void app_event_init(struct app_data *app) {
     struct evconnlistener *listener;
     struct addrinfo hints, *servinfo, *aip;
 
+    // Crypto and worker threads use event bases, locks are only set up
+    // for the bases created after this
+    if (evthread_use_pthreads() != 0)
+        sys_crash("Event", "Failed to enable libevent thread support");
+
     app->base = event_base_new();
     event_base_priority_init(app->base, APP_EV_PRIORITY_COUNT);
+    // Protocol traffic must not delay user input
+    prot_main_ev_priority(APP_EV_PRIORITY_NET);
+
+    // Keep expensive crypto operations out of the main event loop, protocol
+    // handlers created on this base will use the pool
+    if (app->cf.n_crypto_threads > 0)
+        app->crypto = crypto_pool_new(app->base, app->cf.n_crypto_threads);
+
+    app->pool = prot_pool_new(app->base, app->db, app->cf.pool_max_conns, app->cf.pool_idle);
+
+    // Mailbox can handle incomming connections in multiple threads, each
+    // with its own event loop and database connection
+    if (app->cf.is_mailbox && app->cf.n_workers > 0) {
+        sqlite3_busy_timeout(app->db, 5000);
+        app->workers = worker_pool_new(app->cf.n_workers, app->path.db_file,
+            WORKER_POOL_LEAST_LOAD, app_worker_connection, app);
+        worker_pool_start(app->workers);
+    }
 
     // If this is client start UI input handleing
     if (!app->cf.is_mailbox) {
@@ -80,6 +114,55 @@ void app_event_init(struct app_data *app) {
 
     if (aip == NULL)
         sys_crash("Network", "Failed to bind connection listener");
+
+    if (app->cf.direct_listen)
+        app_direct_listen(app);
+}
+
+// Start listener accepting connections without Tor, peers are still
+// authenticated by the signed messages they send
+static void app_direct_listen(struct app_data *app) {
+    int rc;
+    enum prot_transport_types type;
+    char address[DB_ROUTE_ADDR_MAX_LEN + 1];
+    char port[MAX_PORT_STR_LEN];
+    struct evconnlistener *listener = NULL;
+
+    prot_transport_parse(app->cf.direct_listen, &type, address, sizeof(address), port);
+
+    if (type == PROT_TRANSPORT_UNIX) {
+        struct sockaddr_un sun;
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, address, sizeof(sun.sun_path) - 1);
+        // Socket left by the previous run
+        unlink(address);
+
+        listener = evconnlistener_new_bind(app->base, app_accept_connection,
+            app, LEV_OPT_CLOSE_ON_FREE, -1, (struct sockaddr *)&sun, sizeof(sun));
+    } else {
+        struct addrinfo hints, *servinfo, *aip;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if ((rc = getaddrinfo(address, port, &hints, &servinfo)) != 0) {
+            sys_crash("Network", "Failed to get direct address to bind, getaddrinfo: %s", gai_strerror(rc));
+        }
+
+        for (aip = servinfo; aip != NULL; aip = aip->ai_next) {
+            listener = evconnlistener_new_bind(app->base, app_accept_connection,
+                app, LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, -1, aip->ai_addr, aip->ai_addrlen);
+
+            if (listener) break;
+        }
+        freeaddrinfo(servinfo);
+    }
+
+    if (!listener)
+        sys_crash("Network", "Failed to bind direct connection listener on %s", app->cf.direct_listen);
 }
 
 // Start event loop
@@ -139,11 +222,48 @@ static void app_accept_connection(struct evconnlistener *listener,
 
     debug("Got connection");
 
+    // Refuse new connections while existing ones hold too much memory
+    if (prot_main_mem_pressure()) {
+        debug("Connection refused, memory budget exhausted");
+        evutil_closesocket(sock);
+        return;
+    }
+
+    if (app->workers) {
+        worker_pool_dispatch(app->workers, sock);
+        return;
+    }
+
     base = evconnlistener_get_base(listener);
     bev = bufferevent_socket_new(base, sock, BEV_OPT_CLOSE_ON_FREE);
     pmain = prot_main_new(base, app->db);
 
     app_pmain_add_hooks(app, pmain);
     pmain->mode = app->cf.is_mailbox ? PROT_MODE_MAILBOX : PROT_MODE_CLIENT;
+    // Contact connected to us, our traffic to it can use this connection
+    if (!app->cf.is_mailbox)
+        prot_pool_attach(app->pool, pmain);
+    prot_main_assign(pmain, bev);
+}
+// Called once connection handled by the worker is closed
+static void hook_worker_close(int ev, void *data, void *cbarg) {
+    struct worker *worker = cbarg;
+
+    worker_pool_conn_done(worker);
+}
+
+// Handle connection handed to the worker thread, UI hooks are not added
+// since workers are used only by the mailbox
+static void app_worker_connection(struct worker *worker, evutil_socket_t sock, void *arg) {
+    struct bufferevent *bev;
+    struct prot_main *pmain;
+
+    debug("Worker %d got connection", worker->id);
+
+    bev = bufferevent_socket_new(worker->base, sock, BEV_OPT_CLOSE_ON_FREE);
+    pmain = prot_main_new(worker->base, worker->db);
+
+    hook_add(pmain->hooks, PROT_MAIN_EV_CLOSE, hook_worker_close, worker);
+    pmain->mode = PROT_MODE_MAILBOX;
     prot_main_assign(pmain, bev);
-}
\ No newline at end of file
+}
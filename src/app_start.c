@@ -12,6 +12,11 @@
 #include <onion.h>
 #include <sys/stat.h>
 #include <db_init.h>
+#include <db_message.h>
+#include <worker_pool.h>
+#include <crypto_pool.h>
+#include <crypto_ctx.h>
+#include <prot_transport.h>
 #include <debug.h>
 #include <helpers_crypto.h>
 #include <stdint.h>
@@ -41,11 +46,16 @@ void app_start(struct app_data *app, int argc, char **argv) {
         {"keygen",       required_argument, 0, 'g'},
         {"keys",         no_argument,       0, 'k'},
         {"keydel",       required_argument, 0, 'r'},
+        {"idle",         required_argument, 0, 'i'},
+        {"circuits",     required_argument, 0, 'c'},
+        {"threads",      required_argument, 0, 'T'},
+        {"crypto-threads", required_argument, 0, 'C'},
+        {"direct",       required_argument, 0, 'D'},
         {"version",      no_argument,       0, 'v'},
         {0,              0,                 0,  0 },
     };
 
-    const char short_options[] = "hmd:p:P:t:ug:kr:v";
+    const char short_options[] = "hmd:p:P:t:ug:kr:i:c:T:C:D:v";
 
     int opt;
     int option_index = 0;
@@ -61,6 +71,9 @@ void app_start(struct app_data *app, int argc, char **argv) {
 
     debug_set_fp(stdout);
 
+    // Algorithms are fetched before any thread uses them
+    crypto_ctx_init();
+
     // Set default config dir path
     app->path.data_dir = array(char);
     array_strcpy(app->path.data_dir, APP_DEFAULT_DIR_PATH, -1);
@@ -77,6 +90,11 @@ void app_start(struct app_data *app, int argc, char **argv) {
     app->cf.mailbox_port = array(char);
     array_strcpy(app->cf.mailbox_port, DEEP_MESSENGER_MAILBOX_PORT, -1);
 
+    // Set default connection pool limits
+    app->cf.pool_idle = PROT_POOL_IDLE_TIMEOUT;
+    app->cf.pool_max_conns = PROT_POOL_MAX_CONNS;
+    app->cf.n_crypto_threads = CRYPTO_POOL_DEFAULT_THREADS;
+
     while ((opt = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1) {
         switch (opt) {
             case 'h':
@@ -92,6 +110,11 @@ void app_start(struct app_data *app, int argc, char **argv) {
                 printf("  -g, --keygen <uses>       Generate new mailbox access key\n");
                 printf("  -k, --keys                Show list of all available mailbox access keys\n");
                 printf("  -r, --keydel <key>        Delete given mailbox access key\n");
+                printf("  -i, --idle <seconds>      Keep unused connections open this long (default: %d)\n", PROT_POOL_IDLE_TIMEOUT);
+                printf("  -c, --circuits <n>        Maximum number of connections kept open (default: %d)\n", PROT_POOL_MAX_CONNS);
+                printf("  -T, --threads <n>         Handle mailbox connections using n worker threads (default: 0)\n");
+                printf("  -C, --crypto-threads <n>  Run crypto operations in n threads (default: %d)\n", CRYPTO_POOL_DEFAULT_THREADS);
+                printf("  -D, --direct <addr>       Also accept connections without Tor (tcp:<host>:<port> or unix:<path>)\n");
                 printf("  -v, --version             Show application version\n");
                 exit(EXIT_SUCCESS);
                 break;
@@ -155,6 +178,62 @@ void app_start(struct app_data *app, int argc, char **argv) {
                 array_strcpy(access_key, optarg, -1);
                 break;
             
+            case 'i':
+                // Set how long unused connections are kept open
+                if (sscanf(optarg, "%d", &app->cf.pool_idle) != 1 || app->cf.pool_idle < 0) {
+                    printf("Invalid idle timeout provided\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'c':
+                // Set maximum number of connections kept open
+                if (sscanf(optarg, "%d", &app->cf.pool_max_conns) != 1 || app->cf.pool_max_conns < 0) {
+                    printf("Invalid number of connections provided\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'T':
+                // Set number of mailbox worker threads, 0 handles everything in the main thread
+                if (
+                    sscanf(optarg, "%d", &app->cf.n_workers) != 1 ||
+                    app->cf.n_workers < 0 || app->cf.n_workers > WORKER_POOL_MAX_WORKERS
+                ) {
+                    printf("Invalid number of threads provided (max %d)\n", WORKER_POOL_MAX_WORKERS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'C':
+                // Set number of crypto threads, 0 runs crypto operations in the main thread
+                if (
+                    sscanf(optarg, "%d", &app->cf.n_crypto_threads) != 1 ||
+                    app->cf.n_crypto_threads < 0 || app->cf.n_crypto_threads > CRYPTO_POOL_MAX_THREADS
+                ) {
+                    printf("Invalid number of crypto threads provided (max %d)\n", CRYPTO_POOL_MAX_THREADS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'D': {
+                // Accept direct connections, only for trusted networks
+                enum prot_transport_types type;
+                char address[PATH_MAX];
+                char direct_port[MAX_PORT_STR_LEN];
+
+                if (
+                    prot_transport_parse(optarg, &type, address, sizeof(address), direct_port) ||
+                    type == PROT_TRANSPORT_TOR
+                ) {
+                    printf("Invalid direct address provided, use tcp:<host>:<port> or unix:<path>\n");
+                    exit(EXIT_FAILURE);
+                }
+                app->cf.direct_listen = array(char);
+                array_strcpy(app->cf.direct_listen, optarg, -1);
+                break;
+            }
+
             case 'v':
                 // Print app version
                 printf("Deep Messenger version %s (protocol v%d)\n", 
@@ -225,6 +304,8 @@ void app_start(struct app_data *app, int argc, char **argv) {
     }
     // Setup database tables
     db_init_schema(app->db);
+    // Revert messages left unconfirmed by the previous run
+    db_message_batch_rollback(app->db, 0);
 
     // List all available mailbox access keys
     if (key_operation == 'k') {
@@ -376,6 +457,8 @@ void app_end(struct app_data *app) {
 
     app_tor_end(app);
     app_event_end(app);
+    worker_pool_free(app->workers);
+    crypto_pool_free(app->crypto);
     printf("\nStopped Deep Messenger\n");
     exit(EXIT_SUCCESS);
 }
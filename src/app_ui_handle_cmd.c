@@ -15,6 +15,8 @@
 #include <prot_mb_account.h>
 #include <prot_friend_req.h>
 #include <prot_mb_set_contacts.h>
+#include <prot_transport.h>
+#include <db_route.h>
 
 #include <app.h>
 
@@ -37,6 +39,9 @@ static void command_help(int argc, char **argv, void *cbarg) {
     app_ui_shell(app, "  mbsync              Fetch new messages from mailbox server");
     app_ui_shell(app, "  mbdirect <1/0>      Send messages only over mailbox (debug tool)");
     app_ui_shell(app, "  tor                 Start tor client (manual mode)");
+    app_ui_shell(app, "  route <onion> <to>  Reach given onion over tor, tcp:<host>:<port> or unix:<path>");
+    app_ui_shell(app, "  routes              List all routes");
+    app_ui_shell(app, "  routerm <onion>     Remove route, given onion is reached over Tor again");
     app_ui_shell(app, "  version             Prints app and protocol version");
     
 }
@@ -152,7 +157,7 @@ static void command_mbreg(int argc, char **argv, void *cbarg) {
     app_ui_shell(app, "This could take some time...");
 
     pmain = prot_main_new(app->base, app->db);
-    txnreq = prot_txn_req_new();
+    txnreq = prot_txn_req_new(DEEP_MESSENGER_PROTOCOL_VER_MIN);
     accreg = prot_mb_acc_register_new(app->db, argv[1], access_key);
     array_free(access_key);
 
@@ -208,7 +213,7 @@ static void command_mbrm(int argc, char **argv, void *cbarg) {
     db_options_get_text(app->db, "client_mailbox_onion_address", mb_address, ONION_ADDRESS_LEN + 1);
 
     pmain = prot_main_new(app->base, app->db);
-    txnreq = prot_txn_req_new();
+    txnreq = prot_txn_req_new(DEEP_MESSENGER_PROTOCOL_VER_MIN);
     accrm = prot_mb_acc_delete_new(app->db, mb_address, mb_id, mb_sig_priv_key);
 
     prot_main_free_on_done(pmain, 1);
@@ -306,7 +311,7 @@ static void command_friendadd(int argc, char **argv, void *cbarg) {
     app_ui_shell(app, "This could take some time...");
 
     pmain = prot_main_new(app->base, app->db);
-    txnreq = prot_txn_req_new();
+    txnreq = prot_txn_req_new(DEEP_MESSENGER_PROTOCOL_VER_MIN);
     freq = prot_friend_req_new(app->db, argv[1]);
 
     prot_main_free_on_done(pmain, 1);
@@ -418,7 +423,7 @@ static void command_mbcontacts(int argc, char **argv, void *cbarg) {
     conts = db_contact_get_all(app->db, &n_conts);
 
     pmain = prot_main_new(app->base, app->db);
-    txnreq = prot_txn_req_new();
+    txnreq = prot_txn_req_new(DEEP_MESSENGER_PROTOCOL_VER_MIN);
     setconts = prot_mb_set_contacts_new(app->db, mb_address, mb_id, mb_sig_priv_key, conts, n_conts);
 
     prot_main_free_on_done(pmain, 1);
@@ -490,6 +495,70 @@ static void command_tor(int argc, char **argv, void *cbarg) {
     app_tor_start(app);
 }
 
+// Set route used to reach given onion address
+static void command_route(int argc, char **argv, void *cbarg) {
+    struct app_data *app = cbarg;
+    struct db_route *route;
+    enum prot_transport_types type;
+
+    if (!onion_address_valid(argv[1])) {
+        app_ui_shell(app, "error: Invalid onion address provided");
+        return;
+    }
+
+    if (!(route = db_route_get_by_onion(app->db, argv[1], NULL))) {
+        route = db_route_new();
+        strcpy(route->onion_address, argv[1]);
+    }
+
+    if (prot_transport_parse(argv[2], &type, route->address, sizeof(route->address), route->port)) {
+        app_ui_shell(app, "error: Invalid route, use tor, tor:<host>:<port>, tcp:<host>:<port> or unix:<path>");
+        db_route_free(route);
+        return;
+    }
+    route->transport = type;
+    db_route_save(app->db, route);
+
+    // Connections made over the previous route are not used any more
+    prot_pool_flush(app->pool);
+    app_ui_shell(app, "Onion %s is now reached using %s", argv[1], argv[2]);
+    db_route_free(route);
+}
+
+// List all routes
+static void command_routes(int argc, char **argv, void *cbarg) {
+    int i, n;
+    struct app_data *app = cbarg;
+    struct db_route **routes;
+
+    routes = db_route_get_all(app->db, &n);
+
+    app_ui_shell(app, "List of all routes, other onions are reached over Tor:");
+    for (i = 0; i < n; i++) {
+        app_ui_shell(app, "  - %s - %s %s %s", routes[i]->onion_address,
+            prot_transport_get(routes[i]->transport)->name, routes[i]->address, routes[i]->port);
+    }
+    app_ui_shell(app, "Total: %d", n);
+
+    db_route_free_all(routes, n);
+}
+
+// Remove route for given onion address
+static void command_routerm(int argc, char **argv, void *cbarg) {
+    struct app_data *app = cbarg;
+    struct db_route *route;
+
+    if (!(route = db_route_get_by_onion(app->db, argv[1], NULL))) {
+        app_ui_shell(app, "error: There is no route for given onion");
+        return;
+    }
+
+    db_route_delete(app->db, route);
+    prot_pool_flush(app->pool);
+    app_ui_shell(app, "Removed route for %s", argv[1]);
+    db_route_free(route);
+}
+
 // Upload contact list
 static void command_nickname(int argc, char **argv, void *cbarg) {
     int i;
@@ -548,11 +617,14 @@ void app_ui_handle_cmd(struct ui_prompt *prt, void *att) {
         {"mbsync",     0, command_mbsync,     app},
         {"tor",        0, command_tor,        app},
         {"nickname",   1, command_nickname,   app},
+        {"route",      2, command_route,      app},
+        {"routes",     0, command_routes,     app},
+        {"routerm",    1, command_routerm,    app},
     };
 
     app_ui_shell(app, "> %ls", prt->input_buffer);
 
-    if (err = cmd_parse(cmds, 15, ui_prompt_get_input(prt))) {
+    if (err = cmd_parse(cmds, 18, ui_prompt_get_input(prt))) {
         app_ui_shell(app, "error: %s", err);
     }
     ui_prompt_clear(prt);
@@ -3,7 +3,7 @@
 #include <db_message.h>
 #include <prot_main.h>
 #include <prot_message.h>
-#include <prot_transaction.h>
+#include <prot_pool.h>
 #include <hooks.h>
 #include <app.h>
 #include <debug.h>
@@ -17,12 +17,15 @@ static void message_mb_hook_cb(int ev, void *data, void *cbarg) {
         if (app->cont_selected && app->cont_selected->id == dbmsg->contact_id)
             app_ui_chat_refresh(app, 1);
     }
+
+    // Mailbox refused protocol version we offered, next connection offers older one
+    if (ev == PROT_MESSAGE_EV_RETRY)
+        app_message_send_mb(app, dbmsg);
 }
 
 // Try to send message to the contact mailbox (makes a copy of provided message)
 void app_message_send_mb(struct app_data *app, const struct db_message *msg) {
     struct prot_main *pmain;
-    struct prot_txn_req *treq;
     struct prot_message *pmsg;
     struct db_message *dbmsg;
     struct db_contact *dbcont;
@@ -35,20 +38,20 @@ void app_message_send_mb(struct app_data *app, const struct db_message *msg) {
         db_contact_free(dbcont);
         return;
     }
-    dbmsg = db_message_get_by_pk(app->db, msg->id, NULL);
+    // Receipts sent by contact sync are not stored, so they can't go to the mailbox
+    if (!(dbmsg = db_message_get_by_pk(app->db, msg->id, NULL))) {
+        db_contact_free(dbcont);
+        return;
+    }
 
-    pmain = prot_main_new(app->base, app->db);
-    treq = prot_txn_req_new();
+    pmain = prot_pool_get(app->pool, dbcont->mailbox_onion,
+        app->cf.mailbox_port, "127.0.0.1", app->cf.tor_port);
     pmsg = prot_message_to_mailbox_new(app->db, dbmsg);
 
-    prot_main_free_on_done(pmain, 1);
-    hook_add(pmain->hooks, PROT_MESSAGE_EV_OK, message_mb_hook_cb, app);
-    hook_add(pmain->hooks, PROT_MESSAGE_EV_FAIL, message_mb_hook_cb, app);
-    prot_main_push_tran(pmain, &(treq->htran));
+    hook_add_unique(pmain->hooks, PROT_MESSAGE_EV_OK, message_mb_hook_cb, app);
+    hook_add_unique(pmain->hooks, PROT_MESSAGE_EV_FAIL, message_mb_hook_cb, app);
+    hook_add_unique(pmain->hooks, PROT_MESSAGE_EV_RETRY, message_mb_hook_cb, app);
     prot_main_push_tran(pmain, &(pmsg->htran));
-
-    prot_main_connect(pmain, dbcont->mailbox_onion,
-        app->cf.mailbox_port, "127.0.0.1", app->cf.tor_port);
     db_contact_free(dbcont);
 }
 
@@ -63,6 +66,13 @@ static void message_hook_cb(int ev, void *data, void *cbarg) {
         return;
     }
 
+    // Contact refused protocol version we offered, next connection offers older one
+    if (ev == PROT_MESSAGE_EV_RETRY) {
+        if (dbmsg = db_message_get_by_pk(app->db, dbmsg->id, NULL))
+            app_message_send(app, dbmsg);
+        return;
+    }
+
     // Send message to the mailbox if online
     app_message_send_mb(app, dbmsg);
 }
@@ -70,23 +80,20 @@ static void message_hook_cb(int ev, void *data, void *cbarg) {
 // Send message to associated contact (frees message by itself)
 void app_message_send(struct app_data *app, struct db_message *dbmsg) {
     struct prot_main *pmain;
-    struct prot_txn_req *treq;
     struct prot_message *pmsg;
     struct db_contact *cont;
 
     cont = db_contact_get_by_pk(app->db, dbmsg->contact_id, NULL);
-    pmain = prot_main_new(app->base, app->db);
-    treq = prot_txn_req_new();
+    // Contact which is connected to us is reached over its own connection
+    pmain = prot_pool_get(app->pool, cont->onion_address,
+        app->cf.app_port, "127.0.0.1", app->cf.tor_port);
+    app_pmain_add_hooks(app, pmain);
     pmsg = prot_message_to_client_new(app->db, dbmsg);
 
-    prot_main_free_on_done(pmain, 1);
-    hook_add(pmain->hooks, PROT_MESSAGE_EV_OK, message_hook_cb, app);
-    hook_add(pmain->hooks, PROT_MESSAGE_EV_FAIL, message_hook_cb, app);
-    prot_main_push_tran(pmain, &(treq->htran));
+    hook_add_unique(pmain->hooks, PROT_MESSAGE_EV_OK, message_hook_cb, app);
+    hook_add_unique(pmain->hooks, PROT_MESSAGE_EV_FAIL, message_hook_cb, app);
+    hook_add_unique(pmain->hooks, PROT_MESSAGE_EV_RETRY, message_hook_cb, app);
     prot_main_push_tran(pmain, &(pmsg->htran));
-
-    prot_main_connect(pmain, cont->onion_address,
-        app->cf.app_port, "127.0.0.1", app->cf.tor_port);
     db_contact_free(cont);
 }
 
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <event2/buffer.h>
 #include <buffer_crypto.h>
@@ -10,145 +11,404 @@
 #include <debug.h>
 #include <helpers.h>
 #include <helpers_crypto.h>
+#include <key_cache.h>
+#include <crypto_ctx.h>
 
 // Take first len bytes in the given buffer, sign them using provided ed25519
 // private key and add signature to the end of buffer
 int ed25519_buffer_sign(struct evbuffer *buff, size_t len, uint8_t *priv_key) {
-    int i, is_err = 0;
-    int n_iv;
-    struct evbuffer_iovec *iv = NULL;
+    int is_err = 1;
+    EVP_MD_CTX *hashctx;
+    uint8_t sig[ED25519_SIGNATURE_LEN];
 
-    EVP_PKEY *pkey = NULL;
-    EVP_MD_CTX *ctx = NULL;
-    EVP_MD_CTX *hashctx = NULL;
+    if (len == 0)
+        len = evbuffer_get_length(buff);
 
-    uint8_t hash[EVP_MAX_MD_SIZE];
-    int hash_len = EVP_MAX_MD_SIZE;
+    if (!(hashctx = ed25519_prehash_new()))
+        return 1;
+
+    if (
+        !ed25519_prehash_update(hashctx, buff, len) &&
+        !ed25519_prehash_sign(hashctx, sig, priv_key)
+    ) {
+        evbuffer_add(buff, sig, ED25519_SIGNATURE_LEN);
+        is_err = 0;
+    }
+
+    ed25519_prehash_free(hashctx);
+    return is_err;
+}
+
+// Takes last ED25519_SIGNATURE_LEN bytes as a ed25519 signature and validates
+// it against other data using provided ed25519 public key
+int ed25519_buffer_validate(struct evbuffer *buff, size_t len, uint8_t *pub_key) {
+    int is_valid = 0;
+    struct evbuffer_ptr ptr;
+    size_t content_len;
+    EVP_MD_CTX *hashctx;
 
     uint8_t sig[ED25519_SIGNATURE_LEN];
-    size_t sig_len = ED25519_SIGNATURE_LEN;
 
     if (len == 0)
         len = evbuffer_get_length(buff);
+    content_len = len - ED25519_SIGNATURE_LEN;
 
-    hashctx = EVP_MD_CTX_new();
-    if (!EVP_DigestInit_ex2(hashctx, EVP_sha512(), NULL)) {
-        is_err = 1; goto err;
+    evbuffer_ptr_set(buff, &ptr, content_len, EVBUFFER_PTR_SET);
+    evbuffer_copyout_from(buff, &ptr, sig, ED25519_SIGNATURE_LEN);
+
+    if (!(hashctx = ed25519_prehash_new()))
+        return 0;
+
+    if (!ed25519_prehash_update(hashctx, buff, content_len))
+        is_valid = ed25519_prehash_validate(hashctx, sig, pub_key);
+
+    ed25519_prehash_free(hashctx);
+    return is_valid;
+}
+
+// Start new SHA-512 prehash, used to validate signature of the data which
+// is processed as it arrives, returns NULL on failure
+EVP_MD_CTX * ed25519_prehash_new(void) {
+    EVP_MD_CTX *hashctx;
+
+    if (!(hashctx = crypto_ctx_md_get()))
+        return NULL;
+
+    if (!EVP_DigestInit_ex2(hashctx, crypto_ctx_md(CRYPTO_CTX_SHA512), NULL)) {
+        debug("Failed to init prehash: %s", ERR_error_string(ERR_get_error(), NULL));
+        crypto_ctx_md_put(hashctx);
+        return NULL;
     }
 
-    if (!(pkey = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, NULL, priv_key, ED25519_PRIV_KEY_LEN))) {
+    return hashctx;
+}
+
+// Add first len bytes from the given buffer to the prehash, data is
+// not removed from the buffer, returns 0 on success and 1 on failure
+int ed25519_prehash_update(EVP_MD_CTX *hashctx, struct evbuffer *buff, size_t len) {
+    return ed25519_prehash_update_at(hashctx, buff, 0, len);
+}
+
+// Add len bytes from the given buffer starting at given offset to the prehash, data
+// is not removed from the buffer, returns 0 on success and 1 on failure
+int ed25519_prehash_update_at(EVP_MD_CTX *hashctx, struct evbuffer *buff, size_t offset, size_t len) {
+    int i, n_iv;
+    int is_err = 0;
+    struct evbuffer_ptr pos;
+    struct evbuffer_iovec *iv;
+
+    if (len == 0)
+        return 0;
+
+    evbuffer_ptr_set(buff, &pos, offset, EVBUFFER_PTR_SET);
+    n_iv = evbuffer_peek(buff, len, &pos, NULL, 0);
+    iv = safe_malloc((sizeof(struct evbuffer_iovec) * n_iv),
+        "Failed to allocate memory for evbuffer iovec(s), on buffer hash");
+    n_iv = evbuffer_peek(buff, len, &pos, iv, n_iv);
+
+    for (i = 0; i < n_iv && len > 0; i++) {
+        if (!EVP_DigestUpdate(hashctx, iv[i].iov_base, min(iv[i].iov_len, len))) {
+            is_err = 1; break;
+        }
+        len -= min(iv[i].iov_len, len);
+    }
+
+    free(iv);
+    return is_err;
+}
+
+// Finish the prehash and store hash of the data (ED25519_PREHASH_LEN bytes)
+// into hash, returns 0 on success and 1 on failure
+int ed25519_prehash_final(EVP_MD_CTX *hashctx, uint8_t *hash) {
+    unsigned int hash_len = ED25519_PREHASH_LEN;
+
+    if (!EVP_DigestFinal_ex(hashctx, hash, &hash_len)) {
+        debug("Failed to finish prehash: %s", ERR_error_string(ERR_get_error(), NULL));
+        return 1;
+    }
+    return 0;
+}
+
+// Finish the prehash and validate given ed25519 signature of hashed data
+// using provided public key, returns 1 if signature is valid and 0 otherwise
+int ed25519_prehash_validate(EVP_MD_CTX *hashctx, const uint8_t *sig, uint8_t *pub_key) {
+    uint8_t hash[ED25519_PREHASH_LEN];
+
+    if (ed25519_prehash_final(hashctx, hash))
+        return 0;
+
+    return ed25519_hash_validate(hash, sig, pub_key);
+}
+
+// Validate given ed25519 signature of the data with given prehash (finished by
+// ed25519_prehash_final), returns 1 if signature is valid and 0 otherwise
+int ed25519_hash_validate(const uint8_t *hash, const uint8_t *sig, uint8_t *pub_key) {
+    int is_err = 0, is_valid = 0;
+
+    EVP_PKEY *pkey = NULL;
+    EVP_MD_CTX *ctx = NULL;
+
+    if (!(pkey = key_cache_get(KEY_CACHE_ED25519_PUB, pub_key))) {
         is_err = 1; goto err;
     }
 
-    ctx = EVP_MD_CTX_new();
-    if (!EVP_DigestSignInit(ctx, NULL, NULL, NULL, pkey)) {
+    ctx = crypto_ctx_md_get();
+    if (!EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, pkey)) {
         is_err = 1; goto err;
+    };
+
+    is_valid = EVP_DigestVerify(ctx, sig, ED25519_SIGNATURE_LEN, hash, ED25519_PREHASH_LEN);
+
+    err:
+    crypto_ctx_md_put(ctx);
+    EVP_PKEY_free(pkey);
+
+    if (is_err) {
+        debug("An error occured while checking buffer signature: %s", 
+            ERR_error_string(ERR_get_error(), NULL));
+        return 0;
     }
 
-    n_iv = evbuffer_peek(buff, len, NULL, NULL, 0);
-    iv = safe_malloc((sizeof(struct evbuffer_iovec) * n_iv),
-        "Failed to allocate memory for evbuffer iovec(s), on buffer sign");
+    return is_valid == 1;
+}
 
-    n_iv = evbuffer_peek(buff, len, NULL, iv, n_iv);
+// Finish the prehash and sign hashed data using provided ed25519 private
+// key, signature is stored into sig, returns 0 on success and 1 on failure
+int ed25519_prehash_sign(EVP_MD_CTX *hashctx, uint8_t *sig, uint8_t *priv_key) {
+    int is_err = 0;
 
-    for (i = 0; i < n_iv; i++) {
-        if (!EVP_DigestUpdate(hashctx, iv[i].iov_base, min(iv[i].iov_len, len))) {
-            is_err = 1; goto err;
-        }
-        len -= iv[i].iov_len;
+    EVP_PKEY *pkey = NULL;
+    EVP_MD_CTX *ctx = NULL;
+
+    uint8_t hash[EVP_MAX_MD_SIZE];
+    unsigned int hash_len = EVP_MAX_MD_SIZE;
+    size_t sig_len = ED25519_SIGNATURE_LEN;
+
+    if (!(pkey = key_cache_get(KEY_CACHE_ED25519_PRIV, priv_key))) {
+        is_err = 1; goto err;
     }
 
     if (!EVP_DigestFinal_ex(hashctx, hash, &hash_len)) {
         is_err = 1; goto err;
     }
 
-    EVP_DigestSign(ctx, sig, &sig_len, hash, hash_len);
-    evbuffer_add(buff, sig, sig_len);
+    ctx = crypto_ctx_md_get();
+    if (
+        !EVP_DigestSignInit(ctx, NULL, NULL, NULL, pkey) ||
+        !EVP_DigestSign(ctx, sig, &sig_len, hash, hash_len)
+    ) {
+        is_err = 1; goto err;
+    }
 
     err:
-    free(iv);
-    EVP_MD_CTX_free(ctx);
-    EVP_MD_CTX_free(hashctx);
+    crypto_ctx_md_put(ctx);
     EVP_PKEY_free(pkey);
 
     if (is_err) {
-        debug("An error occured while signing the buffer: %s", 
+        debug("An error occured while signing the buffer: %s",
             ERR_error_string(ERR_get_error(), NULL));
+    }
+
+    return is_err;
+}
+
+// Free given prehash context
+void ed25519_prehash_free(EVP_MD_CTX *hashctx) {
+    crypto_ctx_md_put(hashctx);
+}
+
+// Initialize writer which adds data to the end of given buffer
+void ed25519_writer_init(struct ed25519_writer *w, struct evbuffer *buff) {
+    memset(w, 0, sizeof(struct ed25519_writer));
+    w->buff = buff;
+}
+
+// Open new signed section, returns 0 on success and 1 on failure
+int ed25519_writer_begin(struct ed25519_writer *w) {
+    if (w->depth == ED25519_WRITER_MAX_DEPTH || !(w->hash[w->depth] = ed25519_prehash_new())) {
+        w->err = 1;
         return 1;
     }
 
+    ++w->depth;
     return 0;
 }
 
-// Takes last ED25519_SIGNATURE_LEN bytes as a ed25519 signature and validates
-// it against other data using provided ed25519 public key
-int ed25519_buffer_validate(struct evbuffer *buff, size_t len, uint8_t *pub_key) {
-    int i, j, n_iv, i_sig;
-    int is_err = 0, is_valid = 0;
-    struct evbuffer_ptr ptr;
-    struct evbuffer_iovec *iv;
-    size_t content_len;
+// Add data already written to the end of the buffer (for example using reserved
+// space) to the hash, data must be len bytes long
+void ed25519_writer_hash(struct ed25519_writer *w, const void *data, size_t len) {
+    int i;
 
-    EVP_PKEY *pkey = NULL;
-    EVP_MD_CTX *ctx = NULL;
-    EVP_MD_CTX *hashctx = NULL;
+    for (i = 0; i < w->depth; i++) {
+        if (!EVP_DigestUpdate(w->hash[i], data, len))
+            w->err = 1;
+    }
+}
 
-    uint8_t hash[EVP_MAX_MD_SIZE];
-    int hash_len = EVP_MAX_MD_SIZE;
+// Add data to the buffer and hash it
+void ed25519_writer_add(struct ed25519_writer *w, const void *data, size_t len) {
+    evbuffer_add(w->buff, data, len);
+    ed25519_writer_hash(w, data, len);
+}
 
+// Close innermost section and add its signature created using given ed25519
+// private key, returns 0 on success and 1 if this or any previous operation failed
+int ed25519_writer_end(struct ed25519_writer *w, uint8_t *priv_key) {
+    EVP_MD_CTX *hashctx;
     uint8_t sig[ED25519_SIGNATURE_LEN];
 
-    if (len == 0)
-        len = evbuffer_get_length(buff);
-    content_len = len - ED25519_SIGNATURE_LEN;
+    if (w->depth == 0)
+        return 1;
 
-    if (!(pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, pub_key, ED25519_PUB_KEY_LEN))) {
-        is_err = 1; goto err;
+    hashctx = w->hash[--w->depth];
+    w->hash[w->depth] = NULL;
+
+    // Signature is part of the outer sections
+    if (w->err || ed25519_prehash_sign(hashctx, sig, priv_key))
+        w->err = 1;
+    else
+        ed25519_writer_add(w, sig, ED25519_SIGNATURE_LEN);
+
+    ed25519_prehash_free(hashctx);
+    return w->err;
+}
+
+// Free sections which were not closed, used on error
+void ed25519_writer_cleanup(struct ed25519_writer *w) {
+    while (w->depth > 0) {
+        --w->depth;
+        ed25519_prehash_free(w->hash[w->depth]);
+        w->hash[w->depth] = NULL;
     }
-    hashctx = EVP_MD_CTX_new();
-    if (!EVP_DigestInit_ex2(hashctx, EVP_sha512(), NULL)) {
-        is_err = 1; goto err;
+}
+
+// Returns length of the format created by rsa_buffer_encrypt for plain text of given length
+size_t rsa_buffer_sealed_len(size_t plain_len) {
+    size_t block_len = EVP_CIPHER_block_size(crypto_ctx_cipher(CRYPTO_CTX_AES_256_CBC));
+
+    return sizeof(uint32_t) + (plain_len / block_len + 1) * block_len +
+        AES_ENC_KEY_LENGTH + AES_IV_LENGTH;
+}
+
+// Free memory used by the seal
+static void rsa_seal_free(struct rsa_seal *seal) {
+    EVP_PKEY_free(seal->pkey);
+    crypto_ctx_cipher_put(seal->cipctx);
+    seal->pkey = NULL;
+    seal->cipctx = NULL;
+}
+
+// Start encryption of plain_len bytes using RSA 2048bit key in DER format,
+// returns rsa buffer error code, seal is freed on error
+enum rsa_buffer_errors rsa_seal_begin(struct rsa_seal *seal, struct ed25519_writer *w, uint8_t *der_pub_key, size_t plain_len) {
+    uint8_t *ek = seal->ek;
+    uint32_t encrypted_len;
+    size_t block_len = EVP_CIPHER_block_size(crypto_ctx_cipher(CRYPTO_CTX_AES_256_CBC));
+
+    memset(seal, 0, sizeof(struct rsa_seal));
+
+    // Decoded key is taken from the cache
+    if (
+        !(seal->pkey = key_cache_get(KEY_CACHE_RSA_PUB, der_pub_key)) ||
+        EVP_PKEY_get_size(seal->pkey) > AES_ENC_KEY_LENGTH
+    ) {
+        rsa_seal_free(seal);
+        return RSA_BUFFER_ERR_KEY;
     }
 
-    evbuffer_ptr_set(buff, &ptr, content_len, EVBUFFER_PTR_SET);
-    evbuffer_copyout_from(buff, &ptr, sig, ED25519_SIGNATURE_LEN);
+    // Init seal operation
+    if (
+        !(seal->cipctx = crypto_ctx_cipher_get()) ||
+        !EVP_SealInit(seal->cipctx, crypto_ctx_cipher(CRYPTO_CTX_AES_256_CBC), &ek, &(seal->ek_len), seal->iv, &(seal->pkey), 1)
+    ) {
+        rsa_seal_free(seal);
+        return RSA_BUFFER_ERR_OPENSSL;
+    }
 
-    n_iv = evbuffer_peek(buff, content_len, NULL, NULL, 0);
-    iv = safe_malloc((sizeof(struct evbuffer_iovec) * n_iv),
-        "Failed to allocate memory for evbuffer iovec(s), on buffer verify");
-    n_iv = evbuffer_peek(buff, content_len, NULL, iv, n_iv);
+    encrypted_len = htonl((plain_len / block_len + 1) * block_len);
+    ed25519_writer_add(w, &encrypted_len, sizeof(encrypted_len));
 
-    for (i = 0; i < n_iv; i++) {
-        if (!EVP_DigestUpdate(hashctx, iv[i].iov_base, min(iv[i].iov_len, content_len))) {
-            is_err = 1; goto err;
-        }
-        content_len -= iv[i].iov_len;
+    return RSA_BUFFER_ERR_NONE;
+}
+
+// Encrypt next part of the plain text, returns rsa buffer error code, seal is freed on error
+enum rsa_buffer_errors rsa_seal_update(struct rsa_seal *seal, struct ed25519_writer *w, const void *plain, size_t len) {
+    int temp_len;
+    struct evbuffer_iovec vec;
+
+    if (len == 0)
+        return RSA_BUFFER_ERR_NONE;
+
+    // Encrypt straight into the buffer
+    evbuffer_reserve_space(w->buff, len + EVP_CIPHER_block_size(crypto_ctx_cipher(CRYPTO_CTX_AES_256_CBC)), &vec, 1);
+    temp_len = vec.iov_len;
+    if (!EVP_SealUpdate(seal->cipctx, vec.iov_base, &temp_len, plain, len)) {
+        rsa_seal_free(seal);
+        return RSA_BUFFER_ERR_OPENSSL;
     }
+    vec.iov_len = temp_len;
+    ed25519_writer_hash(w, vec.iov_base, vec.iov_len);
+    evbuffer_commit_space(w->buff, &vec, 1);
 
-    if (!EVP_DigestFinal_ex(hashctx, hash, &hash_len)) {
-        is_err = 1; goto err;
+    return RSA_BUFFER_ERR_NONE;
+}
+
+// Finish encryption and add keys, returns rsa buffer error code, seal is always freed
+enum rsa_buffer_errors rsa_seal_end(struct rsa_seal *seal, struct ed25519_writer *w) {
+    int temp_len;
+    struct evbuffer_iovec vec;
+
+    // Write final block to the buffer
+    evbuffer_reserve_space(w->buff, EVP_CIPHER_block_size(crypto_ctx_cipher(CRYPTO_CTX_AES_256_CBC)), &vec, 1);
+    temp_len = vec.iov_len;
+    if (!EVP_SealFinal(seal->cipctx, vec.iov_base, &temp_len)) {
+        rsa_seal_free(seal);
+        return RSA_BUFFER_ERR_OPENSSL;
     }
+    vec.iov_len = temp_len;
+    ed25519_writer_hash(w, vec.iov_base, vec.iov_len);
+    evbuffer_commit_space(w->buff, &vec, 1);
 
-    ctx = EVP_MD_CTX_new();
-    if (!EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, pkey)) {
-        is_err = 1; goto err;
-    };
+    // Add keys to the buffer
+    ed25519_writer_add(w, seal->ek, seal->ek_len);
+    ed25519_writer_add(w, seal->iv, AES_IV_LENGTH);
 
-    is_valid = EVP_DigestVerify(ctx, sig, ED25519_SIGNATURE_LEN, hash, hash_len);
+    rsa_seal_free(seal);
+    return RSA_BUFFER_ERR_NONE;
+}
 
-    err:
-    free(iv);
-    EVP_MD_CTX_free(ctx);
-    EVP_MD_CTX_free(hashctx);
-    EVP_PKEY_free(pkey);
+// Add len bytes from the buffer starting at given offset to the writer,
+// encrypting them if seal is given, returns rsa buffer error code
+static enum rsa_buffer_errors rsa_buffer_write_range(
+    struct evbuffer *buff, size_t offset, size_t len,
+    struct ed25519_writer *w, struct rsa_seal *seal
+) {
+    int i, n_vec;
+    size_t part_len;
+    struct evbuffer_ptr pos;
+    struct evbuffer_iovec *vec;
+    enum rsa_buffer_errors err_code = RSA_BUFFER_ERR_NONE;
 
-    if (is_err) {
-        debug("An error occured while checking buffer signature: %s", 
-            ERR_error_string(ERR_get_error(), NULL));
-        return 0;
+    if (len == 0)
+        return RSA_BUFFER_ERR_NONE;
+
+    evbuffer_ptr_set(buff, &pos, offset, EVBUFFER_PTR_SET);
+    n_vec = evbuffer_peek(buff, len, &pos, NULL, 0);
+    vec = safe_malloc(sizeof(struct evbuffer_iovec) * n_vec, "Failed to allocate iovec");
+    n_vec = evbuffer_peek(buff, len, &pos, vec, n_vec);
+
+    for (i = 0; i < n_vec && len > 0; i++) {
+        part_len = min(vec[i].iov_len, len);
+        len -= part_len;
+
+        if (!seal)
+            ed25519_writer_add(w, vec[i].iov_base, part_len);
+        else if (err_code = rsa_seal_update(seal, w, vec[i].iov_base, part_len))
+            break;
     }
 
-    return is_valid;
+    free(vec);
+    return err_code;
 }
 
 // Takes RSA 2048bit key in DER format encrypts content of plain buffer and puts it into
@@ -162,85 +422,63 @@ int ed25519_buffer_validate(struct evbuffer *buff, size_t len, uint8_t *pub_key)
 //
 // returns rsa buffer error code
 enum rsa_buffer_errors rsa_buffer_encrypt(struct evbuffer *plain, uint8_t *der_pub_key, struct evbuffer *enc, int *enc_len) {
-    int i, temp_len;
-    int err_code = RSA_BUFFER_ERR_NONE; // Set error code to no error
-    uint32_t encrypted_len;             // Ciphertext length
-
-    int ek_len = 1;     // Symetric encrypted key
-    uint8_t *ek = NULL;
-    uint8_t *iv = NULL; // AES IV number
-
-    EVP_PKEY *pkey = NULL;
-    EVP_CIPHER_CTX *cipctx = NULL;
-
-    int n_vec_plain;
-    struct evbuffer_iovec vec_enc;
-    struct evbuffer_iovec *vec_plain = NULL;
-
-    // Decode DER key
-    if (!(pkey = rsa_2048bit_pub_key_decode(der_pub_key))) {
-        err_code = RSA_BUFFER_ERR_KEY; goto err;
-    }
+    int err_code;
+    size_t plain_len;
+    struct rsa_seal seal;
+    struct ed25519_writer w;
 
-    encrypted_len = (evbuffer_get_length(plain) / EVP_CIPHER_block_size(EVP_aes_256_cbc()) + 1) * EVP_CIPHER_block_size(EVP_aes_256_cbc());
-    encrypted_len = htonl(encrypted_len);
-    evbuffer_add(enc, &encrypted_len, sizeof(encrypted_len));
+    plain_len = evbuffer_get_length(plain);
+    ed25519_writer_init(&w, enc);
 
-    // Allocate space for symetric key and IV
-    ek = safe_malloc(EVP_PKEY_get_size(pkey), "Failed to allocate PKEY buffer");
-    iv = safe_malloc(EVP_CIPHER_get_iv_length(EVP_aes_256_cbc()), "Failed to allocate IV buffer");
-
-    // Init seal operation
     if (
-        !(cipctx = EVP_CIPHER_CTX_new()) ||
-        !EVP_SealInit(cipctx, EVP_aes_256_cbc(), &ek, &ek_len, iv, &pkey, 1)
+        (err_code = rsa_seal_begin(&seal, &w, der_pub_key, plain_len)) ||
+        (err_code = rsa_buffer_write_range(plain, 0, plain_len, &w, &seal)) ||
+        (err_code = rsa_seal_end(&seal, &w))
     ) {
-        err_code = RSA_BUFFER_ERR_OPENSSL; goto err;
+        return err_code;
     }
 
-    // Get buffer chunks
-    n_vec_plain = evbuffer_peek(plain, evbuffer_get_length(plain), NULL, NULL, 0);
-    vec_plain = safe_malloc(sizeof(struct evbuffer_iovec) * n_vec_plain, "Failed to allocate iovec");
-    n_vec_plain = evbuffer_peek(plain, evbuffer_get_length(plain), NULL, vec_plain, n_vec_plain);
+    if (enc_len)
+        *enc_len = rsa_buffer_sealed_len(plain_len);
 
-    // For each of the buffer chunks
-    for (i = 0; i < n_vec_plain; i++) {
-        size_t len = vec_plain[i].iov_len;
+    return RSA_BUFFER_ERR_NONE;
+}
 
-        // Add encrypted chunk to the end of enc buffer
-        evbuffer_reserve_space(enc, len + EVP_CIPHER_block_size(EVP_aes_256_cbc()), &vec_enc, 1);
-        temp_len = vec_enc.iov_len;
-        if (!EVP_SealUpdate(cipctx, vec_enc.iov_base, &temp_len, vec_plain[i].iov_base, len)) {
-            err_code = RSA_BUFFER_ERR_OPENSSL; goto err;
-        }
-        vec_enc.iov_len = temp_len;
-        evbuffer_commit_space(enc, &vec_enc, 1);
-    }
+// Build signed envelope in a single pass, first prefix_len bytes of the plain buffer are
+// added to the enc buffer as they are, the rest is encrypted (rsa_buffer_encrypt format),
+// and ed25519 signature of everything is added, returns rsa buffer error code
+enum rsa_buffer_errors rsa_buffer_seal_signed(
+    struct evbuffer *plain,
+    size_t prefix_len,
+    uint8_t *der_pub_key,
+    uint8_t *sig_priv_key,
+    struct evbuffer *enc
+) {
+    int err_code;
+    size_t plain_len;
+    struct rsa_seal seal;
+    struct ed25519_writer w;
+
+    plain_len = evbuffer_get_length(plain) - prefix_len;
+    ed25519_writer_init(&w, enc);
+
+    if (ed25519_writer_begin(&w))
+        return RSA_BUFFER_ERR_OPENSSL;
 
-    // Write final block to the buffer
-    evbuffer_reserve_space(enc, EVP_CIPHER_block_size(EVP_aes_256_cbc()), &vec_enc, 1);
-    temp_len = vec_enc.iov_len;
-    if (!EVP_SealFinal(cipctx, vec_enc.iov_base, &temp_len)) {
-        err_code = RSA_BUFFER_ERR_OPENSSL; goto err;
+    if (
+        (err_code = rsa_buffer_write_range(plain, 0, prefix_len, &w, NULL)) ||
+        (err_code = rsa_seal_begin(&seal, &w, der_pub_key, plain_len)) ||
+        (err_code = rsa_buffer_write_range(plain, prefix_len, plain_len, &w, &seal)) ||
+        (err_code = rsa_seal_end(&seal, &w))
+    ) {
+        ed25519_writer_cleanup(&w);
+        return err_code;
     }
-    vec_enc.iov_len = temp_len;
-    evbuffer_commit_space(enc, &vec_enc, 1);
 
-    // Add keys to the buffer
-    evbuffer_add(enc, ek, ek_len);
-    evbuffer_add(enc, iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc()));
-
-    if (enc_len)
-        *enc_len = sizeof(encrypted_len) + encrypted_len + ek_len + EVP_CIPHER_get_iv_length(EVP_aes_256_cbc());
+    if (ed25519_writer_end(&w, sig_priv_key))
+        return RSA_BUFFER_ERR_OPENSSL;
 
-    // Free everything
-    err:
-    free(iv);
-    free(ek);
-    free(vec_plain);
-    EVP_PKEY_free(pkey);
-    EVP_CIPHER_CTX_free(cipctx);
-    return err_code;
+    return RSA_BUFFER_ERR_NONE;
 }
 
 // Takes buffer encrypted by rsa_buffer_encrypt function and decrypts it into plain buffer
@@ -268,20 +506,20 @@ enum rsa_buffer_errors rsa_buffer_decrypt(struct evbuffer *enc_buff, uint8_t *de
     struct evbuffer_ptr pos; // Evbuffer pointer
 
     int n_vec_enc;                   // Number of ciphertext chunks
-    struct evbuffer_iovec *vec_enc;  // Ciphertext chunks
+    struct evbuffer_iovec *vec_enc = NULL; // Ciphertext chunks
     struct evbuffer_iovec vec_plain; // Plaintext chunk used when decrypting
 
     EVP_PKEY *pkey_priv = NULL;
     EVP_CIPHER_CTX *cipctx = NULL;
 
-    // Decode DER encoded private key
-    if (!(pkey_priv = rsa_2048bit_priv_key_decode(der_priv_key))) {
+    // Decoded private key is taken from the cache
+    if (!(pkey_priv = key_cache_get(KEY_CACHE_RSA_PRIV, der_priv_key))) {
         err_code = RSA_BUFFER_ERR_KEY; goto err;
     }
 
     // Calculate symetric key and IV length
     ekl = EVP_PKEY_get_size(pkey_priv);
-    ivl = EVP_CIPHER_get_iv_length(EVP_aes_256_cbc());
+    ivl = EVP_CIPHER_get_iv_length(crypto_ctx_cipher(CRYPTO_CTX_AES_256_CBC));
     // Allocate memory for symetric key and IV
     ek = safe_malloc(ekl, "Failed to allocate EK when decrypting buffer");
     iv = safe_malloc(ivl, "Failed to allocate IV when decrypting buffer");
@@ -328,8 +566,8 @@ enum rsa_buffer_errors rsa_buffer_decrypt(struct evbuffer *enc_buff, uint8_t *de
     debug("Encrypted len: %d", encrypted_len);
     // Init data decryption with given keys
     if (
-        !(cipctx = EVP_CIPHER_CTX_new()) ||
-        !EVP_OpenInit(cipctx, EVP_aes_256_cbc(), ek, ekl, iv, pkey_priv)
+        !(cipctx = crypto_ctx_cipher_get()) ||
+        !EVP_OpenInit(cipctx, crypto_ctx_cipher(CRYPTO_CTX_AES_256_CBC), ek, ekl, iv, pkey_priv)
     ) {
         debug("Init failed %s", ERR_error_string(ERR_get_error(), NULL));
         err_code = RSA_BUFFER_ERR_OPENSSL; goto err;
@@ -337,10 +575,11 @@ enum rsa_buffer_errors rsa_buffer_decrypt(struct evbuffer *enc_buff, uint8_t *de
 
     // For each chunk of ciphertext
     for (i = 0; i < n_vec_enc; i++) {
-        // Get data len
+        // Get data len, last chunk may contain data after the ciphertext
         len = (vec_enc[i].iov_len < encrypted_len) ? vec_enc[i].iov_len : encrypted_len;
+        encrypted_len -= len;
         // Reserve space for the plain text
-        evbuffer_reserve_space(plain_buff, len, &vec_plain, 1);
+        evbuffer_reserve_space(plain_buff, len + EVP_CIPHER_block_size(crypto_ctx_cipher(CRYPTO_CTX_AES_256_CBC)), &vec_plain, 1);
         // Decrypt chunk and commit plain text
         len_int = vec_plain.iov_len;
         if (EVP_OpenUpdate(cipctx, vec_plain.iov_base, &len_int, vec_enc[i].iov_base, len) == 0) {
@@ -352,7 +591,7 @@ enum rsa_buffer_errors rsa_buffer_decrypt(struct evbuffer *enc_buff, uint8_t *de
     }
 
     // Decrypt final chunk
-    evbuffer_reserve_space(plain_buff, EVP_CIPHER_block_size(EVP_aes_256_cbc()), &vec_plain, 1);
+    evbuffer_reserve_space(plain_buff, EVP_CIPHER_block_size(crypto_ctx_cipher(CRYPTO_CTX_AES_256_CBC)), &vec_plain, 1);
     len_int = vec_plain.iov_len;
     if (!EVP_OpenFinal(cipctx, vec_plain.iov_base, &len_int)) {
         err_code = RSA_BUFFER_ERR_OPENSSL; goto err;
@@ -364,8 +603,164 @@ enum rsa_buffer_errors rsa_buffer_decrypt(struct evbuffer *enc_buff, uint8_t *de
     // Free all allocated memory
     free(ek);
     free(iv);
+    free(vec_enc);
     EVP_PKEY_free(pkey_priv);
-    EVP_CIPHER_CTX_free(cipctx);
+    crypto_ctx_cipher_put(cipctx);
 
     return err_code;
-}
\ No newline at end of file
+}
+// Returns length of the format created by aead seal for plain text of given length
+size_t aead_buffer_sealed_len(size_t plain_len) {
+    return sizeof(uint32_t) + plain_len + SESSION_TAG_LEN;
+}
+
+// Free memory used by the seal
+static void aead_seal_free(struct aead_seal *seal) {
+    crypto_ctx_cipher_put(seal->cipctx);
+    seal->cipctx = NULL;
+}
+
+// Start encryption of plain_len bytes using given session key and nonce,
+// returns 0 on success and 1 on failure, seal is freed on error
+int aead_seal_begin(struct aead_seal *seal, struct ed25519_writer *w,
+    const uint8_t *key, const uint8_t *nonce, size_t plain_len
+) {
+    uint32_t encrypted_len;
+
+    memset(seal, 0, sizeof(struct aead_seal));
+
+    if (
+        !(seal->cipctx = crypto_ctx_cipher_get()) ||
+        !EVP_EncryptInit_ex(seal->cipctx, crypto_ctx_cipher(CRYPTO_CTX_AES_256_GCM), NULL, NULL, NULL) ||
+        !EVP_CIPHER_CTX_ctrl(seal->cipctx, EVP_CTRL_GCM_SET_IVLEN, SESSION_NONCE_LEN, NULL) ||
+        !EVP_EncryptInit_ex(seal->cipctx, NULL, NULL, key, nonce)
+    ) {
+        debug("Failed to init aead seal: %s", ERR_error_string(ERR_get_error(), NULL));
+        aead_seal_free(seal);
+        return 1;
+    }
+
+    encrypted_len = htonl(plain_len);
+    ed25519_writer_add(w, &encrypted_len, sizeof(encrypted_len));
+    return 0;
+}
+
+// Encrypt next part of the plain text, returns 0 on success and 1 on failure, seal is freed on error
+int aead_seal_update(struct aead_seal *seal, struct ed25519_writer *w, const void *plain, size_t len) {
+    int temp_len;
+    struct evbuffer_iovec vec;
+
+    if (len == 0)
+        return 0;
+
+    // Stream cipher, cipher text is as long as the plain text
+    evbuffer_reserve_space(w->buff, len, &vec, 1);
+    temp_len = vec.iov_len;
+    if (!EVP_EncryptUpdate(seal->cipctx, vec.iov_base, &temp_len, plain, len)) {
+        aead_seal_free(seal);
+        return 1;
+    }
+    vec.iov_len = temp_len;
+    ed25519_writer_hash(w, vec.iov_base, vec.iov_len);
+    evbuffer_commit_space(w->buff, &vec, 1);
+
+    return 0;
+}
+
+// Finish encryption and add authentication tag, returns 0 on success and 1 on failure,
+// seal is always freed
+int aead_seal_end(struct aead_seal *seal, struct ed25519_writer *w) {
+    int temp_len = 0;
+    uint8_t tag[SESSION_TAG_LEN];
+
+    if (
+        !EVP_EncryptFinal_ex(seal->cipctx, tag, &temp_len) ||
+        !EVP_CIPHER_CTX_ctrl(seal->cipctx, EVP_CTRL_GCM_GET_TAG, SESSION_TAG_LEN, tag)
+    ) {
+        aead_seal_free(seal);
+        return 1;
+    }
+
+    ed25519_writer_add(w, tag, SESSION_TAG_LEN);
+    aead_seal_free(seal);
+    return 0;
+}
+
+// Decrypt data in aead seal format, starting at given offset of the enc buffer, into plain
+// buffer using given session key and nonce, enc buffer is not modified, returns 0 on success
+// and 1 if data is incomplete or it was not encrypted using given key and nonce
+int aead_buffer_decrypt(struct evbuffer *enc, size_t offset,
+    const uint8_t *key, const uint8_t *nonce, struct evbuffer *plain
+) {
+    int i, n_vec, len_int;
+    int is_err = 1;
+    size_t part_len, left;
+    uint32_t encrypted_len;
+    uint8_t tag[SESSION_TAG_LEN];
+    uint8_t *out;
+
+    struct evbuffer_ptr pos;
+    struct evbuffer_iovec *vec = NULL;
+    struct evbuffer_iovec vec_plain;
+    EVP_CIPHER_CTX *cipctx = NULL;
+
+    if (evbuffer_get_length(enc) < offset + sizeof(encrypted_len))
+        return 1;
+
+    evbuffer_ptr_set(enc, &pos, offset, EVBUFFER_PTR_SET);
+    evbuffer_copyout_from(enc, &pos, &encrypted_len, sizeof(encrypted_len));
+    encrypted_len = ntohl(encrypted_len);
+
+    if (evbuffer_get_length(enc) < offset + aead_buffer_sealed_len(encrypted_len))
+        return 1;
+
+    evbuffer_ptr_set(enc, &pos, offset + sizeof(encrypted_len) + encrypted_len, EVBUFFER_PTR_SET);
+    evbuffer_copyout_from(enc, &pos, tag, SESSION_TAG_LEN);
+
+    if (
+        !(cipctx = crypto_ctx_cipher_get()) ||
+        !EVP_DecryptInit_ex(cipctx, crypto_ctx_cipher(CRYPTO_CTX_AES_256_GCM), NULL, NULL, NULL) ||
+        !EVP_CIPHER_CTX_ctrl(cipctx, EVP_CTRL_GCM_SET_IVLEN, SESSION_NONCE_LEN, NULL) ||
+        !EVP_DecryptInit_ex(cipctx, NULL, NULL, key, nonce)
+    ) {
+        goto err;
+    }
+
+    // Plain text is as long as the cipher text, so it's decrypted into a single chunk
+    evbuffer_reserve_space(plain, encrypted_len + 1, &vec_plain, 1);
+    out = vec_plain.iov_base;
+
+    if (encrypted_len > 0) {
+        evbuffer_ptr_set(enc, &pos, offset + sizeof(encrypted_len), EVBUFFER_PTR_SET);
+        n_vec = evbuffer_peek(enc, encrypted_len, &pos, NULL, 0);
+        vec = safe_malloc(sizeof(struct evbuffer_iovec) * n_vec, "Failed to allocate iovec");
+        n_vec = evbuffer_peek(enc, encrypted_len, &pos, vec, n_vec);
+
+        left = encrypted_len;
+        for (i = 0; i < n_vec && left > 0; i++) {
+            part_len = min(vec[i].iov_len, left);
+            left -= part_len;
+
+            if (!EVP_DecryptUpdate(cipctx, out, &len_int, vec[i].iov_base, part_len))
+                goto err;
+            out += len_int;
+        }
+    }
+
+    // Tag is checked by the final call, nothing is committed if it doesn't match
+    if (
+        !EVP_CIPHER_CTX_ctrl(cipctx, EVP_CTRL_GCM_SET_TAG, SESSION_TAG_LEN, tag) ||
+        EVP_DecryptFinal_ex(cipctx, out, &len_int) <= 0
+    ) {
+        goto err;
+    }
+
+    vec_plain.iov_len = encrypted_len;
+    evbuffer_commit_space(plain, &vec_plain, 1);
+    is_err = 0;
+
+    err:
+    free(vec);
+    crypto_ctx_cipher_put(cipctx);
+    return is_err;
+}
@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <crypto_ctx.h>
+#include <helpers_crypto.h>
+#include <sys_memory.h>
+
+// Unused contexts kept by a single thread
+struct crypto_ctx_arena {
+    int n_md;
+    EVP_MD_CTX *md[CRYPTO_CTX_ARENA_SIZE];
+    int n_cipher;
+    EVP_CIPHER_CTX *cipher[CRYPTO_CTX_ARENA_SIZE];
+    EVP_PKEY_CTX *ed25519_keygen;
+};
+
+// Names of algorithms fetched at startup, in order of their enums
+static const char *md_names[CRYPTO_CTX_MD_N] = {"SHA256", "SHA512", "SHA3-256"};
+static const char *cipher_names[CRYPTO_CTX_CIPHER_N] = {"AES-256-CBC", "AES-256-GCM"};
+
+static EVP_MD *mds[CRYPTO_CTX_MD_N];
+static EVP_CIPHER *ciphers[CRYPTO_CTX_CIPHER_N];
+
+static pthread_once_t fetch_once = PTHREAD_ONCE_INIT;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+
+// Fetch all algorithms, called only once
+static void crypto_ctx_fetch(void) {
+    int i;
+
+    for (i = 0; i < CRYPTO_CTX_MD_N; i++) {
+        if (!(mds[i] = EVP_MD_fetch(NULL, md_names[i], NULL)))
+            sys_openssl_crash("Failed to fetch digest algorithm");
+    }
+    for (i = 0; i < CRYPTO_CTX_CIPHER_N; i++) {
+        if (!(ciphers[i] = EVP_CIPHER_fetch(NULL, cipher_names[i], NULL)))
+            sys_openssl_crash("Failed to fetch cipher algorithm");
+    }
+}
+
+// Free contexts kept by the thread, called once thread exits
+static void crypto_ctx_arena_free(void *arg) {
+    int i;
+    struct crypto_ctx_arena *arena = arg;
+
+    for (i = 0; i < arena->n_md; i++)
+        EVP_MD_CTX_free(arena->md[i]);
+    for (i = 0; i < arena->n_cipher; i++)
+        EVP_CIPHER_CTX_free(arena->cipher[i]);
+    EVP_PKEY_CTX_free(arena->ed25519_keygen);
+    free(arena);
+}
+
+// Create key used to find arena of the thread, called only once
+static void crypto_ctx_arena_key(void) {
+    if (pthread_key_create(&arena_key, crypto_ctx_arena_free))
+        sys_crash("Crypto", "Failed to create context arena key");
+}
+
+// Get arena of the current thread, arena is created on first use
+static struct crypto_ctx_arena * crypto_ctx_arena(void) {
+    struct crypto_ctx_arena *arena;
+
+    pthread_once(&arena_once, crypto_ctx_arena_key);
+    if (arena = pthread_getspecific(arena_key))
+        return arena;
+
+    arena = safe_malloc(sizeof(struct crypto_ctx_arena), "Failed to allocate crypto context arena");
+    memset(arena, 0, sizeof(struct crypto_ctx_arena));
+    pthread_setspecific(arena_key, arena);
+
+    return arena;
+}
+
+// Fetch all algorithms from the default provider, so operations don't have to
+// look them up each time, called once at startup, if it's not called algorithms
+// are fetched once they are needed for the first time
+void crypto_ctx_init(void) {
+    pthread_once(&fetch_once, crypto_ctx_fetch);
+}
+
+// Get fetched digest algorithm
+const EVP_MD * crypto_ctx_md(enum crypto_ctx_mds md) {
+    pthread_once(&fetch_once, crypto_ctx_fetch);
+    return mds[md];
+}
+
+// Get fetched cipher algorithm
+const EVP_CIPHER * crypto_ctx_cipher(enum crypto_ctx_ciphers cipher) {
+    pthread_once(&fetch_once, crypto_ctx_fetch);
+    return ciphers[cipher];
+}
+
+// Get digest context of the current thread, unused contexts are reused instead of
+// being allocated, context must be initialized and given back using crypto_ctx_md_put
+EVP_MD_CTX * crypto_ctx_md_get(void) {
+    struct crypto_ctx_arena *arena = crypto_ctx_arena();
+
+    if (arena->n_md > 0)
+        return arena->md[--arena->n_md];
+    return EVP_MD_CTX_new();
+}
+
+// Give back digest context taken by crypto_ctx_md_get, context is reset, so
+// it can be reused by the next operation, it may be given back by other thread
+void crypto_ctx_md_put(EVP_MD_CTX *ctx) {
+    struct crypto_ctx_arena *arena;
+
+    if (!ctx) return;
+
+    arena = crypto_ctx_arena();
+    if (arena->n_md == CRYPTO_CTX_ARENA_SIZE || !EVP_MD_CTX_reset(ctx)) {
+        EVP_MD_CTX_free(ctx);
+        return;
+    }
+    arena->md[arena->n_md++] = ctx;
+}
+
+// Get cipher context of the current thread, unused contexts are reused instead of
+// being allocated, context must be initialized and given back using crypto_ctx_cipher_put
+EVP_CIPHER_CTX * crypto_ctx_cipher_get(void) {
+    struct crypto_ctx_arena *arena = crypto_ctx_arena();
+
+    if (arena->n_cipher > 0)
+        return arena->cipher[--arena->n_cipher];
+    return EVP_CIPHER_CTX_new();
+}
+
+// Give back cipher context taken by crypto_ctx_cipher_get, context is reset (key
+// material is wiped), so it can be reused by the next operation
+void crypto_ctx_cipher_put(EVP_CIPHER_CTX *ctx) {
+    struct crypto_ctx_arena *arena;
+
+    if (!ctx) return;
+
+    arena = crypto_ctx_arena();
+    if (arena->n_cipher == CRYPTO_CTX_ARENA_SIZE || !EVP_CIPHER_CTX_reset(ctx)) {
+        EVP_CIPHER_CTX_free(ctx);
+        return;
+    }
+    arena->cipher[arena->n_cipher++] = ctx;
+}
+
+// Get ED25519 key generation context of the current thread, context is kept by
+// the thread and initialized only once, it must not be freed
+EVP_PKEY_CTX * crypto_ctx_ed25519_keygen(void) {
+    EVP_PKEY_CTX *ctx;
+    struct crypto_ctx_arena *arena = crypto_ctx_arena();
+
+    if (arena->ed25519_keygen)
+        return arena->ed25519_keygen;
+
+    if (!(ctx = EVP_PKEY_CTX_new_from_name(NULL, "ED25519", NULL)))
+        return NULL;
+    if (EVP_PKEY_keygen_init(ctx) <= 0) {
+        EVP_PKEY_CTX_free(ctx);
+        return NULL;
+    }
+
+    arena->ed25519_keygen = ctx;
+    return ctx;
+}
@@ -0,0 +1,279 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <crypto_pool.h>
+#include <buffer_crypto.h>
+#include <sys_memory.h>
+#include <sys_crash.h>
+#include <free_list.h>
+#include <debug.h>
+
+// Unused jobs, kept together with their buffers and reused by next allocation
+static struct free_list job_free_list = FREE_LIST_INIT(struct crypto_job, FREE_LIST_MAX_FREE);
+
+// Pools associated with event bases
+static struct crypto_pool *pools = NULL;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Allocate new crypto job of given type, key_len bytes of the key are
+// copied into the job, in and out buffers are empty, freed jobs are
+// reused together with their buffers
+struct crypto_job * crypto_job_new(enum crypto_job_types type, const uint8_t *key, size_t key_len) {
+    struct crypto_job *job;
+    struct evbuffer *in, *out;
+
+    if (key_len > CRYPTO_JOB_MAX_KEY_LEN)
+        sys_crash("Crypto pool", "Crypto job key is too long");
+
+    if (job = free_list_take(&job_free_list)) {
+        in = job->in;
+        out = job->out;
+    } else {
+        job = safe_malloc(sizeof(struct crypto_job), "Failed to allocate memory for crypto job");
+        in = evbuffer_new();
+        out = evbuffer_new();
+    }
+    memset(job, 0, sizeof(struct crypto_job));
+
+    job->type = type;
+    job->in = in;
+    job->out = out;
+    memcpy(job->key, key, key_len);
+
+    return job;
+}
+
+// Run given job in the current thread
+void crypto_job_run(struct crypto_job *job) {
+    uint8_t *hash;
+
+    switch (job->type) {
+        case CRYPTO_JOB_SIGN:
+            job->result = ed25519_buffer_sign(job->in, job->len, job->key);
+            break;
+        case CRYPTO_JOB_VERIFY:
+            job->result = ed25519_buffer_validate(job->in, job->len, job->key);
+            break;
+        case CRYPTO_JOB_SEAL:
+            job->result = rsa_buffer_encrypt(job->in, job->key, job->out, &(job->enc_len));
+            break;
+        case CRYPTO_JOB_OPEN:
+            job->result = rsa_buffer_decrypt(job->in, job->key, job->out, &(job->enc_len));
+            break;
+        case CRYPTO_JOB_SEAL_SIGN:
+            job->result = rsa_buffer_seal_signed(job->in, job->len, job->key, job->sign_key, job->out);
+            break;
+        case CRYPTO_JOB_VERIFY_HASH:
+            hash = evbuffer_pullup(job->in, ED25519_PREHASH_LEN + ED25519_SIGNATURE_LEN);
+            job->result = hash && ed25519_hash_validate(hash, hash + ED25519_PREHASH_LEN, job->key);
+            break;
+    }
+}
+
+// Free given job, if job is in flight its callback will not be called
+// and it will be freed once worker is done with it
+void crypto_job_free(struct crypto_job *job) {
+    if (!job) return;
+
+    if (job->in_flight) {
+        job->freed = 1;
+        return;
+    }
+
+    evbuffer_drain(job->in, evbuffer_get_length(job->in));
+    evbuffer_drain(job->out, evbuffer_get_length(job->out));
+    if (free_list_keep(&job_free_list, job))
+        return;
+
+    evbuffer_free(job->in);
+    evbuffer_free(job->out);
+    free(job);
+}
+
+// Worker thread, runs queued jobs until pool is stopped
+static void * crypto_pool_run(void *arg) {
+    uint64_t one = 1;
+    struct crypto_job *job;
+    struct crypto_pool *pool = arg;
+
+    pthread_mutex_lock(&(pool->lock));
+    for (;;) {
+        while (!pool->stop && !pool->queue_head)
+            pthread_cond_wait(&(pool->cond), &(pool->lock));
+        if (pool->stop)
+            break;
+
+        job = pool->queue_head;
+        pool->queue_head = job->next;
+        if (!pool->queue_head)
+            pool->queue_tail = NULL;
+        job->next = NULL;
+
+        // Don't hold the lock while job is running
+        pthread_mutex_unlock(&(pool->lock));
+        crypto_job_run(job);
+        pthread_mutex_lock(&(pool->lock));
+
+        if (pool->done_tail)
+            pool->done_tail->next = job;
+        else
+            pool->done_head = job;
+        pool->done_tail = job;
+
+        if (write(pool->done_fd, &one, sizeof(one)) != sizeof(one))
+            debug("Failed to notify event loop about completed crypto job");
+    }
+    pthread_mutex_unlock(&(pool->lock));
+
+    return NULL;
+}
+
+// Called from the event loop thread once workers completed some jobs
+static void crypto_pool_done_cb(evutil_socket_t fd, short what, void *arg) {
+    uint64_t n;
+    struct crypto_job *job, *next;
+    struct crypto_pool *pool = arg;
+
+    if (read(fd, &n, sizeof(n)) != sizeof(n))
+        return;
+
+    pthread_mutex_lock(&(pool->lock));
+    job = pool->done_head;
+    pool->done_head = pool->done_tail = NULL;
+    pthread_mutex_unlock(&(pool->lock));
+
+    for (; job; job = next) {
+        next = job->next;
+        job->next = NULL;
+        job->in_flight = 0;
+
+        if (job->freed)
+            crypto_job_free(job);
+        else
+            job->cb(job, job->arg);
+    }
+}
+
+// Allocate new crypto pool with n_threads threads, completion callbacks are
+// called from given event base, pool is used by everyone using this base
+struct crypto_pool * crypto_pool_new(struct event_base *base, int n_threads) {
+    int i;
+    struct crypto_pool *pool;
+
+    if (n_threads < 1)
+        n_threads = 1;
+    if (n_threads > CRYPTO_POOL_MAX_THREADS)
+        n_threads = CRYPTO_POOL_MAX_THREADS;
+
+    pool = safe_malloc(sizeof(struct crypto_pool), "Failed to allocate memory for crypto pool");
+    memset(pool, 0, sizeof(struct crypto_pool));
+
+    pool->base = base;
+    pool->n_threads = n_threads;
+    pthread_mutex_init(&(pool->lock), NULL);
+    pthread_cond_init(&(pool->cond), NULL);
+
+    if ((pool->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        sys_crash("Crypto pool", "Failed to create eventfd");
+    pool->done_ev = event_new(base, pool->done_fd, EV_READ | EV_PERSIST, crypto_pool_done_cb, pool);
+    event_add(pool->done_ev, NULL);
+
+    pool->threads = safe_malloc(sizeof(pthread_t) * n_threads, "Failed to allocate memory for crypto threads");
+    for (i = 0; i < n_threads; i++) {
+        if (pthread_create(&(pool->threads[i]), NULL, crypto_pool_run, pool) != 0)
+            sys_crash("Crypto pool", "Failed to start crypto thread");
+    }
+
+    pthread_mutex_lock(&pools_lock);
+    pool->next = pools;
+    pools = pool;
+    pthread_mutex_unlock(&pools_lock);
+
+    debug("Crypto pool started with %d threads", n_threads);
+    return pool;
+}
+
+// Get pool associated with given event base, returns NULL if there is none
+struct crypto_pool * crypto_pool_get(struct event_base *base) {
+    struct crypto_pool *pool;
+
+    pthread_mutex_lock(&pools_lock);
+    for (pool = pools; pool; pool = pool->next) {
+        if (pool->base == base)
+            break;
+    }
+    pthread_mutex_unlock(&pools_lock);
+
+    return pool;
+}
+
+// Submit job to the pool, once job is done callback is called from the
+// event loop thread, job is still owned by the caller which must free it
+void crypto_pool_submit(struct crypto_pool *pool, struct crypto_job *job, crypto_job_cb cb, void *arg) {
+    job->cb = cb;
+    job->arg = arg;
+    job->freed = 0;
+    job->in_flight = 1;
+    job->next = NULL;
+
+    pthread_mutex_lock(&(pool->lock));
+    if (pool->queue_tail)
+        pool->queue_tail->next = job;
+    else
+        pool->queue_head = job;
+    pool->queue_tail = job;
+    pthread_cond_signal(&(pool->cond));
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+// Stop all threads and free the pool, jobs not yet done are discarded
+void crypto_pool_free(struct crypto_pool *pool) {
+    int i;
+    struct crypto_pool **pp;
+    struct crypto_job *lists[2], *job, *next;
+
+    if (!pool) return;
+
+    pthread_mutex_lock(&pools_lock);
+    for (pp = &pools; *pp; pp = &((*pp)->next)) {
+        if (*pp == pool) {
+            *pp = pool->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pools_lock);
+
+    pthread_mutex_lock(&(pool->lock));
+    pool->stop = 1;
+    pthread_cond_broadcast(&(pool->cond));
+    pthread_mutex_unlock(&(pool->lock));
+
+    for (i = 0; i < pool->n_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    // Callbacks of discarded jobs are never called, owners can still free them
+    lists[0] = pool->queue_head;
+    lists[1] = pool->done_head;
+    for (i = 0; i < 2; i++) {
+        for (job = lists[i]; job; job = next) {
+            next = job->next;
+            job->next = NULL;
+            job->in_flight = 0;
+
+            if (job->freed)
+                crypto_job_free(job);
+        }
+    }
+
+    event_free(pool->done_ev);
+    close(pool->done_fd);
+    pthread_mutex_destroy(&(pool->lock));
+    pthread_cond_destroy(&(pool->cond));
+    free(pool->threads);
+    free(pool);
+}
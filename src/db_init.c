@@ -55,6 +55,11 @@ void db_init_schema(sqlite3 *db) {
             "PRIMARY KEY(id AUTOINCREMENT),"
             "FOREIGN KEY(contact_id) REFERENCES client_contacts(id) ON DELETE CASCADE"
         ");"
+        "CREATE TABLE IF NOT EXISTS client_messages_provisional ("
+            "batch INTEGER,"
+            "message_id INTEGER,"
+            "prev_status INTEGER"
+        ");"
         "CREATE TABLE IF NOT EXISTS mailbox_keys ("
             "id INTEGER,"
             "key TEXT,"
@@ -84,6 +89,26 @@ void db_init_schema(sqlite3 *db) {
             "FOREIGN KEY(account_id) REFERENCES mailbox_accounts(id) ON DELETE CASCADE,"
             "FOREIGN KEY(contact_id) REFERENCES mailbox_contacts(id) ON DELETE CASCADE"
         ");"
+        "CREATE TABLE IF NOT EXISTS client_sessions ("
+            "id INTEGER,"
+            "contact_id INTEGER,"
+            "direction INTEGER,"
+            "session_id INTEGER,"
+            "key BLOB,"
+            "wrap BLOB,"
+            "counter INTEGER,"
+            "confirmed INTEGER,"
+            "PRIMARY KEY(id AUTOINCREMENT),"
+            "FOREIGN KEY(contact_id) REFERENCES client_contacts(id) ON DELETE CASCADE"
+        ");"
+        "CREATE TABLE IF NOT EXISTS routes ("
+            "id INTEGER,"
+            "onion_address TEXT UNIQUE NOT NULL,"
+            "transport INTEGER,"
+            "address TEXT,"
+            "port TEXT,"
+            "PRIMARY KEY(id AUTOINCREMENT)"
+        ");"
 
         "PRAGMA foreign_keys = ON;"
     ;
@@ -31,7 +31,12 @@ void db_mb_message_free(struct db_mb_message *msg) {
 
 // Set message content
 void db_mb_message_set_data(struct db_mb_message *msg, const uint8_t *data, int data_len) {
-    int i;
+    memcpy(db_mb_message_data_reserve(msg, data_len), data, data_len);
+}
+
+// Resize message content to given length and return pointer to it, used
+// to fill the content in place without an intermediate copy
+uint8_t * db_mb_message_data_reserve(struct db_mb_message *msg, int data_len) {
     int new_len;
 
     new_len = (data_len / DB_MB_MESSAGE_CHUNK_SIZE + 1) * DB_MB_MESSAGE_CHUNK_SIZE;
@@ -42,15 +47,13 @@ void db_mb_message_set_data(struct db_mb_message *msg, const uint8_t *data, int
         msg->data = safe_malloc((sizeof(uint8_t) * new_len),
             "Failed to allocate mailbox message data");
 
-    } else if (msg->data_len < new_len) {
+    } else if (msg->data_n_chunks < new_len) {
         msg->data_n_chunks = new_len;
         msg->data = safe_realloc(msg->data, (sizeof(uint8_t) * new_len), 
             "Failed to realloc mailbox message data");
     }
 
-    for (i = 0; i < data_len; i++) {
-        msg->data[i] = data[i];
-    }
+    return msg->data;
 }
 
 // Save changes on given object to database
@@ -355,4 +355,136 @@ void db_message_free_all(struct db_message **msgs, int n_msgs) {
     for (i = 0; i < n_msgs; i++) {
         db_message_free(msgs[i]);
     }
-}
\ No newline at end of file
+}
+// Run given batch statement, first parameter of the statement is bound
+// to the batch ID, all remaining ones are bound to the "all batches" flag
+static void db_message_batch_exec(sqlite3 *db, const char *sql, int batch) {
+    int i;
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to prepare provisional batch statement");
+
+    for (i = 1; i <= sqlite3_bind_parameter_count(stmt); i++) {
+        if (sqlite3_bind_int(stmt, i, (i % 2) ? batch : batch == 0) != SQLITE_OK)
+            sys_db_crash(db, "Failed to bind provisional batch id");
+    }
+
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        sys_db_crash(db, "Failed to execute provisional batch statement (step)");
+
+    sqlite3_finalize(stmt);
+}
+
+// Start new provisional batch, returns batch ID
+int db_message_batch_begin(sqlite3 *db) {
+    int batch = 0;
+    sqlite3_stmt *stmt;
+    // Last batch started, batches begun but still empty are not in the table
+    static int last_batch = 0;
+
+    const char sql[] = "SELECT IFNULL(MAX(batch), 0) + 1 FROM client_messages_provisional";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to start provisional batch");
+
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        batch = sqlite3_column_int(stmt, 0);
+
+    sqlite3_finalize(stmt);
+
+    if (batch <= last_batch)
+        batch = last_batch + 1;
+    last_batch = batch;
+    return batch;
+}
+
+// Save message as a part of given batch
+void db_message_batch_save(sqlite3 *db, int batch, struct db_message *msg) {
+    sqlite3_stmt *stmt;
+    int is_new = msg->id == 0;
+
+    // Existing messages remember their status so it can be restored,
+    // new ones are simply removed on rollback
+    const char sql_update[] =
+        "INSERT INTO client_messages_provisional (batch, message_id, prev_status) "
+        "SELECT ?, id, status FROM client_messages WHERE id = ?";
+    const char sql_insert[] =
+        "INSERT INTO client_messages_provisional (batch, message_id, prev_status) "
+        "VALUES (?, ?, NULL)";
+
+    if (!is_new) {
+        if (sqlite3_prepare_v2(db, sql_update, -1, &stmt, NULL) != SQLITE_OK)
+            sys_db_crash(db, "Failed to save provisional message state");
+        if (
+            SQLITE_OK != sqlite3_bind_int(stmt, 1, batch) ||
+            SQLITE_OK != sqlite3_bind_int(stmt, 2, msg->id)
+        ) {
+            sys_db_crash(db, "Failed to bind provisional message state");
+        }
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+            sys_db_crash(db, "Failed to save provisional message state (step)");
+        sqlite3_finalize(stmt);
+    }
+
+    db_message_save(db, msg);
+
+    if (is_new && msg->id > 0) {
+        if (sqlite3_prepare_v2(db, sql_insert, -1, &stmt, NULL) != SQLITE_OK)
+            sys_db_crash(db, "Failed to save provisional message state");
+        if (
+            SQLITE_OK != sqlite3_bind_int(stmt, 1, batch) ||
+            SQLITE_OK != sqlite3_bind_int(stmt, 2, msg->id)
+        ) {
+            sys_db_crash(db, "Failed to bind provisional message state");
+        }
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+            sys_db_crash(db, "Failed to save provisional message state (step)");
+        sqlite3_finalize(stmt);
+    }
+}
+
+// Keep all changes made within given batch
+void db_message_batch_commit(sqlite3 *db, int batch) {
+    db_message_batch_exec(db,
+        "DELETE FROM client_messages_provisional WHERE batch = ?", batch);
+}
+
+// Revert all changes made within given batch, if batch is 0 changes
+// made by all unfinished batches are reverted (used on startup)
+void db_message_batch_rollback(sqlite3 *db, int batch) {
+    // Restore status of updated messages, oldest saved state wins
+    db_message_batch_exec(db,
+        "UPDATE client_messages SET status = ("
+            "SELECT p.prev_status FROM client_messages_provisional AS p "
+            "WHERE p.message_id = client_messages.id AND p.prev_status IS NOT NULL "
+                "AND (p.batch = ? OR ?) "
+            "ORDER BY p.rowid LIMIT 1"
+        ") WHERE id IN ("
+            "SELECT message_id FROM client_messages_provisional "
+            "WHERE (batch = ? OR ?) AND prev_status IS NOT NULL"
+        ")", batch);
+
+    // Remove inserted messages
+    db_message_batch_exec(db,
+        "DELETE FROM client_messages WHERE id IN ("
+            "SELECT message_id FROM client_messages_provisional "
+            "WHERE (batch = ? OR ?) AND prev_status IS NULL"
+        ")", batch);
+
+    db_message_batch_exec(db,
+        "DELETE FROM client_messages_provisional WHERE batch = ? OR ?", batch);
+}
+
+// Start write transaction, everything saved until it ends is written
+// to the disk at once, transactions can be nested
+void db_message_write_begin(sqlite3 *db) {
+    if (sqlite3_exec(db, "SAVEPOINT message_write", NULL, NULL, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to start message write transaction");
+}
+
+// End write transaction started by begin, keeping all changes
+void db_message_write_end(sqlite3 *db) {
+    if (sqlite3_exec(db, "RELEASE message_write", NULL, NULL, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to end message write transaction");
+}
@@ -0,0 +1,184 @@
+#include <db_init.h>
+#include <db_route.h>
+#include <sqlite3.h>
+#include <string.h>
+#include <helpers.h>
+#include <sys_memory.h>
+#include <constants.h>
+
+// Create new empty route object
+struct db_route * db_route_new(void) {
+    struct db_route *route;
+
+    route = safe_malloc(sizeof(struct db_route), "Failed to allocate route object");
+    memset(route, 0, sizeof(struct db_route));
+
+    return route;
+}
+
+// Free given route object, if you want to save it call the
+// save function first
+void db_route_free(struct db_route *route) {
+    free(route);
+}
+
+// Save changes on given object to database
+void db_route_save(sqlite3 *db, struct db_route *route) {
+    sqlite3_stmt *stmt;
+    const char *sql;
+
+    const char sql_insert[] =
+        "INSERT INTO routes (onion_address, transport, address, port) "
+        "VALUES (?, ?, ?, ?)";
+
+    const char sql_update[] =
+        "UPDATE routes SET onion_address = ?, transport = ?, address = ?, port = ? "
+        "WHERE id = ?";
+
+    sql = (route->id > 0) ? sql_update : sql_insert;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to save route into the database");
+
+    if (
+        SQLITE_OK != sqlite3_bind_text(stmt, 1, route->onion_address, -1, NULL) ||
+        SQLITE_OK != sqlite3_bind_int(stmt, 2, route->transport) ||
+        SQLITE_OK != sqlite3_bind_text(stmt, 3, route->address, -1, NULL) ||
+        SQLITE_OK != sqlite3_bind_text(stmt, 4, route->port, -1, NULL)
+    ) {
+        sys_db_crash(db, "Failed to bind route fields");
+    }
+
+    if (route->id > 0) {
+        if (sqlite3_bind_int(stmt, 5, route->id) != SQLITE_OK)
+            sys_db_crash(db, "Failed to bind route id");
+    }
+
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        sys_db_crash(db, "Failed to save route into the database (step)");
+
+    if (route->id == 0)
+        route->id = sqlite3_last_insert_rowid(db);
+
+    sqlite3_finalize(stmt);
+}
+
+// Remove given route from the database
+void db_route_delete(sqlite3 *db, struct db_route *route) {
+    sqlite3_stmt *stmt;
+
+    const char sql[] = "DELETE FROM routes WHERE id = ?";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to delete route from database");
+
+    if (sqlite3_bind_int(stmt, 1, route->id) != SQLITE_OK)
+        sys_db_crash(db, "Failed to bind route id, when deleting");
+
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        sys_db_crash(db, "Failed to delete route from database (step)");
+
+    sqlite3_finalize(stmt);
+}
+
+// Copy text column into given buffer of given size
+static void db_route_column_text(sqlite3_stmt *stmt, int col, char *dest, int dest_len) {
+    int len;
+
+    len = min(dest_len - 1, sqlite3_column_bytes(stmt, col));
+    memcpy(dest, sqlite3_column_text(stmt, col), len);
+    dest[len] = '\0';
+}
+
+// Process the next step of given statement and allocate or populate given object with row data
+static struct db_route * db_route_process_row(sqlite3 *db, sqlite3_stmt *stmt, struct db_route *dest) {
+    int rc;
+    struct db_route *route = dest;
+
+    // Check if there are no results or an error occurred
+    if ((rc = sqlite3_step(stmt)) != SQLITE_ROW) {
+        if (rc == SQLITE_DONE)
+            return NULL;
+
+        sys_db_crash(db, "Failed to fetch route (step)");
+    }
+
+    if (route == NULL)
+        route = db_route_new();
+
+    route->id = sqlite3_column_int(stmt, 0);
+    route->transport = sqlite3_column_int(stmt, 2);
+
+    db_route_column_text(stmt, 1, route->onion_address, sizeof(route->onion_address));
+    db_route_column_text(stmt, 3, route->address, sizeof(route->address));
+    db_route_column_text(stmt, 4, route->port, sizeof(route->port));
+
+    return route;
+}
+
+// Get route for given onion address
+struct db_route * db_route_get_by_onion(sqlite3 *db, const char *onion_address, struct db_route *dest) {
+    sqlite3_stmt *stmt;
+    struct db_route *route;
+
+    const char sql[] = "SELECT * FROM routes WHERE onion_address = ?";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to fetch route from database (by onion)");
+
+    if (sqlite3_bind_text(stmt, 1, onion_address, -1, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to bind route onion address, when fetching");
+
+    route = db_route_process_row(db, stmt, dest);
+
+    sqlite3_finalize(stmt);
+    return route;
+}
+
+// Get all routes from the db, they are returned as array of pointers to
+// route structures, n will be set to length of the array, if there are
+// no routes in the db NULL will be returned
+struct db_route ** db_route_get_all(sqlite3 *db, int *n) {
+    int i;
+    sqlite3_stmt *stmt;
+    struct db_route **routes;
+
+    const char sql[] = "SELECT * FROM routes";
+    const char sql_count[] = "SELECT COUNT(*) FROM routes";
+
+    if (sqlite3_prepare_v2(db, sql_count, -1, &stmt, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to count all routes");
+
+    if (sqlite3_step(stmt) != SQLITE_ROW)
+        sys_db_crash(db, "Failed to count all routes (step)");
+
+    *n = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    if (*n == 0) return NULL;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to fetch all routes");
+
+    routes = safe_malloc((sizeof(struct db_route *) * (*n)),
+        "Failed to allocate memory for route list");
+
+    for (i = 0; i < *n; i++) {
+        routes[i] = db_route_process_row(db, stmt, NULL);
+    }
+
+    sqlite3_finalize(stmt);
+    return routes;
+}
+
+// Free route list fetched using db_route_get_all()
+void db_route_free_all(struct db_route **routes, int n) {
+    int i;
+
+    if (!routes)
+        return;
+
+    for (i = 0; i < n; i++)
+        free(routes[i]);
+    free(routes);
+}
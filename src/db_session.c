@@ -0,0 +1,228 @@
+#include <db_init.h>
+#include <db_session.h>
+#include <sqlite3.h>
+#include <string.h>
+#include <openssl/crypto.h>
+#include <helpers.h>
+#include <sys_memory.h>
+#include <constants.h>
+
+// Create new empty session object
+struct db_session * db_session_new(void) {
+    struct db_session *sess;
+
+    sess = safe_malloc(sizeof(struct db_session), "Failed to allocate session object");
+    memset(sess, 0, sizeof(struct db_session));
+
+    return sess;
+}
+
+// Free given session object, key is wiped, if you want to save
+// it call the save function first
+void db_session_free(struct db_session *sess) {
+    if (!sess)
+        return;
+
+    OPENSSL_cleanse(sess, sizeof(struct db_session));
+    free(sess);
+}
+
+// Save changes on given object to database
+void db_session_save(sqlite3 *db, struct db_session *sess) {
+    sqlite3_stmt *stmt;
+    const char *sql;
+
+    const char sql_insert[] =
+        "INSERT INTO client_sessions "
+        "(contact_id, direction, session_id, key, wrap, counter, confirmed) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?)";
+
+    const char sql_update[] =
+        "UPDATE client_sessions SET contact_id = ?, direction = ?, session_id = ?, "
+        "key = ?, wrap = ?, counter = ?, confirmed = ? WHERE id = ?";
+
+    sql = (sess->id > 0) ? sql_update : sql_insert;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to save session into the database");
+
+    if (
+        SQLITE_OK != sqlite3_bind_int(stmt, 1, sess->contact_id) ||
+        SQLITE_OK != sqlite3_bind_int(stmt, 2, sess->direction) ||
+        SQLITE_OK != sqlite3_bind_int64(stmt, 3, sess->session_id) ||
+        SQLITE_OK != sqlite3_bind_blob(stmt, 4, sess->key, SESSION_KEY_LEN, NULL) ||
+        SQLITE_OK != (sess->wrapped ?
+            sqlite3_bind_blob(stmt, 5, sess->wrap, SESSION_WRAP_LEN, NULL) : sqlite3_bind_null(stmt, 5)) ||
+        SQLITE_OK != sqlite3_bind_int64(stmt, 6, sess->counter) ||
+        SQLITE_OK != sqlite3_bind_int(stmt, 7, sess->confirmed)
+    ) {
+        sys_db_crash(db, "Failed to bind session fields");
+    }
+
+    if (sess->id > 0) {
+        if (sqlite3_bind_int(stmt, 8, sess->id) != SQLITE_OK)
+            sys_db_crash(db, "Failed to bind session id");
+    }
+
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        sys_db_crash(db, "Failed to save session into the database (step)");
+
+    if (sess->id == 0)
+        sess->id = sqlite3_last_insert_rowid(db);
+
+    sqlite3_finalize(stmt);
+}
+
+// Remove given session from the database
+void db_session_delete(sqlite3 *db, struct db_session *sess) {
+    sqlite3_stmt *stmt;
+
+    const char sql[] = "DELETE FROM client_sessions WHERE id = ?";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to delete session from database");
+
+    if (sqlite3_bind_int(stmt, 1, sess->id) != SQLITE_OK)
+        sys_db_crash(db, "Failed to bind session id, when deleting");
+
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        sys_db_crash(db, "Failed to delete session from database (step)");
+
+    sqlite3_finalize(stmt);
+}
+
+// Store sealed key of the session with given database ID, other fields are not changed
+void db_session_set_wrap(sqlite3 *db, int id, const uint8_t *wrap) {
+    sqlite3_stmt *stmt;
+
+    const char sql[] = "UPDATE client_sessions SET wrap = ? WHERE id = ?";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to store session wrap");
+
+    if (
+        SQLITE_OK != sqlite3_bind_blob(stmt, 1, wrap, SESSION_WRAP_LEN, NULL) ||
+        SQLITE_OK != sqlite3_bind_int(stmt, 2, id)
+    ) {
+        sys_db_crash(db, "Failed to bind session fields, when storing wrap");
+    }
+
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        sys_db_crash(db, "Failed to store session wrap (step)");
+
+    sqlite3_finalize(stmt);
+}
+
+// Mark local session with given ID as known by the contact
+void db_session_confirm(sqlite3 *db, int contact_id, uint32_t session_id) {
+    sqlite3_stmt *stmt;
+
+    const char sql[] =
+        "UPDATE client_sessions SET confirmed = 1 "
+        "WHERE contact_id = ? AND direction = ? AND session_id = ?";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to confirm session");
+
+    if (
+        SQLITE_OK != sqlite3_bind_int(stmt, 1, contact_id) ||
+        SQLITE_OK != sqlite3_bind_int(stmt, 2, DB_SESSION_LOCAL) ||
+        SQLITE_OK != sqlite3_bind_int64(stmt, 3, session_id)
+    ) {
+        sys_db_crash(db, "Failed to bind session fields, when confirming");
+    }
+
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        sys_db_crash(db, "Failed to confirm session (step)");
+
+    sqlite3_finalize(stmt);
+}
+
+// Copy blob column into given buffer, missing bytes are set to zero
+static void db_session_column_blob(sqlite3_stmt *stmt, int col, uint8_t *dest, int dest_len) {
+    int len;
+
+    len = min(dest_len, sqlite3_column_bytes(stmt, col));
+    memcpy(dest, sqlite3_column_blob(stmt, col), len);
+    memset(dest + len, 0, dest_len - len);
+}
+
+// Process the next step of given statement and allocate or populate given object with row data
+static struct db_session * db_session_process_row(sqlite3 *db, sqlite3_stmt *stmt, struct db_session *dest) {
+    int rc;
+    struct db_session *sess = dest;
+
+    // Check if there are no results or an error occurred
+    if ((rc = sqlite3_step(stmt)) != SQLITE_ROW) {
+        if (rc == SQLITE_DONE)
+            return NULL;
+
+        sys_db_crash(db, "Failed to fetch session (step)");
+    }
+
+    if (sess == NULL)
+        sess = db_session_new();
+
+    sess->id = sqlite3_column_int(stmt, 0);
+    sess->contact_id = sqlite3_column_int(stmt, 1);
+    sess->direction = sqlite3_column_int(stmt, 2);
+    sess->session_id = sqlite3_column_int64(stmt, 3);
+    sess->counter = sqlite3_column_int64(stmt, 6);
+    sess->confirmed = sqlite3_column_int(stmt, 7);
+
+    db_session_column_blob(stmt, 4, sess->key, SESSION_KEY_LEN);
+    db_session_column_blob(stmt, 5, sess->wrap, SESSION_WRAP_LEN);
+    sess->wrapped = sqlite3_column_type(stmt, 5) != SQLITE_NULL;
+
+    return sess;
+}
+
+// Get current local session of the contact
+struct db_session * db_session_get_local(sqlite3 *db, int contact_id, struct db_session *dest) {
+    sqlite3_stmt *stmt;
+    struct db_session *sess;
+
+    const char sql[] =
+        "SELECT * FROM client_sessions WHERE contact_id = ? AND direction = ? "
+        "ORDER BY id DESC LIMIT 1";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to fetch session from database (local)");
+
+    if (
+        SQLITE_OK != sqlite3_bind_int(stmt, 1, contact_id) ||
+        SQLITE_OK != sqlite3_bind_int(stmt, 2, DB_SESSION_LOCAL)
+    ) {
+        sys_db_crash(db, "Failed to bind session fields, when fetching");
+    }
+
+    sess = db_session_process_row(db, stmt, dest);
+
+    sqlite3_finalize(stmt);
+    return sess;
+}
+
+// Get remote session of the contact with given ID
+struct db_session * db_session_get_remote(sqlite3 *db, int contact_id, uint32_t session_id, struct db_session *dest) {
+    sqlite3_stmt *stmt;
+    struct db_session *sess;
+
+    const char sql[] =
+        "SELECT * FROM client_sessions WHERE contact_id = ? AND direction = ? AND session_id = ?";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        sys_db_crash(db, "Failed to fetch session from database (remote)");
+
+    if (
+        SQLITE_OK != sqlite3_bind_int(stmt, 1, contact_id) ||
+        SQLITE_OK != sqlite3_bind_int(stmt, 2, DB_SESSION_REMOTE) ||
+        SQLITE_OK != sqlite3_bind_int64(stmt, 3, session_id)
+    ) {
+        sys_db_crash(db, "Failed to bind session fields, when fetching");
+    }
+
+    sess = db_session_process_row(db, stmt, dest);
+
+    sqlite3_finalize(stmt);
+    return sess;
+}
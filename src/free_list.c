@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <free_list.h>
+#include <sys_memory.h>
+
+// Get object from the list, allocates new object if list is empty,
+// returned memory is not initialized
+void * free_list_get(struct free_list *fl) {
+    void *item;
+
+    if (!(item = free_list_take(fl))) {
+        return safe_malloc(
+            fl->item_size < sizeof(struct free_list_item) ? sizeof(struct free_list_item) : fl->item_size,
+            "Failed to allocate free list object");
+    }
+
+    return item;
+}
+
+// Put object back into the list, object is freed if list is full
+void free_list_put(struct free_list *fl, void *item) {
+    if (item && !free_list_keep(fl, item))
+        free(item);
+}
+
+// Take object from the list, returns NULL if list is empty, used for objects
+// which keep their resources while they are in the list
+void * free_list_take(struct free_list *fl) {
+    struct free_list_item *item;
+
+    pthread_mutex_lock(&(fl->lock));
+    if (item = fl->head) {
+        fl->head = item->next;
+        --fl->n_free;
+    }
+    pthread_mutex_unlock(&(fl->lock));
+
+    return item;
+}
+
+// Put object back into the list, returns 1 if object is kept and 0 if
+// list is full, in which case caller must free the object
+int free_list_keep(struct free_list *fl, void *item) {
+    int kept = 0;
+    struct free_list_item *fitem = item;
+
+    pthread_mutex_lock(&(fl->lock));
+    if (fl->n_free < fl->max_free) {
+        fitem->next = fl->head;
+        fl->head = fitem;
+        ++fl->n_free;
+        kept = 1;
+    }
+    pthread_mutex_unlock(&(fl->lock));
+
+    return kept;
+}
+
+// Free all unused objects kept in the list
+void free_list_clear(struct free_list *fl) {
+    pthread_mutex_lock(&(fl->lock));
+    while (fl->head) {
+        struct free_list_item *next = fl->head->next;
+
+        free(fl->head);
+        fl->head = next;
+    }
+    fl->n_free = 0;
+    pthread_mutex_unlock(&(fl->lock));
+}
@@ -5,6 +5,7 @@
 #include <openssl/decoder.h>
 #include <constants.h>
 #include <helpers_crypto.h>
+#include <crypto_ctx.h>
 #include <debug.h>
 
 // Generate ED25519 keypair and place keys on given locations
@@ -14,8 +15,7 @@ void ed25519_keygen(uint8_t *public_key, uint8_t *private_key) {
     EVP_PKEY_CTX *keyctx;
 
     if (
-        !(keyctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, NULL)) ||
-        !EVP_PKEY_keygen_init(keyctx) ||
+        !(keyctx = crypto_ctx_ed25519_keygen()) ||
         !EVP_PKEY_generate(keyctx, &pkey)
     )
         sys_openssl_crash("Failed to generate ED25519 keypair");
@@ -28,8 +28,8 @@ void ed25519_keygen(uint8_t *public_key, uint8_t *private_key) {
     if (!EVP_PKEY_get_raw_private_key(pkey, private_key, &len))
         sys_openssl_crash("Failed to extract private ED25519 key");
 
+    // Context is kept by the thread, so it's not freed
     EVP_PKEY_free(pkey);
-    EVP_PKEY_CTX_free(keyctx);
 }
 
 // Generate 2048bit RSA keypair, encode them in DER format and store keys
@@ -1,6 +1,10 @@
 #include <hooks.h>
 #include <stdlib.h>
 #include <sys_memory.h>
+#include <free_list.h>
+
+// Unused hooks, reused by next allocation
+static struct free_list hook_free_list = FREE_LIST_INIT(struct hook, FREE_LIST_MAX_FREE * 4);
 
 // Create new hook list to handle hooks
 struct hook_list * hook_list_new(void) {
@@ -15,6 +19,12 @@ struct hook_list * hook_list_new(void) {
 
 // Free the hook list and all it's hooks
 void hook_list_free(struct hook_list *list) {
+    hook_list_clear(list);
+    free(list);
+}
+
+// Remove all hooks from the list
+void hook_list_clear(struct hook_list *list) {
     struct hook *hk;
 
     // Free all hooks in the list
@@ -23,17 +33,17 @@ void hook_list_free(struct hook_list *list) {
         struct hook *hk_free = hk;
 
         hk = hk->next;
-        free(hk_free);
+        free_list_put(&hook_free_list, hk_free);
     }
 
-    free(list);
+    list->head = NULL;
 }
 
 // Add new hook to the hook list
 void hook_add(struct hook_list *list, int hevent, hook_callback cb, void *cbarg) {
     struct hook *hk;
 
-    hk = safe_malloc(sizeof(struct hook), "Failed to allocate hook");
+    hk = free_list_get(&hook_free_list);
     hk->cb = cb;
     hk->cbarg = cbarg;
     hk->hook_event = hevent;
@@ -52,6 +62,18 @@ void hook_add(struct hook_list *list, int hevent, hook_callback cb, void *cbarg)
     }
 }
 
+// Add new hook to the hook list, unless the same hook is already in the list
+void hook_add_unique(struct hook_list *list, int hevent, hook_callback cb, void *cbarg) {
+    struct hook *hk;
+
+    for (hk = list->head; hk != NULL; hk = hk->next) {
+        if (hk->hook_event == hevent && hk->cb == cb && hk->cbarg == cbarg)
+            return;
+    }
+
+    hook_add(list, hevent, cb, cbarg);
+}
+
 // Remove hook with given data from the list
 void hook_remove(struct hook_list *list, int hevent, hook_callback cb, void *cbarg) {
     struct hook *hk;
@@ -60,7 +82,7 @@ void hook_remove(struct hook_list *list, int hevent, hook_callback cb, void *cba
     // If the first hook is the one
     if (hk->hook_event == hevent && hk->cb == cb && hk->cbarg == cbarg) {
         list->head = hk->next;
-        free(hk);
+        free_list_put(&hook_free_list, hk);
         return;
     }
 
@@ -70,7 +92,7 @@ void hook_remove(struct hook_list *list, int hevent, hook_callback cb, void *cba
 
         if (hkn->hook_event == hevent && hkn->cb == cb && hkn->cbarg == cbarg) {
             hk->next = hkn->next;
-            free(hkn);
+            free_list_put(&hook_free_list, hkn);
             return;
         }
     }
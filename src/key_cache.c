@@ -0,0 +1,175 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include <key_cache.h>
+#include <crypto_ctx.h>
+#include <helpers_crypto.h>
+#include <constants.h>
+#include <debug.h>
+
+// Single decoded key, identified by fingerprint of its encoded form,
+// encoded key itself is not kept
+struct key_cache_entry {
+    EVP_PKEY *pkey; // NULL if entry is unused
+    enum key_cache_types type;
+    uint64_t last_used;
+    uint8_t fingerprint[KEY_CACHE_FINGERPRINT_LEN];
+};
+
+static struct key_cache_entry cache[KEY_CACHE_SIZE];
+static uint64_t cache_clock = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Get number of bytes of the encoded key, RSA keys are stored in buffers of
+// fixed size, so only the DER structure itself is used
+static size_t key_cache_key_len(enum key_cache_types type, const uint8_t *key) {
+    size_t max_len, len;
+
+    switch (type) {
+        case KEY_CACHE_ED25519_PUB:
+            return ED25519_PUB_KEY_LEN;
+        case KEY_CACHE_ED25519_PRIV:
+            return ED25519_PRIV_KEY_LEN;
+        case KEY_CACHE_RSA_PUB:
+            max_len = CLIENT_ENC_KEY_PUB_LEN;
+            break;
+        default:
+            max_len = CLIENT_ENC_KEY_PRIV_LEN;
+            break;
+    }
+
+    // SEQUENCE with two byte length
+    if (key[0] != 0x30 || key[1] != 0x82)
+        return max_len;
+    len = 4 + ((key[2] << 8) | key[3]);
+    return len < max_len ? len : max_len;
+}
+
+// Calculate fingerprint of the encoded key, returns 0 on success and 1 on failure
+static int key_cache_fingerprint(enum key_cache_types type, const uint8_t *key, uint8_t *fingerprint) {
+    int is_err = 1;
+    uint8_t type_byte = type;
+    EVP_MD_CTX *ctx;
+
+    if (!(ctx = crypto_ctx_md_get()))
+        return 1;
+
+    if (
+        EVP_DigestInit_ex2(ctx, crypto_ctx_md(CRYPTO_CTX_SHA256), NULL) &&
+        EVP_DigestUpdate(ctx, &type_byte, sizeof(type_byte)) &&
+        EVP_DigestUpdate(ctx, key, key_cache_key_len(type, key)) &&
+        EVP_DigestFinal_ex(ctx, fingerprint, NULL)
+    ) {
+        is_err = 0;
+    }
+
+    crypto_ctx_md_put(ctx);
+    return is_err;
+}
+
+// Decode key of given type, returns NULL on failure
+static EVP_PKEY * key_cache_decode(enum key_cache_types type, const uint8_t *key) {
+    switch (type) {
+        case KEY_CACHE_ED25519_PUB:
+            return EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, key, ED25519_PUB_KEY_LEN);
+        case KEY_CACHE_ED25519_PRIV:
+            return EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, NULL, key, ED25519_PRIV_KEY_LEN);
+        case KEY_CACHE_RSA_PUB:
+            return rsa_2048bit_pub_key_decode((uint8_t *)key);
+        case KEY_CACHE_RSA_PRIV:
+            return rsa_2048bit_priv_key_decode((uint8_t *)key);
+    }
+    return NULL;
+}
+
+// Release key held by the entry and wipe the entry, OpenSSL clears
+// private key material once the last reference is freed
+static void key_cache_evict(struct key_cache_entry *entry) {
+    EVP_PKEY_free(entry->pkey);
+    OPENSSL_cleanse(entry, sizeof(struct key_cache_entry));
+}
+
+// Find entry with given fingerprint, must be called with lock held
+static struct key_cache_entry * key_cache_find(enum key_cache_types type, const uint8_t *fingerprint) {
+    int i;
+
+    for (i = 0; i < KEY_CACHE_SIZE; i++) {
+        if (
+            cache[i].pkey && cache[i].type == type &&
+            memcmp(cache[i].fingerprint, fingerprint, KEY_CACHE_FINGERPRINT_LEN) == 0
+        ) {
+            return &(cache[i]);
+        }
+    }
+    return NULL;
+}
+
+// Get decoded key of given type, key is decoded only if it's not in the cache
+// already, cache is shared by all threads, returned key must be freed using
+// EVP_PKEY_free once it's not needed anymore, returns NULL if key is invalid
+EVP_PKEY * key_cache_get(enum key_cache_types type, const uint8_t *key) {
+    int i;
+    EVP_PKEY *pkey;
+    struct key_cache_entry *entry;
+    uint8_t fingerprint[KEY_CACHE_FINGERPRINT_LEN];
+
+    if (key_cache_fingerprint(type, key, fingerprint))
+        return key_cache_decode(type, key);
+
+    pthread_mutex_lock(&cache_lock);
+    if (entry = key_cache_find(type, fingerprint)) {
+        entry->last_used = ++cache_clock;
+        pkey = entry->pkey;
+        EVP_PKEY_up_ref(pkey);
+        pthread_mutex_unlock(&cache_lock);
+
+        OPENSSL_cleanse(fingerprint, KEY_CACHE_FINGERPRINT_LEN);
+        return pkey;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    // Decoding is slow, so other threads are not blocked meanwhile
+    if (!(pkey = key_cache_decode(type, key))) {
+        OPENSSL_cleanse(fingerprint, KEY_CACHE_FINGERPRINT_LEN);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    // Some other thread might have added the same key in the meantime
+    if (!key_cache_find(type, fingerprint)) {
+        entry = &(cache[0]);
+        for (i = 0; i < KEY_CACHE_SIZE && entry->pkey; i++) {
+            if (!cache[i].pkey || cache[i].last_used < entry->last_used)
+                entry = &(cache[i]);
+        }
+        if (entry->pkey) {
+            debug("Key cache full, evicting least recently used key");
+            key_cache_evict(entry);
+        }
+
+        EVP_PKEY_up_ref(pkey);
+        entry->pkey = pkey;
+        entry->type = type;
+        entry->last_used = ++cache_clock;
+        memcpy(entry->fingerprint, fingerprint, KEY_CACHE_FINGERPRINT_LEN);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    OPENSSL_cleanse(fingerprint, KEY_CACHE_FINGERPRINT_LEN);
+    return pkey;
+}
+
+// Remove all keys from the cache, keys still used by someone are
+// freed once they are released
+void key_cache_clear(void) {
+    int i;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < KEY_CACHE_SIZE; i++) {
+        if (cache[i].pkey)
+            key_cache_evict(&(cache[i]));
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -9,6 +9,7 @@
 #include <constants.h>
 #include <sys_memory.h>
 #include <sys_crash.h>
+#include <crypto_ctx.h>
 
 /**
  * Functions below are used to check and decode .onion address
@@ -58,15 +59,15 @@ int onion_address_valid(const char *onion_address) {
     if (version != ONION_VERSION)
         return 0;
 
-    mdctx = EVP_MD_CTX_new();
+    mdctx = crypto_ctx_md_get();
 
-    EVP_DigestInit_ex(mdctx, EVP_sha3_256(), NULL);
+    EVP_DigestInit_ex(mdctx, crypto_ctx_md(CRYPTO_CTX_SHA3_256), NULL);
     EVP_DigestUpdate(mdctx, ".onion checksum", 15);
     EVP_DigestUpdate(mdctx, pub_key, ONION_PUB_KEY_LEN);
     EVP_DigestUpdate(mdctx, &onion_version, 1);
     EVP_DigestFinal_ex(mdctx, hash, &hash_len);
 
-    EVP_MD_CTX_free(mdctx);
+    crypto_ctx_md_put(mdctx);
 
     for (i = 0; i < ONION_CHECKSUM_LEN; i++) {
         if (hash[i] != checksum[i])
@@ -100,12 +101,13 @@ void onion_address_from_pub_key(const uint8_t *pub_key, char *onion_address) {
 
     memcpy(buffer, pub_key, ONION_PUB_KEY_LEN);
 
-    ctx = EVP_MD_CTX_new();
-    EVP_DigestInit_ex(ctx, EVP_sha3_256(), NULL);
+    ctx = crypto_ctx_md_get();
+    EVP_DigestInit_ex(ctx, crypto_ctx_md(CRYPTO_CTX_SHA3_256), NULL);
     EVP_DigestUpdate(ctx, ".onion checksum", 15);
     EVP_DigestUpdate(ctx, pub_key, ONION_PUB_KEY_LEN);
     EVP_DigestUpdate(ctx, &onion_version, 1);
     EVP_DigestFinal_ex(ctx, hash, &hash_len);
+    crypto_ctx_md_put(ctx);
 
     memcpy(buffer + ONION_PUB_KEY_LEN, hash, ONION_CHECKSUM_LEN);
     buffer[ONION_CHECKSUM_LEN + ONION_PUB_KEY_LEN] = onion_version;
@@ -119,10 +121,10 @@ void onion_priv_key_expand(const uint8_t *priv_key, uint8_t *expanded) {
     int len = 64;
     EVP_MD_CTX *ctx;
 
-    ctx = EVP_MD_CTX_new();
+    ctx = crypto_ctx_md_get();
 
     if (
-        !EVP_DigestInit_ex2(ctx, EVP_sha512(), NULL) ||
+        !EVP_DigestInit_ex2(ctx, crypto_ctx_md(CRYPTO_CTX_SHA512), NULL) ||
         !EVP_DigestUpdate(ctx, priv_key, ED25519_PRIV_KEY_LEN) ||
         !EVP_DigestFinal(ctx, expanded, &len)
     ) {
@@ -131,7 +133,7 @@ void onion_priv_key_expand(const uint8_t *priv_key, uint8_t *expanded) {
         return;
     }
 
-    EVP_MD_CTX_free(ctx);
+    crypto_ctx_md_put(ctx);
 
     expanded[0] &= 248;
     expanded[31] &= 127;
@@ -1,4 +1,6 @@
 #include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
 #include <sys_memory.h>
 #include <constants.h>
 #include <prot_ack.h>
@@ -7,6 +9,31 @@
 #include <event2/bufferevent.h>
 #include <buffer_crypto.h>
 #include <debug.h>
+#include <free_list.h>
+#include <array.h>
+
+// Layout of ACK message
+#define ACK_FIELDS(X) \
+    X(ACK_HEADER, BYTES, PROT_HEADER_LEN,       0) \
+    X(ACK_TXN,    BYTES, TRANSACTION_ID_LEN,    0) \
+    X(ACK_SIG,    BYTES, ED25519_SIGNATURE_LEN, 0)
+
+enum ack_fields { ACK_FIELDS(PROT_FIELD_NAME) };
+static const struct prot_layout ack_layout = PROT_LAYOUT(ACK_FIELDS);
+
+// Layout of batched ACK message
+#define ACK_BATCH_FIELDS(X) \
+    X(ACK_BATCH_HEADER, BYTES, PROT_HEADER_LEN,       0) \
+    X(ACK_BATCH_TXN,    BYTES, TRANSACTION_ID_LEN,    0) \
+    X(ACK_BATCH_N_ACKS, U16,   0,                     PROT_ACK_BATCH_MAX) \
+    X(ACK_BATCH_GIDS,   VAR,   MESSAGE_ID_LEN,        ACK_BATCH_N_ACKS) \
+    X(ACK_BATCH_SIG,    BYTES, ED25519_SIGNATURE_LEN, 0)
+
+enum ack_batch_fields { ACK_BATCH_FIELDS(PROT_FIELD_NAME) };
+static const struct prot_layout ack_batch_layout = PROT_LAYOUT(ACK_BATCH_FIELDS);
+
+// Unused handler objects, reused by next allocation
+static struct free_list ack_free_list = FREE_LIST_INIT(struct prot_ack_ed25519, FREE_LIST_MAX_FREE);
 
 // Free ACK handler memory
 static void tran_cleanup(struct prot_main *pmain, struct prot_tran_handler *phand) {
@@ -52,16 +79,13 @@ static void recv_cleanup(struct prot_main *pmain, struct prot_recv_handler *phan
 static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand) {
     struct evbuffer *input;
     struct prot_ack_ed25519 *ack = phand->msg;
-    int message_len = PROT_HEADER_LEN + TRANSACTION_ID_LEN + ED25519_SIGNATURE_LEN;
-
-    debug("Hello");
 
     input = bufferevent_get_input(pmain->bev);
 
-    if (evbuffer_get_length(input) < message_len)
+    if (!prot_main_recv_parse_signed(pmain, &(ack->codec), &ack_layout))
         return;
 
-    if (!ed25519_buffer_validate(input, message_len, ack->pub_key)) {
+    if (!prot_main_recv_verify(pmain, &(ack->codec), ack->pub_key)) {
         prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
         return;
     }
@@ -70,7 +94,7 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
     if (ack->cb)
         ack->cb(1, pmain, ack->cbarg);
 
-    evbuffer_drain(input, message_len);
+    evbuffer_drain(input, ack->codec.frame_len);
     pmain->current_recv_done = 1;
 }
 
@@ -84,7 +108,7 @@ struct prot_ack_ed25519 * prot_ack_ed25519_new(
 ) {
     struct prot_ack_ed25519 *ack;
 
-    ack = safe_malloc(sizeof(struct prot_ack_ed25519), "Failed to allocate ACK message");
+    ack = free_list_get(&ack_free_list);
     memset(ack, 0, sizeof(struct prot_ack_ed25519));
     
     ack->cb = cb;
@@ -97,10 +121,11 @@ struct prot_ack_ed25519 * prot_ack_ed25519_new(
 
     ack->htran.msg = ack;
     ack->htran.msg_code = msg_code;
+    ack->htran.priority = PROT_PRIO_ACK;
     ack->htran.done_cb = tran_done;
     ack->htran.setup_cb = tran_setup;
     ack->htran.cleanup_cb = tran_cleanup;
-    ack->htran.buffer = evbuffer_new();
+    ack->htran.buffer = NULL;
 
     ack->hrecv.msg = ack;
     ack->hrecv.msg_code = msg_code;
@@ -113,7 +138,249 @@ struct prot_ack_ed25519 * prot_ack_ed25519_new(
 
 // Free memory for given ack
 void prot_ack_ed25519_free(struct prot_ack_ed25519 *ack) {
-    if (ack && ack->htran.buffer)
-        evbuffer_free(ack->htran.buffer);
-    free(ack);
-}
\ No newline at end of file
+    free_list_put(&ack_free_list, ack);
+}
+
+/**
+ * Batched ACK message
+ */
+
+// Unused batched ACK handlers, reused by next allocation
+static struct free_list ack_batch_free_list = FREE_LIST_INIT(struct prot_ack_batch, FREE_LIST_MAX_FREE);
+
+// Notify all messages which are not acknowledged yet that ACK failed
+static void batch_fail(struct prot_main *pmain, struct prot_ack_batch *ack) {
+    int i;
+
+    for (i = 0; i < ack->n_items; i++) {
+        if (!ack->items[i].acked && ack->items[i].cb)
+            ack->items[i].cb(0, pmain, ack->items[i].cbarg);
+    }
+}
+
+// Free batched ACK handler memory
+static void batch_tran_cleanup(struct prot_main *pmain, struct prot_tran_handler *phand) {
+    struct prot_ack_batch *ack = phand->msg;
+
+    batch_fail(pmain, ack);
+    prot_ack_batch_free(ack);
+}
+
+// Called once batched ACK is sent, all messages in it are acknowledged
+static void batch_tran_done(struct prot_main *pmain, struct prot_tran_handler *phand) {
+    int i;
+    struct prot_ack_batch *ack = phand->msg;
+
+    for (i = 0; i < ack->n_items; i++) {
+        ack->items[i].acked = 1;
+        if (ack->items[i].cb)
+            ack->items[i].cb(1, pmain, ack->items[i].cbarg);
+    }
+}
+
+// Fill batched ACK buffer
+static void batch_tran_setup(struct prot_main *pmain, struct prot_tran_handler *phand) {
+    int i;
+    uint16_t n_acks;
+    struct prot_ack_batch *ack = phand->msg;
+
+    debug("Preparing batched ack transmission for %d messages", ack->n_items);
+
+    n_acks = htons(ack->n_items);
+
+    evbuffer_add(phand->buffer, prot_header(ack->msg_code), PROT_HEADER_LEN);
+    evbuffer_add(phand->buffer, pmain->transaction_id, TRANSACTION_ID_LEN);
+    evbuffer_add(phand->buffer, &n_acks, sizeof(n_acks));
+    for (i = 0; i < ack->n_items; i++)
+        evbuffer_add(phand->buffer, ack->items[i].gid, MESSAGE_ID_LEN);
+    ed25519_buffer_sign(phand->buffer, 0, ack->priv_key);
+}
+
+// Free batched ACK handler memory
+static void batch_recv_cleanup(struct prot_main *pmain, struct prot_recv_handler *phand) {
+    struct prot_ack_batch *ack = phand->msg;
+
+    batch_fail(pmain, ack);
+    prot_ack_batch_free(ack);
+}
+
+// Find message with given global ID which is not acknowledged yet, messages
+// are usually acknowledged in order they were sent so search starts from
+// the first one still pending, returns NULL if there is no such message
+static struct prot_ack_batch_item * batch_find(struct prot_ack_batch *ack, const uint8_t *gid) {
+    int i;
+
+    for (i = ack->first_pending; i < ack->n_items; i++) {
+        if (!ack->items[i].acked && !memcmp(ack->items[i].gid, gid, MESSAGE_ID_LEN))
+            return &(ack->items[i]);
+    }
+    return NULL;
+}
+
+// Handle incomming batched ACK, handler stays in the queue until
+// all messages in the batch are acknowledged
+static void batch_recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand) {
+    int i;
+    uint16_t n_acks;
+    size_t message_len;
+    uint8_t *gid;
+    struct evbuffer *input;
+    struct prot_ack_batch_item *item;
+    struct prot_ack_batch *ack = phand->msg;
+
+    input = bufferevent_get_input(pmain->bev);
+
+    if (!prot_main_recv_parse_signed(pmain, &(ack->codec), &ack_batch_layout))
+        return;
+
+    n_acks = prot_codec_value(&(ack->codec), ACK_BATCH_N_ACKS);
+    message_len = ack->codec.frame_len;
+
+    if (n_acks == 0 || !prot_main_recv_verify(pmain, &(ack->codec), ack->pub_key)) {
+        prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+        return;
+    }
+
+    gid = prot_codec_pullup(&(ack->codec), input, ACK_BATCH_GIDS);
+
+    for (i = 0; i < n_acks; i++, gid += MESSAGE_ID_LEN) {
+        // ACK for message we are not waiting for
+        if (!(item = batch_find(ack, gid))) {
+            prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+            return;
+        }
+
+        item->acked = 1;
+        --ack->n_pending;
+        while (ack->first_pending < ack->n_items && ack->items[ack->first_pending].acked)
+            ++ack->first_pending;
+
+        if (item->cb)
+            item->cb(1, pmain, item->cbarg);
+    }
+
+    evbuffer_drain(input, message_len);
+    prot_codec_reset(&(ack->codec));
+
+    if (ack->n_pending == 0)
+        pmain->current_recv_done = 1;
+    else
+        pmain->current_recv_more = 1;
+}
+
+// Allocate new batched ACK handler
+static struct prot_ack_batch * prot_ack_batch_new(enum prot_message_codes msg_code) {
+    struct prot_ack_batch *ack;
+
+    ack = free_list_get(&ack_batch_free_list);
+    memset(ack, 0, sizeof(struct prot_ack_batch));
+
+    ack->msg_code = msg_code;
+    ack->items = array(struct prot_ack_batch_item);
+
+    ack->htran.msg = ack;
+    ack->htran.msg_code = msg_code;
+    ack->htran.priority = PROT_PRIO_ACK;
+    ack->htran.done_cb = batch_tran_done;
+    ack->htran.setup_cb = batch_tran_setup;
+    ack->htran.cleanup_cb = batch_tran_cleanup;
+    ack->htran.buffer = NULL;
+
+    ack->hrecv.msg = ack;
+    ack->hrecv.msg_code = msg_code;
+    ack->hrecv.require_transaction = 1;
+    ack->hrecv.handle_cb = batch_recv_handle;
+    ack->hrecv.cleanup_cb = batch_recv_cleanup;
+
+    return ack;
+}
+
+// Add message with given global ID to the batch
+static void prot_ack_batch_add(struct prot_ack_batch *ack, const uint8_t *gid, prot_ack_ed25519_cb cb, void *cbarg) {
+    struct prot_ack_batch_item *item;
+
+    array_expand(ack->items, ack->n_items + 1);
+    item = &(ack->items[ack->n_items++]);
+
+    memcpy(item->gid, gid, MESSAGE_ID_LEN);
+    item->acked = 0;
+    item->cb = cb;
+    item->cbarg = cbarg;
+
+    ++ack->n_pending;
+}
+
+// Send ACK for message with given global ID, ACK is added to the batch waiting
+// to be sent if there is one, new batch is pushed into transmission queue otherwise,
+// callback is called once ACK is sent or sending failed
+void prot_ack_batch_send(
+    struct prot_main *pmain,
+    enum prot_message_codes msg_code,
+    uint8_t *priv_key,
+    const uint8_t *gid,
+    prot_ack_ed25519_cb cb,
+    void *cbarg
+) {
+    struct prot_ack_batch *ack = NULL;
+    struct prot_tran_handler *last;
+
+    // Batch can only be extended while it is the last thing to be sent,
+    // otherwise ACKs would arrive out of order
+    if ((last = prot_main_tran_last(pmain)) && last->msg_code == msg_code) {
+        ack = last->msg;
+
+        if (ack->n_items >= PROT_ACK_BATCH_MAX || memcmp(ack->priv_key, priv_key, ED25519_PRIV_KEY_LEN))
+            ack = NULL;
+    }
+
+    if (ack) {
+        prot_ack_batch_add(ack, gid, cb, cbarg);
+        return;
+    }
+
+    ack = prot_ack_batch_new(msg_code);
+    memcpy(ack->priv_key, priv_key, ED25519_PRIV_KEY_LEN);
+    prot_ack_batch_add(ack, gid, cb, cbarg);
+    prot_main_push_tran(pmain, &(ack->htran));
+}
+
+// Expect ACK for message with given global ID, message is added to the last batch
+// in receiver queue if there is one, new batch is pushed otherwise, callback is
+// called once ACK arrives or connection fails, single batch can be acknowledged
+// by multiple batched ACK messages
+void prot_ack_batch_expect(
+    struct prot_main *pmain,
+    enum prot_message_codes msg_code,
+    uint8_t *pub_key,
+    const uint8_t *gid,
+    prot_ack_ed25519_cb cb,
+    void *cbarg
+) {
+    struct prot_ack_batch *ack = NULL;
+    struct prot_recv_handler *last;
+
+    if ((last = prot_main_recv_last(pmain)) && last->msg_code == msg_code) {
+        ack = last->msg;
+
+        if (memcmp(ack->pub_key, pub_key, ED25519_PUB_KEY_LEN))
+            ack = NULL;
+    }
+
+    if (ack) {
+        prot_ack_batch_add(ack, gid, cb, cbarg);
+        return;
+    }
+
+    ack = prot_ack_batch_new(msg_code);
+    memcpy(ack->pub_key, pub_key, ED25519_PUB_KEY_LEN);
+    prot_ack_batch_add(ack, gid, cb, cbarg);
+    prot_main_push_recv(pmain, &(ack->hrecv));
+}
+
+// Free given batched ACK handler
+void prot_ack_batch_free(struct prot_ack_batch *ack) {
+    if (!ack) return;
+
+    array_free(ack->items);
+    free_list_put(&ack_batch_free_list, ack);
+}
@@ -3,12 +3,26 @@
 #include <db_contact.h>
 #include <prot_client_fetch.h>
 #include <sys_memory.h>
+#include <free_list.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <debug.h>
 #include <buffer_crypto.h>
 #include <prot_message_list.h>
 
+// Layout of client fetch message
+#define CLIENT_FETCH_FIELDS(X) \
+    X(CLIENT_FETCH_HEADER,  BYTES, PROT_HEADER_LEN,        0) \
+    X(CLIENT_FETCH_TXN,     BYTES, TRANSACTION_ID_LEN,     0) \
+    X(CLIENT_FETCH_SIG_KEY, BYTES, CLIENT_SIG_KEY_PUB_LEN, 0) \
+    X(CLIENT_FETCH_SIG,     BYTES, ED25519_SIGNATURE_LEN,  0)
+
+enum client_fetch_fields { CLIENT_FETCH_FIELDS(PROT_FIELD_NAME) };
+static const struct prot_layout client_fetch_layout = PROT_LAYOUT(CLIENT_FETCH_FIELDS);
+
+// Unused handler objects, reused by next allocation
+static struct free_list client_fetch_free_list = FREE_LIST_INIT(struct prot_client_fetch, FREE_LIST_MAX_FREE);
+
 // Called when fetch request is sent successfully
 static void tran_done(struct prot_main *pmain, struct prot_tran_handler *phand) {
     struct prot_client_fetch *msg = phand->msg;
@@ -20,10 +34,13 @@ static void tran_done(struct prot_main *pmain, struct prot_tran_handler *phand)
     msg->cont = NULL;
 }
 
-// Called to free fetch request memory
+// Called to free fetch request memory, if peer refused the connection
+// fetch is handed back to be sent again using the oldest protocol version
 static void tran_cleanup(struct prot_main *pmain, struct prot_tran_handler *phand) {
     struct prot_client_fetch *msg = phand->msg;
-    if (!phand->success)
+    if (!phand->success && pmain->status == PROT_ERR_REFUSED)
+        hook_list_call(pmain->hooks, PROT_CLIENT_FETCH_EV_RETRY, msg->cont);
+    else if (!phand->success)
         hook_list_call(pmain->hooks, PROT_CLIENT_FETCH_EV_FAIL, NULL);
     debug("PCF Cleanup called");
     prot_client_fetch_free(msg);
@@ -53,7 +70,6 @@ static void recv_cleanup(struct prot_main *pmain, struct prot_recv_handler *phan
 static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand) {
     struct prot_client_fetch *msg = phand->msg;
     struct evbuffer *input;
-    struct evbuffer_ptr pos;
     struct db_contact *cont;
 
     int n_msgs;
@@ -61,22 +77,18 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
     struct prot_message_list *msg_list;
     uint8_t sig_pub_key[CLIENT_SIG_KEY_PUB_LEN];
 
-    size_t message_len = PROT_HEADER_LEN + TRANSACTION_ID_LEN +
-        CLIENT_SIG_KEY_PUB_LEN + ED25519_SIGNATURE_LEN;
-
     debug("CLIENT FETCH HANDLE");
 
     input = bufferevent_get_input(pmain->bev);
-    
-    if (evbuffer_get_length(input) < message_len)
+
+    if (!prot_main_recv_parse_signed(pmain, &(msg->codec), &client_fetch_layout))
         return;
 
     debug("Received client fetch");
 
-    evbuffer_ptr_set(input, &pos, PROT_HEADER_LEN + TRANSACTION_ID_LEN, EVBUFFER_PTR_SET);
-    evbuffer_copyout_from(input, &pos, sig_pub_key, CLIENT_SIG_KEY_PUB_LEN);
+    prot_codec_copy(&(msg->codec), input, CLIENT_FETCH_SIG_KEY, sig_pub_key);
 
-    if (!ed25519_buffer_validate(input, message_len, sig_pub_key)) {
+    if (!prot_main_recv_verify(pmain, &(msg->codec), sig_pub_key)) {
         prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
         return;
     }
@@ -94,7 +106,7 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
     msg_list = prot_message_list_client_new(msg->db, cont, msgs, n_msgs);
     prot_main_push_tran(pmain, &(msg_list->htran));
 
-    evbuffer_drain(input, message_len);
+    evbuffer_drain(input, msg->codec.frame_len);
     pmain->current_recv_done = 1;
 }
 
@@ -102,8 +114,7 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
 struct prot_client_fetch * prot_client_fetch_new(sqlite3 *db, struct db_contact *cont) {
     struct prot_client_fetch *msg;
 
-    msg = safe_malloc(sizeof(struct prot_client_fetch),
-        "Failed to allocate memory for client fetch request handler");
+    msg = free_list_get(&client_fetch_free_list);
     memset(msg, 0, sizeof(struct prot_client_fetch));
 
     msg->db = db;
@@ -111,10 +122,11 @@ struct prot_client_fetch * prot_client_fetch_new(sqlite3 *db, struct db_contact
 
     msg->htran.msg = msg;
     msg->htran.msg_code = PROT_CLIENT_FETCH;
+    msg->htran.priority = PROT_PRIO_INTERACTIVE;
     msg->htran.done_cb = tran_done;
     msg->htran.setup_cb = tran_setup;
     msg->htran.cleanup_cb = tran_cleanup;
-    msg->htran.buffer = evbuffer_new();
+    msg->htran.buffer = NULL;
 
     msg->hrecv.msg = msg;
     msg->hrecv.msg_code = PROT_CLIENT_FETCH;
@@ -128,10 +140,7 @@ struct prot_client_fetch * prot_client_fetch_new(sqlite3 *db, struct db_contact
 // Free client fetch handler
 void prot_client_fetch_free(struct prot_client_fetch *msg) {
     debug("PCF FREE called");
-    if (msg) {
-        evbuffer_free(msg->htran.buffer);
-        if (msg->cont)
-            db_contact_free(msg->cont);
-    }
-    free(msg);
+    if (msg && msg->cont)
+        db_contact_free(msg->cont);
+    free_list_put(&client_fetch_free_list, msg);
 }
\ No newline at end of file
@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <string.h>
+#include <event2/buffer.h>
+#include <prot_codec.h>
+#include <sys_memory.h>
+
+// Maximum number of buffer chunks integer field can span
+#define PROT_CODEC_IOVECS 4
+
+// Get length of integer field of given type
+static size_t prot_codec_int_len(enum prot_field_types type) {
+    switch (type) {
+        case PROT_FIELD_U8:
+            return sizeof(uint8_t);
+        case PROT_FIELD_U16:
+            return sizeof(uint16_t);
+        case PROT_FIELD_U32:
+            return sizeof(uint32_t);
+        default:
+            return 0;
+    }
+}
+
+// Decode big endian integer of given length at given offset, bytes are
+// read from buffer chunks directly, without copying them out first
+static uint32_t prot_codec_decode(struct evbuffer *input, size_t offset, size_t len) {
+    int i, n_vec;
+    size_t j, n = 0;
+    uint32_t value = 0;
+    struct evbuffer_ptr pos;
+    struct evbuffer_iovec vec[PROT_CODEC_IOVECS];
+
+    evbuffer_ptr_set(input, &pos, offset, EVBUFFER_PTR_SET);
+    n_vec = evbuffer_peek(input, len, &pos, vec, PROT_CODEC_IOVECS);
+
+    for (i = 0; i < n_vec && n < len; i++) {
+        for (j = 0; j < vec[i].iov_len && n < len; j++, n++)
+            value = (value << 8) | ((uint8_t *)vec[i].iov_base)[j];
+    }
+    return value;
+}
+
+// Reset parse state, used before parsing next message
+void prot_codec_reset(struct prot_codec *codec) {
+    codec->n_parsed = 0;
+    codec->offset[0] = 0;
+    codec->frame_len = 0;
+}
+
+// Parse fields of the message at the start of the input buffer, fields which
+// were parsed by the previous call are skipped, integer fields are decoded
+// straight from the buffer memory, frame length is known as soon as the last
+// integer field arrives, even if result is PROT_CODEC_MORE
+enum prot_codec_results prot_codec_parse(struct prot_codec *codec,
+    const struct prot_layout *layout, struct evbuffer *input
+) {
+    size_t len, offset;
+    size_t available = evbuffer_get_length(input);
+    const struct prot_field *field;
+
+    while (codec->n_parsed < layout->n_fields) {
+        field = &(layout->fields[codec->n_parsed]);
+        offset = codec->offset[codec->n_parsed];
+
+        switch (field->type) {
+            case PROT_FIELD_BYTES:
+                len = field->len;
+                break;
+            case PROT_FIELD_VAR:
+                len = field->len * codec->value[field->arg];
+                break;
+            default:
+                len = prot_codec_int_len(field->type);
+                if (available < offset + len)
+                    return PROT_CODEC_MORE;
+
+                codec->value[codec->n_parsed] = prot_codec_decode(input, offset, len);
+                if (field->arg && codec->value[codec->n_parsed] > field->arg)
+                    return PROT_CODEC_INVALID;
+                break;
+        }
+
+        codec->offset[++codec->n_parsed] = offset + len;
+    }
+
+    codec->frame_len = codec->offset[layout->n_fields];
+    return available < codec->frame_len ? PROT_CODEC_MORE : PROT_CODEC_DONE;
+}
+
+// Get value of parsed integer field
+uint32_t prot_codec_value(struct prot_codec *codec, int field) {
+    return codec->value[field];
+}
+
+// Get offset of parsed field from the message start
+size_t prot_codec_offset(struct prot_codec *codec, int field) {
+    return codec->offset[field];
+}
+
+// Get length of parsed field
+size_t prot_codec_len(struct prot_codec *codec, int field) {
+    return codec->offset[field + 1] - codec->offset[field];
+}
+
+// Copy parsed field from the input buffer into dst
+void prot_codec_copy(struct prot_codec *codec, struct evbuffer *input, int field, void *dst) {
+    struct evbuffer_ptr pos;
+
+    evbuffer_ptr_set(input, &pos, codec->offset[field], EVBUFFER_PTR_SET);
+    evbuffer_copyout_from(input, &pos, dst, prot_codec_len(codec, field));
+}
+
+// Get pointer to parsed field in the input buffer, buffer is made
+// contiguous only up to the end of the field
+uint8_t * prot_codec_pullup(struct prot_codec *codec, struct evbuffer *input, int field) {
+    return evbuffer_pullup(input, codec->offset[field + 1]) + codec->offset[field];
+}
+
+// Set view to parsed fields from first to last (inclusive), view must be freed
+void prot_codec_view(struct prot_codec *codec, struct evbuffer *input,
+    int first, int last, struct prot_view *view
+) {
+    prot_view_set(view, input, codec->offset[first], codec->offset[last + 1] - codec->offset[first]);
+}
+
+// Get pointer to parsed field without copying it, if field is split between
+// buffer chunks it's copied into scratch, which must be big enough to hold it,
+// pointer is valid only until the buffer is modified
+uint8_t * prot_codec_field(struct prot_codec *codec, struct evbuffer *input,
+    int field, uint8_t *scratch
+) {
+    uint8_t *data = scratch;
+    struct prot_view view;
+
+    prot_codec_view(codec, input, field, field, &view);
+    if (view.n_vec == 1)
+        data = view.vec[0].iov_base;
+    else
+        prot_view_copy(&view, scratch);
+
+    prot_view_free(&view);
+    return data;
+}
+
+// Set view to len bytes of the buffer starting at given offset, view must be freed
+void prot_view_set(struct prot_view *view, struct evbuffer *input, size_t offset, size_t len) {
+    int i;
+    size_t left = len;
+    struct evbuffer_ptr pos;
+
+    view->len = len;
+    view->n_vec = 0;
+    view->vec = view->inline_vec;
+    if (len == 0)
+        return;
+
+    evbuffer_ptr_set(input, &pos, offset, EVBUFFER_PTR_SET);
+    view->n_vec = evbuffer_peek(input, len, &pos, NULL, 0);
+
+    if (view->n_vec > PROT_VIEW_INLINE_VECS) {
+        view->vec = safe_malloc(sizeof(struct evbuffer_iovec) * view->n_vec,
+            "Failed to allocate buffer view");
+    }
+    evbuffer_peek(input, len, &pos, view->vec, view->n_vec);
+
+    // Last chunk may extend past the range
+    for (i = 0; i < view->n_vec; i++) {
+        if (view->vec[i].iov_len > left)
+            view->vec[i].iov_len = left;
+        left -= view->vec[i].iov_len;
+    }
+}
+
+// Copy data from the view into dst, which must be big enough to hold it
+void prot_view_copy(struct prot_view *view, void *dst) {
+    int i;
+    uint8_t *out = dst;
+
+    for (i = 0; i < view->n_vec; i++) {
+        memcpy(out, view->vec[i].iov_base, view->vec[i].iov_len);
+        out += view->vec[i].iov_len;
+    }
+}
+
+// Add data from the view to the end of given buffer, used to give crypto job its own copy
+void prot_view_add(struct prot_view *view, struct evbuffer *dst) {
+    int i;
+    struct evbuffer_iovec out;
+
+    // Reserve space once, so data is copied into a single chunk
+    if (evbuffer_reserve_space(dst, view->len, &out, 1) < 1) {
+        for (i = 0; i < view->n_vec; i++)
+            evbuffer_add(dst, view->vec[i].iov_base, view->vec[i].iov_len);
+        return;
+    }
+
+    prot_view_copy(view, out.iov_base);
+    out.iov_len = view->len;
+    evbuffer_commit_space(dst, &out, 1);
+}
+
+// Free chunk list of the view, if it was allocated
+void prot_view_free(struct prot_view *view) {
+    if (view->vec != view->inline_vec)
+        free(view->vec);
+
+    view->vec = view->inline_vec;
+    view->n_vec = 0;
+}
@@ -3,6 +3,7 @@
 #include <db_options.h>
 #include <db_contact.h>
 #include <sys_memory.h>
+#include <free_list.h>
 #include <prot_main.h>
 #include <sqlite3.h>
 #include <prot_ack.h>
@@ -16,6 +17,25 @@
 #include <openssl/encoder.h>
 #include <helpers_crypto.h>
 
+// Layout of friend request message
+#define FRIEND_REQ_FIELDS(X) \
+    X(FRIEND_REQ_HEADER,   BYTES, PROT_HEADER_LEN,        0) \
+    X(FRIEND_REQ_TXN,      BYTES, TRANSACTION_ID_LEN,     0) \
+    X(FRIEND_REQ_ONION,    BYTES, ONION_ADDRESS_LEN,      0) \
+    X(FRIEND_REQ_SIG_KEY,  BYTES, CLIENT_SIG_KEY_PUB_LEN, 0) \
+    X(FRIEND_REQ_ENC_KEY,  BYTES, CLIENT_ENC_KEY_PUB_LEN, 0) \
+    X(FRIEND_REQ_MB_ONION, BYTES, ONION_ADDRESS_LEN,      0) \
+    X(FRIEND_REQ_MB_ID,    BYTES, MAILBOX_ID_LEN,         0) \
+    X(FRIEND_REQ_NICK_LEN, U8,    0,                      CLIENT_NICK_MAX_LEN) \
+    X(FRIEND_REQ_NICK,     VAR,   1,                      FRIEND_REQ_NICK_LEN) \
+    X(FRIEND_REQ_SIG,      BYTES, ED25519_SIGNATURE_LEN,  0)
+
+enum friend_req_fields { FRIEND_REQ_FIELDS(PROT_FIELD_NAME) };
+static const struct prot_layout friend_req_layout = PROT_LAYOUT(FRIEND_REQ_FIELDS);
+
+// Unused handler objects, reused by next allocation
+static struct free_list friend_req_free_list = FREE_LIST_INIT(struct prot_friend_req, FREE_LIST_MAX_FREE);
+
 // Called when ACK message is received (or cleaned up)
 static void ack_received_cb(int ack_success, struct prot_main *pmain, void *arg) {
     struct prot_friend_req *msg = arg;
@@ -123,69 +143,38 @@ static void ack_sent_cb(int ack_success, struct prot_main *pmain, void *arg) {
 static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand) {
     struct evbuffer *input;
     struct prot_friend_req *msg = phand->msg;
+    struct prot_codec *codec = &(msg->codec);
     struct prot_ack_ed25519 *ack;
 
     uint8_t onion_priv_key[ONION_PRIV_KEY_LEN];
 
-    uint8_t *onion_addr_ptr;
     uint8_t received_onion_key[ONION_PUB_KEY_LEN];
     char received_onion_address[ONION_ADDRESS_LEN];
 
-    uint8_t nick_len;
-    uint8_t *message_static;
-
-    // Length of all fields before nickname field
-    int message_len = PROT_HEADER_LEN + TRANSACTION_ID_LEN + ONION_ADDRESS_LEN + 
-        CLIENT_SIG_KEY_PUB_LEN + CLIENT_ENC_KEY_PUB_LEN + ONION_ADDRESS_LEN + MAILBOX_ID_LEN + 1;
-
     input = bufferevent_get_input(pmain->bev);
 
-    if (evbuffer_get_length(input) < message_len)
+    if (!prot_main_recv_parse_signed(pmain, codec, &friend_req_layout))
         return;
 
-    debug("LEN 1 OK");
-
-    message_static = evbuffer_pullup(input, message_len);
-    nick_len = message_static[message_len - 1]; // Last byte of static fields
-    debug("nick len: %d", nick_len);
-
-    // If nick is too large
-    if (nick_len > CLIENT_NICK_MAX_LEN) {
-        prot_main_set_error(pmain, PROT_ERR_INVALID_MSG); 
-        return;
-    }
+    debug("LEN OK");
 
-    debug("NICK LEN OK");
+    prot_codec_copy(codec, input, FRIEND_REQ_ONION, received_onion_address);
 
-    // Add nickname and signature length
-    message_len += nick_len + ED25519_SIGNATURE_LEN;
-
-    // Wait for all data
-    if (evbuffer_get_length(input) < message_len)
-        return;
-
-    debug("LEN 2 OK");
-
-    onion_addr_ptr = message_static + PROT_HEADER_LEN + TRANSACTION_ID_LEN;
-
-    if (!onion_address_valid(onion_addr_ptr)) {
+    if (!onion_address_valid(received_onion_address)) {
         prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
         return;
     }
 
     debug("ONION OK");
 
-    onion_extract_key(onion_addr_ptr, received_onion_key);
-    if (!ed25519_buffer_validate(input, message_len, received_onion_key)) {
+    onion_extract_key(received_onion_address, received_onion_key);
+    if (!prot_main_recv_verify(pmain, codec, received_onion_key)) {
         prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
         return;
     }
 
     debug("BUFFER SIG OK");
 
-    evbuffer_drain(input, PROT_HEADER_LEN + TRANSACTION_ID_LEN);
-    evbuffer_remove(input, received_onion_address, ONION_ADDRESS_LEN);
-
     // Check for this onion on the database
     msg->friend = db_contact_get_by_onion(msg->db, received_onion_address, NULL);
     if (!msg->friend) {
@@ -197,19 +186,18 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
         msg->friend->status = DB_CONTACT_ACTIVE;
     }
 
-    evbuffer_remove(input, msg->friend->remote_sig_key_pub, CLIENT_SIG_KEY_PUB_LEN);
-    evbuffer_remove(input, msg->friend->remote_enc_key_pub, CLIENT_ENC_KEY_PUB_LEN);
+    prot_codec_copy(codec, input, FRIEND_REQ_SIG_KEY, msg->friend->remote_sig_key_pub);
+    prot_codec_copy(codec, input, FRIEND_REQ_ENC_KEY, msg->friend->remote_enc_key_pub);
 
-    evbuffer_remove(input, msg->friend->mailbox_onion, ONION_ADDRESS_LEN);
-    evbuffer_remove(input, msg->friend->mailbox_id, MAILBOX_ID_LEN);
+    prot_codec_copy(codec, input, FRIEND_REQ_MB_ONION, msg->friend->mailbox_onion);
+    prot_codec_copy(codec, input, FRIEND_REQ_MB_ID, msg->friend->mailbox_id);
     msg->friend->has_mailbox = !!(msg->friend->mailbox_id[0]);
 
     // Get nickname
-    evbuffer_drain(input, 1); // Drain nickname length (we already have it)
-    msg->friend->nickname_len = nick_len;
-    evbuffer_remove(input, msg->friend->nickname, nick_len);
-    // Drain signature
-    evbuffer_drain(input, ED25519_SIGNATURE_LEN);
+    msg->friend->nickname_len = prot_codec_value(codec, FRIEND_REQ_NICK_LEN);
+    prot_codec_copy(codec, input, FRIEND_REQ_NICK, msg->friend->nickname);
+
+    evbuffer_drain(input, codec->frame_len);
 
     // Get local user's onion priv key from database
     db_options_get_bin(msg->db, "onion_private_key", onion_priv_key, ONION_PRIV_KEY_LEN);
@@ -227,8 +215,7 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
 struct prot_friend_req * prot_friend_req_new(sqlite3 *db, const char *onion_address) {
     struct prot_friend_req *msg;
 
-    msg = safe_malloc(sizeof(struct prot_friend_req), 
-        "Failed to allocate new friend request message");
+    msg = free_list_get(&friend_req_free_list);
     memset(msg, 0, sizeof(struct prot_friend_req));
 
     msg->db = db;
@@ -253,10 +240,11 @@ struct prot_friend_req * prot_friend_req_new(sqlite3 *db, const char *onion_addr
 
     msg->htran.msg = msg;
     msg->htran.msg_code = PROT_FRIEND_REQUEST;
+    msg->htran.priority = PROT_PRIO_INTERACTIVE;
     msg->htran.done_cb = tran_done;
     msg->htran.setup_cb = tran_setup;
     msg->htran.cleanup_cb = tran_cleanup;
-    msg->htran.buffer = evbuffer_new();
+    msg->htran.buffer = NULL;
 
     return msg;
 }
@@ -265,8 +253,6 @@ struct prot_friend_req * prot_friend_req_new(sqlite3 *db, const char *onion_addr
 void prot_friend_req_free(struct prot_friend_req *msg) {
     if (msg && msg->friend)
         db_contact_free(msg->friend);
-    if (msg && msg->htran.buffer)
-        evbuffer_free(msg->htran.buffer);
 
-    free(msg);
+    free_list_put(&friend_req_free_list, msg);
 }
\ No newline at end of file
@@ -1,7 +1,7 @@
 #include <sqlite3.h>
 #include <prot_main.h>
 #include <sys_memory.h>
-#include <socks5.h>
+#include <db_route.h>
 #include <queue.h>
 #include <string.h>
 #include <constants.h>
@@ -11,36 +11,94 @@
 #include <hooks.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <netdb.h>
 
 #include <debug.h>
-#include <prot_friend_req.h>
-#include <prot_transaction.h>
-#include <prot_message.h>
-#include <prot_client_fetch.h>
-#include <prot_mb_account.h>
-#include <prot_mb_set_contacts.h>
-#include <prot_mb_fetch.h>
+#include <prot_registry.h>
+#include <prot_stream.h>
+#include <free_list.h>
+#include <buffer_crypto.h>
+#include <helpers.h>
 
 // Internal bufferevent callbacks
 static void prot_main_bev_read_cb(struct bufferevent *bev, void *ctx);
 static void prot_main_bev_write_cb(struct bufferevent *bev, void *ctx);
 static void prot_main_bev_event_cb(struct bufferevent *bev, short events, void *ctx);
 
-// Socks5 done callback, called to setup
-static void prot_main_socks5_cb(struct bufferevent *bev, enum socks5_errors err, void *attr);
+// Transport done callback, called to setup
+static void prot_main_transport_cb(struct bufferevent *bev, int err, void *attr);
+// Give bufferevent the priority of protocol events
+static void prot_main_bev_priority(struct prot_main *pmain);
+
+// Set transmitters up and put their data into the output buffer
+static void prot_main_tran_fill(struct prot_main *pmain);
+// Pause or resume reading depending on how far transmitters are behind
+static void prot_main_read_throttle(struct prot_main *pmain);
+
+// Unused protocol handlers, reused by next allocation
+static struct free_list pmain_free_list = FREE_LIST_INIT(struct prot_main, FREE_LIST_MAX_FREE);
+
+// Number of bytes held by all connections (updated atomically,
+// connections can live in different threads) and maximum allowed
+static size_t prot_mem_global_used = 0;
+static size_t prot_mem_global_budget = PROT_MEM_GLOBAL_BUDGET;
+// Event priority of protocol bufferevents, -1 keeps the default
+static int prot_ev_priority = -1;
+// Run done and cleanup callbacks for all transmitters whose data has been sent
+static int prot_main_tran_complete(struct prot_main *pmain);
 
 // Call close callback and free protocol main
 static void prot_main_fail(struct prot_main *pmain, enum prot_status_codes status) {
+    pmain->status = status;
     hook_list_call(pmain->hooks, PROT_MAIN_EV_CLOSE, pmain);
     debug("Main protocol handler failed with error: %s", prot_main_error_string(status));
     prot_main_free(pmain);
 }
 
-// Returns 0 normally and 1 if protocol handler has been freed
+// Called once any of the deadlines expires
+static void prot_main_deadline_cb(void *arg) {
+    struct prot_main *pmain = arg;
+
+    debug("Connection deadline expired");
+    prot_main_fail(pmain, PROT_ERR_TIMEOUT);
+}
+
+// Start (or restart) given deadline, if it is enabled
+static void prot_main_deadline_set(struct prot_main *pmain, enum prot_deadlines deadline) {
+    if (pmain->timeouts[deadline] > 0)
+        timer_wheel_add(pmain->wheel, &(pmain->deadlines[deadline]), pmain->timeouts[deadline] * 1000);
+}
+
+// Stop given deadline
+static void prot_main_deadline_clear(struct prot_main *pmain, enum prot_deadlines deadline) {
+    timer_wheel_del(pmain->wheel, &(pmain->deadlines[deadline]));
+}
+
+// Returns number of transmitters waiting to be set up
+static int prot_main_tran_waiting(struct prot_main *pmain) {
+    int i, n = 0;
+
+    for (i = 0; i < PROT_PRIO_N; i++)
+        n += queue_get_length(pmain->tran_wait[i]);
+    return n;
+}
+
+// Returns 1 if protocol handler has transmitters or receivers which
+// are not done, and 0 otherwise
+int prot_main_busy(struct prot_main *pmain) {
+    return
+        !queue_is_empty(pmain->recv_q) || !queue_is_empty(pmain->tran_q) ||
+        prot_main_tran_waiting(pmain) > 0;
+}
+
+// Returns 0 normally and 1 if protocol handler has been freed, handler is
+// not done while its streams are open or it has more data to process
 static int prot_main_done_check(struct prot_main *pmain) {
-    debug("Queue state recv(%d) tran(%d)", queue_get_length(pmain->recv_q), queue_get_length(pmain->tran_q));
-    if (queue_is_empty(pmain->recv_q) && queue_is_empty(pmain->tran_q)) {
+    debug("Queue state recv(%d) tran(%d)", queue_get_length(pmain->recv_q),
+        queue_get_length(pmain->tran_q) + prot_main_tran_waiting(pmain));
+    if (
+        !prot_main_busy(pmain) && !pmain->streams &&
+        evbuffer_get_length(bufferevent_get_input(pmain->bev)) == 0
+    ) {
         hook_list_call(pmain->hooks, PROT_MAIN_EV_DONE, pmain);
         debug("Main protocol handler done processing all messages");
         
@@ -54,11 +112,32 @@ static int prot_main_done_check(struct prot_main *pmain) {
     return 0;
 }
 
-// Allocate new main protocol object
+// Allocate new main protocol object, unused objects are reused
+// together with their queues, hook list and transmit buffer
 struct prot_main *prot_main_new(struct event_base *base, sqlite3 *db) {
+    int i;
     struct prot_main *pmain;
-
-    pmain = safe_malloc(sizeof(struct prot_main), "Failed to allocate memory for prot_main struct");
+    struct queue *tran_q, *recv_q;
+    struct queue *tran_wait[PROT_PRIO_N];
+    struct hook_list *hooks;
+    struct evbuffer *tran_buffer;
+
+    if (pmain = free_list_take(&pmain_free_list)) {
+        hooks = pmain->hooks;
+        tran_q = pmain->tran_q;
+        recv_q = pmain->recv_q;
+        memcpy(tran_wait, pmain->tran_wait, sizeof(tran_wait));
+        tran_buffer = pmain->tran_buffer;
+    } else {
+        pmain = safe_malloc(sizeof(struct prot_main), "Failed to allocate memory for prot_main struct");
+        hooks = hook_list_new();
+        tran_q = queue_new(sizeof(struct prot_tran_handler));
+        recv_q = queue_new(sizeof(struct prot_recv_handler));
+        for (i = 0; i < PROT_PRIO_N; i++)
+            tran_wait[i] = queue_new(sizeof(struct prot_tran_handler));
+        // Allocated once first message is transmitted
+        tran_buffer = NULL;
+    }
     memset(pmain, 0, sizeof(struct prot_main));
 
     // Everything is fine
@@ -66,20 +145,52 @@ struct prot_main *prot_main_new(struct event_base *base, sqlite3 *db) {
     // Set event base and databse
     pmain->db = db;
     pmain->event_base = base;
-    pmain->hooks = hook_list_new();
+    pmain->hooks = hooks;
 
-    // Allocate queues
-    pmain->tran_q = queue_new(sizeof(struct prot_tran_handler));
-    pmain->recv_q = queue_new(sizeof(struct prot_recv_handler));
+    // Set queues
+    pmain->tran_q = tran_q;
+    pmain->recv_q = recv_q;
+    memcpy(pmain->tran_wait, tran_wait, sizeof(tran_wait));
 
     // Transmission is enabled by default
     pmain->tran_enabled = 1;
     // There are no active transmitters
     pmain->tran_in_progress = 0;
+    pmain->tran_high_water = PROT_TRAN_HIGH_WATER;
+    pmain->tran_buffer = tran_buffer;
+    pmain->mem_budget = PROT_MEM_BUDGET;
+    pmain->read_budget = PROT_READ_BUDGET;
+    // Side which connects opens odd streams
+    pmain->stream_next_id = 2;
+
+    // Setup deadlines, they are started as connection progresses
+    pmain->wheel = timer_wheel_get(base);
+    pmain->timeouts[PROT_DEADLINE_CONNECT] = PROT_TIMEOUT_CONNECT;
+    pmain->timeouts[PROT_DEADLINE_HANDSHAKE] = PROT_TIMEOUT_HANDSHAKE;
+    pmain->timeouts[PROT_DEADLINE_RESPONSE] = PROT_TIMEOUT_RESPONSE;
+    pmain->timeouts[PROT_DEADLINE_IDLE] = PROT_TIMEOUT_IDLE;
+    for (i = 0; i < PROT_DEADLINE_N; i++)
+        timer_wheel_entry_init(&(pmain->deadlines[i]), prot_main_deadline_cb, pmain);
+
+    // Offload crypto if event loop has a pool
+    pmain->crypto = crypto_pool_get(base);
+
+    return pmain;
 }
 
 // Call cleanup for all in the queue and free main protocol object
 void prot_main_free(struct prot_main *pmain) {
+    int i, reset;
+
+    for (i = 0; i < PROT_DEADLINE_N; i++)
+        prot_main_deadline_clear(pmain, i);
+
+    // Streams can't outlive the connection
+    if (pmain->streams)
+        prot_stream_free_all(pmain);
+    // Stream handler which didn't finish its exchange resets the stream
+    reset = pmain->status != PROT_STATUS_OK || prot_main_busy(pmain);
+
     // Run cleanup function for all handlers in Receive queue
     while (!queue_is_empty(pmain->recv_q)) {
         struct prot_recv_handler *phand = queue_peek(pmain->recv_q, 0);
@@ -89,7 +200,6 @@ void prot_main_free(struct prot_main *pmain) {
             phand->cleanup_cb(pmain, phand);
         queue_dequeue(pmain->recv_q, NULL);
     }
-    queue_free(pmain->recv_q);
 
     // Run cleanup function for all handlers in Transmit queue
     while (!queue_is_empty(pmain->tran_q)) {
@@ -100,10 +210,49 @@ void prot_main_free(struct prot_main *pmain) {
             phand->cleanup_cb(pmain, phand);
         queue_dequeue(pmain->tran_q, NULL);
     }
-    queue_free(pmain->tran_q);
-    
-    if (pmain->bev)
+
+    // And for the ones which were never set up
+    for (i = 0; i < PROT_PRIO_N; i++) {
+        while (!queue_is_empty(pmain->tran_wait[i])) {
+            struct prot_tran_handler *phand = queue_peek(pmain->tran_wait[i], 0);
+
+            phand->success = 0;
+            if (phand->cleanup_cb)
+                phand->cleanup_cb(pmain, phand);
+            queue_dequeue(pmain->tran_wait[i], NULL);
+        }
+    }
+
+    if (pmain->tran_drain_cb)
+        evbuffer_remove_cb_entry(bufferevent_get_output(pmain->bev), pmain->tran_drain_cb);
+    if (pmain->mem_out_cb)
+        evbuffer_remove_cb_entry(bufferevent_get_output(pmain->bev), pmain->mem_out_cb);
+    if (pmain->mem_in_cb)
+        evbuffer_remove_cb_entry(bufferevent_get_input(pmain->bev), pmain->mem_in_cb);
+    if (pmain->read_ev)
+        event_free(pmain->read_ev);
+    __atomic_sub_fetch(&prot_mem_global_used, pmain->mem_used, __ATOMIC_RELAXED);
+    // Stream bufferevent is owned by the stream
+    if (pmain->stream)
+        prot_stream_detach(pmain->stream, reset);
+    else if (pmain->bev)
         bufferevent_free(pmain->bev);
+
+    prot_main_recv_hash_reset(pmain);
+
+    // Keep the object for reuse if possible
+    hook_list_clear(pmain->hooks);
+    if (pmain->tran_buffer)
+        evbuffer_drain(pmain->tran_buffer, evbuffer_get_length(pmain->tran_buffer));
+    if (free_list_keep(&pmain_free_list, pmain))
+        return;
+
+    queue_free(pmain->recv_q);
+    queue_free(pmain->tran_q);
+    for (i = 0; i < PROT_PRIO_N; i++)
+        queue_free(pmain->tran_wait[i]);
+    if (pmain->tran_buffer)
+        evbuffer_free(pmain->tran_buffer);
     hook_list_free(pmain->hooks);
     free(pmain);
 }
@@ -118,11 +267,12 @@ void prot_main_defer_free(struct prot_main *pmain) {
 // When set to 1 main protocol handler will free itself once it's
 // done processing all messages
 void prot_main_free_on_done(struct prot_main *pmain, int yes) {
-    pmain->free_on_done = 1;
+    pmain->free_on_done = yes;
 }
 
-// Connect to given TOR client socks server and try to contact
-// deep messenger instance on given onion address
+// Connect to deep messenger instance on given onion address, if there is a route
+// for the address in the database its transport is used, otherwise connection
+// is made through given TOR client socks server
 void prot_main_connect(
     struct prot_main *pmain,
     const char *onion_address,
@@ -130,61 +280,87 @@ void prot_main_connect(
     const char *socks_server_addr,
     const char *socks_server_port
 ) {
-    int rc;
-    uint16_t onion_port_parsed;
-    struct addrinfo hints, *servinfo, *aip;
+    struct db_route droute;
+    struct prot_route route = {PROT_TRANSPORT_TOR, socks_server_addr, socks_server_port};
+
+    if (
+        pmain->db && db_route_get_by_onion(pmain->db, onion_address, &droute) &&
+        droute.transport >= 0 && droute.transport < PROT_TRANSPORT_N
+    ) {
+        route.type = droute.transport;
+        // Tor route without address uses the default socks server
+        if (droute.transport != PROT_TRANSPORT_TOR || droute.address[0]) {
+            route.address = droute.address;
+            route.port = droute.port;
+        }
+    }
 
+    prot_main_connect_route(pmain, &route, onion_address, onion_port);
+}
+
+// Connect to deep messenger instance on given onion address over given route
+void prot_main_connect_route(
+    struct prot_main *pmain,
+    const struct prot_route *route,
+    const char *onion_address,
+    const char *onion_port
+) {
+    const struct prot_transport *transport;
+
+    pmain->stream_next_id = 1;
     pmain->bev = bufferevent_socket_new(pmain->event_base, -1, BEV_OPT_CLOSE_ON_FREE);
     if (!pmain->bev) {
         prot_main_fail(pmain, PROT_ERR_SOCKS_CONN_FAIL);
         return;
     }
+    prot_main_bev_priority(pmain);
     bufferevent_enable(pmain->bev, EV_READ | EV_WRITE);
 
     debug("Got socket");
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+    // Tor circuit may stall so limit how long connecting can take
+    transport = prot_transport_get(route->type);
+    prot_main_deadline_set(pmain, PROT_DEADLINE_CONNECT);
 
-    if ((rc = getaddrinfo(socks_server_addr, socks_server_port, &hints, &servinfo)) != 0) {
-        debug("getaddrinfo: %s", gai_strerror(rc));
+    if (transport->connect(pmain->bev, route, onion_address, onion_port, prot_main_transport_cb, pmain)) {
+        debug("Failed to connect using %s transport", transport->name);
         prot_main_fail(pmain, PROT_ERR_SOCKS_CONN_FAIL);
-        return;
     }
+}
 
-    debug("Got addrinfo addresses");
-
-    for (aip = servinfo; aip != NULL; aip = aip->ai_next) {
-        if (bufferevent_socket_connect(pmain->bev, aip->ai_addr, aip->ai_addrlen) == 0)
-            break;
-    }
-    freeaddrinfo(servinfo);
+// Called each time data is added to or removed from the output buffer
+static void prot_main_drain_cb(struct evbuffer *buff, const struct evbuffer_cb_info *info, void *arg) {
+    struct prot_main *pmain = arg;
 
-    debug("Got socket connected");
+    pmain->tran_drained += info->n_deleted;
+}
 
-    if (aip == NULL || sscanf(onion_port, "%d", &onion_port_parsed) != 1) {
-        prot_main_fail(pmain, PROT_ERR_SOCKS_CONN_FAIL);
-        return;
-    }
+// Called each time data is added to or removed from input or output
+// buffer, used to track memory held by the connection
+static void prot_main_mem_cb(struct evbuffer *buff, const struct evbuffer_cb_info *info, void *arg) {
+    prot_main_mem_charge(arg, info->n_added, info->n_deleted);
+}
 
-    debug("Connecting to onion");
+// Set output watermark, so write callback is called once there is room
+// for more data in the output buffer, and input watermark so connection
+// stops reading once input buffer is full
+static void prot_main_set_watermark(struct prot_main *pmain) {
+    bufferevent_setwatermark(pmain->bev, EV_WRITE, pmain->tran_high_water / 2, 0);
+    bufferevent_setwatermark(pmain->bev, EV_READ, 0, pmain->mem_budget);
+}
 
-    // Connect to onion service
-    socks5_connect_onion(pmain->bev, onion_address,
-        onion_port_parsed, prot_main_socks5_cb, pmain);
+// Give bufferevent the priority of protocol events, if base supports it
+static void prot_main_bev_priority(struct prot_main *pmain) {
+    if (prot_ev_priority >= 0 && prot_ev_priority < event_base_get_npriorities(pmain->event_base))
+        bufferevent_priority_set(pmain->bev, prot_ev_priority);
 }
 
-// Socks5 done callback, called to setup
-static void prot_main_socks5_cb(struct bufferevent *bev, enum socks5_errors err, void *attr) {
+// Attach protocol handler callbacks to the bufferevent
+static void prot_main_bev_setup(struct prot_main *pmain) {
     struct evbuffer *out_buff;
-    struct prot_main *pmain = attr;
-
-    if (err > 0) {
-        prot_main_fail(pmain, PROT_ERR_SOCKS_CONN_FAIL);
-        return;
-    }
+    struct evbuffer *in_buff;
 
+    prot_main_bev_priority(pmain);
     bufferevent_setcb(
         pmain->bev,
         prot_main_bev_read_cb,
@@ -192,9 +368,42 @@ static void prot_main_socks5_cb(struct bufferevent *bev, enum socks5_errors err,
         prot_main_bev_event_cb,
         pmain);
 
+    // Anything already in the output buffer does not belong to any transmitter
+    out_buff = bufferevent_get_output(pmain->bev);
+    in_buff = bufferevent_get_input(pmain->bev);
+    pmain->tran_drained = 0;
+    pmain->tran_written = evbuffer_get_length(out_buff);
+    pmain->tran_drain_cb = evbuffer_add_cb(out_buff, prot_main_drain_cb, pmain);
+
+    // Start tracking memory held by the connection
+    pmain->mem_used = evbuffer_get_length(in_buff) + evbuffer_get_length(out_buff);
+    __atomic_add_fetch(&prot_mem_global_used, pmain->mem_used, __ATOMIC_RELAXED);
+    pmain->mem_in_cb = evbuffer_add_cb(in_buff, prot_main_mem_cb, pmain);
+    pmain->mem_out_cb = evbuffer_add_cb(out_buff, prot_main_mem_cb, pmain);
+    prot_main_set_watermark(pmain);
+
+    // Connection is ready, transaction must start soon and traffic must flow
+    if (!pmain->transaction_started)
+        prot_main_deadline_set(pmain, PROT_DEADLINE_HANDSHAKE);
+    prot_main_deadline_set(pmain, PROT_DEADLINE_IDLE);
+
     pmain->bev_ready = 1;
-    // If transmitter queue is not empty
-    if (!queue_is_empty(pmain->tran_q)) {
+}
+
+// Transport done callback, called to setup
+static void prot_main_transport_cb(struct bufferevent *bev, int err, void *attr) {
+    struct prot_main *pmain = attr;
+
+    prot_main_deadline_clear(pmain, PROT_DEADLINE_CONNECT);
+
+    if (err) {
+        prot_main_fail(pmain, PROT_ERR_SOCKS_CONN_FAIL);
+        return;
+    }
+
+    prot_main_bev_setup(pmain);
+    // If there are transmitters waiting
+    if (prot_main_tran_waiting(pmain) > 0) {
         prot_main_bev_write_cb(pmain->bev, pmain);
     }
 }
@@ -205,67 +414,104 @@ void prot_main_recv_done(struct prot_main *pmain) {
     pmain->current_recv_done = 1;
 }
 
-// Push new message into transmission queue, returns zero on success
+// Push new message into transmission queue of its priority class, returns zero on success
 void prot_main_push_tran(struct prot_main *pmain, struct prot_tran_handler *phand) {
     // Insert handler into queue
-    debug("pushing into T queue %p", phand);
-    queue_enqueue(pmain->tran_q, phand);
+    debug("pushing into T queue %p (class %d)", phand, phand->priority);
+    queue_enqueue(pmain->tran_wait[phand->priority], phand);
+    pmain->tran_last_prio = phand->priority;
     debug("pushed into T queue");
 
-    // If bufferevent is ready and no transmission is in progress
-    if (pmain->bev_ready && !pmain->tran_in_progress) {
-        // Call write callback manually to try starting a new transmission
-        prot_main_bev_write_cb(pmain->bev, pmain);
-    }
+    // If bufferevent is ready try to start a new transmission, transmitters
+    // which are done are handled later from the write callback
+    if (pmain->bev_ready)
+        prot_main_tran_fill(pmain);
 
     debug("pushed T success");
 }
 
+// Get last pushed transmitter if it is not set up yet, used to add more
+// data to it, returns NULL if there is no such transmitter
+struct prot_tran_handler * prot_main_tran_last(struct prot_main *pmain) {
+    // Only the last pushed transmitter can be extended, otherwise other side
+    // would see data in different order than it was pushed, classes are drained
+    // in order, so if its queue is not empty it's still waiting at the end of it
+    return queue_peek_last(pmain->tran_wait[pmain->tran_last_prio]);
+}
+
+// Get last receiver in the queue, returns NULL if queue is empty
+struct prot_recv_handler * prot_main_recv_last(struct prot_main *pmain) {
+    return queue_peek_last(pmain->recv_q);
+}
+
 // Push new message receiver into receiver queue, this is done when you are
 // expecting message to arrive (response), returns zero on success
 void prot_main_push_recv(struct prot_main *pmain, struct prot_recv_handler *phand) {
     // Insert handler into queue
     queue_enqueue(pmain->recv_q, phand);
+    // Expected message must arrive in time
+    prot_main_deadline_set(pmain, PROT_DEADLINE_RESPONSE);
 }
 
 // Assign protocol connection handler to given bufferevent
 void prot_main_assign(struct prot_main *pmain, struct bufferevent *bev) {
     bufferevent_enable(bev, EV_READ | EV_WRITE);
 
-    bufferevent_setcb(
-        bev,
-        prot_main_bev_read_cb,
-        prot_main_bev_write_cb,
-        prot_main_bev_event_cb,
-        pmain
-    );
-
     pmain->bev = bev;
-    pmain->bev_ready = 1;
+    prot_main_bev_setup(pmain);
 }
 
-// Called when there is data to read from bufferevent
-static void prot_main_bev_read_cb(struct bufferevent *bev, void *ctx) {
-    int i;
+// Called from the event loop to continue processing messages which
+// didn't fit into the budget of the previous read callback
+static void prot_main_read_ev_cb(evutil_socket_t fd, short what, void *arg) {
+    struct prot_main *pmain = arg;
+
+    prot_main_bev_read_cb(pmain->bev, pmain);
+}
+
+// Schedule processing of the remaining messages, events of higher priority
+// and the ones which are already active run before it
+static void prot_main_read_defer(struct prot_main *pmain) {
+    if (!pmain->read_ev) {
+        pmain->read_ev = event_new(pmain->event_base, -1, 0, prot_main_read_ev_cb, pmain);
+        event_priority_set(pmain->read_ev, bufferevent_get_priority(pmain->bev));
+    }
+    debug("Read budget used up, deferring the rest");
+    event_active(pmain->read_ev, EV_READ, 0);
+}
+
+// Process messages from the input buffer, returns 1 if protocol
+// handler has been freed and 0 otherwise
+static int prot_main_read(struct prot_main *pmain) {
+    int i, n, rc;
+    int n_handled = 0;
     struct evbuffer *buff;
-    struct prot_main *pmain = ctx;
     struct prot_recv_handler *phand;
 
-    if (!pmain->bev_ready)
-        return;
+    // Response may arrive before write callback noticed that request has been
+    // sent, finish sent transmitters first so they can push their receivers
+    if (prot_main_tran_complete(pmain))
+        return 1;
 
-    debug("PMAIN READING");
+    // Current receiver is waiting for crypto job
+    if (pmain->recv_job)
+        return 0;
 
     buff = bufferevent_get_input(pmain->bev);
 
-    while (evbuffer_get_length(buff) > 0) {
-
-        debug("Found something to read");
+    while (evbuffer_get_length(buff) > 0 || pmain->recv_resumed) {
+        // Don't take new messages while transmitters are behind
+        prot_main_read_throttle(pmain);
+        if (pmain->read_paused)
+            return 0;
 
-        if (!queue_is_empty(pmain->recv_q))
-            phand = queue_peek(pmain->recv_q, 0);
+        // Budget is used up, let other events run and continue later
+        if (pmain->read_budget > 0 && n_handled >= pmain->read_budget) {
+            prot_main_read_defer(pmain);
+            return 0;
+        }
 
-        debug("Queue not empty");
+        debug("Found something to read");
 
         if (!pmain->message_check_done) {
             uint8_t *header;
@@ -273,46 +519,82 @@ static void prot_main_bev_read_cb(struct bufferevent *bev, void *ctx) {
 
             // Check if header arrived
             if (evbuffer_get_length(buff) < PROT_HEADER_LEN)
-                return;
+                return 0;
 
             header = evbuffer_pullup(buff, PROT_HEADER_LEN);
 
-            // Check version
-            if (header[0] != DEEP_MESSENGER_PROTOCOL_VER) {
+            // Check version, older peers send only messages their version knows
+            if (header[0] < DEEP_MESSENGER_PROTOCOL_VER_MIN || header[0] > DEEP_MESSENGER_PROTOCOL_VER) {
                 prot_main_fail(pmain, PROT_ERR_PROTOCOL);
-                return;
+                return 1;
             }
+            pmain->peer_seen = 1;
 
             message_code = header[1];
 
             debug("Got new message with code %02x", message_code);
 
+            // Once version is agreed on, peer sends only messages it knows
+            if (pmain->version && !prot_main_peer_knows(pmain, message_code)) {
+                prot_main_fail(pmain, PROT_ERR_PROTOCOL);
+                return 1;
+            }
+
+            // Stream chunks are not expected by receivers, they are passed
+            // to streams multiplexed over this connection
+            if (message_code == PROT_STREAM_DATA) {
+                rc = prot_stream_recv(pmain, buff);
+
+                if (pmain->status != PROT_STATUS_OK) {
+                    prot_main_fail(pmain, pmain->status);
+                    return 1;
+                }
+                if (!rc)
+                    return 0;
+                ++n_handled;
+                continue;
+            }
+
             // If queue is empty try to get handler for given message type
             if (queue_is_empty(pmain->recv_q)) {
-
-                if (pmain->mode == PROT_MODE_CLIENT)
-                    phand = prot_handler_autogen_client(message_code, pmain->db);
-                else
-                    phand = prot_handler_autogen_mailbox(message_code, pmain->db);
+                phand = prot_registry_autogen(pmain->mode, message_code, pmain->db);
 
                 if (phand == NULL) {
                     debug("Unknown message type");
                     prot_main_fail(pmain, PROT_ERR_INVALID_MSG);
-                    return;
+                    return 1;
                 }
 
                 // Add new handler to the queue
                 queue_enqueue(pmain->recv_q, phand);
                 pmain->current_recv_done = 0;
+                pmain->recv_current = 0;
 
-                // Otherwise check if current handler is expecting this message type
-                // if not fail
+                // Otherwise find the oldest handler expecting this message type,
+                // other side sends higher priority classes first, so messages of
+                // different types may arrive in different order than their
+                // receivers were pushed, if no one is expecting it, it may still
+                // be a request from the other side (both sides can send requests
+                // over the same connection), fail if it isn't
 
             } else {
-                if (phand->msg_code != message_code) {
-                    prot_main_fail(pmain, PROT_ERR_UNEXPECTED_MSG);
-                    return;
+                n = queue_get_length(pmain->recv_q);
+                for (i = 0; i < n; i++) {
+                    phand = queue_peek(pmain->recv_q, i);
+                    if (phand->msg_code == message_code)
+                        break;
                 }
+                if (i == n) {
+                    phand = prot_registry_autogen(pmain->mode, message_code, pmain->db);
+
+                    if (phand == NULL) {
+                        prot_main_fail(pmain, PROT_ERR_UNEXPECTED_MSG);
+                        return 1;
+                    }
+                    queue_enqueue(pmain->recv_q, phand);
+                    pmain->current_recv_done = 0;
+                }
+                pmain->recv_current = i;
             }
 
             if (phand->require_transaction) {
@@ -320,12 +602,12 @@ static void prot_main_bev_read_cb(struct bufferevent *bev, void *ctx) {
 
                 if (!pmain->transaction_started) {
                     prot_main_fail(pmain, PROT_ERR_TRANSACTION);
-                    return;
+                    return 1;
                 }
 
                 // Transaction ID not arrived yet
                 if (evbuffer_get_length(buff) < PROT_HEADER_LEN + TRANSACTION_ID_LEN)
-                    return;
+                    return 0;
 
                 header = evbuffer_pullup(buff, PROT_HEADER_LEN + TRANSACTION_ID_LEN);
                 transaction_id = header + PROT_HEADER_LEN;
@@ -335,24 +617,44 @@ static void prot_main_bev_read_cb(struct bufferevent *bev, void *ctx) {
                     if (transaction_id[i] != pmain->transaction_id[i]) {
                         // Fail if not
                         prot_main_fail(pmain, PROT_ERR_TRANSACTION);
-                        return;
+                        return 1;
                     }
                 }
             }
             pmain->message_check_done = 1;
+
+            if (pmain->recv_entry = prot_registry_get(pmain->mode, message_code))
+                prot_registry_count(pmain->recv_entry->n_received);
         }
 
         debug("Message check done");
+        phand = queue_peek(pmain->recv_q, pmain->recv_current);
+
+        // Don't bother the handler until static part of the message arrives
+        if (
+            !pmain->recv_resumed && pmain->recv_entry &&
+            evbuffer_get_length(buff) < pmain->recv_entry->min_len
+        ) {
+            return 0;
+        }
 
         // Run handler
+        pmain->recv_resumed = 0;
         pmain->current_recv_done = 0;
+        pmain->current_recv_more = 0;
         phand->handle_cb(pmain, phand);
 
         if (pmain->status != PROT_STATUS_OK) {
+            if (pmain->recv_entry)
+                prot_registry_count(pmain->recv_entry->n_failed);
             prot_main_fail(pmain, pmain->status);
-            return;
+            return 1;
         }
 
+        // Handler is suspended, it will be called again once its job is done
+        if (pmain->recv_job)
+            return 0;
+
         debug("Handle done");
 
         // If handler is done run the handler cleanup and
@@ -365,57 +667,186 @@ static void prot_main_bev_read_cb(struct bufferevent *bev, void *ctx) {
 
                 if (pmain->status != PROT_STATUS_OK) {
                     prot_main_fail(pmain, pmain->status);
-                    return;
+                    return 1;
                 }
             }
-            queue_dequeue(pmain->recv_q, NULL);
+            queue_remove(pmain->recv_q, pmain->recv_current);
 
             pmain->current_recv_done = 0;
             pmain->message_check_done = 0;
+            prot_main_recv_hash_reset(pmain);
+
+            if (pmain->transaction_started)
+                prot_main_deadline_clear(pmain, PROT_DEADLINE_HANDSHAKE);
+            // Restart deadline for the next expected message
+            if (queue_is_empty(pmain->recv_q))
+                prot_main_deadline_clear(pmain, PROT_DEADLINE_RESPONSE);
+            else
+                prot_main_deadline_set(pmain, PROT_DEADLINE_RESPONSE);
 
 
             if (prot_main_done_check(pmain))
-                return;
+                return 1;
+            ++n_handled;
+        } else if (pmain->current_recv_more) {
+            // Receiver stays in the queue and handles next message as well
+            ++n_handled;
+            pmain->current_recv_more = 0;
+            pmain->message_check_done = 0;
+            prot_main_recv_hash_reset(pmain);
+            prot_main_deadline_set(pmain, PROT_DEADLINE_RESPONSE);
         } else {
-            return;
+            // Message is not complete, so everything in the buffer belongs to it
+            if (
+                pmain->recv_entry && pmain->recv_entry->max_len &&
+                evbuffer_get_length(buff) > pmain->recv_entry->max_len
+            ) {
+                debug("Message exceeds maximum size");
+                prot_registry_count(pmain->recv_entry->n_failed);
+                prot_main_fail(pmain, PROT_ERR_INVALID_MSG);
+                return 1;
+            }
+            // Input buffer is full and reading is paused, message will never complete
+            if (evbuffer_get_length(buff) >= pmain->mem_budget) {
+                debug("Message exceeds connection memory budget");
+                if (pmain->recv_entry)
+                    prot_registry_count(pmain->recv_entry->n_failed);
+                prot_main_fail(pmain, PROT_ERR_MEM_LIMIT);
+                return 1;
+            }
+            return 0;
         }
     }
+
+    return 0;
 }
 
-static void prot_main_bev_write_cb(struct bufferevent *bev, void *ctx) {
-    struct evbuffer *buff;
+// Called when there is data to read from bufferevent, transmitters pushed while
+// messages are processed are set up once all of them are done, so responses to
+// messages which arrived together can be merged
+static void prot_main_bev_read_cb(struct bufferevent *bev, void *ctx) {
     struct prot_main *pmain = ctx;
-    struct prot_tran_handler *phand;
 
     if (!pmain->bev_ready)
         return;
 
-    buff = bufferevent_get_output(bev);
+    debug("PMAIN READING");
 
-    debug("PMAIN WRITING");
+    prot_main_deadline_set(pmain, PROT_DEADLINE_IDLE);
 
-    // If not all data from previous transmission is gone yet abort
-    if (evbuffer_get_length(buff) > 0)
+    pmain->tran_hold = 1;
+    if (prot_main_read(pmain))
         return;
-
-    // If queue is empty abort
-    if (queue_is_empty(pmain->tran_q))
+    // Receiver is waiting for crypto job, messages after it may still be merged
+    if (pmain->recv_job)
         return;
+    pmain->tran_hold = 0;
+
+    prot_main_tran_fill(pmain);
+}
+
+// Take next transmitter to set up out of waiting queues, queues are drained
+// in order of priority classes, but transmitter which was passed over too many
+// times is taken before the ones of higher classes, so it can't starve
+static void prot_main_tran_next(struct prot_main *pmain, struct prot_tran_handler *phand) {
+    int i, next = -1;
+
+    for (i = 0; i < PROT_PRIO_N; i++) {
+        if (queue_is_empty(pmain->tran_wait[i]))
+            continue;
+
+        if (next < 0 || (
+            pmain->tran_skipped[i] >= PROT_TRAN_AGING &&
+            pmain->tran_skipped[next] < PROT_TRAN_AGING
+        ))
+            next = i;
+    }
+
+    for (i = 0; i < PROT_PRIO_N; i++) {
+        if (i == next || queue_is_empty(pmain->tran_wait[i]))
+            pmain->tran_skipped[i] = 0;
+        else
+            ++pmain->tran_skipped[i];
+    }
+
+    queue_dequeue(pmain->tran_wait[next], phand);
+}
+
+// Set transmitters up and put their data into the output buffer, if pipelining
+// is disabled only one transmitter is set up once output buffer is empty
+static void prot_main_tran_fill(struct prot_main *pmain) {
+    struct evbuffer *buff;
+    struct prot_tran_handler tran, *phand;
+
+    buff = bufferevent_get_output(pmain->bev);
+
+    while (
+        pmain->tran_enabled && !pmain->tran_job && !pmain->tran_hold && (
+            pmain->tran_in_progress < queue_get_length(pmain->tran_q) ||
+            prot_main_tran_waiting(pmain) > 0
+        )
+    ) {
+        // Wait for enough data to be sent
+        if (pmain->tran_high_water == 0) {
+            if (pmain->tran_in_progress > 0 || evbuffer_get_length(buff) > 0)
+                return;
+        } else if (evbuffer_get_length(buff) >= pmain->tran_high_water) {
+            return;
+        }
+
+        // Take transmitter from the highest class unless the previous one
+        // was suspended, it is set up after the ones already in the output buffer
+        if (pmain->tran_in_progress == queue_get_length(pmain->tran_q)) {
+            prot_main_tran_next(pmain, &tran);
+            queue_enqueue(pmain->tran_q, &tran);
+        }
+
+        phand = queue_peek(pmain->tran_q, pmain->tran_in_progress);
+        if (!phand->buffer) {
+            if (!pmain->tran_buffer)
+                pmain->tran_buffer = evbuffer_new();
+            phand->buffer = pmain->tran_buffer;
+        }
+
+        debug("Writing data to output buffer %p", phand);
+        // Run transmission setup and add data to the buffer
+        if (phand->setup_cb) {
+            phand->setup_cb(pmain, phand);
 
-    phand = queue_peek(pmain->tran_q, 0);
+            if (pmain->status != PROT_STATUS_OK) {
+                prot_main_fail(pmain, pmain->status);
+                return;
+            }
+            // Setup is suspended, it will be called again once its job is done
+            if (pmain->tran_job)
+                return;
+        }
+        pmain->tran_written += evbuffer_get_length(phand->buffer);
+        phand->tran_end = pmain->tran_written;
+        evbuffer_add_buffer(buff, phand->buffer);
+        ++pmain->tran_in_progress;
+    }
+}
 
-    debug("Got handler to write %p", phand);
+// Run done and cleanup callbacks for all transmitters whose data has been
+// sent, returns 1 if protocol handler has been freed and 0 otherwise
+static int prot_main_tran_complete(struct prot_main *pmain) {
+    struct prot_tran_handler *phand;
 
-    // If there is transmission in progress it is done now
-    if (pmain->tran_in_progress) {
-        debug("Transmission is done");
+    while (pmain->tran_in_progress > 0) {
+        phand = queue_peek(pmain->tran_q, 0);
+
+        if (phand->tran_end > pmain->tran_drained)
+            return 0;
+
+        debug("Transmission is done %p", phand);
         // Notifiy handler that transmission is done and run the cleanup
         if (phand->done_cb) {
             phand->done_cb(pmain, phand);
 
             if (pmain->status != PROT_STATUS_OK) {
                 prot_main_fail(pmain, pmain->status);
-                return;
+                return 1;
             }
         }
 
@@ -425,37 +856,71 @@ static void prot_main_bev_write_cb(struct bufferevent *bev, void *ctx) {
 
             if (pmain->status != PROT_STATUS_OK) {
                 prot_main_fail(pmain, pmain->status);
-                return;
+                return 1;
             }
         }
 
         queue_dequeue(pmain->tran_q, NULL);
-        pmain->tran_in_progress = 0;
+        --pmain->tran_in_progress;
 
-        if (prot_main_done_check(pmain))
-            return;
-        if (queue_is_empty(pmain->tran_q))
-            return;
+        if (pmain->transaction_started)
+            prot_main_deadline_clear(pmain, PROT_DEADLINE_HANDSHAKE);
 
-        phand = queue_peek(pmain->tran_q, 0);
+        if (prot_main_done_check(pmain))
+            return 1;
     }
 
-    // Abort if transmission is disabled
-    if (!pmain->tran_enabled)
+    return 0;
+}
+
+static void prot_main_bev_write_cb(struct bufferevent *bev, void *ctx) {
+    struct prot_main *pmain = ctx;
+
+    if (!pmain->bev_ready)
         return;
 
-    debug("Writing data to output buffer");
-    // Run transmission setup and add data to the buffer
-    if (phand->setup_cb) {
-        phand->setup_cb(pmain, phand);
-        
-        if (pmain->status != PROT_STATUS_OK) {
-            prot_main_fail(pmain, pmain->status);
-            return;
-        }
+    debug("PMAIN WRITING");
+
+    prot_main_deadline_set(pmain, PROT_DEADLINE_IDLE);
+
+    if (prot_main_tran_complete(pmain))
+        return;
+
+    prot_main_tran_fill(pmain);
+    prot_main_read_throttle(pmain);
+}
+
+// Pause reading while transmitters are behind, either output buffer holds more
+// than half of the budget or, while we are not waiting for any response, too many
+// of them wait to be set up, reading is resumed from the write callback once they
+// catch up
+static void prot_main_read_throttle(struct prot_main *pmain) {
+    int behind;
+    struct evbuffer *buff;
+
+    buff = bufferevent_get_output(pmain->bev);
+    behind =
+        evbuffer_get_length(buff) > pmain->mem_budget / 2 || (
+            pmain->tran_enabled && queue_is_empty(pmain->recv_q) &&
+            prot_main_tran_waiting(pmain) > PROT_TRAN_MAX_PENDING
+        );
+
+    if (behind && !pmain->read_paused) {
+        debug("Transmitters are behind, pausing read");
+        bufferevent_disable(pmain->bev, EV_READ);
+        pmain->read_paused = 1;
+    } else if (!behind && pmain->read_paused) {
+        debug("Transmitters caught up, resuming read");
+        // Reading stays off while streams hold too much data
+        if (!pmain->stream_blocked)
+            bufferevent_enable(pmain->bev, EV_READ);
+        pmain->read_paused = 0;
+
+        // Process messages which arrived before reading was paused
+        if (evbuffer_get_length(bufferevent_get_input(pmain->bev)) > 0)
+            bufferevent_trigger(pmain->bev, EV_READ,
+                BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
     }
-    evbuffer_add_buffer(buff, phand->buffer);
-    pmain->tran_in_progress = 1;
 }
 
 static void prot_main_bev_event_cb(struct bufferevent *bev, short events, void *ctx) {
@@ -467,14 +932,19 @@ static void prot_main_bev_event_cb(struct bufferevent *bev, short events, void *
     }
 
     if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
-        prot_main_fail(pmain, PROT_ERR_CONN_CLOSED);
+        // Peer which doesn't speak the version we offered closes the connection
+        // without a word, it can be tried again using the oldest version
+        if (!pmain->peer_seen && pmain->version_offered > DEEP_MESSENGER_PROTOCOL_VER_MIN)
+            prot_main_fail(pmain, PROT_ERR_REFUSED);
+        else
+            prot_main_fail(pmain, PROT_ERR_CONN_CLOSED);
         return;
     }
 }
 
 // Convert given error code to human readable error
 const char *prot_main_error_string(enum prot_status_codes err_code) {
-    static char error_string[PROT_ERROR_MAX_LEN] = "Protocol: ";
+    static __thread char error_string[PROT_ERROR_MAX_LEN] = "Protocol: ";
     char *e = error_string + 10;
 
     switch (err_code)
@@ -504,114 +974,360 @@ const char *prot_main_error_string(enum prot_status_codes err_code) {
     case PROT_ERR_TRANSACTION:
         strcpy(e, "Transaction is invalid, or not started but message type requires it");
         break;
+    case PROT_ERR_MEM_LIMIT:
+        strcpy(e, "Connection exceeded its memory budget");
+        break;
+    case PROT_ERR_REFUSED:
+        strcpy(e, "Peer closed the connection without answering offered protocol version");
+        break;
 
     default:
         strcpy(e, "Unknown error code, this should never happen");
         break;
     }
+
+    return error_string;
 }
 
 // Used to enable/disable transmission on main protocol handler
 void prot_main_tran_enable(struct prot_main *pmain, int yes) {
     pmain->tran_enabled = yes;
 
-    if (yes)
-        prot_main_bev_write_cb(pmain->bev, pmain);
+    if (yes && pmain->bev_ready)
+        prot_main_tran_fill(pmain);
 }
 
-// Allocate new receive handler for given message type, returns prot_recv_handler (on client)
-struct prot_recv_handler *prot_handler_autogen_client(enum prot_message_codes code, sqlite3 *db) {
+// Set maximum number of messages processed by single read callback before
+// processing is continued in the next round of the event loop, 0 means no limit
+void prot_main_read_budget(struct prot_main *pmain, int budget) {
+    pmain->read_budget = budget;
+}
 
-    if (code == PROT_TRANSACTION_REQUEST) {
-        struct prot_txn_req *msg;
-        msg = prot_txn_req_new();
+// Set event priority of bufferevents used by all protocol handlers created
+// from now on, ignored on event bases which don't have that many priorities
+void prot_main_ev_priority(int priority) {
+    prot_ev_priority = priority;
+}
 
-        return &(msg->hrecv);
-    }
+// Set output buffer size up to which messages are transmitted back to back,
+// 0 means next message is set up only once previous one is completely sent
+void prot_main_tran_high_water(struct prot_main *pmain, size_t high_water) {
+    pmain->tran_high_water = high_water;
 
-    if (code == PROT_FRIEND_REQUEST) {
-        struct prot_friend_req *msg;
-        msg = prot_friend_req_new(db, NULL);
+    if (pmain->bev_ready)
+        prot_main_set_watermark(pmain);
+}
 
-        return &(msg->hrecv);
-    }
+// Set timeout (in seconds) for given deadline, 0 disables it, if deadline
+// is currently running it is restarted with the new timeout
+void prot_main_timeout(struct prot_main *pmain, enum prot_deadlines deadline, int seconds) {
+    pmain->timeouts[deadline] = seconds;
 
-    if (code == PROT_MESSAGE_CONTAINER) {
-        struct prot_message *msg;
-        msg = prot_message_to_client_new(db, NULL);
+    if (!pmain->deadlines[deadline].active)
+        return;
 
-        return &(msg->hrecv);
-    }
+    if (seconds > 0)
+        prot_main_deadline_set(pmain, deadline);
+    else
+        prot_main_deadline_clear(pmain, deadline);
+}
 
-    if (code == PROT_CLIENT_FETCH) {
-        struct prot_client_fetch *msg;
-        msg = prot_client_fetch_new(db, NULL);
+// Called once crypto job suspended handler is waiting for is done
+static void prot_main_crypto_cb(struct crypto_job *job, void *arg) {
+    struct prot_main *pmain = arg;
+
+    // Resume the handler, it's called again with the same data
+    if (job == pmain->recv_job) {
+        pmain->recv_job = NULL;
+        pmain->recv_resumed = 1;
+        if (pmain->bev_ready)
+            prot_main_bev_read_cb(pmain->bev, pmain);
+    } else if (job == pmain->tran_job) {
+        pmain->tran_job = NULL;
+        if (pmain->bev_ready)
+            prot_main_bev_write_cb(pmain->bev, pmain);
+    }
+}
 
-        return &(msg->hrecv);
+// Run given crypto job in the pool, or synchronously if there is no pool,
+// returns 1 if job was submitted and 0 if it's already done
+static int prot_main_crypto_run(struct prot_main *pmain, struct crypto_job *job) {
+    if (!pmain->crypto) {
+        crypto_job_run(job);
+        return 0;
     }
 
-    return NULL;
+    crypto_pool_submit(pmain->crypto, job, prot_main_crypto_cb, pmain);
+    return 1;
 }
 
-// Allocate new receive handler for given message type, returns prot_recv_handler (on mailbox)
-struct prot_recv_handler *prot_handler_autogen_mailbox(enum prot_message_codes code, sqlite3 *db) {
+// Called from within recv handler to run given crypto job, returns 0 if job is
+// already done (no crypto pool) and 1 if handler is suspended, handler must then
+// return leaving the message in the input buffer, and it will be called again
+// once the job is done, handler owns the job and must free it in its cleanup
+int prot_main_recv_await(struct prot_main *pmain, struct crypto_job *job) {
+    if (!prot_main_crypto_run(pmain, job))
+        return 0;
 
-    if (code == PROT_TRANSACTION_REQUEST) {
-        struct prot_txn_req *msg;
-        msg = prot_txn_req_new();
+    pmain->recv_job = job;
+    return 1;
+}
 
-        return &(msg->hrecv);
-    }
+// Called from within recv handler to start given crypto job without suspending
+// the handler, so it can start more of them, returns 0 if job is already done
+// (no crypto pool) and 1 if it's running, handler owns the job and must free it
+int prot_main_recv_submit(struct prot_main *pmain, struct crypto_job *job) {
+    return prot_main_crypto_run(pmain, job);
+}
 
-    if (code == PROT_MAILBOX_REGISTER) {
-        struct prot_mb_acc *msg;
-        msg = prot_mb_acc_register_new(db, NULL, NULL);
+// Called from within recv handler to wait for crypto job started by submit,
+// returns 0 if job is already done and 1 if handler is suspended, handler must
+// then return and it will be called again once the job is done, even if all
+// of its data was already removed from the input buffer
+int prot_main_recv_wait(struct prot_main *pmain, struct crypto_job *job) {
+    if (!job->in_flight)
+        return 0;
 
-        return &(msg->hrecv);
-    }
+    pmain->recv_job = job;
+    return 1;
+}
+
+// Called from within tran setup callback to run given crypto job, returns 0 if
+// job is already done and 1 if transmitter is suspended, setup callback must
+// then return and it will be called again with the same buffer once the job
+// is done, handler owns the job and must free it in its cleanup
+int prot_main_tran_await(struct prot_main *pmain, struct crypto_job *job) {
+    if (!prot_main_crypto_run(pmain, job))
+        return 0;
+
+    pmain->tran_job = job;
+    return 1;
+}
 
-    if (code == PROT_MAILBOX_DEL_ACCOUNT) {
-        struct prot_mb_acc *msg;
-        msg = prot_mb_acc_delete_new(db, NULL, NULL, NULL);
+// Set maximum number of bytes connection can hold in its buffers, once input
+// buffer is full reading is paused, and connection fails if current message
+// can't fit into it
+void prot_main_mem_budget(struct prot_main *pmain, size_t budget) {
+    pmain->mem_budget = budget;
 
-        return &(msg->hrecv);
+    if (pmain->bev_ready)
+        prot_main_set_watermark(pmain);
+}
+
+// Set maximum number of bytes all connections together can hold in their buffers
+void prot_main_mem_global_budget(size_t budget) {
+    prot_mem_global_budget = budget;
+}
+
+// Returns 1 if all connections together hold more memory than global budget
+// allows, used to refuse new connections, and 0 otherwise
+int prot_main_mem_pressure(void) {
+    return __atomic_load_n(&prot_mem_global_used, __ATOMIC_RELAXED) > prot_mem_global_budget;
+}
+
+// Charge memory held by the connection outside of its own buffers (data waiting
+// for streams multiplexed over it), it counts against connection and global budget
+void prot_main_mem_charge(struct prot_main *pmain, size_t added, size_t deleted) {
+    pmain->mem_used += added;
+    pmain->mem_used -= deleted;
+    __atomic_add_fetch(&prot_mem_global_used, added, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&prot_mem_global_used, deleted, __ATOMIC_RELAXED);
+}
+
+// Called from within recv handler once it knows the full length of the message,
+// if it exceeds maximum for the message type error is set and 1 is returned,
+// handler should return immediately in that case, otherwise returns 0
+int prot_main_frame_len_check(struct prot_main *pmain, size_t frame_len) {
+    if (
+        (pmain->recv_entry && pmain->recv_entry->max_len &&
+            frame_len > pmain->recv_entry->max_len) ||
+        frame_len > pmain->mem_budget
+    ) {
+        debug("Message length %zu rejected", frame_len);
+        prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+        return 1;
     }
+    return 0;
+}
 
-    if (code == PROT_MAILBOX_SET_CONTACTS) {
-        struct prot_mb_set_contacts *msg;
-        msg = prot_mb_set_contacts_new(db, NULL, NULL, NULL, NULL, 0);
+// Called from within recv handler to parse incomming message described by given
+// layout, parse state is kept in codec between calls, returns 1 once whole message
+// is in the input buffer and 0 otherwise, error is set if message is invalid or
+// exceeds maximum for its type, handler should return immediately in that case
+int prot_main_recv_parse(struct prot_main *pmain, struct prot_codec *codec, const struct prot_layout *layout) {
+    enum prot_codec_results rc;
 
-        return &(msg->hrecv);
+    rc = prot_codec_parse(codec, layout, bufferevent_get_input(pmain->bev));
+
+    if (rc == PROT_CODEC_INVALID) {
+        prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+        return 0;
     }
+    // Reject oversized messages before buffering them
+    if (codec->frame_len && prot_main_frame_len_check(pmain, codec->frame_len))
+        return 0;
 
-    if (code == PROT_MESSAGE_CONTAINER) {
-        struct prot_message *msg;
-        msg = prot_message_to_mailbox_new(db, NULL);
+    return rc == PROT_CODEC_DONE;
+}
 
-        return &(msg->hrecv);
+// Same as prot_main_recv_parse, used for messages which end with ed25519 signature,
+// everything before the signature is hashed as it arrives, so once whole message
+// is in the buffer its signature is checked without reading it again
+int prot_main_recv_parse_signed(struct prot_main *pmain, struct prot_codec *codec, const struct prot_layout *layout) {
+    int rc;
+    size_t end;
+    struct evbuffer *input = bufferevent_get_input(pmain->bev);
+
+    rc = prot_main_recv_parse(pmain, codec, layout);
+    if (pmain->status != PROT_STATUS_OK || pmain->recv_hash_done)
+        return rc;
+
+    // Signature is the last field, until message length is known
+    // only fields which were parsed are surely before it
+    if (codec->frame_len)
+        end = codec->frame_len - ED25519_SIGNATURE_LEN;
+    else
+        end = codec->offset[codec->n_parsed];
+    end = min(end, evbuffer_get_length(input));
+
+    if (end <= pmain->recv_hashed)
+        return rc;
+
+    if (
+        (!pmain->recv_hash && !(pmain->recv_hash = ed25519_prehash_new())) ||
+        ed25519_prehash_update_at(pmain->recv_hash, input, pmain->recv_hashed, end - pmain->recv_hashed)
+    ) {
+        prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+        return 0;
     }
+    pmain->recv_hashed = end;
 
-    if (code == PROT_MAILBOX_FETCH) {
-        struct prot_mb_fetch *msg;
-        msg = prot_mb_fetch_new(db);
+    return rc;
+}
 
-        return &(msg->hrecv);
+// Finish hash of the whole message parsed by prot_main_recv_parse_signed and store
+// it into hash (ED25519_PREHASH_LEN bytes), returns 0 on success and 1 on failure
+int prot_main_recv_hash(struct prot_main *pmain, struct prot_codec *codec, uint8_t *hash) {
+    if (
+        !pmain->recv_hash || pmain->recv_hash_done ||
+        pmain->recv_hashed != codec->frame_len - ED25519_SIGNATURE_LEN
+    ) {
+        return 1;
     }
 
-    return NULL;
+    pmain->recv_hash_done = 1;
+    return ed25519_prehash_final(pmain->recv_hash, hash);
+}
+
+// Check signature of the whole message parsed by prot_main_recv_parse_signed using
+// given ed25519 public key, returns 1 if signature is valid and 0 otherwise
+int prot_main_recv_verify(struct prot_main *pmain, struct prot_codec *codec, uint8_t *pub_key) {
+    struct evbuffer_ptr pos;
+    uint8_t hash[ED25519_PREHASH_LEN];
+    uint8_t sig[ED25519_SIGNATURE_LEN];
+    struct evbuffer *input = bufferevent_get_input(pmain->bev);
+
+    if (prot_main_recv_hash(pmain, codec, hash))
+        return 0;
+
+    evbuffer_ptr_set(input, &pos, codec->frame_len - ED25519_SIGNATURE_LEN, EVBUFFER_PTR_SET);
+    evbuffer_copyout_from(input, &pos, sig, ED25519_SIGNATURE_LEN);
+
+    return ed25519_hash_validate(hash, sig, pub_key);
+}
+
+// Forget hash of the signed message, it's done once message is handled, handler
+// taking multiple signed messages out of the buffer must call it after each of them
+void prot_main_recv_hash_reset(struct prot_main *pmain) {
+    if (pmain->recv_hash)
+        ed25519_prehash_free(pmain->recv_hash);
+
+    pmain->recv_hash = NULL;
+    pmain->recv_hashed = 0;
+    pmain->recv_hash_done = 0;
+}
+
+// Allocate new receive handler for given message type, returns prot_recv_handler (on client)
+struct prot_recv_handler *prot_handler_autogen_client(enum prot_message_codes code, sqlite3 *db) {
+    return prot_registry_autogen(PROT_MODE_CLIENT, code, db);
+}
+
+// Allocate new receive handler for given message type, returns prot_recv_handler (on mailbox)
+struct prot_recv_handler *prot_handler_autogen_mailbox(enum prot_message_codes code, sqlite3 *db) {
+    return prot_registry_autogen(PROT_MODE_MAILBOX, code, db);
 }
 
 // Returns pointer to protocol header generated for given message type
-// length of the header is equal to PROT_HEADER_LEN
+// length of the header is equal to PROT_HEADER_LEN, header carries version
+// which introduced the message type, so older peers can read it
 const uint8_t *prot_header(enum prot_message_codes msg_code) {
-    static uint8_t header[PROT_HEADER_LEN] = {DEEP_MESSENGER_PROTOCOL_VER};
+    return prot_header_version(msg_code, prot_code_version(msg_code));
+}
+
+// Same as prot_header, but header carries given protocol version, used by
+// transaction messages which agree on the version
+const uint8_t * prot_header_version(enum prot_message_codes msg_code, int version) {
+    static __thread uint8_t header[PROT_HEADER_LEN];
+    header[0] = version;
     header[1] = msg_code;
 
     return header;
 }
 
+// Returns protocol version which introduced given message type
+int prot_code_version(enum prot_message_codes msg_code) {
+    switch (msg_code) {
+        case PROT_TRANSACTION_0RTT:
+        case PROT_STREAM_DATA:
+        case PROT_ACK_BATCH_ONION:
+        case PROT_ACK_BATCH_SIGNATURE:
+        case PROT_CONTACT_SYNC:
+        case PROT_MESSAGE_SESSION:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+// Returns 1 if peer on the other side of the connection knows given message
+// type, according to the version agreed on by the transaction, and 0 otherwise
+int prot_main_peer_knows(struct prot_main *pmain, enum prot_message_codes msg_code) {
+    return pmain->version >= prot_code_version(msg_code);
+}
+
+// Close the connection from outside of handler callbacks, close hooks are
+// called with given status and protocol handler is freed
+void prot_main_close(struct prot_main *pmain, enum prot_status_codes status) {
+    prot_main_fail(pmain, status);
+}
+
+// Start transaction with given ID, called by transaction handlers once
+// transaction ID is known, streams of the connection share the transaction
+void prot_main_transaction_start(struct prot_main *pmain, const uint8_t *txn_id) {
+    pmain->transaction_started = 1;
+    memcpy(pmain->transaction_id, txn_id, TRANSACTION_ID_LEN);
+
+    if (pmain->streams)
+        prot_stream_transaction(pmain);
+}
+
 // Called from within tran/recv handler callbacks in case of error, main protocol
 // handler will then free itself and close the connection
 void prot_main_set_error(struct prot_main *pmain, enum prot_status_codes err_code) {
     pmain->status = err_code;
-}
\ No newline at end of file
+}
+
+// Called by receive handlers once signed message proved which contact is on the
+// other side, signature covers the transaction ID, but it only proves that contact
+// is live if the ID is fresh, event is reported on the connection stream belongs
+// to, and only if that is the case, otherwise signed message could be replayed
+void prot_main_peer_auth(struct prot_main *pmain, struct db_contact *cont) {
+    if (pmain->stream)
+        pmain = pmain->stream->conn;
+
+    // Connection is being freed, or other side picked the transaction ID
+    if (!pmain || !pmain->transaction_fresh)
+        return;
+
+    hook_list_call(pmain->hooks, PROT_MAIN_EV_PEER, cont);
+}
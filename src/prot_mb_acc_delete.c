@@ -6,12 +6,26 @@
 #include <db_mb_account.h>
 #include <prot_mb_account.h>
 #include <sys_memory.h>
+#include <free_list.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <db_options.h>
 #include <buffer_crypto.h>
 #include <debug.h>
 
+// Layout of delete account message
+#define DELETE_FIELDS(X) \
+    X(DELETE_HEADER, BYTES, PROT_HEADER_LEN,       0) \
+    X(DELETE_TXN,    BYTES, TRANSACTION_ID_LEN,    0) \
+    X(DELETE_MB_ID,  BYTES, MAILBOX_ID_LEN,        0) \
+    X(DELETE_SIG,    BYTES, ED25519_SIGNATURE_LEN, 0)
+
+enum delete_fields { DELETE_FIELDS(PROT_FIELD_NAME) };
+static const struct prot_layout delete_layout = PROT_LAYOUT(DELETE_FIELDS);
+
+// Unused handler objects, reused by next allocation
+static struct free_list delete_free_list = FREE_LIST_INIT(struct prot_mb_acc, FREE_LIST_MAX_FREE);
+
 // Called when ack is received after transmission
 static void ack_received(int ack_success, struct prot_main *pmain, void *cbarg) {
     struct prot_mb_acc *acc = cbarg;
@@ -79,19 +93,15 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
     struct prot_ack_ed25519 *ack;
     uint8_t mb_onion_priv_key[MAILBOX_ACCOUNT_KEY_PRIV_LEN];
 
-    int message_len = PROT_HEADER_LEN + TRANSACTION_ID_LEN + 
-        MAILBOX_ID_LEN + ED25519_SIGNATURE_LEN;
-
     input = bufferevent_get_input(pmain->bev);
 
-    if (evbuffer_get_length(input) < message_len)
+    if (!prot_main_recv_parse_signed(pmain, &(acc->codec), &delete_layout))
         return;
 
-    mailbox_id = evbuffer_pullup(input, message_len - ED25519_SIGNATURE_LEN)
-        + PROT_HEADER_LEN + TRANSACTION_ID_LEN;
+    mailbox_id = prot_codec_pullup(&(acc->codec), input, DELETE_MB_ID);
     acc->mb_acc = db_mb_account_get_by_mbid(acc->db, mailbox_id, NULL);
 
-    if (!acc->mb_acc || !ed25519_buffer_validate(input, message_len, acc->mb_acc->signing_pub_key)) {
+    if (!acc->mb_acc || !prot_main_recv_verify(pmain, &(acc->codec), acc->mb_acc->signing_pub_key)) {
         prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
         return;
     }
@@ -100,7 +110,7 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
     ack = prot_ack_ed25519_new(PROT_ACK_ONION, NULL, mb_onion_priv_key, ack_sent, acc);
     prot_main_push_tran(pmain, &(ack->htran));
 
-    evbuffer_drain(input, message_len);
+    evbuffer_drain(input, acc->codec.frame_len);
     pmain->current_recv_done = 1;
     phand->cleanup_cb = NULL;
 }
@@ -110,8 +120,7 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
 struct prot_mb_acc * prot_mb_acc_delete_new(sqlite3 *db, const char *onion_address, const uint8_t *mb_id, const uint8_t *mb_sig_priv_key) {
     struct prot_mb_acc *acc;
 
-    acc = safe_malloc(sizeof(struct prot_mb_acc),
-        "Failed to allocate memory for mb account delete handler");
+    acc = free_list_get(&delete_free_list);
     memset(acc, 0, sizeof(struct prot_mb_acc));
 
     acc->db = db;
@@ -128,10 +137,11 @@ struct prot_mb_acc * prot_mb_acc_delete_new(sqlite3 *db, const char *onion_addre
 
     acc->htran.msg = acc;
     acc->htran.msg_code = PROT_MAILBOX_DEL_ACCOUNT;
+    acc->htran.priority = PROT_PRIO_INTERACTIVE;
     acc->htran.done_cb = tran_done;
     acc->htran.setup_cb = tran_setup;
     acc->htran.cleanup_cb = tran_cleanup;
-    acc->htran.buffer = evbuffer_new();
+    acc->htran.buffer = NULL;
 
     acc->hrecv.msg = acc;
     acc->hrecv.msg_code = PROT_MAILBOX_DEL_ACCOUNT;
@@ -151,5 +161,5 @@ void prot_mb_acc_delete_free(struct prot_mb_acc *msg) {
     if (msg->mb_acc)
         db_mb_account_free(msg->mb_acc);
 
-    free(msg);
+    free_list_put(&delete_free_list, msg);
 }
\ No newline at end of file
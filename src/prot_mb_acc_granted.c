@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <string.h>
 #include <hooks.h>
 #include <onion.h>
 #include <prot_main.h>
@@ -11,6 +12,20 @@
 #include <db_options.h>
 #include <buffer_crypto.h>
 #include <debug.h>
+#include <free_list.h>
+
+// Layout of account granted message
+#define GRANTED_FIELDS(X) \
+    X(GRANTED_HEADER, BYTES, PROT_HEADER_LEN,       0) \
+    X(GRANTED_TXN,    BYTES, TRANSACTION_ID_LEN,    0) \
+    X(GRANTED_MB_ID,  BYTES, MAILBOX_ID_LEN,        0) \
+    X(GRANTED_SIG,    BYTES, ED25519_SIGNATURE_LEN, 0)
+
+enum granted_fields { GRANTED_FIELDS(PROT_FIELD_NAME) };
+static const struct prot_layout granted_layout = PROT_LAYOUT(GRANTED_FIELDS);
+
+// Unused handler objects, reused by next allocation
+static struct free_list granted_free_list = FREE_LIST_INIT(struct prot_mb_acc, FREE_LIST_MAX_FREE);
 
 // Called when transmission finished successfully
 static void tran_done(struct prot_main *pmain, struct prot_tran_handler *phand) {
@@ -52,25 +67,21 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
     struct prot_mb_acc *acc = phand->msg;
     struct evbuffer *input;
 
-    size_t message_len = PROT_HEADER_LEN + TRANSACTION_ID_LEN + 
-        MAILBOX_ID_LEN + ED25519_SIGNATURE_LEN;
-
     input = bufferevent_get_input(pmain->bev);
 
-    if (evbuffer_get_length(input) < message_len)
+    if (!prot_main_recv_parse_signed(pmain, &(acc->codec), &granted_layout))
         return;
 
-    if (!ed25519_buffer_validate(input, message_len, acc->cl_acc->onion_key)) {
+    if (!prot_main_recv_verify(pmain, &(acc->codec), acc->cl_acc->onion_key)) {
         prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
         return;
     }
 
-    evbuffer_drain(input, PROT_HEADER_LEN + TRANSACTION_ID_LEN);
-    evbuffer_remove(input, acc->cl_acc->mailbox_id, MAILBOX_ID_LEN);
+    prot_codec_copy(&(acc->codec), input, GRANTED_MB_ID, acc->cl_acc->mailbox_id);
 
     hook_list_call(pmain->hooks, PROT_MB_ACC_REGISTER_EV_OK, acc->cl_acc);
 
-    evbuffer_drain(input, ED25519_SIGNATURE_LEN);
+    evbuffer_drain(input, acc->codec.frame_len);
     pmain->current_recv_done = 1;
 }
 
@@ -79,8 +90,8 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
 struct prot_mb_acc * prot_mb_acc_granted_new(struct prot_mb_acc *acc_reg_req) {
     struct prot_mb_acc *acc;
 
-    acc = safe_malloc(sizeof(struct prot_mb_acc), 
-        "Failed to allocate memory for mailbox granted handler");
+    acc = free_list_get(&granted_free_list);
+    memset(acc, 0, sizeof(struct prot_mb_acc));
 
     // Copy data from registration request
     acc->db = acc_reg_req->db;
@@ -89,10 +100,11 @@ struct prot_mb_acc * prot_mb_acc_granted_new(struct prot_mb_acc *acc_reg_req) {
 
     acc->htran.msg = acc;
     acc->htran.msg_code = PROT_MAILBOX_GRANTED;
+    acc->htran.priority = PROT_PRIO_ACK;
     acc->htran.done_cb = tran_done;
     acc->htran.setup_cb = tran_setup;
     acc->htran.cleanup_cb = tran_cleanup;
-    acc->htran.buffer = evbuffer_new();
+    acc->htran.buffer = NULL;
 
     acc->hrecv.msg = acc;
     acc->hrecv.msg_code = PROT_MAILBOX_GRANTED;
@@ -112,6 +124,5 @@ void prot_mb_acc_granted_free(struct prot_mb_acc *msg) {
     if (msg->mb_acc)
         db_mb_account_free(msg->mb_acc);
 
-    evbuffer_free(msg->htran.buffer);
-    free(msg);
+    free_list_put(&granted_free_list, msg);
 }
\ No newline at end of file
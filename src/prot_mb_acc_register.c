@@ -7,11 +7,25 @@
 #include <db_mb_account.h>
 #include <prot_mb_account.h>
 #include <sys_memory.h>
+#include <free_list.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <openssl/rand.h>
 #include <debug.h>
 
+// Layout of register message
+#define REGISTER_FIELDS(X) \
+    X(REGISTER_HEADER,     BYTES, PROT_HEADER_LEN,             0) \
+    X(REGISTER_TXN,        BYTES, TRANSACTION_ID_LEN,          0) \
+    X(REGISTER_ACCESS_KEY, BYTES, MAILBOX_ACCESS_KEY_LEN,      0) \
+    X(REGISTER_SIG_KEY,    BYTES, MAILBOX_ACCOUNT_KEY_PUB_LEN, 0)
+
+enum register_fields { REGISTER_FIELDS(PROT_FIELD_NAME) };
+static const struct prot_layout register_layout = PROT_LAYOUT(REGISTER_FIELDS);
+
+// Unused handler objects, reused by next allocation
+static struct free_list register_free_list = FREE_LIST_INIT(struct prot_mb_acc, FREE_LIST_MAX_FREE);
+
 // Called if request is sent successfully
 static void tran_done(struct prot_main *pmain, struct prot_tran_handler *phand) {
     struct prot_mb_acc *acc = phand->msg;
@@ -59,16 +73,12 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
     struct db_mb_key *dbkey;
     uint8_t access_key[MAILBOX_ACCESS_KEY_LEN];
 
-    size_t message_len = PROT_HEADER_LEN + TRANSACTION_ID_LEN +
-        MAILBOX_ACCESS_KEY_LEN + MAILBOX_ACCOUNT_KEY_PUB_LEN;
-
     input = bufferevent_get_input(pmain->bev);
 
-    if (evbuffer_get_length(input) < message_len)
+    if (!prot_main_recv_parse(pmain, &(acc->codec), &register_layout))
         return;
-    
-    evbuffer_drain(input, PROT_HEADER_LEN + TRANSACTION_ID_LEN);
-    evbuffer_remove(input, access_key, MAILBOX_ACCESS_KEY_LEN);
+
+    prot_codec_copy(&(acc->codec), input, REGISTER_ACCESS_KEY, access_key);
 
     dbkey = db_mb_key_get_by_key(acc->db, access_key, NULL);
 
@@ -83,7 +93,8 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
     db_mb_key_free(dbkey);
 
     acc->mb_acc = db_mb_account_new();
-    evbuffer_remove(input, acc->mb_acc->signing_pub_key, MAILBOX_ACCOUNT_KEY_PUB_LEN);
+    prot_codec_copy(&(acc->codec), input, REGISTER_SIG_KEY, acc->mb_acc->signing_pub_key);
+    evbuffer_drain(input, acc->codec.frame_len);
 
     // Generate random mailbox ID
     RAND_bytes(acc->mb_acc->mailbox_id, MAILBOX_ID_LEN);
@@ -100,8 +111,7 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
 struct prot_mb_acc * prot_mb_acc_register_new(sqlite3 *db, const char *onion_address, const uint8_t *access_key) {
     struct prot_mb_acc *msg;
 
-    msg = safe_malloc(sizeof(struct prot_mb_acc),
-        "Failed to allocate mailbox register handler");
+    msg = free_list_get(&register_free_list);
     memset(msg, 0, sizeof(struct prot_mb_acc));
 
     debug("Creating new MB register handler");
@@ -129,10 +139,11 @@ struct prot_mb_acc * prot_mb_acc_register_new(sqlite3 *db, const char *onion_add
 
     msg->htran.msg = msg;
     msg->htran.msg_code = PROT_MAILBOX_REGISTER;
+    msg->htran.priority = PROT_PRIO_INTERACTIVE;
     msg->htran.done_cb = tran_done;
     msg->htran.setup_cb = tran_setup;
     msg->htran.cleanup_cb = tran_cleanup;
-    msg->htran.buffer = evbuffer_new();
+    msg->htran.buffer = NULL;
 
     msg->hrecv.msg = msg;
     msg->hrecv.msg_code = PROT_MAILBOX_REGISTER;
@@ -154,6 +165,5 @@ void prot_mb_acc_register_free(struct prot_mb_acc *msg) {
     if (msg->mb_acc)
         db_mb_account_free(msg->mb_acc);
     
-    evbuffer_free(msg->htran.buffer);
-    free(msg);
+    free_list_put(&register_free_list, msg);
 }
@@ -3,6 +3,7 @@
 #include <prot_mb_fetch.h>
 #include <db_mb_account.h>
 #include <sys_memory.h>
+#include <free_list.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <debug.h>
@@ -11,6 +12,19 @@
 #include <prot_message_list.h>
 #include <db_mb_message.h>
 
+// Layout of mailbox fetch message
+#define MB_FETCH_FIELDS(X) \
+    X(MB_FETCH_HEADER, BYTES, PROT_HEADER_LEN,       0) \
+    X(MB_FETCH_TXN,    BYTES, TRANSACTION_ID_LEN,    0) \
+    X(MB_FETCH_MB_ID,  BYTES, MAILBOX_ID_LEN,        0) \
+    X(MB_FETCH_SIG,    BYTES, ED25519_SIGNATURE_LEN, 0)
+
+enum mb_fetch_fields { MB_FETCH_FIELDS(PROT_FIELD_NAME) };
+static const struct prot_layout mb_fetch_layout = PROT_LAYOUT(MB_FETCH_FIELDS);
+
+// Unused handler objects, reused by next allocation
+static struct free_list mb_fetch_free_list = FREE_LIST_INIT(struct prot_mb_fetch, FREE_LIST_MAX_FREE);
+
 // Called when fetch request is sent successfully
 static void tran_done(struct prot_main *pmain, struct prot_tran_handler *phand) {
     struct prot_mb_fetch *msg = phand->msg;
@@ -26,7 +40,8 @@ static void tran_cleanup(struct prot_main *pmain, struct prot_tran_handler *phan
     struct prot_mb_fetch *msg = phand->msg;
 
     if (!phand->success)
-        hook_list_call(pmain->hooks, PROT_MB_FETCH_EV_FAIL, NULL);
+        hook_list_call(pmain->hooks, pmain->status == PROT_ERR_REFUSED ?
+            PROT_MB_FETCH_EV_RETRY : PROT_MB_FETCH_EV_FAIL, NULL);
     prot_mb_fetch_free(msg);
 }
 
@@ -50,29 +65,25 @@ static void recv_cleanup(struct prot_main *pmain, struct prot_recv_handler *phan
 static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand) {
     struct prot_mb_fetch *msg = phand->msg;
     struct evbuffer *input;
-    struct evbuffer_ptr pos;
     struct db_mb_account *acc;
     uint8_t mb_onion_priv_key[ONION_PRIV_KEY_LEN];
 
     int n_msgs;
     struct db_mb_message **msgs;
     struct prot_message_list *msg_list;
-    uint8_t message_len = PROT_HEADER_LEN + TRANSACTION_ID_LEN +
-        MAILBOX_ID_LEN + ED25519_SIGNATURE_LEN;
     
     debug("MB FETCH");
 
     input = bufferevent_get_input(pmain->bev);
-    if (evbuffer_get_length(input) < message_len)
+    if (!prot_main_recv_parse_signed(pmain, &(msg->codec), &mb_fetch_layout))
         return;
 
     debug("LENGTH OK");
 
-    evbuffer_ptr_set(input, &pos, PROT_HEADER_LEN + TRANSACTION_ID_LEN, EVBUFFER_PTR_SET);
-    evbuffer_copyout_from(input, &pos, msg->mb_id, MAILBOX_ID_LEN);
+    prot_codec_copy(&(msg->codec), input, MB_FETCH_MB_ID, msg->mb_id);
 
     acc = db_mb_account_get_by_mbid(msg->db, msg->mb_id, NULL);
-    if (!acc || !ed25519_buffer_validate(input, message_len, acc->signing_pub_key)) {
+    if (!acc || !prot_main_recv_verify(pmain, &(msg->codec), acc->signing_pub_key)) {
         prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
         return;
     }
@@ -86,7 +97,7 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
 
     debug("PUSHED MSG LIST");
 
-    evbuffer_drain(input, message_len);
+    evbuffer_drain(input, msg->codec.frame_len);
     pmain->current_recv_done = 1;
 
     debug("DONE");
@@ -96,18 +107,18 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
 struct prot_mb_fetch * prot_mb_fetch_new(sqlite3 *db) {
     struct prot_mb_fetch *msg;
 
-    msg = safe_malloc(sizeof(struct prot_mb_fetch),
-        "Failed to allocate memory for mailbox fetch request handler");
+    msg = free_list_get(&mb_fetch_free_list);
     memset(msg, 0, sizeof(struct prot_mb_fetch));
 
     msg->db = db;
 
     msg->htran.msg = msg;
     msg->htran.msg_code = PROT_MAILBOX_FETCH;
+    msg->htran.priority = PROT_PRIO_INTERACTIVE;
     msg->htran.done_cb = tran_done;
     msg->htran.setup_cb = tran_setup;
     msg->htran.cleanup_cb = tran_cleanup;
-    msg->htran.buffer = evbuffer_new();
+    msg->htran.buffer = NULL;
 
     msg->hrecv.msg = msg;
     msg->hrecv.msg_code = PROT_MAILBOX_FETCH;
@@ -127,8 +138,5 @@ struct prot_mb_fetch * prot_mb_fetch_new(sqlite3 *db) {
 
 // Free mailbox fetch handler
 void prot_mb_fetch_free(struct prot_mb_fetch *msg) {
-    if (msg) {
-        evbuffer_free(msg->htran.buffer);
-    }
-    free(msg);
+    free_list_put(&mb_fetch_free_list, msg);
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include <sqlite3.h>
 #include <prot_main.h>
 #include <sys_memory.h>
+#include <free_list.h>
 #include <db_contact.h>
 #include <db_mb_account.h>
 #include <db_mb_contact.h>
@@ -16,6 +17,21 @@
 #include <db_options.h>
 #include <debug.h>
 
+// Layout of set contacts message
+#define SET_CONTACTS_FIELDS(X) \
+    X(SET_CONTACTS_HEADER,   BYTES, PROT_HEADER_LEN,        0) \
+    X(SET_CONTACTS_TXN,      BYTES, TRANSACTION_ID_LEN,     0) \
+    X(SET_CONTACTS_MB_ID,    BYTES, MAILBOX_ID_LEN,         0) \
+    X(SET_CONTACTS_N_CONTS,  U16,   0,                      0) \
+    X(SET_CONTACTS_CONTACTS, VAR,   CLIENT_SIG_KEY_PUB_LEN, SET_CONTACTS_N_CONTS) \
+    X(SET_CONTACTS_SIG,      BYTES, ED25519_SIGNATURE_LEN,  0)
+
+enum set_contacts_fields { SET_CONTACTS_FIELDS(PROT_FIELD_NAME) };
+static const struct prot_layout set_contacts_layout = PROT_LAYOUT(SET_CONTACTS_FIELDS);
+
+// Unused handler objects, reused by next allocation
+static struct free_list set_contacts_free_list = FREE_LIST_INIT(struct prot_mb_set_contacts, FREE_LIST_MAX_FREE);
+
 // Called when ack is received after transmission
 static void ack_received(int ack_success, struct prot_main *pmain, void *cbarg) {
     struct prot_mb_set_contacts *msg = cbarg;
@@ -88,47 +104,38 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
     int i;
     struct evbuffer *input;
     uint8_t *mailbox_id;
+    uint8_t *contact_key;
     uint16_t contacts_len;
     struct prot_ack_ed25519 *ack;
     uint8_t mb_onion_priv_key[ONION_PRIV_KEY_LEN];
 
-    size_t message_len = PROT_HEADER_LEN + TRANSACTION_ID_LEN + 
-        MAILBOX_ID_LEN + sizeof(contacts_len);
-
     input = bufferevent_get_input(pmain->bev);
 
-    if (evbuffer_get_length(input) < message_len)
-        return;
-
-    mailbox_id = evbuffer_pullup(input, message_len) + PROT_HEADER_LEN + TRANSACTION_ID_LEN;
-    contacts_len = ntohs(*(uint16_t*)(mailbox_id + MAILBOX_ID_LEN));
-
-    message_len += contacts_len * CLIENT_SIG_KEY_PUB_LEN + ED25519_SIGNATURE_LEN;
-
-    if (evbuffer_get_length(input) < message_len)
+    if (!prot_main_recv_parse_signed(pmain, &(msg->codec), &set_contacts_layout))
         return;
 
+    mailbox_id = prot_codec_pullup(&(msg->codec), input, SET_CONTACTS_MB_ID);
     msg->mb_acc = db_mb_account_get_by_mbid(msg->db, mailbox_id, NULL);
 
-    if (!msg->mb_acc || !ed25519_buffer_validate(input, message_len, msg->mb_acc->signing_pub_key)) {
+    if (!msg->mb_acc || !prot_main_recv_verify(pmain, &(msg->codec), msg->mb_acc->signing_pub_key)) {
         prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
         return;
     }
 
-    message_len -= contacts_len * CLIENT_SIG_KEY_PUB_LEN + ED25519_SIGNATURE_LEN;
-    evbuffer_drain(input, message_len);
+    contacts_len = prot_codec_value(&(msg->codec), SET_CONTACTS_N_CONTS);
+    contact_key = prot_codec_pullup(&(msg->codec), input, SET_CONTACTS_CONTACTS);
 
     msg->n_mb_conts = contacts_len;
     msg->mb_conts = array(struct db_mb_contact *);
-    for (i = 0; i < contacts_len; i++) {
+    for (i = 0; i < contacts_len; i++, contact_key += CLIENT_SIG_KEY_PUB_LEN) {
         struct db_mb_contact *cont;
 
         cont = db_mb_contact_new();
         cont->account_id = msg->mb_acc->id;
-        evbuffer_remove(input, cont->signing_pub_key, CLIENT_SIG_KEY_PUB_LEN);
+        memcpy(cont->signing_pub_key, contact_key, CLIENT_SIG_KEY_PUB_LEN);
         array_set(msg->mb_conts, i, cont);
     }
-    evbuffer_drain(input, ED25519_SIGNATURE_LEN);
+    evbuffer_drain(input, msg->codec.frame_len);
 
     db_options_get_bin(msg->db, "onion_private_key", mb_onion_priv_key, ONION_PRIV_KEY_LEN);
     ack = prot_ack_ed25519_new(PROT_ACK_ONION, NULL, mb_onion_priv_key, ack_sent, msg);
@@ -150,8 +157,7 @@ struct prot_mb_set_contacts * prot_mb_set_contacts_new(
 ) {
     struct prot_mb_set_contacts *msg;
 
-    msg = safe_malloc(sizeof(struct prot_mb_set_contacts),
-        "Failed to allocate memory for mailbox set contacts messsage handler");
+    msg = free_list_get(&set_contacts_free_list);
     memset(msg, 0, sizeof(struct prot_mb_set_contacts));
 
     msg->db = db;
@@ -169,10 +175,11 @@ struct prot_mb_set_contacts * prot_mb_set_contacts_new(
 
     msg->htran.msg = msg;
     msg->htran.msg_code = PROT_MAILBOX_SET_CONTACTS;
+    msg->htran.priority = PROT_PRIO_INTERACTIVE;
     msg->htran.done_cb = tran_done;
     msg->htran.setup_cb = tran_setup;
     msg->htran.cleanup_cb = tran_cleanup;
-    msg->htran.buffer = evbuffer_new();
+    msg->htran.buffer = NULL;
     
     msg->hrecv.msg = msg;
     msg->hrecv.msg_code = PROT_MAILBOX_SET_CONTACTS;
@@ -200,5 +207,5 @@ void prot_mb_set_contacts_free(struct prot_mb_set_contacts *msg) {
         array_free(msg->mb_conts);
     }
 
-    free(msg);
+    free_list_put(&set_contacts_free_list, msg);
 }
\ No newline at end of file
@@ -8,14 +8,27 @@
 #include <db_mb_account.h>
 #include <db_mb_contact.h>
 #include <db_mb_message.h>
+#include <db_session.h>
 #include <sys_memory.h>
+#include <free_list.h>
 #include <prot_main.h>
 #include <prot_message.h>
 #include <prot_ack.h>
+#include <prot_registry.h>
 #include <buffer_crypto.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
 #include <debug.h>
 #include <hooks.h>
 
+// Layout of message container
+const struct prot_layout prot_message_layout = PROT_LAYOUT(PROT_MESSAGE_FIELDS);
+// Layout of message container encrypted using session key
+const struct prot_layout prot_session_layout = PROT_LAYOUT(PROT_SESSION_FIELDS);
+
+// Unused handler objects, reused by next allocation
+static struct free_list message_free_list = FREE_LIST_INIT(struct prot_message, FREE_LIST_MAX_FREE);
+
 // Called when ACK is arrived or failed to arrive
 static void ack_received(int ack_success, struct prot_main *pmain, void *arg) {
     struct prot_message *msg = arg;
@@ -34,24 +47,39 @@ static void ack_received(int ack_success, struct prot_main *pmain, void *arg) {
         } else {
             db_message_save(msg->db, msg->client_msg);
         }
+
+        // Contact decrypted the message, so it has the session key
+        if (msg->to == PROT_MESSAGE_TO_CLIENT && msg->session_id)
+            db_session_confirm(msg->db, msg->client_msg->contact_id, msg->session_id);
     }
 
-    hook_list_call(pmain->hooks,
-        ack_success ? PROT_MESSAGE_EV_OK : PROT_MESSAGE_EV_FAIL, msg->client_msg);
+    // Peer refused the connection (version or 0RTT) without reading the message,
+    // so it's handed back to be sent again over the next connection
+    if (!ack_success && pmain->status == PROT_ERR_REFUSED)
+        hook_list_call(pmain->hooks, PROT_MESSAGE_EV_RETRY, msg->client_msg);
+    else
+        hook_list_call(pmain->hooks,
+            ack_success ? PROT_MESSAGE_EV_OK : PROT_MESSAGE_EV_FAIL, msg->client_msg);
     prot_message_free(msg);
 }
 
-// Called if message is sent successfully
+// Called if message is sent successfully, session containers sent back to back
+// are acknowledged together by a batched ACK, legacy ones one by one
 static void tran_done(struct prot_main *pmain, struct prot_tran_handler *phand) {
     struct prot_message *msg = phand->msg;
-    struct prot_ack_ed25519 *ack;
+    struct prot_ack_ed25519 *ack = NULL;
+    int batched = phand->msg_code == PROT_MESSAGE_SESSION;
 
     // Only client can sent a message outside the message list
     if (pmain->mode != PROT_MODE_CLIENT) return;
 
     if (msg->to == PROT_MESSAGE_TO_CLIENT) {
         msg->client_msg->status = DB_MESSAGE_STATUS_SENT_CONFIRMED;
-        ack = prot_ack_ed25519_new(PROT_ACK_SIGNATURE, msg->client_cont->remote_sig_key_pub, NULL, ack_received, msg);
+        if (batched)
+            prot_ack_batch_expect(pmain, PROT_ACK_BATCH_SIGNATURE, msg->client_cont->remote_sig_key_pub,
+                msg->client_msg->global_id, ack_received, msg);
+        else
+            ack = prot_ack_ed25519_new(PROT_ACK_SIGNATURE, msg->client_cont->remote_sig_key_pub, NULL, ack_received, msg);
     }
 
     if (msg->to == PROT_MESSAGE_TO_MAILBOX) {
@@ -59,68 +87,282 @@ static void tran_done(struct prot_main *pmain, struct prot_tran_handler *phand)
 
         msg->client_msg->status = DB_MESSAGE_STATUS_SENT;
         onion_extract_key(msg->client_cont->mailbox_onion, onion_key);
-        ack = prot_ack_ed25519_new(PROT_ACK_ONION, onion_key, NULL, ack_received, msg);
+        if (batched)
+            prot_ack_batch_expect(pmain, PROT_ACK_BATCH_ONION, onion_key,
+                msg->client_msg->global_id, ack_received, msg);
+        else
+            ack = prot_ack_ed25519_new(PROT_ACK_ONION, onion_key, NULL, ack_received, msg);
     }
 
-    prot_main_push_recv(pmain, &(ack->hrecv));
+    if (ack)
+        prot_main_push_recv(pmain, &(ack->hrecv));
     phand->cleanup_cb = NULL;
 }
 
-// Free message handler object
+// Free message handler object, message was not sent, if peer refused the
+// connection it's handed back to be sent again using the oldest protocol version
 static void tran_cleanup(struct prot_main *pmain, struct prot_tran_handler *phand) {
     struct prot_message *msg = phand->msg;
-    hook_list_call(pmain->hooks, PROT_MESSAGE_EV_FAIL, msg->client_msg);
+    hook_list_call(pmain->hooks, pmain->status == PROT_ERR_REFUSED ?
+        PROT_MESSAGE_EV_RETRY : PROT_MESSAGE_EV_FAIL, msg->client_msg);
     prot_message_free(msg);
 }
 
-// Called to put message into buffer
+// Split plain text of the message container carrying given client message into
+// parts, first part is message type which is stored into ctype, returns number of parts
+static int prot_message_plain_parts(struct db_message *dbmsg, uint8_t *ctype, struct evbuffer_iovec *parts) {
+    int n_parts = 1;
+
+    *ctype = dbmsg->type;
+    parts[0].iov_base = ctype;
+    parts[0].iov_len = sizeof(*ctype);
+
+    switch (dbmsg->type) {
+        case DB_MESSAGE_TEXT:
+            parts[n_parts].iov_base = dbmsg->body_text;
+            parts[n_parts++].iov_len = dbmsg->body_text_len;
+            break;
+        case DB_MESSAGE_NICK:
+            parts[n_parts].iov_base = dbmsg->body_nick;
+            parts[n_parts++].iov_len = dbmsg->body_nick_len;
+            break;
+        case DB_MESSAGE_MBOX:
+            parts[n_parts].iov_base = dbmsg->body_mbox_id;
+            parts[n_parts++].iov_len = MAILBOX_ID_LEN;
+            parts[n_parts].iov_base = dbmsg->body_mbox_onion;
+            parts[n_parts++].iov_len = ONION_ADDRESS_LEN;
+            break;
+        case DB_MESSAGE_RECV:
+            parts[n_parts].iov_base = dbmsg->body_recv_id;
+            parts[n_parts++].iov_len = MESSAGE_ID_LEN;
+            break;
+    }
+
+    return n_parts;
+}
+
+// Write unencrypted part of the message container encrypted using contact's RSA key
+static void prot_message_write_header(
+    struct ed25519_writer *w,
+    const uint8_t *transaction_id,
+    struct db_contact *cont,
+    struct db_message *dbmsg
+) {
+    ed25519_writer_add(w, prot_header(PROT_MESSAGE_CONTAINER), PROT_HEADER_LEN);
+    ed25519_writer_add(w, transaction_id, TRANSACTION_ID_LEN);
+    ed25519_writer_add(w, cont->mailbox_id, MAILBOX_ID_LEN);
+    ed25519_writer_add(w, cont->local_sig_key_pub, CLIENT_SIG_KEY_PUB_LEN);
+    ed25519_writer_add(w, dbmsg->global_id, MESSAGE_ID_LEN);
+}
+
+// Write message container encrypted using contact's RSA key, without the signature,
+// used for peers which don't know session keys, returns 0 on success and 1 on failure
+static int prot_message_write_legacy(
+    struct ed25519_writer *w,
+    const uint8_t *transaction_id,
+    struct db_contact *cont,
+    struct db_message *dbmsg
+) {
+    int i, n_parts;
+    uint8_t ctype;
+    size_t plain_len = 0;
+    struct rsa_seal seal;
+    struct evbuffer_iovec parts[PROT_MESSAGE_PLAIN_MAX_PARTS];
+
+    n_parts = prot_message_plain_parts(dbmsg, &ctype, parts);
+    for (i = 0; i < n_parts; i++)
+        plain_len += parts[i].iov_len;
+
+    prot_message_write_header(w, transaction_id, cont, dbmsg);
+
+    if (rsa_seal_begin(&seal, w, cont->remote_enc_key_pub, plain_len)) {
+        w->err = 1;
+        return 1;
+    }
+    for (i = 0; i < n_parts; i++) {
+        if (rsa_seal_update(&seal, w, parts[i].iov_base, parts[i].iov_len)) {
+            w->err = 1;
+            return 1;
+        }
+    }
+    if (rsa_seal_end(&seal, w)) {
+        w->err = 1;
+        return 1;
+    }
+
+    return w->err;
+}
+
+// Write message container encrypted using the next reserved nonce of the session,
+// without the signature, returns 0 on success and 1 on failure
+static int prot_message_write_body(
+    struct ed25519_writer *w,
+    const uint8_t *transaction_id,
+    struct db_contact *cont,
+    struct db_session *sess,
+    struct db_message *dbmsg
+) {
+    int i, n_parts;
+    uint8_t ctype;
+    size_t plain_len = 0;
+    uint16_t wrap_len;
+    uint32_t session_id;
+    uint32_t counter_hi, counter_lo;
+    uint8_t nonce[SESSION_NONCE_LEN];
+    struct aead_seal seal;
+    struct evbuffer_iovec parts[PROT_MESSAGE_PLAIN_MAX_PARTS];
+
+    n_parts = prot_message_plain_parts(dbmsg, &ctype, parts);
+    for (i = 0; i < n_parts; i++)
+        plain_len += parts[i].iov_len;
+
+    // Nonce is never reused, counter is reserved in the database
+    session_id = htonl(sess->session_id);
+    counter_hi = htonl(sess->counter >> 32);
+    counter_lo = htonl(sess->counter & 0xFFFFFFFF);
+    memcpy(nonce, &session_id, sizeof(session_id));
+    memcpy(nonce + 4, &counter_hi, sizeof(counter_hi));
+    memcpy(nonce + 8, &counter_lo, sizeof(counter_lo));
+    ++sess->counter;
+
+    ed25519_writer_add(w, prot_header(PROT_MESSAGE_SESSION), PROT_HEADER_LEN);
+    ed25519_writer_add(w, transaction_id, TRANSACTION_ID_LEN);
+    ed25519_writer_add(w, cont->mailbox_id, MAILBOX_ID_LEN);
+    ed25519_writer_add(w, cont->local_sig_key_pub, CLIENT_SIG_KEY_PUB_LEN);
+    ed25519_writer_add(w, dbmsg->global_id, MESSAGE_ID_LEN);
+    ed25519_writer_add(w, nonce, SESSION_NONCE_LEN);
+
+    // Contact can't read the message without the key
+    wrap_len = htons(sess->confirmed ? 0 : SESSION_WRAP_LEN);
+    ed25519_writer_add(w, &wrap_len, sizeof(wrap_len));
+    if (!sess->confirmed)
+        ed25519_writer_add(w, sess->wrap, SESSION_WRAP_LEN);
+
+    if (aead_seal_begin(&seal, w, sess->key, nonce, plain_len)) {
+        w->err = 1;
+        return 1;
+    }
+    for (i = 0; i < n_parts; i++) {
+        if (aead_seal_update(&seal, w, parts[i].iov_base, parts[i].iov_len)) {
+            w->err = 1;
+            return 1;
+        }
+    }
+    if (aead_seal_end(&seal, w)) {
+        w->err = 1;
+        return 1;
+    }
+
+    return w->err;
+}
+
+// Create crypto job which encrypts the message using contact's RSA key and signs
+// it in a single pass, job buffer holds header followed by the plain text
+static struct crypto_job * tran_job_legacy(struct prot_main *pmain, struct prot_message *msg) {
+    int i, n_parts;
+    uint8_t ctype;
+    struct crypto_job *job;
+    struct ed25519_writer w;
+    struct evbuffer_iovec parts[PROT_MESSAGE_PLAIN_MAX_PARTS];
+
+    job = crypto_job_new(CRYPTO_JOB_SEAL_SIGN, msg->client_cont->remote_enc_key_pub, CLIENT_ENC_KEY_PUB_LEN);
+    memcpy(job->sign_key, msg->client_cont->local_sig_key_priv, CLIENT_SIG_KEY_PRIV_LEN);
+    job->len = PROT_MESSAGE_HEADER_LEN;
+
+    ed25519_writer_init(&w, job->in);
+    prot_message_write_header(&w, pmain->transaction_id, msg->client_cont, msg->client_msg);
+
+    n_parts = prot_message_plain_parts(msg->client_msg, &ctype, parts);
+    for (i = 0; i < n_parts; i++)
+        evbuffer_add(job->in, parts[i].iov_base, parts[i].iov_len);
+
+    return job;
+}
+
+// Create crypto job which signs the message encrypted using reserved session,
+// symmetric encryption is cheap, so it's done here, returns NULL on failure
+static struct crypto_job * tran_job_session(struct prot_main *pmain, struct prot_message *msg) {
+    struct crypto_job *job;
+    struct ed25519_writer w;
+
+    job = crypto_job_new(CRYPTO_JOB_SIGN, msg->client_cont->local_sig_key_priv, CLIENT_SIG_KEY_PRIV_LEN);
+    ed25519_writer_init(&w, job->in);
+
+    if (prot_message_write_body(&w, pmain->transaction_id, msg->client_cont, msg->sess, msg->client_msg)) {
+        crypto_job_free(job);
+        return NULL;
+    }
+    return job;
+}
+
+// Called to put message into buffer, message is encrypted using contact's session
+// if peer (contact or mailbox) knows session containers, and using contact's RSA
+// key otherwise, crypto jobs seal key of the new session and sign the message,
+// each may suspend the transmitter, in which case this is called again once
+// the job is done
 static void tran_setup(struct prot_main *pmain, struct prot_tran_handler *phand) {
+    int rc;
     struct prot_message *msg = phand->msg;
 
     debug(">>>>> Running msg tran <<<<<");
 
     // Only client can send a message outside the message list
-    if (pmain->mode == PROT_MODE_CLIENT) {
-        uint8_t ctype;
-        struct evbuffer *plain;
+    if (pmain->mode != PROT_MODE_CLIENT)
+        return;
 
-        plain = evbuffer_new();
+    if (!msg->job) {
+        msg->client_msg->sender = DB_MESSAGE_SENDER_ME;
 
-        evbuffer_add(phand->buffer, prot_header(PROT_MESSAGE_CONTAINER), PROT_HEADER_LEN);
-        evbuffer_add(phand->buffer, pmain->transaction_id, TRANSACTION_ID_LEN);
-        evbuffer_add(phand->buffer, msg->client_cont->mailbox_id, MAILBOX_ID_LEN);
-        evbuffer_add(phand->buffer, msg->client_cont->local_sig_key_pub, CLIENT_SIG_KEY_PUB_LEN);
-        evbuffer_add(phand->buffer, msg->client_msg->global_id, MESSAGE_ID_LEN);
+        if (prot_main_peer_knows(pmain, PROT_MESSAGE_SESSION)) {
+            phand->msg_code = PROT_MESSAGE_SESSION;
 
-        ctype = msg->client_msg->type;
-        evbuffer_add(plain, &ctype, sizeof(ctype));
+            if (!(msg->sess = prot_message_session_reserve(msg->db, msg->client_cont, 1))) {
+                prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+                return;
+            }
+            msg->session_id = msg->sess->session_id;
+            msg->job = prot_message_session_wrap_job(msg->sess, msg->client_cont);
+        }
 
-        msg->client_msg->sender = DB_MESSAGE_SENDER_ME;
+        if (!msg->job)
+            msg->job = msg->sess ? tran_job_session(pmain, msg) : tran_job_legacy(pmain, msg);
 
-        switch (ctype) {
-            case DB_MESSAGE_TEXT:
-                evbuffer_add(plain, msg->client_msg->body_text, msg->client_msg->body_text_len);
-                break;
-            case DB_MESSAGE_NICK:
-                evbuffer_add(plain, msg->client_msg->body_nick, msg->client_msg->body_nick_len);
-                break;
-            case DB_MESSAGE_MBOX:
-                evbuffer_add(plain, msg->client_msg->body_mbox_id, MAILBOX_ID_LEN);
-                evbuffer_add(plain, msg->client_msg->body_mbox_onion, ONION_ADDRESS_LEN);
-                break;
-            case DB_MESSAGE_RECV:
-                evbuffer_add(plain, msg->client_msg->body_recv_id, MESSAGE_ID_LEN);
-                break;
+        if (!msg->job) {
+            prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+            return;
         }
-        debug("Created with len (before enc) (%d)", evbuffer_get_length(phand->buffer));
-        
-        rsa_buffer_encrypt(plain, msg->client_cont->remote_enc_key_pub, phand->buffer, NULL);
-        ed25519_buffer_sign(phand->buffer, 0, msg->client_cont->local_sig_key_priv);
+        if (prot_main_tran_await(pmain, msg->job))
+            return;
+    }
+
+    // Key of the new session is sealed, message can be written now
+    if (msg->job->type == CRYPTO_JOB_SEAL) {
+        rc = prot_message_session_wrap_done(msg->db, msg->sess, msg->job);
+        crypto_job_free(msg->job);
+        msg->job = NULL;
 
-        debug("Created with len (%d)", evbuffer_get_length(phand->buffer));
+        if (rc || !(msg->job = tran_job_session(pmain, msg))) {
+            prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+            return;
+        }
+        if (prot_main_tran_await(pmain, msg->job))
+            return;
+    }
 
-        evbuffer_free(plain);
+    if (msg->job->result) {
+        prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+        return;
     }
+
+    // Sealed container is written to the out buffer, signed one stays in the in buffer
+    if (msg->job->type == CRYPTO_JOB_SEAL_SIGN)
+        evbuffer_add_buffer(phand->buffer, msg->job->out);
+    else
+        evbuffer_add_buffer(phand->buffer, msg->job->in);
+    crypto_job_free(msg->job);
+    msg->job = NULL;
+
+    debug("Created with len (%d)", evbuffer_get_length(phand->buffer));
 }
 
 // Called when ACK is sent successfully or the sending failed
@@ -150,94 +392,187 @@ static void recv_cleanup(struct prot_main *pmain, struct prot_recv_handler *phan
     prot_message_free(msg);
 }
 
-// Handler incomming message
+// Acknowledge received message, session container can only come from a v2 peer,
+// so it's acknowledged by a batched ACK, legacy container by the legacy ACK code
+static void prot_message_ack_send(
+    struct prot_main *pmain,
+    enum prot_message_codes msg_code,
+    enum prot_message_codes ack_code,
+    uint8_t *priv_key,
+    const uint8_t *message_gid,
+    struct prot_message *msg
+) {
+    struct prot_ack_ed25519 *ack;
+
+    if (msg_code == PROT_MESSAGE_SESSION) {
+        prot_ack_batch_send(pmain, ack_code == PROT_ACK_ONION ? PROT_ACK_BATCH_ONION : PROT_ACK_BATCH_SIGNATURE,
+            priv_key, message_gid, ack_sent, msg);
+        return;
+    }
+
+    ack = prot_ack_ed25519_new(ack_code, NULL, priv_key, ack_sent, msg);
+    prot_main_push_tran(pmain, &(ack->htran));
+}
+
+// Handler incomming message, signature check and decryption may suspend
+// the handler, in which case it's called again once they are done
 static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand) {
     int rc;
-    uint32_t data_len;
+    size_t message_len;
     struct evbuffer *input;
-    struct evbuffer_ptr pos;
+    const struct prot_layout *layout;
 
-    struct prot_ack_ed25519 *ack;
+    struct prot_view view;
     struct prot_message *msg = phand->msg;
+    struct prot_codec *codec = &(msg->codec);
+    uint8_t hash[ED25519_PREHASH_LEN];
 
-    uint8_t mailbox_id[MAILBOX_ID_LEN];
-    uint8_t signing_pub_key[CLIENT_SIG_KEY_PUB_LEN];
-    uint8_t message_gid[MESSAGE_ID_LEN];
-
-    size_t message_len = PROT_HEADER_LEN + TRANSACTION_ID_LEN + MAILBOX_ID_LEN + CLIENT_SIG_KEY_PUB_LEN
-        + MESSAGE_ID_LEN + sizeof(data_len);
+    // Fields are read in place, scratch is used only if field is split between chunks
+    uint8_t *mailbox_id, *signing_pub_key, *message_gid;
+    uint8_t mailbox_id_s[MAILBOX_ID_LEN];
+    uint8_t signing_pub_key_s[CLIENT_SIG_KEY_PUB_LEN];
+    uint8_t message_gid_s[MESSAGE_ID_LEN];
 
+    // Fields are parsed once, handler resumed after crypto job skips this
     input = bufferevent_get_input(pmain->bev);
-    if (evbuffer_get_length(input) < message_len)
-        return;
-
-    // Get data length from the buffer
-    evbuffer_ptr_set(input, &pos, message_len - sizeof(data_len), EVBUFFER_PTR_SET);
-    evbuffer_copyout_from(input, &pos, &data_len, sizeof(data_len));
-    data_len = ntohl(data_len);
-
-    message_len += data_len + ED25519_SIGNATURE_LEN + AES_IV_LENGTH + AES_ENC_KEY_LENGTH;
-    
-    if (evbuffer_get_length(input) < message_len)
+    layout = prot_message_layout_get(phand->msg_code);
+    if (!prot_main_recv_parse_signed(pmain, codec, layout))
         return;
 
-    evbuffer_ptr_set(input, &pos, PROT_HEADER_LEN + TRANSACTION_ID_LEN + MAILBOX_ID_LEN, EVBUFFER_PTR_SET);
-    evbuffer_copyout_from(input, &pos, signing_pub_key, CLIENT_SIG_KEY_PUB_LEN);
+    message_len = codec->frame_len;
+    signing_pub_key = prot_codec_field(codec, input, PROT_MESSAGE_F_SIG_KEY, signing_pub_key_s);
 
     debug("Message length OK");
 
-    // If message signature is invalid
-    if (!ed25519_buffer_validate(input, message_len, signing_pub_key)) {
-        prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
-        return;
+    // Check message signature, message was hashed as it arrived,
+    // so job gets only its hash and the signature
+    if (!msg->job) {
+        if (prot_main_recv_hash(pmain, codec, hash)) {
+            prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+            return;
+        }
+        msg->job = crypto_job_new(CRYPTO_JOB_VERIFY_HASH, signing_pub_key, CLIENT_SIG_KEY_PUB_LEN);
+        evbuffer_add(msg->job->in, hash, ED25519_PREHASH_LEN);
+        prot_view_set(&view, input, message_len - ED25519_SIGNATURE_LEN, ED25519_SIGNATURE_LEN);
+        prot_view_add(&view, msg->job->in);
+        prot_view_free(&view);
+
+        if (prot_main_recv_await(pmain, msg->job))
+            return;
     }
 
-    debug("Message buffer SIG OK");
+    if (msg->job->type == CRYPTO_JOB_VERIFY_HASH) {
+        rc = msg->job->result;
+        crypto_job_free(msg->job);
+        msg->job = NULL;
+
+        // If message signature is invalid
+        if (!rc) {
+            prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+            return;
+        }
+        debug("Message buffer SIG OK");
+    }
 
     // Extract message GID from the buffer
-    evbuffer_ptr_set(input, &pos, PROT_HEADER_LEN + TRANSACTION_ID_LEN +
-        MAILBOX_ID_LEN + CLIENT_SIG_KEY_PUB_LEN, EVBUFFER_PTR_SET);
-    evbuffer_copyout_from(input, &pos, message_gid, MESSAGE_ID_LEN);
+    message_gid = prot_codec_field(codec, input, PROT_MESSAGE_F_GID, message_gid_s);
 
     if (pmain->mode == PROT_MODE_CLIENT) {
         int i;
         uint8_t ctype;
         size_t plain_len;
         uint8_t *plain_data;
-        struct evbuffer *plain = NULL;
+        struct evbuffer *plain;
+        struct evbuffer *session_plain = NULL;
+
+        // Session key used by the message (protocol v2 envelope)
+        struct db_session sess;
+        int has_session = layout == &prot_session_layout;
+
+        memset(&sess, 0, sizeof(struct db_session));
 
         debug("Working as a client");
 
-        // Drain header data
-        evbuffer_drain(input, PROT_HEADER_LEN + TRANSACTION_ID_LEN +
-            MAILBOX_ID_LEN + CLIENT_SIG_KEY_PUB_LEN + MESSAGE_ID_LEN);
+        // Signature is OK, decrypt message body
+        if (!msg->job) {
+            // If given contact doesn't exist quit
+            if(
+                !(msg->client_cont = db_contact_get_by_rsk_pub(msg->db, signing_pub_key, NULL))
+                || msg->client_cont->status != DB_CONTACT_ACTIVE || msg->client_cont->deleted
+            ) {
+                prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+                goto cl_err;
+            }
 
-        // If given contact doesn't exist quit
-        if(
-            !(msg->client_cont = db_contact_get_by_rsk_pub(msg->db, signing_pub_key, NULL)) 
-            || msg->client_cont->status != DB_CONTACT_ACTIVE || msg->client_cont->deleted
-        ) {
-            prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
-            goto cl_err;
-        }
+            // If this message is already here skip processing, unless it carries
+            // key of the session we don't have, contact takes our ACK as a sign
+            // that we have it
+            msg->client_msg = db_message_get_by_gid(msg->db, message_gid, NULL);
+            if (msg->client_msg && !has_session)
+                goto cl_ack_send;
 
-        // If this message is already here skip processing
-        msg->client_msg = db_message_get_by_gid(msg->db, message_gid, NULL);
-        if (msg->client_msg)
-            goto cl_ack_send;
+            // Else create new message
+            if (!msg->client_msg) {
+                msg->client_msg = db_message_new();
+                msg->client_msg->contact_id = msg->client_cont->id;
+                msg->client_msg->sender = DB_MESSAGE_SENDER_FRIEND;
+                memcpy(msg->client_msg->global_id, message_gid, MESSAGE_ID_LEN);
+            }
+
+            if (has_session) {
+                // Key is known, RSA is used only once per session
+                if (db_session_get_remote(msg->db, msg->client_cont->id,
+                    prot_message_session_id(codec, input), &sess)
+                ) {
+                    if (msg->client_msg->id)
+                        goto cl_ack_send;
+                    goto cl_decrypt;
+                }
+
+                if (prot_codec_len(codec, PROT_SESSION_F_WRAP) != SESSION_WRAP_LEN) {
+                    prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+                    goto cl_err;
+                }
+                prot_codec_view(codec, input, PROT_SESSION_F_WRAP, PROT_SESSION_F_WRAP, &view);
+            } else {
+                prot_codec_view(codec, input, PROT_MESSAGE_F_DATA_LEN, PROT_MESSAGE_F_DATA_IV, &view);
+            }
+
+            msg->job = crypto_job_new(CRYPTO_JOB_OPEN, msg->client_cont->local_enc_key_priv, CLIENT_ENC_KEY_PRIV_LEN);
+            prot_view_add(&view, msg->job->in);
+            prot_view_free(&view);
 
-        // Else create new message
-        msg->client_msg = db_message_new();
-        msg->client_msg->contact_id = msg->client_cont->id;
-        msg->client_msg->sender = DB_MESSAGE_SENDER_FRIEND;
-        memcpy(msg->client_msg->global_id, message_gid, MESSAGE_ID_LEN);
+            if (prot_main_recv_await(pmain, msg->job))
+                return;
+        }
 
-        plain = evbuffer_new();
-        if (rc = rsa_buffer_decrypt(input, msg->client_cont->local_enc_key_priv, plain, NULL)) {
+        if (msg->job->result) {
             prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
             goto cl_err;
         }
 
+        cl_decrypt:
+        if (has_session) {
+            // Session key was unwrapped by the job
+            if (msg->job && prot_message_session_add(msg->db, msg->client_cont,
+                prot_message_session_id(codec, input), msg->job->out, &sess)
+            ) {
+                prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+                goto cl_err;
+            }
+
+            // Message is already here, only the key was needed
+            if (msg->client_msg->id)
+                goto cl_ack_send;
+
+            plain = session_plain = evbuffer_new();
+            if (prot_message_session_open(codec, input, &sess, plain)) {
+                prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+                goto cl_err;
+            }
+        } else {
+            plain = msg->job->out;
+        }
         evbuffer_remove(plain, &ctype, sizeof(ctype));
         plain_len = evbuffer_get_length(plain);
         plain_data = evbuffer_pullup(plain, plain_len);
@@ -305,27 +640,29 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
         }
 
         cl_ack_send:
-        ack = prot_ack_ed25519_new(PROT_ACK_SIGNATURE, NULL, msg->client_cont->local_sig_key_priv, ack_sent, msg);
-        prot_main_push_tran(pmain, &(ack->htran));
-        msg->hrecv.cleanup_cb = NULL;
+        prot_main_peer_auth(pmain, msg->client_cont);
+        prot_message_ack_send(pmain, phand->msg_code, PROT_ACK_SIGNATURE,
+            msg->client_cont->local_sig_key_priv, message_gid, msg);
+        phand->cleanup_cb = NULL;
         pmain->current_recv_done = 1;
 
         cl_err:
-        if (plain)
-            evbuffer_free(plain);
-        evbuffer_drain(input, sizeof(data_len) + data_len + AES_ENC_KEY_LENGTH + AES_IV_LENGTH + ED25519_SIGNATURE_LEN);
+        OPENSSL_cleanse(&sess, sizeof(struct db_session));
+        if (session_plain)
+            evbuffer_free(session_plain);
+        crypto_job_free(msg->job);
+        msg->job = NULL;
+        evbuffer_drain(input, message_len);
         return;
     }
 
     if (pmain->mode == PROT_MODE_MAILBOX) {
-        uint8_t *message_data;
         struct db_mb_account *mb_account = NULL;
         struct db_mb_contact *mb_contact = NULL;
         uint8_t mb_onion_priv_key[ONION_PRIV_KEY_LEN];
 
         // Get mailbox ID from the buffer
-        evbuffer_ptr_set(input, &pos, PROT_HEADER_LEN + TRANSACTION_ID_LEN, EVBUFFER_PTR_SET);
-        evbuffer_copyout_from(input, &pos, mailbox_id, MAILBOX_ID_LEN);
+        mailbox_id = prot_codec_field(codec, input, PROT_MESSAGE_F_MB_ID, mailbox_id_s);
 
         if (!(mb_account = db_mb_account_get_by_mbid(msg->db, mailbox_id, NULL))) {
             prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
@@ -345,13 +682,14 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
         msg->mailbox_msg->contact_id = mb_contact->id;
         memcpy(msg->mailbox_msg->global_id, message_gid, MESSAGE_ID_LEN);
 
-        message_data = evbuffer_pullup(input, message_len);
-        db_mb_message_set_data(msg->mailbox_msg, message_data, message_len);
+        // Message is stored as it is, copied once from the buffer chunks
+        prot_view_set(&view, input, 0, message_len);
+        prot_view_copy(&view, db_mb_message_data_reserve(msg->mailbox_msg, message_len));
+        prot_view_free(&view);
 
         mb_ack_send:
         db_options_get_bin(msg->db, "onion_private_key", mb_onion_priv_key, ONION_PRIV_KEY_LEN);
-        ack = prot_ack_ed25519_new(PROT_ACK_ONION, NULL, mb_onion_priv_key, ack_sent, msg);
-        prot_main_push_tran(pmain, &(ack->htran));
+        prot_message_ack_send(pmain, phand->msg_code, PROT_ACK_ONION, mb_onion_priv_key, message_gid, msg);
 
         pmain->current_recv_done = 1;
         phand->cleanup_cb = NULL;
@@ -368,8 +706,7 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
 static struct prot_message * prot_message_new(sqlite3 *db, struct db_message *dbmsg) {
     struct prot_message *msg;
 
-    msg = safe_malloc(sizeof(struct prot_message),
-        "Failed to allocate message protocol handler");
+    msg = free_list_get(&message_free_list);
     memset(msg, 0, sizeof(struct prot_message));
 
     msg->db = db;
@@ -385,10 +722,13 @@ static struct prot_message * prot_message_new(sqlite3 *db, struct db_message *db
 
     msg->htran.msg = msg;
     msg->htran.msg_code = PROT_MESSAGE_CONTAINER;
-    msg->htran.buffer = evbuffer_new();
+    msg->htran.priority = PROT_PRIO_INTERACTIVE;
+    msg->htran.buffer = NULL;
     msg->htran.done_cb = tran_done;
     msg->htran.setup_cb = tran_setup;
     msg->htran.cleanup_cb = tran_cleanup;
+
+    return msg;
 }
 
 // Allocate new message handler for sending message between clients
@@ -411,6 +751,205 @@ struct prot_message * prot_message_to_mailbox_new(sqlite3 *db, struct db_message
     return msg;
 }
 
+// Get layout of the message container with given message code, returns
+// NULL if code doesn't belong to a message container
+const struct prot_layout * prot_message_layout_get(uint8_t msg_code) {
+    switch (msg_code) {
+        case PROT_MESSAGE_CONTAINER:
+            return &prot_message_layout;
+        case PROT_MESSAGE_SESSION:
+            return &prot_session_layout;
+        default:
+            return NULL;
+    }
+}
+
+// Get local session used to encrypt messages to the contact and reserve nonces for
+// n messages, session is created if there is none, or replaced if it was used too
+// many times, counter of the returned session is the first reserved one, key of
+// the new session is not sealed yet (see prot_message_session_wrap_job), returns
+// NULL on failure, session must be freed
+struct db_session * prot_message_session_reserve(sqlite3 *db, struct db_contact *cont, int n) {
+    uint64_t counter;
+    uint32_t session_id = 1;
+    struct db_session *sess, *old;
+
+    sess = db_session_get_local(db, cont->id, NULL);
+
+    if (!sess || sess->counter + n > PROT_SESSION_REKEY_AFTER) {
+        // Sessions of the contact are numbered, so new one can't reuse ID of
+        // the session contact still keeps, old one is replaced right away
+        old = sess;
+        if (old) {
+            debug("Session %u used up, creating new one", old->session_id);
+            // ID 0 means there is no session
+            session_id = old->session_id + 1 ? old->session_id + 1 : 1;
+        }
+
+        sess = db_session_new();
+        sess->contact_id = cont->id;
+        sess->direction = DB_SESSION_LOCAL;
+        sess->session_id = session_id;
+
+        if (RAND_bytes(sess->key, SESSION_KEY_LEN) != 1) {
+            db_session_free(sess);
+            db_session_free(old);
+            return NULL;
+        }
+
+        if (old)
+            db_session_delete(db, old);
+        db_session_free(old);
+    }
+
+    counter = sess->counter;
+    sess->counter += n;
+    db_session_save(db, sess);
+    sess->counter = counter;
+
+    return sess;
+}
+
+// Create crypto job which seals key of the session using contact's RSA key, returns
+// NULL if session doesn't need it (key is sealed already, or contact has it),
+// messages reserved while the job runs seal the key again, any of the seals works
+struct crypto_job * prot_message_session_wrap_job(struct db_session *sess, struct db_contact *cont) {
+    struct crypto_job *job;
+
+    if (sess->wrapped || sess->confirmed)
+        return NULL;
+
+    job = crypto_job_new(CRYPTO_JOB_SEAL, cont->remote_enc_key_pub, CLIENT_ENC_KEY_PUB_LEN);
+    evbuffer_add(job->in, sess->key, SESSION_KEY_LEN);
+    return job;
+}
+
+// Store key sealed by given job into the session and the database, returns
+// 0 on success and 1 on failure
+int prot_message_session_wrap_done(sqlite3 *db, struct db_session *sess, struct crypto_job *job) {
+    if (job->result || evbuffer_get_length(job->out) != SESSION_WRAP_LEN)
+        return 1;
+
+    evbuffer_remove(job->out, sess->wrap, SESSION_WRAP_LEN);
+    sess->wrapped = 1;
+    db_session_set_wrap(db, sess->id, sess->wrap);
+    return 0;
+}
+
+// Returns length of the message container carrying given client message, encrypted
+// using given session, or using contact's RSA key if session is NULL
+size_t prot_message_container_len(struct db_session *sess, struct db_message *dbmsg) {
+    int i, n_parts;
+    uint8_t ctype;
+    size_t plain_len = 0;
+    struct evbuffer_iovec parts[PROT_MESSAGE_PLAIN_MAX_PARTS];
+
+    n_parts = prot_message_plain_parts(dbmsg, &ctype, parts);
+    for (i = 0; i < n_parts; i++)
+        plain_len += parts[i].iov_len;
+
+    if (!sess)
+        return PROT_MESSAGE_HEADER_LEN + rsa_buffer_sealed_len(plain_len) + ED25519_SIGNATURE_LEN;
+
+    return PROT_MESSAGE_HEADER_LEN + SESSION_NONCE_LEN + sizeof(uint16_t) +
+        (sess->confirmed ? 0 : SESSION_WRAP_LEN) + aead_buffer_sealed_len(plain_len) +
+        ED25519_SIGNATURE_LEN;
+}
+
+// Write signed message container carrying given client message to the writer in
+// a single pass, message is encrypted straight into the buffer using the next
+// reserved nonce of the session, or using contact's RSA key if session is NULL,
+// returns 0 on success and 1 on failure, in which case writer is left with open
+// sections
+int prot_message_write(
+    struct ed25519_writer *w,
+    const uint8_t *transaction_id,
+    struct db_contact *cont,
+    struct db_session *sess,
+    struct db_message *dbmsg
+) {
+    if (ed25519_writer_begin(w))
+        return 1;
+    if (sess && prot_message_write_body(w, transaction_id, cont, sess, dbmsg))
+        return 1;
+    if (!sess && prot_message_write_legacy(w, transaction_id, cont, dbmsg))
+        return 1;
+
+    return ed25519_writer_end(w, cont->local_sig_key_priv);
+}
+
+// Get ID of the session used by the message container encrypted using session key,
+// parsed by the codec at the start of given buffer
+uint32_t prot_message_session_id(struct prot_codec *codec, struct evbuffer *buff) {
+    uint32_t session_id;
+    struct evbuffer_ptr pos;
+
+    // Nonce starts with the session ID
+    evbuffer_ptr_set(buff, &pos, prot_codec_offset(codec, PROT_SESSION_F_NONCE), EVBUFFER_PTR_SET);
+    evbuffer_copyout_from(buff, &pos, &session_id, sizeof(session_id));
+    return ntohl(session_id);
+}
+
+// Save remote session of the contact with key unwrapped from the message container,
+// returns 0 on success and 1 if unwrapped data is not a session key
+int prot_message_session_add(
+    sqlite3 *db,
+    struct db_contact *cont,
+    uint32_t session_id,
+    struct evbuffer *key,
+    struct db_session *sess
+) {
+    if (evbuffer_get_length(key) != SESSION_KEY_LEN)
+        return 1;
+
+    memset(sess, 0, sizeof(struct db_session));
+    sess->contact_id = cont->id;
+    sess->direction = DB_SESSION_REMOTE;
+    sess->session_id = session_id;
+    evbuffer_remove(key, sess->key, SESSION_KEY_LEN);
+
+    db_session_save(db, sess);
+    return 0;
+}
+
+// Decrypt body of the message container encrypted using given session key, parsed by
+// the codec at the start of given buffer, into plain buffer, buffer is not modified,
+// returns 0 on success and 1 on failure
+int prot_message_session_open(
+    struct prot_codec *codec,
+    struct evbuffer *buff,
+    struct db_session *sess,
+    struct evbuffer *plain
+) {
+    uint8_t nonce[SESSION_NONCE_LEN];
+
+    prot_codec_copy(codec, buff, PROT_SESSION_F_NONCE, nonce);
+    return aead_buffer_decrypt(buff, prot_codec_offset(codec, PROT_SESSION_F_DATA_LEN),
+        sess->key, nonce, plain);
+}
+
+// Wait for ACK of given client message which has been sent to the contact as a part of
+// another message (contact sync), message is saved and message events are called once
+// ACK arrives or fails to arrive, just like for the message container, message is freed
+void prot_message_ack_expect(struct prot_main *pmain, sqlite3 *db, struct db_contact *cont, struct db_message *dbmsg) {
+    struct prot_message *msg;
+    struct db_session sess;
+
+    msg = prot_message_new(db, NULL);
+    msg->to = PROT_MESSAGE_TO_CLIENT;
+    msg->client_msg = dbmsg;
+
+    // Message was just written using the current session
+    if (db_session_get_local(db, cont->id, &sess))
+        msg->session_id = sess.session_id;
+    OPENSSL_cleanse(&sess, sizeof(struct db_session));
+    msg->client_msg->status = DB_MESSAGE_STATUS_SENT_CONFIRMED;
+
+    prot_ack_batch_expect(pmain, PROT_ACK_BATCH_SIGNATURE, cont->remote_sig_key_pub,
+        dbmsg->global_id, ack_received, msg);
+}
+
+// Free given handler and message model given to the new method
 void prot_message_free(struct prot_message *msg) {
     if (!msg) return;
 
@@ -420,7 +959,8 @@ void prot_message_free(struct prot_message *msg) {
         db_contact_free(msg->client_cont);
     if (msg->mailbox_msg)
         db_mb_message_free(msg->mailbox_msg);
+    db_session_free(msg->sess);
+    crypto_job_free(msg->job);
 
-    evbuffer_free(msg->htran.buffer);
-    free(msg);
+    free_list_put(&message_free_list, msg);
 }
\ No newline at end of file
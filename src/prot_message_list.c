@@ -4,6 +4,7 @@
 #include <prot_main.h>
 #include <db_message.h>
 #include <db_mb_message.h>
+#include <prot_message.h>
 #include <prot_message_list.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
@@ -16,6 +17,52 @@
 #include <array.h>
 #include <prot_client_fetch.h>
 #include <prot_mb_fetch.h>
+#include <prot_registry.h>
+#include <prot_ack.h>
+#include <free_list.h>
+#include <openssl/crypto.h>
+
+// Layout of message list header, messages and list signature follow it
+#define LIST_FIELDS(X) \
+    X(LIST_HEADER, BYTES, PROT_HEADER_LEN,    0) \
+    X(LIST_TXN,    BYTES, TRANSACTION_ID_LEN, 0) \
+    X(LIST_LENGTH, U32,   0,                  0)
+
+enum list_fields { LIST_FIELDS(PROT_FIELD_NAME) };
+static const struct prot_layout list_layout = PROT_LAYOUT(LIST_FIELDS);
+
+// Layout of contact sync header, it carries key of the contact sending it
+#define SYNC_FIELDS(X) \
+    X(SYNC_HEADER, BYTES, PROT_HEADER_LEN,        0) \
+    X(SYNC_TXN,    BYTES, TRANSACTION_ID_LEN,     0) \
+    X(SYNC_KEY,    BYTES, CLIENT_SIG_KEY_PUB_LEN, 0) \
+    X(SYNC_LENGTH, U32,   0,                      0)
+
+enum sync_fields { SYNC_FIELDS(PROT_FIELD_NAME) };
+static const struct prot_layout sync_layout = PROT_LAYOUT(SYNC_FIELDS);
+
+// Unused handler objects, reused by next allocation
+static struct free_list message_list_free_list = FREE_LIST_INIT(struct prot_message_list, FREE_LIST_MAX_FREE);
+
+// Called when contact sync request is sent, sent messages are now waiting
+// for ACK and contact's messages for us are expected to follow it
+static void sync_tran_done(struct prot_main *pmain, struct prot_message_list *msg) {
+    int i;
+    struct prot_message_list *msg_list;
+
+    for (i = 0; i < msg->n_client_msgs; i++) {
+        if (msg->client_msgs[i]->contact_id != msg->client_cont->id)
+            continue;
+        // Message is freed once ACK arrives
+        prot_message_ack_expect(pmain, msg->db, msg->client_cont, msg->client_msgs[i]);
+        msg->client_msgs[i] = NULL;
+    }
+
+    msg_list = prot_message_list_client_new(msg->db, msg->client_cont, NULL, 0);
+    prot_main_push_recv(pmain, &(msg_list->hrecv));
+    // Contact is now owned by the list receiver
+    msg->client_cont = NULL;
+}
 
 // Called when message list is sent successfully
 static void tran_done(struct prot_main *pmain, struct prot_tran_handler *phand) {
@@ -24,6 +71,11 @@ static void tran_done(struct prot_main *pmain, struct prot_tran_handler *phand)
     struct prot_message_list_ev_data evdata =
         { msg->n_client_msgs, msg->client_msgs };
 
+    if (msg->sync) {
+        sync_tran_done(pmain, msg);
+        return;
+    }
+
     debug("DONE PML messages %d %p %p", msg->n_client_msgs, msg->client_msgs, msg->client_cont);
     
     for (i = 0; i < msg->n_client_msgs; i++) {
@@ -42,94 +94,122 @@ static void tran_done(struct prot_main *pmain, struct prot_tran_handler *phand)
 
 // Called to free memory taken by handler object when transmission is done
 static void tran_cleanup(struct prot_main *pmain, struct prot_tran_handler *phand) {
+    int i;
     struct prot_message_list *msg = phand->msg;
+
+    // Sync request failed, so did all messages in it
+    if (msg->sync && !phand->success) {
+        for (i = 0; i < msg->n_client_msgs; i++)
+            hook_list_call(pmain->hooks, PROT_MESSAGE_EV_FAIL, msg->client_msgs[i]);
+        hook_list_call(pmain->hooks, PROT_CLIENT_FETCH_EV_FAIL, NULL);
+    }
+
     prot_message_list_free(msg);
 }
 
-// Called to serilize message and put it into buffer
+// Called to serilize message and put it into buffer, list length is calculated
+// first, so list is written, encrypted and signed in a single pass, if new session
+// is created its key is sealed by crypto job first, which may suspend the
+// transmitter, in which case this is called again once the job is done
 static void tran_setup(struct prot_main *pmain, struct prot_tran_handler *phand) {
     struct prot_message_list *msg = phand->msg;
-    int i;
+    int i, rc;
     uint32_t length = 0;
+    struct ed25519_writer w;
 
     debug("Transmission setup PML");
 
+    ed25519_writer_init(&w, phand->buffer);
+
     if (pmain->mode == PROT_MODE_CLIENT) {
+        int n_msgs = 0;
+        struct db_session *sess;
         struct db_contact *cont = msg->client_cont;
 
-        for (i = 0; i < msg->n_client_msgs; i++) {
-            struct db_message *dbmsg = msg->client_msgs[i];
-            struct evbuffer *plain;
-            struct evbuffer *encrypted;
-
-            uint8_t ctype = dbmsg->type;
-
-            if (dbmsg->contact_id != cont->id)
-                continue;
-
-            plain = evbuffer_new();
-            encrypted = evbuffer_new();
-
-            evbuffer_add(encrypted, prot_header(PROT_MESSAGE_CONTAINER), PROT_HEADER_LEN);
-            evbuffer_add(encrypted, pmain->transaction_id, TRANSACTION_ID_LEN);
-            evbuffer_add(encrypted, cont->mailbox_id, MAILBOX_ID_LEN);
-            evbuffer_add(encrypted, cont->local_sig_key_pub, CLIENT_SIG_KEY_PUB_LEN);
-            evbuffer_add(encrypted, dbmsg->global_id, MESSAGE_ID_LEN);
+        if (!msg->tran_job) {
+            for (i = 0; i < msg->n_client_msgs; i++) {
+                if (msg->client_msgs[i]->contact_id == cont->id)
+                    ++n_msgs;
+            }
 
-            evbuffer_add(plain, &ctype, sizeof(ctype));
+            // Nonces for all messages are reserved at once, peer which doesn't know
+            // session containers gets messages encrypted using contact's RSA key
+            if (n_msgs > 0 && prot_main_peer_knows(pmain, PROT_MESSAGE_SESSION)) {
+                if (!(msg->tran_sess = prot_message_session_reserve(msg->db, cont, n_msgs))) {
+                    prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+                    return;
+                }
 
-            switch (dbmsg->type) {
-                case DB_MESSAGE_TEXT:
-                    evbuffer_add(plain, dbmsg->body_text, dbmsg->body_text_len);
-                    break;
-                case DB_MESSAGE_NICK:
-                    evbuffer_add(plain, dbmsg->body_nick, dbmsg->body_nick_len);
-                    break;
-                case DB_MESSAGE_RECV:
-                    evbuffer_add(plain, dbmsg->body_recv_id, MESSAGE_ID_LEN);
-                    break;
-                case DB_MESSAGE_MBOX:
-                    evbuffer_add(plain, dbmsg->body_mbox_id, MAILBOX_ID_LEN);
-                    evbuffer_add(plain, dbmsg->body_mbox_onion, ONION_ADDRESS_LEN);
-                    break;
+                msg->tran_job = prot_message_session_wrap_job(msg->tran_sess, cont);
+                if (msg->tran_job && prot_main_tran_await(pmain, msg->tran_job))
+                    return;
             }
+        }
 
-            rsa_buffer_encrypt(plain, cont->remote_enc_key_pub, encrypted, NULL);
-            evbuffer_free(plain);
+        // Key of the new session is sealed, list can be written now
+        if (msg->tran_job) {
+            rc = prot_message_session_wrap_done(msg->db, msg->tran_sess, msg->tran_job);
+            crypto_job_free(msg->tran_job);
+            msg->tran_job = NULL;
 
-            ed25519_buffer_sign(encrypted, 0, cont->local_sig_key_priv);
-            evbuffer_add_buffer_reference(phand->buffer, encrypted);
+            if (rc) {
+                prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+                return;
+            }
+        }
+        sess = msg->tran_sess;
 
-            length += evbuffer_get_length(encrypted);
-            evbuffer_free(encrypted);
+        for (i = 0; i < msg->n_client_msgs; i++) {
+            if (msg->client_msgs[i]->contact_id == cont->id)
+                length += prot_message_container_len(sess, msg->client_msgs[i]);
         }
 
         length = htonl(length);
-        evbuffer_prepend(phand->buffer, &length, sizeof(length));
-        evbuffer_prepend(phand->buffer, pmain->transaction_id, TRANSACTION_ID_LEN);
-        evbuffer_prepend(phand->buffer, prot_header(PROT_MESSAGE_LIST), PROT_HEADER_LEN);
+        ed25519_writer_begin(&w);
+        ed25519_writer_add(&w, prot_header(msg->htran.msg_code), PROT_HEADER_LEN);
+        ed25519_writer_add(&w, pmain->transaction_id, TRANSACTION_ID_LEN);
+        // Sync request carries our key, so contact knows who is asking
+        if (msg->sync)
+            ed25519_writer_add(&w, cont->local_sig_key_pub, CLIENT_SIG_KEY_PUB_LEN);
+        ed25519_writer_add(&w, &length, sizeof(length));
+
+        for (i = 0; i < msg->n_client_msgs; i++) {
+            struct db_message *dbmsg = msg->client_msgs[i];
 
-        ed25519_buffer_sign(phand->buffer, 0, cont->local_sig_key_priv);
+            if (dbmsg->contact_id != cont->id)
+                continue;
+            if (prot_message_write(&w, pmain->transaction_id, cont, sess, dbmsg))
+                break;
+        }
+
+        ed25519_writer_end(&w, cont->local_sig_key_priv);
 
         debug("Transmission setup PML DONE for %d messages %p", msg->n_client_msgs, msg->client_msgs);
     }
 
     if (pmain->mode == PROT_MODE_MAILBOX) {
-        int i;
         uint8_t mb_sig_priv_key[ONION_PRIV_KEY_LEN];
-        
-        for (i = 0; i < msg->n_mailbox_msgs; i++) {
+
+        for (i = 0; i < msg->n_mailbox_msgs; i++)
             length += msg->mailbox_msgs[i]->data_len;
-            evbuffer_add(phand->buffer, msg->mailbox_msgs[i]->data, msg->mailbox_msgs[i]->data_len);
-        }
 
         length = htonl(length);
-        evbuffer_prepend(phand->buffer, &length, sizeof(length));
-        evbuffer_prepend(phand->buffer, pmain->transaction_id, TRANSACTION_ID_LEN);
-        evbuffer_prepend(phand->buffer, prot_header(PROT_MESSAGE_LIST), PROT_HEADER_LEN);
+        ed25519_writer_begin(&w);
+        ed25519_writer_add(&w, prot_header(PROT_MESSAGE_LIST), PROT_HEADER_LEN);
+        ed25519_writer_add(&w, pmain->transaction_id, TRANSACTION_ID_LEN);
+        ed25519_writer_add(&w, &length, sizeof(length));
+
+        for (i = 0; i < msg->n_mailbox_msgs; i++)
+            ed25519_writer_add(&w, msg->mailbox_msgs[i]->data, msg->mailbox_msgs[i]->data_len);
 
         db_options_get_bin(msg->db, "onion_private_key", mb_sig_priv_key, ONION_PRIV_KEY_LEN);
-        ed25519_buffer_sign(phand->buffer, 0, mb_sig_priv_key);
+        ed25519_writer_end(&w, mb_sig_priv_key);
+    }
+
+    // Partially written list can't be sent
+    if (w.err) {
+        ed25519_writer_cleanup(&w);
+        prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
     }
 }
 
@@ -138,7 +218,12 @@ static void recv_cleanup(struct prot_main *pmain, struct prot_recv_handler *phan
     struct prot_message_list *msg = phand->msg;
 
     if (!phand->success) {
-        if (msg->from == PROT_MESSAGE_LIST_FROM_CLIENT)
+        // List didn't finish, revert messages saved from it so far
+        if (msg->recv_batch)
+            db_message_batch_rollback(msg->db, msg->recv_batch);
+
+        // Nobody is waiting for the sync request we received
+        if (msg->from == PROT_MESSAGE_LIST_FROM_CLIENT && !msg->sync)
             hook_list_call(pmain->hooks, PROT_CLIENT_FETCH_EV_FAIL, NULL);
         if (msg->from == PROT_MESSAGE_LIST_FROM_MAILBOX)
             hook_list_call(pmain->hooks, PROT_MB_FETCH_EV_FAIL, NULL);
@@ -147,230 +232,534 @@ static void recv_cleanup(struct prot_main *pmain, struct prot_recv_handler *phan
     prot_message_list_free(msg);
 }
 
-// Called to handle incomming message
-static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand) {
-    struct prot_message_list *msg = phand->msg; // Message handler instance
+// Remember global ID of the message which should be acknowledged (sync)
+static void recv_ack_add(struct prot_message_list *msg, const uint8_t *gid) {
+    array_expand(msg->recv_acks, (msg->n_recv_acks + 1) * MESSAGE_ID_LEN);
+    memcpy(msg->recv_acks + msg->n_recv_acks * MESSAGE_ID_LEN, gid, MESSAGE_ID_LEN);
+    ++msg->n_recv_acks;
+}
+
+// Get contact changed by earlier message from the list, which is not saved yet
+static struct db_contact * recv_update_get(struct prot_message_list *msg, int contact_id) {
     int i;
-    uint32_t length;                            // List length (size in bytes)
-    struct evbuffer *input;                     // Bufferevent input buffer
-    struct evbuffer_ptr pos;                    // Buffer position pointer
-    uint8_t key[ED25519_PUB_KEY_LEN];           // Key used to check message signature
-    struct prot_message_list_ev_data evdata;    // Data passed to hook callback
 
-    // Full message length
-    size_t message_len = PROT_HEADER_LEN + TRANSACTION_ID_LEN + sizeof(length);
+    for (i = 0; i < msg->n_recv_updates; i++) {
+        if (msg->recv_updates[i]->id == contact_id)
+            return msg->recv_updates[i];
+    }
+    return NULL;
+}
 
-    // Get buffer and check buffer length, wait for entire message to arrive
-    input = bufferevent_get_input(pmain->bev);
+// Remember changes made to the contact, contact is saved once the list signature
+// is checked, so changes from the list which fails are never written
+static void recv_update_add(struct prot_message_list *msg, struct db_contact *cont) {
+    struct db_contact *update;
 
-    if (evbuffer_get_length(input) < message_len)
-        return;
+    if (!(update = recv_update_get(msg, cont->id))) {
+        update = db_contact_new();
+        array_set(msg->recv_updates, msg->n_recv_updates, update);
+        ++msg->n_recv_updates;
+    }
+    memcpy(update, cont, sizeof(struct db_contact));
+}
 
-    evbuffer_ptr_set(input, &pos, message_len - sizeof(length), EVBUFFER_PTR_SET);
-    evbuffer_copyout_from(input, &pos, &length, sizeof(length));
-    length = ntohl(length);
+// Save contacts changed by messages from the list, called once list is committed
+static void recv_updates_save(struct prot_message_list *msg) {
+    int i;
 
-    message_len += length + ED25519_SIGNATURE_LEN;
+    for (i = 0; i < msg->n_recv_updates; i++) {
+        db_contact_save(msg->db, msg->recv_updates[i]);
+        db_contact_free(msg->recv_updates[i]);
+    }
+    msg->n_recv_updates = 0;
+}
 
-    if (evbuffer_get_length(input) < message_len)
+// Take message container parsed by the list codec out of the input buffer and start
+// its signature check and decryption, checks which need the database are done here,
+// so jobs are not started for messages which will be skipped anyway
+static void recv_entry_start(struct prot_main *pmain, struct prot_message_list *msg, struct evbuffer *input) {
+    int i, dup;
+    struct prot_view view;
+    struct db_session sess;
+    struct db_contact *cont;
+    struct db_message *dbmsg;
+    struct prot_codec *codec;
+    struct prot_message_list_entry *e, *prev;
+
+    // Global message ID
+    uint8_t gid[MESSAGE_ID_LEN];
+    // Message sender public signing key
+    uint8_t contact_sig_key[CLIENT_SIG_KEY_PUB_LEN];
+
+    e = &(msg->recv_entries[(msg->recv_first + msg->n_recv_entries) % PROT_MESSAGE_LIST_MAX_PENDING]);
+    memset(e, 0, sizeof(struct prot_message_list_entry));
+    e->layout = msg->recv_layout;
+    e->codec = msg->recv_codec;
+    codec = &(e->codec);
+
+    ++msg->n_recv_entries;
+    msg->recv_pending_len += codec->frame_len;
+
+    // Job gets its own copy of the message, copied once straight from
+    // the buffer chunks, message is decrypted from the copy as well
+    prot_codec_copy(codec, input, PROT_MESSAGE_F_SIG_KEY, contact_sig_key);
+    e->verify = crypto_job_new(CRYPTO_JOB_VERIFY, contact_sig_key, CLIENT_SIG_KEY_PUB_LEN);
+    prot_view_set(&view, input, 0, codec->frame_len);
+    prot_view_add(&view, e->verify->in);
+    prot_view_free(&view);
+    evbuffer_drain(input, codec->frame_len);
+    input = e->verify->in;
+
+    // Contact can only sync its own messages
+    if (msg->sync && memcmp(contact_sig_key, msg->recv_key, CLIENT_SIG_KEY_PUB_LEN)) {
+        e->invalid = 1;
         return;
+    }
 
-    debug("Length OK");
-
-    // If message is from client use client key to verify it, otherwise use
-    // mailbox onion key
-    if (msg->from == PROT_MESSAGE_LIST_FROM_CLIENT) {
-        memcpy(key, msg->client_cont->remote_sig_key_pub, CLIENT_SIG_KEY_PUB_LEN);
-    } else {
-        char mb_onion[ONION_ADDRESS_LEN + 1];
-        db_options_get_text(msg->db, "client_mailbox_onion_address", 
-            mb_onion, ONION_ADDRESS_LEN + 1);
-        onion_extract_key(mb_onion, key);
+    // Messages in the list usually come from the same sender
+    if (!msg->recv_cont || memcmp(msg->recv_cont->remote_sig_key_pub, contact_sig_key, CLIENT_SIG_KEY_PUB_LEN)) {
+        if (!(cont = db_contact_get_by_rsk_pub(msg->db, contact_sig_key, msg->recv_cont))) {
+            e->invalid = 1;
+            return;
+        }
+        msg->recv_cont = cont;
+    }
+    e->contact_id = msg->recv_cont->id;
+    prot_main_recv_submit(pmain, e->verify);
+
+    // Message we already have doesn't have to be decrypted, but key
+    // of its session may still be missing
+    prot_codec_copy(codec, input, PROT_MESSAGE_F_GID, gid);
+    dbmsg = db_message_get_by_gid(msg->db, gid, NULL);
+    dup = dbmsg != NULL;
+    if (dup) {
+        db_message_free(dbmsg);
+        if (e->layout != &prot_session_layout)
+            return;
     }
 
-    if (!ed25519_buffer_validate(input, message_len, key)) {
-        prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
-        return;
+    if (e->layout == &prot_session_layout) {
+        e->session_id = prot_message_session_id(codec, input);
+
+        // Key is known, RSA is used only once per session
+        if (db_session_get_remote(msg->db, e->contact_id, e->session_id, &sess)) {
+            OPENSSL_cleanse(&sess, sizeof(struct db_session));
+            return;
+        }
+        // Or it's going to be, key is unwrapped by the first message of the session
+        for (i = 0; i < msg->n_recv_entries - 1; i++) {
+            prev = &(msg->recv_entries[(msg->recv_first + i) % PROT_MESSAGE_LIST_MAX_PENDING]);
+
+            if (prev->open && prev->contact_id == e->contact_id && prev->session_id == e->session_id)
+                return;
+        }
+
+        if (prot_codec_len(codec, PROT_SESSION_F_WRAP) != SESSION_WRAP_LEN) {
+            // Message we already have is still acknowledged
+            e->invalid = !dup;
+            return;
+        }
+        prot_codec_view(codec, input, PROT_SESSION_F_WRAP, PROT_SESSION_F_WRAP, &view);
+    } else {
+        prot_codec_view(codec, input, PROT_MESSAGE_F_DATA_LEN, PROT_MESSAGE_F_DATA_IV, &view);
     }
 
-    debug("List signature OK");
+    e->open = crypto_job_new(CRYPTO_JOB_OPEN, msg->recv_cont->local_enc_key_priv, CLIENT_ENC_KEY_PRIV_LEN);
+    prot_view_add(&view, e->open->in);
+    prot_view_free(&view);
+    prot_main_recv_submit(pmain, e->open);
+}
 
-    // Remove list header
-    evbuffer_drain(input, PROT_HEADER_LEN + TRANSACTION_ID_LEN + sizeof(length));
+// Process message whose jobs are done, valid messages are provisionally saved,
+// invalid ones are skipped, returns 1 if message is invalid
+static int recv_entry_finish(struct prot_message_list *msg, struct prot_message_list_entry *e) {
+    int i, invalid = 1;
+    uint8_t ctype;                   // Message content type
+    size_t plain_len;                // Decrypted message body length
+    uint8_t *plain_data;             // Pointer to decrypted message body
+    struct evbuffer *plain = NULL;   // Buffer that contains decrypted message body
+    struct db_message *dbmsg = NULL; // Message object
+    struct db_contact *cont, *update;
+    struct db_session sess;
+
+    struct prot_codec *codec = &(e->codec);
+    struct evbuffer *input = e->verify->in;
+
+    // Global message ID
+    uint8_t gid[MESSAGE_ID_LEN];
+    // Message sender public signing key
+    uint8_t contact_sig_key[CLIENT_SIG_KEY_PUB_LEN];
+
+    memset(&sess, 0, sizeof(struct db_session));
+    debug("Got message in the list");
+
+    if (e->invalid)
+        goto message_free;
+
+    // Validate buffer signature
+    if (!e->verify->result) {
+        debug("Message sig FAIL");
+        goto message_free;
+    }
 
-    evdata.n_messages = 0;
-    evdata.messages = array(struct db_message *);
-    
-    // Process all messages
-    while (length > 0) {
-        int rc, i;
-        uint8_t ctype;                   // Message content type
-        uint32_t data_len;               // Encrypted message body length
-        size_t plain_len;                // Decrypted message body length
-        uint8_t *plain_data;             // Pointer to decrypted message body
-        struct evbuffer *plain = NULL;   // Buffer that contains decrypted message body
-        struct db_message *dbmsg = NULL; // Message object
-
-        size_t header_len = PROT_HEADER_LEN + TRANSACTION_ID_LEN + MAILBOX_ID_LEN +
-            CLIENT_SIG_KEY_PUB_LEN + MESSAGE_ID_LEN + sizeof(data_len);
-        size_t message_len = header_len;
-
-        // Global message ID
-        uint8_t gid[MESSAGE_ID_LEN];
-        // Message sender public signing key
-        uint8_t contact_sig_key[CLIENT_SIG_KEY_PUB_LEN];
-
-        if (length < message_len)
-            break;
+    // Sender is fetched again, earlier messages may have changed it, changes
+    // which are not saved yet are taken from the list
+    prot_codec_copy(codec, input, PROT_MESSAGE_F_SIG_KEY, contact_sig_key);
+    if (!(cont = db_contact_get_by_rsk_pub(msg->db, contact_sig_key, msg->client_cont))) {
+        goto message_free;
+    }
+    msg->client_cont = cont;
+    if (update = recv_update_get(msg, cont->id))
+        memcpy(cont, update, sizeof(struct db_contact));
 
-        debug("Got message in the list");
+    debug("Message sig OK");
 
-        // Get message encrypted body length
-        evbuffer_ptr_set(input, &pos, message_len - sizeof(data_len), EVBUFFER_PTR_SET);
-        evbuffer_copyout_from(input, &pos, &data_len, sizeof(data_len));
-        data_len = ntohl(data_len);
+    prot_codec_copy(codec, input, PROT_MESSAGE_F_GID, gid);
 
-        // Get message sender signing key
-        evbuffer_ptr_set(input, &pos, PROT_HEADER_LEN + TRANSACTION_ID_LEN + 
-            MAILBOX_ID_LEN, EVBUFFER_PTR_SET);
-        evbuffer_copyout_from(input, &pos, contact_sig_key, CLIENT_SIG_KEY_PUB_LEN);
+    debug("Message checking existance");
+    if (dbmsg = db_message_get_by_gid(msg->db, gid, NULL)) {
+        debug("Message exists NOT OK");
+        // Key of the session is still needed by the messages after this one
+        if (e->open && !e->open->result)
+            prot_message_session_add(msg->db, msg->client_cont, e->session_id, e->open->out, &sess);
 
-        message_len += data_len + AES_ENC_KEY_LENGTH + AES_IV_LENGTH + ED25519_SIGNATURE_LEN;
+        // Already received, but sender didn't get the ACK
+        if (msg->sync)
+            recv_ack_add(msg, gid);
+        invalid = 0;
+        goto message_free;
+    }
+    debug("Message doesn't exist OK");
 
-        if (length < message_len)
-            break;
-        length -= message_len;
+    plain = evbuffer_new();
+    dbmsg = db_message_new();
 
-        debug("Message len OK %d", message_len);
-        
-        // Validate buffer signature
-        if (!ed25519_buffer_validate(input, message_len, contact_sig_key)) {
-            debug("Message sig FAIL");
+    if (e->layout == &prot_session_layout) {
+        // Session key was unwrapped by the job, or by the job of earlier message
+        if (e->open) {
+            if (e->open->result || prot_message_session_add(msg->db, msg->client_cont,
+                e->session_id, e->open->out, &sess)
+            ) {
+                goto message_free;
+            }
+        } else if (!db_session_get_remote(msg->db, msg->client_cont->id, e->session_id, &sess)) {
             goto message_free;
         }
 
-        // Search for the sender in the database
-        if (!(msg->client_cont = db_contact_get_by_rsk_pub(msg->db, contact_sig_key, msg->client_cont))) {
+        if (prot_message_session_open(codec, input, &sess, plain)) {
+            debug("Failed to decrypt");
+            goto message_free;
+        }
+    } else {
+        if (!e->open || e->open->result) {
+            debug("Failed to decrypt");
             goto message_free;
         }
+        evbuffer_add_buffer(plain, e->open->out);
+    }
+    debug("Message decrypted");
+
+    evbuffer_remove(plain, &ctype, sizeof(ctype));
+    plain_len = evbuffer_get_length(plain);
+    plain_data = evbuffer_pullup(plain, plain_len);
+
+    dbmsg->type = ctype;
+    dbmsg->sender = DB_MESSAGE_SENDER_FRIEND;
+    dbmsg->contact_id = msg->client_cont->id;
+    memcpy(dbmsg->global_id, gid, MESSAGE_ID_LEN);
 
-        debug("Message sig OK");
+    dbmsg->status = msg->from == PROT_MESSAGE_LIST_FROM_CLIENT ? 
+        DB_MESSAGE_STATUS_RECV_CONFIRMED : DB_MESSAGE_STATUS_RECV;
+
+    switch (ctype) {
+        case DB_MESSAGE_TEXT:
+            debug("Message type is text");
+            db_message_set_text(dbmsg, plain_data, plain_len);
+            break;
+        case DB_MESSAGE_NICK:
+            if (plain_len > CLIENT_NICK_MAX_LEN) {
+                goto message_free;
+            }
+            // Update message
+            memcpy(dbmsg->body_nick, plain_data, plain_len);
+            dbmsg->body_nick_len = plain_len;
+            // Update nickname
+            memcpy(msg->client_cont->nickname, plain_data, plain_len);
+            msg->client_cont->nickname_len = plain_len;
+            msg->client_cont->nickname[plain_len] = '\0';
+            break;
+        case DB_MESSAGE_MBOX:
+            if (plain_len < MAILBOX_ID_LEN + ONION_ADDRESS_LEN) {
+                goto message_free;
+            }
+            memcpy(dbmsg->body_mbox_id, plain_data, MAILBOX_ID_LEN);
+            // Check the onion address
+            if (!onion_address_valid(dbmsg->body_mbox_onion)) {
+                goto message_free;
+            }
+            memcpy(dbmsg->body_mbox_onion, plain_data + MAILBOX_ID_LEN, ONION_ADDRESS_LEN);
 
-        message_len -= (header_len - sizeof(data_len));
-        evbuffer_drain(input, header_len - sizeof(data_len) - MESSAGE_ID_LEN);
-        evbuffer_remove(input, gid, MESSAGE_ID_LEN);
+            for (i = 0; i < MAILBOX_ID_LEN; i++)
+                if (dbmsg->body_mbox_id[i] != 0)
+                    break;
 
-        debug("Message checking existance");
-        if (dbmsg = db_message_get_by_gid(msg->db, gid, NULL)) {
-            debug("Message exists NOT OK");
+            msg->client_cont->has_mailbox = i < MAILBOX_ID_LEN;
+                
+            if (msg->client_cont->has_mailbox) {
+                memcpy(msg->client_cont->mailbox_id, plain_data, MAILBOX_ID_LEN);
+                memcpy(msg->client_cont->mailbox_onion, plain_data + MAILBOX_ID_LEN, ONION_ADDRESS_LEN);
+            }
+            break;
+        case DB_MESSAGE_RECV:
+            if (plain_len < MESSAGE_ID_LEN) {
+                goto message_free;
+            }
+            // Try to find message to be confirmed
+            if (!db_message_get_by_gid(msg->db, plain_data, dbmsg)) {
+                goto message_free;
+            }
+            dbmsg->status = DB_MESSAGE_STATUS_SENT_CONFIRMED;
+            break;
+        default:
             goto message_free;
+    }
+
+    // Message is kept only if signature of the whole list is valid
+    db_message_batch_save(msg->db, msg->recv_batch, dbmsg);
+    if (ctype == DB_MESSAGE_NICK || ctype == DB_MESSAGE_MBOX)
+        recv_update_add(msg, msg->client_cont);
+    if (msg->sync)
+        recv_ack_add(msg, gid);
+
+    // Save message object to event (hook) data
+    array_set(msg->recv_evdata.messages, msg->recv_evdata.n_messages, dbmsg);
+    ++msg->recv_evdata.n_messages;
+    dbmsg = NULL;
+    invalid = 0;
+
+    message_free:
+    OPENSSL_cleanse(&sess, sizeof(struct db_session));
+    if (plain)
+        evbuffer_free(plain);
+    if (dbmsg)
+        db_message_free(dbmsg);
+    return invalid;
+}
+
+// Process pending messages whose jobs are done, in the order they arrived, all of them
+// are saved in a single database transaction, returns 1 if handler has to wait for the
+// jobs of the oldest pending message, or if it failed
+static int recv_entries_finish(struct prot_main *pmain, struct prot_message_list *msg) {
+    int rc = 0, started = 0;
+    struct prot_message_list_entry *e;
+
+    while (msg->n_recv_entries > 0) {
+        e = &(msg->recv_entries[msg->recv_first]);
+
+        if (prot_main_recv_wait(pmain, e->verify) || (e->open && prot_main_recv_wait(pmain, e->open))) {
+            rc = 1;
+            break;
+        }
+
+        if (!started) {
+            db_message_write_begin(msg->db);
+            started = 1;
+        }
+        rc = recv_entry_finish(msg, e);
+
+        crypto_job_free(e->verify);
+        crypto_job_free(e->open);
+        msg->recv_pending_len -= e->codec.frame_len;
+        msg->recv_first = (msg->recv_first + 1) % PROT_MESSAGE_LIST_MAX_PENDING;
+        --msg->n_recv_entries;
+
+        // Every message in sync request must be acknowledged, so invalid
+        // one fails the whole request, same as single message would
+        if (rc && msg->sync) {
+            prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+            break;
         }
-        debug("Message doesn't exist OK");
+        rc = 0;
+    }
 
-        plain = evbuffer_new();
-        dbmsg = db_message_new();
+    if (started)
+        db_message_write_end(msg->db);
+    return rc;
+}
 
-        if (rc = rsa_buffer_decrypt(input, msg->client_cont->local_enc_key_priv, plain, NULL)) {
-            debug("Failed to decrypt: %d", rc);
-            goto message_free;
+// Called once contact sync request is received, received messages are acknowledged
+// and messages we have for the contact are sent back together with the ACK
+static void recv_sync_done(struct prot_main *pmain, struct prot_message_list *msg) {
+    int i, n_msgs;
+    struct db_message **msgs;
+    struct prot_message_list *msg_list;
+
+    for (i = 0; i < msg->n_recv_acks; i++) {
+        prot_ack_batch_send(pmain, PROT_ACK_BATCH_SIGNATURE, msg->client_cont->local_sig_key_priv,
+            msg->recv_acks + i * MESSAGE_ID_LEN, NULL, NULL);
+    }
+
+    for (i = 0; i < msg->recv_evdata.n_messages; i++)
+        hook_list_call(pmain->hooks, PROT_MESSAGE_EV_INCOMMING, msg->recv_evdata.messages[i]);
+
+    msgs = db_message_get_all(msg->db, msg->client_cont, DB_MESSAGE_STATUS_UNDELIVERED, &n_msgs);
+    msg_list = prot_message_list_client_new(msg->db, msg->client_cont, msgs, n_msgs);
+    prot_main_push_tran(pmain, &(msg_list->htran));
+    // Contact is now owned by the response
+    msg->client_cont = NULL;
+}
+
+// Called to handle incomming message, messages from the list are taken out of the
+// buffer as they arrive, while the list signature is checked incrementally, their
+// signatures are checked and they are decrypted in parallel on the crypto pool,
+// and they are processed in order once that is done
+static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand) {
+    int rc;
+    struct prot_message_list *msg = phand->msg; // Message handler instance
+    struct prot_codec *codec;                   // Parse state of the list header or current message
+    struct evbuffer *input;                     // Bufferevent input buffer
+    uint8_t sig[ED25519_SIGNATURE_LEN];         // List signature
+
+    // Message (from the list) header length, everything before encrypted data
+    size_t header_len = PROT_MESSAGE_HEADER_LEN + sizeof(uint32_t);
+
+    codec = &(msg->recv_codec);
+    input = bufferevent_get_input(pmain->bev);
+
+    if (!msg->recv_started) {
+        // Sync request carries key of the contact sending it
+        if (!prot_main_recv_parse(pmain, codec, msg->sync ? &sync_layout : &list_layout))
+            return;
+
+        msg->recv_remaining = prot_codec_value(codec, msg->sync ? SYNC_LENGTH : LIST_LENGTH);
+
+        // If message is from client use client key to verify it, otherwise use
+        // mailbox onion key, sync request is verified using key it carries
+        if (msg->sync) {
+            prot_codec_copy(codec, input, SYNC_KEY, msg->recv_key);
+
+            if (
+                !(msg->client_cont = db_contact_get_by_rsk_pub(msg->db, msg->recv_key, NULL))
+                || msg->client_cont->status != DB_CONTACT_ACTIVE || msg->client_cont->deleted
+            ) {
+                prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+                return;
+            }
+            msg->recv_acks = array(uint8_t);
+        } else if (msg->from == PROT_MESSAGE_LIST_FROM_CLIENT) {
+            memcpy(msg->recv_key, msg->client_cont->remote_sig_key_pub, CLIENT_SIG_KEY_PUB_LEN);
+        } else {
+            char mb_onion[ONION_ADDRESS_LEN + 1];
+            db_options_get_text(msg->db, "client_mailbox_onion_address", 
+                mb_onion, ONION_ADDRESS_LEN + 1);
+            onion_extract_key(mb_onion, msg->recv_key);
         }
-        debug("Message decrypted");
 
-        evbuffer_remove(plain, &ctype, sizeof(ctype));
-        plain_len = evbuffer_get_length(plain);
-        plain_data = evbuffer_pullup(plain, plain_len);
+        if (
+            !(msg->recv_hash = ed25519_prehash_new()) ||
+            ed25519_prehash_update(msg->recv_hash, input, codec->frame_len)
+        ) {
+            prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+            return;
+        }
 
-        dbmsg->type = ctype;
-        dbmsg->sender = DB_MESSAGE_SENDER_FRIEND;
-        dbmsg->contact_id = msg->client_cont->id;
-        memcpy(dbmsg->global_id, gid, MESSAGE_ID_LEN);
+        // Remove list header
+        evbuffer_drain(input, codec->frame_len);
+        prot_codec_reset(codec);
 
-        dbmsg->status = msg->from == PROT_MESSAGE_LIST_FROM_CLIENT ? 
-            DB_MESSAGE_STATUS_RECV_CONFIRMED : DB_MESSAGE_STATUS_RECV;
+        msg->recv_started = 1;
+        msg->recv_batch = db_message_batch_begin(msg->db);
+        msg->recv_evdata.n_messages = 0;
+        msg->recv_evdata.messages = array(struct db_message *);
+        msg->recv_updates = array(struct db_contact *);
+    }
 
-        switch (ctype) {
-            case DB_MESSAGE_TEXT:
-                debug("Message type is text");
-                db_message_set_text(dbmsg, plain_data, plain_len);
-                break;
-            case DB_MESSAGE_NICK:
-                if (plain_len > CLIENT_NICK_MAX_LEN) {
-                    goto message_free;
-                }
-                // Update message
-                memcpy(dbmsg->body_nick, plain_data, plain_len);
-                dbmsg->body_nick_len = plain_len;
-                // Update nickname
-                memcpy(msg->client_cont->nickname, plain_data, plain_len);
-                msg->client_cont->nickname_len = plain_len;
-                msg->client_cont->nickname[plain_len] = '\0';
-                break;
-            case DB_MESSAGE_MBOX:
-                if (plain_len < MAILBOX_ID_LEN + ONION_ADDRESS_LEN) {
-                    goto message_free;
-                }
-                memcpy(dbmsg->body_mbox_id, plain_data, MAILBOX_ID_LEN);
-                // Check the onion address
-                if (!onion_address_valid(dbmsg->body_mbox_onion)) {
-                    goto message_free;
-                }
-                memcpy(dbmsg->body_mbox_onion, plain_data + MAILBOX_ID_LEN, ONION_ADDRESS_LEN);
+    for (;;) {
+        // Take messages that arrived out of the buffer, while there is room for them
+        while (
+            msg->recv_remaining > 0 && msg->n_recv_entries < PROT_MESSAGE_LIST_MAX_PENDING &&
+            (msg->n_recv_entries == 0 || msg->recv_pending_len < PROT_MESSAGE_LIST_MAX_PENDING_LEN)
+        ) {
+            if (msg->recv_remaining < header_len) {
+                debug("List length doesn't match its messages");
+                prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+                return;
+            }
 
-                for (i = 0; i < MAILBOX_ID_LEN; i++)
-                    if (dbmsg->body_mbox_id[i] != 0)
-                        break;
+            // Layout depends on the container type
+            if (codec->n_parsed == 0) {
+                if (evbuffer_get_length(input) < PROT_HEADER_LEN)
+                    break;
 
-                msg->client_cont->has_mailbox = i < MAILBOX_ID_LEN;
-                    
-                if (msg->client_cont->has_mailbox) {
-                    memcpy(msg->client_cont->mailbox_id, plain_data, MAILBOX_ID_LEN);
-                    memcpy(msg->client_cont->mailbox_onion, plain_data + MAILBOX_ID_LEN, ONION_ADDRESS_LEN);
-                }
-                break;
-            case DB_MESSAGE_RECV:
-                if (plain_len < MESSAGE_ID_LEN) {
-                    goto message_free;
-                }
-                // Try to find message to be confirmed
-                if (!db_message_get_by_gid(msg->db, plain_data, dbmsg)) {
-                    goto message_free;
+                if (!(msg->recv_layout = prot_message_layout_get(evbuffer_pullup(input, PROT_HEADER_LEN)[1]))) {
+                    prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+                    return;
                 }
-                dbmsg->status = DB_MESSAGE_STATUS_SENT_CONFIRMED;
+            }
+
+            // Message length is known once its header arrives, even if the
+            // rest didn't, too long message fails the codec
+            rc = prot_main_recv_parse(pmain, codec, msg->recv_layout);
+            if (pmain->status != PROT_STATUS_OK)
+                return;
+
+            if (msg->recv_remaining < codec->frame_len) {
+                debug("List length doesn't match its messages");
+                prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+                return;
+            }
+
+            if (!rc)
                 break;
-            default:
-                goto message_free;
+
+            if (ed25519_prehash_update(msg->recv_hash, input, codec->frame_len)) {
+                prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+                return;
+            }
+            msg->recv_remaining -= codec->frame_len;
+
+            recv_entry_start(pmain, msg, input);
+            prot_codec_reset(codec);
         }
 
-        db_message_save(msg->db, dbmsg);
-        db_contact_save(msg->db, msg->client_cont);
+        if (msg->n_recv_entries == 0)
+            break;
+        if (recv_entries_finish(pmain, msg))
+            return;
+    }
 
-        // Save message object to event (hook) data
-        array_set(evdata.messages, evdata.n_messages, dbmsg);
-        ++evdata.n_messages;
-        dbmsg = NULL;
+    // Rest of the list didn't arrive yet
+    if (msg->recv_remaining > 0)
+        return;
 
-        message_free:
-        evbuffer_drain(input, message_len);
-        if (plain)
-            evbuffer_free(plain);
-        if (dbmsg)
-            db_message_free(dbmsg);
+    // Wait for the list signature
+    if (evbuffer_get_length(input) < ED25519_SIGNATURE_LEN)
+        return;
+
+    evbuffer_remove(input, sig, ED25519_SIGNATURE_LEN);
+
+    if (!ed25519_prehash_validate(msg->recv_hash, sig, msg->recv_key)) {
+        debug("List signature FAIL");
+        prot_main_set_error(pmain, PROT_ERR_INVALID_MSG);
+        return;
     }
 
-    if (msg->from == PROT_MESSAGE_LIST_FROM_CLIENT) {
-        hook_list_call(pmain->hooks, PROT_CLIENT_FETCH_EV_OK, &evdata);
+    debug("List signature OK");
+
+    db_message_batch_commit(msg->db, msg->recv_batch);
+    recv_updates_save(msg);
+    msg->recv_batch = 0;
+
+    if (msg->sync) {
+        prot_main_peer_auth(pmain, msg->client_cont);
+        recv_sync_done(pmain, msg);
+    } else if (msg->from == PROT_MESSAGE_LIST_FROM_CLIENT) {
+        hook_list_call(pmain->hooks, PROT_CLIENT_FETCH_EV_OK, &(msg->recv_evdata));
     }
     if (msg->from == PROT_MESSAGE_LIST_FROM_MAILBOX) {
-        hook_list_call(pmain->hooks, PROT_MB_FETCH_EV_OK, &evdata);
-    }
-
-    for (i = 0; i < evdata.n_messages; i++) {
-        db_message_free(evdata.messages[i]);
+        hook_list_call(pmain->hooks, PROT_MB_FETCH_EV_OK, &(msg->recv_evdata));
     }
-    array_free(evdata.messages);
 
-    evbuffer_drain(input, length);
-    evbuffer_drain(input, ED25519_SIGNATURE_LEN);
     pmain->current_recv_done = 1;
 }
 
@@ -378,8 +767,7 @@ static void recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand
 static struct prot_message_list * prot_message_list_new(sqlite3 *db) {
     struct prot_message_list *msg;
 
-    msg = safe_malloc(sizeof(struct prot_message_list),
-        "Failed to allocate memory for message list handler");
+    msg = free_list_get(&message_list_free_list);
     memset(msg, 0, sizeof(struct prot_message_list));
 
     msg->db = db;
@@ -387,10 +775,11 @@ static struct prot_message_list * prot_message_list_new(sqlite3 *db) {
 
     msg->htran.msg = msg;
     msg->htran.msg_code = PROT_MESSAGE_LIST;
+    msg->htran.priority = PROT_PRIO_BULK;
     msg->htran.done_cb = tran_done;
     msg->htran.setup_cb = tran_setup;
     msg->htran.cleanup_cb = tran_cleanup;
-    msg->htran.buffer = evbuffer_new();
+    msg->htran.buffer = NULL;
 
     msg->hrecv.msg = msg;
     msg->hrecv.msg_code = PROT_MESSAGE_LIST;
@@ -427,20 +816,67 @@ struct prot_message_list * prot_message_list_mailbox_new(sqlite3 *db, struct db_
     return msg;
 }
 
+// Allocate new contact sync handler, given messages are sent to the contact
+// together with the fetch request, contact responds with cumulative ACK for
+// them and the list of its messages for us, all in a single round trip
+struct prot_message_list * prot_message_list_sync_new(
+    sqlite3 *db, struct db_contact *cont, struct db_message **msgs, int n_msgs
+) {
+    struct prot_message_list *msg;
+
+    msg = prot_message_list_client_new(db, cont, msgs, n_msgs);
+    msg->sync = 1;
+    msg->htran.msg_code = PROT_CONTACT_SYNC;
+    msg->htran.priority = PROT_PRIO_BULK;
+    msg->hrecv.msg_code = PROT_CONTACT_SYNC;
+
+    return msg;
+}
+
 // When creating message receive handler use this function to set where is the
 // message list comming from, is it from CLIENT or the MAILBOX
 void prot_message_list_from(struct prot_message_list *msg, enum prot_message_list_from from) {
     msg->from = from;
 }
 
-// Free given message list handler and messages given to new method
+// Free given message list handler, contact and messages given to new method
 void prot_message_list_free(struct prot_message_list *msg) {
+    int i;
+
     if (!msg) return;
     debug("message list free");
 
+    if (msg->client_cont)
+        db_contact_free(msg->client_cont);
+    if (msg->client_msgs) {
+        db_message_free_all(msg->client_msgs, msg->n_client_msgs);
+        free(msg->client_msgs);
+    }
     if (msg->n_mailbox_msgs > 0)
         db_mb_message_free_all(msg->mailbox_msgs, msg->n_mailbox_msgs);
+    if (msg->recv_acks)
+        array_free(msg->recv_acks);
+    db_session_free(msg->tran_sess);
+    crypto_job_free(msg->tran_job);
+
+    if (msg->recv_hash)
+        ed25519_prehash_free(msg->recv_hash);
+    if (msg->recv_cont)
+        db_contact_free(msg->recv_cont);
+    if (msg->recv_updates) {
+        for (i = 0; i < msg->n_recv_updates; i++)
+            db_contact_free(msg->recv_updates[i]);
+        array_free(msg->recv_updates);
+    }
+    for (i = 0; i < msg->n_recv_entries; i++) {
+        crypto_job_free(msg->recv_entries[(msg->recv_first + i) % PROT_MESSAGE_LIST_MAX_PENDING].verify);
+        crypto_job_free(msg->recv_entries[(msg->recv_first + i) % PROT_MESSAGE_LIST_MAX_PENDING].open);
+    }
+    if (msg->recv_evdata.messages) {
+        for (i = 0; i < msg->recv_evdata.n_messages; i++)
+            db_message_free(msg->recv_evdata.messages[i]);
+        array_free(msg->recv_evdata.messages);
+    }
 
-    evbuffer_free(msg->htran.buffer);
-    free(msg);
+    free_list_put(&message_list_free_list, msg);
 }
\ No newline at end of file
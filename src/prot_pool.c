@@ -0,0 +1,392 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <stdlib.h>
+#include <sqlite3.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#include <hooks.h>
+#include <queue.h>
+#include <prot_main.h>
+#include <prot_pool.h>
+#include <prot_transaction.h>
+#include <db_contact.h>
+#include <sys_memory.h>
+#include <debug.h>
+
+// Remove entry from the pool and free it, protocol handler is not touched
+static void prot_pool_entry_remove(struct prot_pool_entry *entry);
+
+// Find peer with given onion address, returns NULL if pool didn't talk to it yet
+static struct prot_pool_peer * prot_pool_peer_find(struct prot_pool *pool, const char *onion_address) {
+    struct prot_pool_peer *peer;
+
+    for (peer = pool->peers; peer != NULL; peer = peer->next) {
+        if (!strcmp(peer->onion_address, onion_address))
+            return peer;
+    }
+    return NULL;
+}
+
+// Remember protocol version of the peer with given onion address
+static void prot_pool_peer_set(struct prot_pool *pool, const char *onion_address, int version) {
+    struct prot_pool_peer *peer;
+
+    if (!(peer = prot_pool_peer_find(pool, onion_address))) {
+        peer = safe_malloc(sizeof(struct prot_pool_peer), "Failed to allocate connection pool peer");
+        memset(peer, 0, sizeof(struct prot_pool_peer));
+        strncpy(peer->onion_address, onion_address, ONION_ADDRESS_LEN);
+
+        peer->next = pool->peers;
+        pool->peers = peer;
+    }
+    peer->version = version;
+}
+
+// Remember version outgoing connection agreed on, once peer answered it
+static void prot_pool_peer_learn(struct prot_pool_entry *entry) {
+    struct prot_main *pmain = entry->pmain;
+
+    if (!entry->inbound && pmain->peer_seen && pmain->version)
+        prot_pool_peer_set(entry->pool, entry->onion_address, pmain->version);
+}
+
+// Called when connection is closed for any reason
+static void hook_pool_close(int ev, void *data, void *cbarg) {
+    struct prot_pool_entry *entry = cbarg;
+    struct prot_main *pmain = data;
+    struct prot_pool_peer *peer;
+
+    debug("Pooled connection to %s closed", entry->onion_address);
+    prot_pool_peer_learn(entry);
+
+    if (pmain->status == PROT_ERR_REFUSED) {
+        // Peer knows 0RTT (we used it), but refused it, next connections use normal handshake
+        if (entry->zrtt && (peer = prot_pool_peer_find(entry->pool, entry->onion_address)))
+            peer->no_zrtt = 1;
+        // Peer doesn't speak the version we offered, next connection offers the oldest one
+        else
+            prot_pool_peer_set(entry->pool, entry->onion_address, DEEP_MESSENGER_PROTOCOL_VER_MIN);
+    }
+
+    prot_pool_entry_remove(entry);
+}
+
+// Called once message signed over the transaction ID we picked (or over fresh
+// 0RTT nonce) proved that contact is live on the other side of incomming
+// connection, it can carry our traffic to the contact from now on
+static void hook_pool_peer(int ev, void *data, void *cbarg) {
+    struct db_contact *cont = data;
+    struct prot_pool_entry *entry = cbarg;
+
+    if (!strcmp(entry->onion_address, cont->onion_address))
+        return;
+
+    debug("Incomming connection authenticated as %s", cont->onion_address);
+    strncpy(entry->onion_address, cont->onion_address, ONION_ADDRESS_LEN);
+}
+
+// Called when protocol handler is done processing all queued messages
+static void hook_pool_done(int ev, void *data, void *cbarg) {
+    struct timeval tv;
+    struct prot_pool_entry *entry = cbarg;
+
+    prot_pool_peer_learn(entry);
+
+    // Transient handler will free itself after this hook
+    if (entry->transient) {
+        prot_pool_entry_remove(entry);
+        return;
+    }
+
+    gettimeofday(&(entry->last_used), NULL);
+    tv.tv_sec = entry->pool->idle_timeout;
+    tv.tv_usec = 0;
+    evtimer_add(entry->idle_ev, &tv);
+}
+
+// Called when connection was unused for idle timeout
+static void prot_pool_idle_cb(evutil_socket_t fd, short what, void *arg) {
+    struct timeval tv;
+    struct prot_main *pmain;
+    struct prot_pool_entry *entry = arg;
+
+    pmain = entry->pmain;
+
+    // Someone is still using the connection, check again later
+    if (prot_main_busy(pmain)) {
+        tv.tv_sec = entry->pool->idle_timeout;
+        tv.tv_usec = 0;
+        evtimer_add(entry->idle_ev, &tv);
+        return;
+    }
+
+    debug("Closing idle pooled connection to %s", entry->onion_address);
+    prot_pool_entry_remove(entry);
+    prot_main_free(pmain);
+}
+
+// Called once caller had the chance to push handlers
+static void prot_pool_connect_cb(evutil_socket_t fd, short what, void *arg) {
+    struct prot_pool_entry *entry = arg;
+
+    // Entry may be removed (and freed) if connecting fails right away
+    prot_main_connect(entry->pmain, entry->onion_address,
+        entry->onion_port, entry->socks_addr, entry->socks_port);
+}
+
+// Check if pooled connection can still be used
+static int prot_pool_entry_healthy(struct prot_pool_entry *entry) {
+    int rc;
+    uint8_t byte;
+    evutil_socket_t fd;
+    struct prot_main *pmain = entry->pmain;
+
+    if (pmain->status != PROT_STATUS_OK)
+        return 0;
+
+    // Still connecting, nothing to check yet
+    if (!pmain->bev_ready)
+        return 1;
+
+    if ((fd = bufferevent_getfd(pmain->bev)) < 0)
+        return 0;
+    if (!(bufferevent_get_enabled(pmain->bev) & EV_READ))
+        return 0;
+
+    // Peer closed the connection but event loop did not notice yet
+    rc = recv(fd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+    if (rc == 0)
+        return 0;
+    if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return 0;
+
+    return 1;
+}
+
+// Remove entry from the pool and free it, protocol handler is not touched, hooks
+// are left in place since protocol handler is always freed right after removal
+static void prot_pool_entry_remove(struct prot_pool_entry *entry) {
+    struct prot_pool *pool = entry->pool;
+    struct prot_pool_entry **ep;
+
+    for (ep = &(pool->head); *ep != NULL; ep = &((*ep)->next)) {
+        if (*ep == entry) {
+            *ep = entry->next;
+            break;
+        }
+    }
+
+    if (!entry->transient && !entry->inbound)
+        --pool->n_conns;
+
+    if (entry->idle_ev)
+        event_free(entry->idle_ev);
+    if (entry->connect_ev)
+        event_free(entry->connect_ev);
+    free(entry);
+}
+
+// Find least recently used connection which is not in use
+static struct prot_pool_entry * prot_pool_find_idle(struct prot_pool *pool) {
+    struct prot_pool_entry *entry, *lru = NULL;
+
+    for (entry = pool->head; entry != NULL; entry = entry->next) {
+        struct prot_main *pmain = entry->pmain;
+
+        if (entry->transient || entry->inbound)
+            continue;
+        if (prot_main_busy(pmain))
+            continue;
+        if (!lru || timercmp(&(entry->last_used), &(lru->last_used), <))
+            lru = entry;
+    }
+
+    return lru;
+}
+
+// Allocate new connection pool
+struct prot_pool * prot_pool_new(struct event_base *base, sqlite3 *db, int max_conns, int idle_timeout) {
+    struct prot_pool *pool;
+
+    pool = safe_malloc(sizeof(struct prot_pool), "Failed to allocate connection pool");
+    memset(pool, 0, sizeof(struct prot_pool));
+
+    pool->db = db;
+    pool->base = base;
+    pool->max_conns = max_conns;
+    pool->idle_timeout = idle_timeout;
+
+    return pool;
+}
+
+// Close all pooled connections and free the pool
+void prot_pool_free(struct prot_pool *pool) {
+    struct prot_pool_peer *peer;
+
+    while (pool->head) {
+        struct prot_main *pmain = pool->head->pmain;
+
+        prot_pool_entry_remove(pool->head);
+        prot_main_free(pmain);
+    }
+    while (peer = pool->peers) {
+        pool->peers = peer->next;
+        free(peer);
+    }
+    free(pool);
+}
+
+// Close all connections in the pool that are not currently in use
+void prot_pool_flush(struct prot_pool *pool) {
+    struct prot_pool_entry *entry;
+
+    while (entry = prot_pool_find_idle(pool)) {
+        struct prot_main *pmain = entry->pmain;
+
+        prot_pool_entry_remove(entry);
+        prot_main_free(pmain);
+    }
+}
+
+// Offer incomming connection for reuse, once signed message proves that contact
+// is live on the other side traffic to the contact's onion address goes over this
+// connection instead of dialing a new one, connection is not closed by the pool
+void prot_pool_attach(struct prot_pool *pool, struct prot_main *pmain) {
+    struct prot_pool_entry *entry;
+
+    entry = safe_malloc(sizeof(struct prot_pool_entry), "Failed to allocate connection pool entry");
+    memset(entry, 0, sizeof(struct prot_pool_entry));
+
+    entry->pool = pool;
+    entry->pmain = pmain;
+    entry->inbound = 1;
+
+    hook_add(pmain->hooks, PROT_MAIN_EV_PEER, hook_pool_peer, entry);
+    hook_add(pmain->hooks, PROT_MAIN_EV_CLOSE, hook_pool_close, entry);
+
+    entry->next = pool->head;
+    pool->head = entry;
+}
+
+// Get connection to the given onion service, if there is established connection
+// in the pool (outgoing, or incomming from the contact with given address) it is
+// returned, otherwise new one is created and 0RTT transaction is queued if peer
+// is known to speak it and never refused it, connection is made once control returns to the event
+// loop so caller can push handlers onto returned object right away
+struct prot_main * prot_pool_get(
+    struct prot_pool *pool,
+    const char *onion_address,
+    const char *onion_port,
+    const char *socks_server_addr,
+    const char *socks_server_port
+) {
+    struct timeval tv;
+    struct prot_pool_peer *peer;
+    struct prot_pool_entry *entry, *next;
+
+    for (entry = pool->head; entry != NULL; entry = next) {
+        next = entry->next;
+
+        if (entry->transient)
+            continue;
+        if (strcmp(entry->onion_address, onion_address))
+            continue;
+
+        // Other side dialed us, its port is not known, transaction is already running
+        if (entry->inbound) {
+            if (entry->pmain->status != PROT_STATUS_OK)
+                continue;
+
+            debug("Reusing incomming connection from %s", onion_address);
+            return entry->pmain;
+        }
+
+        if (strcmp(entry->onion_port, onion_port))
+            continue;
+
+        if (!prot_pool_entry_healthy(entry)) {
+            struct prot_main *pmain = entry->pmain;
+
+            debug("Dropping broken pooled connection to %s", onion_address);
+            prot_pool_entry_remove(entry);
+            prot_main_free(pmain);
+            // Cleanup callbacks may have changed the pool, start over
+            next = pool->head;
+            continue;
+        }
+
+        debug("Reusing pooled connection to %s", onion_address);
+        gettimeofday(&(entry->last_used), NULL);
+        // Idle callback checks if connection is in use before closing it
+        tv.tv_sec = pool->idle_timeout;
+        tv.tv_usec = 0;
+        evtimer_add(entry->idle_ev, &tv);
+        return entry->pmain;
+    }
+
+    entry = safe_malloc(sizeof(struct prot_pool_entry), "Failed to allocate connection pool entry");
+    memset(entry, 0, sizeof(struct prot_pool_entry));
+
+    entry->pool = pool;
+    strncpy(entry->onion_address, onion_address, ONION_ADDRESS_LEN);
+    strncpy(entry->onion_port, onion_port, MAX_PORT_STR_LEN - 1);
+    strncpy(entry->socks_addr, socks_server_addr, PROT_POOL_SOCKS_ADDR_MAX_LEN - 1);
+    strncpy(entry->socks_port, socks_server_port, MAX_PORT_STR_LEN - 1);
+    gettimeofday(&(entry->last_used), NULL);
+
+    // If pool is full try to make room by closing least recently used connection,
+    // if all connections are in use this one is not kept after it's done
+    if (pool->n_conns >= pool->max_conns) {
+        struct prot_pool_entry *lru;
+
+        if (lru = prot_pool_find_idle(pool)) {
+            struct prot_main *pmain = lru->pmain;
+
+            prot_pool_entry_remove(lru);
+            prot_main_free(pmain);
+        } else {
+            entry->transient = 1;
+        }
+    }
+
+    entry->pmain = prot_main_new(pool->base, pool->db);
+    entry->idle_ev = evtimer_new(pool->base, prot_pool_idle_cb, entry);
+    entry->connect_ev = evtimer_new(pool->base, prot_pool_connect_cb, entry);
+
+    prot_main_free_on_done(entry->pmain, entry->transient);
+    // Pool closes unused connections itself, they are expected to sit idle
+    if (!entry->transient)
+        prot_main_timeout(entry->pmain, PROT_DEADLINE_IDLE, 0);
+    hook_add(entry->pmain->hooks, PROT_MAIN_EV_DONE, hook_pool_done, entry);
+    hook_add(entry->pmain->hooks, PROT_MAIN_EV_CLOSE, hook_pool_close, entry);
+
+    // Peer answered before, so caller can pick messages its version knows right away
+    if (peer = prot_pool_peer_find(pool, onion_address))
+        entry->pmain->version = peer->version;
+
+    // Transaction doesn't wait for the response, so the first requests pushed
+    // by the caller go out in the same flight, peer which didn't answer yet is
+    // offered our version
+    if (peer && !peer->no_zrtt && prot_main_peer_knows(entry->pmain, PROT_TRANSACTION_0RTT)) {
+        entry->zrtt = 1;
+        prot_main_push_tran(entry->pmain, &(prot_txn_0rtt_new()->htran));
+    } else {
+        prot_main_push_tran(entry->pmain, &(prot_txn_req_new(
+            peer ? peer->version : DEEP_MESSENGER_PROTOCOL_VER)->htran));
+    }
+
+    entry->next = pool->head;
+    pool->head = entry;
+    if (!entry->transient)
+        ++pool->n_conns;
+
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    evtimer_add(entry->connect_ev, &tv);
+
+    return entry->pmain;
+}
@@ -0,0 +1,220 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <onion.h>
+#include <constants.h>
+#include <prot_main.h>
+#include <prot_registry.h>
+#include <prot_ack.h>
+#include <prot_friend_req.h>
+#include <prot_transaction.h>
+#include <prot_message.h>
+#include <prot_message_list.h>
+#include <prot_client_fetch.h>
+#include <prot_mb_account.h>
+#include <prot_mb_set_contacts.h>
+#include <prot_mb_fetch.h>
+
+// Length of common message header (header and transaction ID)
+#define TXN_HEADER_LEN (PROT_HEADER_LEN + TRANSACTION_ID_LEN)
+
+// Static part of friend request, everything before nickname
+#define FRIEND_REQ_STATIC_LEN (TXN_HEADER_LEN + ONION_ADDRESS_LEN + CLIENT_SIG_KEY_PUB_LEN + \
+    CLIENT_ENC_KEY_PUB_LEN + ONION_ADDRESS_LEN + MAILBOX_ID_LEN + 1)
+
+// Static part of message container, everything before encrypted data
+#define MESSAGE_STATIC_LEN (TXN_HEADER_LEN + MAILBOX_ID_LEN + CLIENT_SIG_KEY_PUB_LEN + \
+    MESSAGE_ID_LEN + sizeof(uint32_t))
+// Static part of the message container encrypted using session key
+#define SESSION_STATIC_LEN (TXN_HEADER_LEN + MAILBOX_ID_LEN + CLIENT_SIG_KEY_PUB_LEN + \
+    MESSAGE_ID_LEN + SESSION_NONCE_LEN + sizeof(uint16_t))
+// Longest message container encrypted using session key
+#define SESSION_MAX_LEN (SESSION_STATIC_LEN + SESSION_WRAP_LEN + sizeof(uint32_t) + \
+    PROT_MESSAGE_MAX_DATA_LEN + SESSION_TAG_LEN + ED25519_SIGNATURE_LEN)
+
+// Batched ACK acknowledging maximum number of messages
+#define ACK_BATCH_MAX_LEN (TXN_HEADER_LEN + sizeof(uint16_t) + \
+    PROT_ACK_BATCH_MAX * MESSAGE_ID_LEN + ED25519_SIGNATURE_LEN)
+
+// Table of all known message types
+static struct prot_registry_entry registry[PROT_REGISTRY_MODES][PROT_REGISTRY_CODES];
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Constructors for built in message types
+ */
+
+static struct prot_recv_handler * ctor_txn_req(sqlite3 *db) {
+    return &(prot_txn_req_new(DEEP_MESSENGER_PROTOCOL_VER)->hrecv);
+}
+
+static struct prot_recv_handler * ctor_txn_0rtt(sqlite3 *db) {
+    return &(prot_txn_0rtt_new()->hrecv);
+}
+
+static struct prot_recv_handler * ctor_friend_req(sqlite3 *db) {
+    return &(prot_friend_req_new(db, NULL)->hrecv);
+}
+
+static struct prot_recv_handler * ctor_message_client(sqlite3 *db) {
+    return &(prot_message_to_client_new(db, NULL)->hrecv);
+}
+
+static struct prot_recv_handler * ctor_message_mailbox(sqlite3 *db) {
+    return &(prot_message_to_mailbox_new(db, NULL)->hrecv);
+}
+
+static struct prot_recv_handler * ctor_session_client(sqlite3 *db) {
+    struct prot_message *msg = prot_message_to_client_new(db, NULL);
+
+    msg->hrecv.msg_code = PROT_MESSAGE_SESSION;
+    return &(msg->hrecv);
+}
+
+static struct prot_recv_handler * ctor_session_mailbox(sqlite3 *db) {
+    struct prot_message *msg = prot_message_to_mailbox_new(db, NULL);
+
+    msg->hrecv.msg_code = PROT_MESSAGE_SESSION;
+    return &(msg->hrecv);
+}
+
+static struct prot_recv_handler * ctor_client_fetch(sqlite3 *db) {
+    return &(prot_client_fetch_new(db, NULL)->hrecv);
+}
+
+static struct prot_recv_handler * ctor_contact_sync(sqlite3 *db) {
+    return &(prot_message_list_sync_new(db, NULL, NULL, 0)->hrecv);
+}
+
+static struct prot_recv_handler * ctor_mb_register(sqlite3 *db) {
+    return &(prot_mb_acc_register_new(db, NULL, NULL)->hrecv);
+}
+
+static struct prot_recv_handler * ctor_mb_delete(sqlite3 *db) {
+    return &(prot_mb_acc_delete_new(db, NULL, NULL, NULL)->hrecv);
+}
+
+static struct prot_recv_handler * ctor_mb_set_contacts(sqlite3 *db) {
+    return &(prot_mb_set_contacts_new(db, NULL, NULL, NULL, NULL, 0)->hrecv);
+}
+
+static struct prot_recv_handler * ctor_mb_fetch(sqlite3 *db) {
+    return &(prot_mb_fetch_new(db)->hrecv);
+}
+
+// Fill registry entry for given message type
+static void prot_registry_set(
+    enum prot_modes mode,
+    enum prot_message_codes code,
+    prot_registry_ctor ctor,
+    size_t min_len,
+    size_t max_len
+) {
+    struct prot_registry_entry *entry;
+
+    entry = &(registry[mode][(uint8_t)code]);
+    memset(entry, 0, sizeof(struct prot_registry_entry));
+
+    entry->registered = 1;
+    entry->ctor = ctor;
+    entry->min_len = min_len;
+    entry->max_len = max_len;
+}
+
+// Register message types handled by the Deep Messenger itself
+static void prot_registry_init(void) {
+    enum prot_modes mode;
+
+    // Messages that can only arrive as a response, or have same limits in both modes
+    for (mode = 0; mode < PROT_REGISTRY_MODES; mode++) {
+        prot_registry_set(mode, PROT_TRANSACTION_REQUEST, ctor_txn_req,
+            PROT_HEADER_LEN, PROT_HEADER_LEN);
+        prot_registry_set(mode, PROT_TRANSACTION_RESPONSE, NULL,
+            TXN_HEADER_LEN, TXN_HEADER_LEN);
+        prot_registry_set(mode, PROT_TRANSACTION_0RTT, ctor_txn_0rtt,
+            PROT_TXN_0RTT_LEN, PROT_TXN_0RTT_LEN);
+        prot_registry_set(mode, PROT_ACK_ONION, NULL,
+            TXN_HEADER_LEN + ED25519_SIGNATURE_LEN, TXN_HEADER_LEN + ED25519_SIGNATURE_LEN);
+        prot_registry_set(mode, PROT_ACK_SIGNATURE, NULL,
+            TXN_HEADER_LEN + ED25519_SIGNATURE_LEN, TXN_HEADER_LEN + ED25519_SIGNATURE_LEN);
+        prot_registry_set(mode, PROT_ACK_BATCH_ONION, NULL,
+            TXN_HEADER_LEN + sizeof(uint16_t), ACK_BATCH_MAX_LEN);
+        prot_registry_set(mode, PROT_ACK_BATCH_SIGNATURE, NULL,
+            TXN_HEADER_LEN + sizeof(uint16_t), ACK_BATCH_MAX_LEN);
+        prot_registry_set(mode, PROT_MAILBOX_GRANTED, NULL,
+            TXN_HEADER_LEN + MAILBOX_ID_LEN + ED25519_SIGNATURE_LEN,
+            TXN_HEADER_LEN + MAILBOX_ID_LEN + ED25519_SIGNATURE_LEN);
+        prot_registry_set(mode, PROT_MESSAGE_LIST, NULL,
+            TXN_HEADER_LEN + sizeof(uint32_t), 0);
+    }
+
+    // Messages handled by the client
+    prot_registry_set(PROT_MODE_CLIENT, PROT_FRIEND_REQUEST, ctor_friend_req,
+        FRIEND_REQ_STATIC_LEN, FRIEND_REQ_STATIC_LEN + CLIENT_NICK_MAX_LEN + ED25519_SIGNATURE_LEN);
+    prot_registry_set(PROT_MODE_CLIENT, PROT_MESSAGE_CONTAINER, ctor_message_client,
+        MESSAGE_STATIC_LEN, MESSAGE_STATIC_LEN + PROT_MESSAGE_MAX_DATA_LEN +
+        AES_ENC_KEY_LENGTH + AES_IV_LENGTH + ED25519_SIGNATURE_LEN);
+    prot_registry_set(PROT_MODE_CLIENT, PROT_MESSAGE_SESSION, ctor_session_client,
+        SESSION_STATIC_LEN, SESSION_MAX_LEN);
+    prot_registry_set(PROT_MODE_CLIENT, PROT_CLIENT_FETCH, ctor_client_fetch,
+        TXN_HEADER_LEN + CLIENT_SIG_KEY_PUB_LEN + ED25519_SIGNATURE_LEN,
+        TXN_HEADER_LEN + CLIENT_SIG_KEY_PUB_LEN + ED25519_SIGNATURE_LEN);
+    prot_registry_set(PROT_MODE_CLIENT, PROT_CONTACT_SYNC, ctor_contact_sync,
+        TXN_HEADER_LEN + CLIENT_SIG_KEY_PUB_LEN + sizeof(uint32_t), 0);
+
+    // Messages handled by the mailbox
+    prot_registry_set(PROT_MODE_MAILBOX, PROT_MAILBOX_REGISTER, ctor_mb_register,
+        TXN_HEADER_LEN + MAILBOX_ACCESS_KEY_LEN + MAILBOX_ACCOUNT_KEY_PUB_LEN,
+        TXN_HEADER_LEN + MAILBOX_ACCESS_KEY_LEN + MAILBOX_ACCOUNT_KEY_PUB_LEN);
+    prot_registry_set(PROT_MODE_MAILBOX, PROT_MAILBOX_DEL_ACCOUNT, ctor_mb_delete,
+        TXN_HEADER_LEN + MAILBOX_ID_LEN + ED25519_SIGNATURE_LEN,
+        TXN_HEADER_LEN + MAILBOX_ID_LEN + ED25519_SIGNATURE_LEN);
+    prot_registry_set(PROT_MODE_MAILBOX, PROT_MAILBOX_SET_CONTACTS, ctor_mb_set_contacts,
+        TXN_HEADER_LEN + MAILBOX_ID_LEN + sizeof(uint16_t),
+        TXN_HEADER_LEN + MAILBOX_ID_LEN + sizeof(uint16_t) +
+        UINT16_MAX * CLIENT_SIG_KEY_PUB_LEN + ED25519_SIGNATURE_LEN);
+    prot_registry_set(PROT_MODE_MAILBOX, PROT_MESSAGE_CONTAINER, ctor_message_mailbox,
+        MESSAGE_STATIC_LEN, MESSAGE_STATIC_LEN + PROT_MESSAGE_MAX_DATA_LEN +
+        AES_ENC_KEY_LENGTH + AES_IV_LENGTH + ED25519_SIGNATURE_LEN);
+    prot_registry_set(PROT_MODE_MAILBOX, PROT_MESSAGE_SESSION, ctor_session_mailbox,
+        SESSION_STATIC_LEN, SESSION_MAX_LEN);
+    prot_registry_set(PROT_MODE_MAILBOX, PROT_MAILBOX_FETCH, ctor_mb_fetch,
+        TXN_HEADER_LEN + MAILBOX_ID_LEN + ED25519_SIGNATURE_LEN,
+        TXN_HEADER_LEN + MAILBOX_ID_LEN + ED25519_SIGNATURE_LEN);
+}
+
+// Register handler for given message type in given mode, replaces
+// existing entry if there is one
+void prot_registry_add(
+    enum prot_modes mode,
+    enum prot_message_codes code,
+    prot_registry_ctor ctor,
+    size_t min_len,
+    size_t max_len
+) {
+    pthread_once(&registry_once, prot_registry_init);
+    prot_registry_set(mode, code, ctor, min_len, max_len);
+}
+
+// Get registry entry for given message type, returns NULL
+// if message type is not registered in given mode
+struct prot_registry_entry * prot_registry_get(enum prot_modes mode, uint8_t code) {
+    pthread_once(&registry_once, prot_registry_init);
+
+    if (mode < 0 || mode >= PROT_REGISTRY_MODES || !registry[mode][code].registered)
+        return NULL;
+
+    return &(registry[mode][code]);
+}
+
+// Allocate new receive handler for given incomming message type,
+// returns NULL if message of this type is not expected to arrive
+struct prot_recv_handler * prot_registry_autogen(enum prot_modes mode, uint8_t code, sqlite3 *db) {
+    struct prot_registry_entry *entry;
+
+    if (!(entry = prot_registry_get(mode, code)) || !entry->ctor)
+        return NULL;
+
+    return entry->ctor(db);
+}
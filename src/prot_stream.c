@@ -0,0 +1,351 @@
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <prot_main.h>
+#include <prot_stream.h>
+#include <prot_registry.h>
+#include <free_list.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <debug.h>
+
+// Unused stream objects, reused by next allocation
+static struct free_list stream_free_list = FREE_LIST_INIT(struct prot_stream, FREE_LIST_MAX_FREE);
+
+static void chunk_tran_setup(struct prot_main *conn, struct prot_tran_handler *phand);
+static void chunk_tran_done(struct prot_main *conn, struct prot_tran_handler *phand);
+
+// Find stream with given ID, returns NULL if there is no such stream
+static struct prot_stream * stream_find(struct prot_main *conn, uint16_t id) {
+    struct prot_stream *stream;
+
+    for (stream = conn->streams; stream != NULL; stream = stream->next) {
+        if (stream->id == id)
+            return stream;
+    }
+    return NULL;
+}
+
+// Called each time data is added to or taken from the mux output, data waiting
+// for the stream handler is charged to the connection, connection which stopped
+// taking chunks is resumed once stream takes some of it
+static void stream_mux_mem_cb(struct evbuffer *buff, const struct evbuffer_cb_info *info, void *arg) {
+    struct prot_stream *stream = arg;
+    struct prot_main *conn = stream->conn;
+
+    if (!conn)
+        return;
+
+    prot_main_mem_charge(conn, info->n_added, info->n_deleted);
+    if (info->n_deleted > 0 && conn->stream_blocked) {
+        conn->stream_blocked = 0;
+        if (!conn->read_paused)
+            bufferevent_enable(conn->bev, EV_READ);
+        bufferevent_trigger(conn->bev, EV_READ, BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+    }
+}
+
+// Free the stream, data still waiting for it is no longer charged to the connection
+static void stream_free(struct prot_stream *stream) {
+    struct evbuffer *output = bufferevent_get_output(stream->mux);
+
+    evbuffer_remove_cb_entry(output, stream->mux_mem_cb);
+    if (stream->conn) {
+        prot_main_mem_charge(stream->conn, 0, evbuffer_get_length(output));
+        --stream->conn->n_streams;
+    }
+
+    bufferevent_free(stream->end);
+    bufferevent_free(stream->mux);
+    free_list_put(&stream_free_list, stream);
+}
+
+// Queue chunk transmitter if stream has something to send, stream is freed
+// once its handler is done and all of its data is sent
+static void stream_kick(struct prot_stream *stream) {
+    struct prot_stream **sp;
+    struct prot_main *conn = stream->conn;
+
+    if (stream->tran_pending)
+        return;
+
+    if (evbuffer_get_length(bufferevent_get_input(stream->mux)) > 0 || stream->reset == 1) {
+        stream->tran_pending = 1;
+        prot_main_push_tran(conn, &(stream->htran));
+        return;
+    }
+    if (stream->pmain)
+        return;
+
+    debug("Stream %u closed", stream->id);
+    for (sp = &(conn->streams); *sp != stream; sp = &((*sp)->next));
+    *sp = stream->next;
+
+    stream_free(stream);
+}
+
+// Called once stream handler wrote data, it's sent in chunks
+static void stream_mux_read_cb(struct bufferevent *bev, void *ctx) {
+    stream_kick(ctx);
+}
+
+// Allocate new stream with given ID and add it to the connection
+static struct prot_stream * stream_new(struct prot_main *conn, uint16_t id) {
+    struct bufferevent *pair[2];
+    struct prot_stream *stream;
+
+    stream = free_list_get(&stream_free_list);
+    memset(stream, 0, sizeof(struct prot_stream));
+
+    stream->id = id;
+    stream->conn = conn;
+
+    bufferevent_pair_new(conn->event_base, BEV_OPT_DEFER_CALLBACKS, pair);
+    stream->end = pair[0];
+    stream->mux = pair[1];
+    // Stream data is network traffic as well, end gets its priority once assigned
+    bufferevent_priority_set(stream->mux, bufferevent_get_priority(conn->bev));
+    bufferevent_setcb(stream->mux, stream_mux_read_cb, NULL, NULL, stream);
+    bufferevent_enable(stream->mux, EV_READ | EV_WRITE);
+    stream->mux_mem_cb = evbuffer_add_cb(bufferevent_get_output(stream->mux), stream_mux_mem_cb, stream);
+
+    stream->htran.msg = stream;
+    stream->htran.msg_code = PROT_STREAM_DATA;
+    stream->htran.priority = PROT_PRIO_BULK;
+    stream->htran.setup_cb = chunk_tran_setup;
+    stream->htran.done_cb = chunk_tran_done;
+    stream->htran.buffer = NULL;
+
+    stream->next = conn->streams;
+    conn->streams = stream;
+    ++conn->n_streams;
+
+    return stream;
+}
+
+// Create protocol handler for the stream
+static struct prot_main * stream_attach(struct prot_stream *stream) {
+    struct prot_main *pmain;
+    struct prot_main *conn = stream->conn;
+
+    pmain = prot_main_new(conn->event_base, conn->db);
+    pmain->mode = conn->mode;
+    pmain->stream = stream;
+    stream->pmain = pmain;
+    prot_main_free_on_done(pmain, 1);
+
+    // Streams share transaction of the connection, nothing can be sent before it starts
+    pmain->transaction_started = conn->transaction_started;
+    memcpy(pmain->transaction_id, conn->transaction_id, TRANSACTION_ID_LEN);
+    pmain->tran_enabled = conn->transaction_started;
+    pmain->version = conn->version;
+
+    // Reset was sent for the previous handler, not this one
+    if (stream->reset == 2)
+        stream->reset = 0;
+
+    prot_main_assign(pmain, stream->end);
+    if (evbuffer_get_length(bufferevent_get_input(stream->end)) > 0)
+        bufferevent_trigger(stream->end, EV_READ, BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+    return pmain;
+}
+
+// Open new logical stream over given connection, returns protocol handler
+// of the stream, handlers pushed to it are processed independently from the
+// ones on the connection and on other streams, stream handler frees itself
+// once it's done, and it's closed together with the connection
+struct prot_main * prot_stream_open(struct prot_main *conn) {
+    uint16_t id;
+
+    // Each side uses its own IDs (odd or even), skip the ones still in use
+    do {
+        id = conn->stream_next_id;
+        conn->stream_next_id += 2;
+    } while (id == 0 || stream_find(conn, id));
+
+    debug("Opening stream %u", id);
+    return stream_attach(stream_new(conn, id));
+}
+
+// Put next chunk of stream data into the buffer
+static void chunk_tran_setup(struct prot_main *conn, struct prot_tran_handler *phand) {
+    size_t len;
+    uint8_t flags = 0;
+    uint16_t id_n, len_n;
+    struct evbuffer *input;
+    struct prot_stream *stream = phand->msg;
+
+    input = bufferevent_get_input(stream->mux);
+    len = evbuffer_get_length(input);
+    if (len > PROT_STREAM_CHUNK_LEN)
+        len = PROT_STREAM_CHUNK_LEN;
+
+    // Data of the failed stream is useless to the other side
+    if (stream->reset == 1) {
+        evbuffer_drain(input, evbuffer_get_length(input));
+        flags |= PROT_STREAM_FLAG_RESET;
+        stream->reset = 2;
+        len = 0;
+    }
+
+    id_n = htons(stream->id);
+    len_n = htons(len);
+    evbuffer_add(phand->buffer, prot_header(PROT_STREAM_DATA), PROT_HEADER_LEN);
+    evbuffer_add(phand->buffer, &id_n, sizeof(id_n));
+    evbuffer_add(phand->buffer, &flags, sizeof(flags));
+    evbuffer_add(phand->buffer, &len_n, sizeof(len_n));
+    evbuffer_remove_buffer(input, phand->buffer, len);
+}
+
+// Chunk is sent, queue the next one so streams take turns
+static void chunk_tran_done(struct prot_main *conn, struct prot_tran_handler *phand) {
+    struct prot_stream *stream = phand->msg;
+
+    stream->tran_pending = 0;
+    stream_kick(stream);
+}
+
+// Called by the connection once chunk header arrives, chunk data is passed
+// to the stream, stream is created if it doesn't exist, returns 1 once chunk
+// is processed and 0 if not all data arrived yet, or if connection holds too
+// much stream data (it's processed once streams take their data), sets error
+// on connection if chunk is invalid or stream can't be opened
+int prot_stream_recv(struct prot_main *conn, struct evbuffer *input) {
+    uint8_t *header;
+    uint8_t flags;
+    uint16_t id, len;
+    struct prot_main *pmain;
+    struct prot_stream *stream;
+
+    if (evbuffer_get_length(input) < PROT_STREAM_HEADER_LEN)
+        return 0;
+
+    header = evbuffer_pullup(input, PROT_STREAM_HEADER_LEN);
+    memcpy(&id, header + PROT_HEADER_LEN, sizeof(id));
+    flags = header[PROT_HEADER_LEN + sizeof(id)];
+    memcpy(&len, header + PROT_HEADER_LEN + sizeof(id) + 1, sizeof(len));
+    id = ntohs(id);
+    len = ntohs(len);
+
+    if (len > PROT_STREAM_CHUNK_LEN || id == 0) {
+        prot_main_set_error(conn, PROT_ERR_INVALID_MSG);
+        return 0;
+    }
+    if (!conn->transaction_started) {
+        prot_main_set_error(conn, PROT_ERR_TRANSACTION);
+        return 0;
+    }
+    if (evbuffer_get_length(input) < PROT_STREAM_HEADER_LEN + len)
+        return 0;
+
+    stream = stream_find(conn, id);
+
+    // Other side failed, so does our handler
+    if (flags & PROT_STREAM_FLAG_RESET) {
+        evbuffer_drain(input, PROT_STREAM_HEADER_LEN + len);
+        if (stream && stream->pmain) {
+            // No need to send reset back
+            stream->reset = 2;
+            prot_main_close(stream->pmain, PROT_ERR_CONN_CLOSED);
+        }
+        return 1;
+    }
+
+    // Empty chunk only tells that other side is done with the stream
+    if (len == 0) {
+        evbuffer_drain(input, PROT_STREAM_HEADER_LEN);
+        return 1;
+    }
+
+    // New stream must use IDs of the other side, and there must be room for it
+    if (!stream && ((id & 1) == (conn->stream_next_id & 1) || conn->n_streams >= PROT_STREAM_MAX)) {
+        debug("Stream %u refused", id);
+        prot_main_set_error(conn, PROT_ERR_INVALID_MSG);
+        return 0;
+    }
+    if ((!stream || !stream->pmain) && prot_main_mem_pressure()) {
+        prot_main_set_error(conn, PROT_ERR_MEM_LIMIT);
+        return 0;
+    }
+
+    // Data waiting for streams counts against connection budget, chunk stays
+    // in the input buffer and reading stops until streams take some of it
+    if (conn->mem_used - evbuffer_get_length(input) + len > conn->mem_budget) {
+        conn->stream_blocked = 1;
+        bufferevent_disable(conn->bev, EV_READ);
+        return 0;
+    }
+
+    // New stream, or new exchange on the stream whose handler is done
+    if (!stream)
+        stream = stream_new(conn, id);
+    if (!stream->pmain) {
+        debug("Accepting stream %u", id);
+        pmain = stream_attach(stream);
+        hook_list_call(conn->hooks, PROT_MAIN_EV_STREAM, pmain);
+    }
+
+    evbuffer_drain(input, PROT_STREAM_HEADER_LEN);
+    evbuffer_remove_buffer(input, bufferevent_get_output(stream->mux), len);
+    return 1;
+}
+
+// Called once transaction on the connection starts, streams are allowed
+// to transmit from now on
+void prot_stream_transaction(struct prot_main *conn) {
+    struct prot_stream *stream;
+
+    for (stream = conn->streams; stream != NULL; stream = stream->next) {
+        if (!stream->pmain)
+            continue;
+
+        stream->pmain->transaction_started = 1;
+        memcpy(stream->pmain->transaction_id, conn->transaction_id, TRANSACTION_ID_LEN);
+        stream->pmain->version = conn->version;
+        prot_main_tran_enable(stream->pmain, 1);
+    }
+}
+
+// Called once stream protocol handler is freed, remaining stream data is
+// sent, reset is sent instead if handler failed (reset = 1)
+void prot_stream_detach(struct prot_stream *stream, int reset) {
+    bufferevent_setcb(stream->end, NULL, NULL, NULL, NULL);
+    stream->pmain = NULL;
+
+    // Rest of the failed exchange can't be processed by the next handler
+    if (reset) {
+        struct evbuffer *input = bufferevent_get_input(stream->end);
+        evbuffer_drain(input, evbuffer_get_length(input));
+    }
+
+    // Connection is being freed
+    if (!stream->conn)
+        return;
+
+    if (reset && !stream->reset)
+        stream->reset = 1;
+    // Let the other side know we are done even if there is nothing to send,
+    // stream is freed once the chunk is sent
+    if (!stream->tran_pending) {
+        stream->tran_pending = 1;
+        prot_main_push_tran(stream->conn, &(stream->htran));
+    }
+}
+
+// Close protocol handlers of all streams and free the streams, called
+// once connection is freed
+void prot_stream_free_all(struct prot_main *conn) {
+    struct prot_stream *stream;
+
+    while (stream = conn->streams) {
+        conn->streams = stream->next;
+
+        // Data waiting for the stream is released together with the connection
+        stream->conn = NULL;
+        if (stream->pmain)
+            prot_main_close(stream->pmain, PROT_ERR_CONN_CLOSED);
+
+        stream_free(stream);
+    }
+    conn->n_streams = 0;
+}
@@ -1,7 +1,11 @@
 #include <stdint.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
 #include <prot_main.h>
 #include <prot_transaction.h>
 #include <sys_memory.h>
+#include <free_list.h>
 #include <sys_crash.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
@@ -9,11 +13,16 @@
 #include <openssl/err.h>
 #include <debug.h>
 #include <constants.h>
+#include <helpers_crypto.h>
+#include <crypto_ctx.h>
 
 /**
  * Transaction REQUEST message
  */
 
+// Unused handler objects, reused by next allocation
+static struct free_list req_free_list = FREE_LIST_INIT(struct prot_txn_req, FREE_LIST_MAX_FREE);
+
 // Callback functions
 static void req_tran_cleanup(struct prot_main *pmain, struct prot_tran_handler *phand) {
     struct prot_txn_req *msg = phand->msg;
@@ -21,8 +30,14 @@ static void req_tran_cleanup(struct prot_main *pmain, struct prot_tran_handler *
 }
 
 static void req_tran_setup(struct prot_main *pmain, struct prot_tran_handler *phand) {
+    struct prot_txn_req *msg = phand->msg;
     debug("Setting up transaction req");
-    evbuffer_add(phand->buffer, prot_header(PROT_TRANSACTION_REQUEST), PROT_HEADER_LEN);
+
+    // Header carries version we offer, response carries the one peer speaks
+    pmain->version_offered = msg->version;
+    evbuffer_add(phand->buffer, prot_header_version(PROT_TRANSACTION_REQUEST, msg->version), PROT_HEADER_LEN);
+    // Nothing else can be sent until response with transaction ID is received
+    prot_main_tran_enable(pmain, 0);
 }
 
 static void req_tran_done(struct prot_main *pmain, struct prot_tran_handler *phand) {
@@ -32,8 +47,6 @@ static void req_tran_done(struct prot_main *pmain, struct prot_tran_handler *pha
     // Create new response handler and put it into queue
     res = prot_txn_res_new();
     prot_main_push_recv(pmain, &(res->hrecv));
-    // Disable transmission until response is received
-    prot_main_tran_enable(pmain, 0);
 }
 
 static void req_recv_cleanup(struct prot_main *pmain, struct prot_recv_handler *phand) {
@@ -47,6 +60,9 @@ static void req_recv_handle(struct prot_main *pmain, struct prot_recv_handler *p
     debug("Received transaction request");
 
     buff = bufferevent_get_input(pmain->bev);
+
+    // Version was checked by prot_main, we speak anything up to ours
+    pmain->version = evbuffer_pullup(buff, PROT_HEADER_LEN)[0];
     evbuffer_drain(buff, PROT_HEADER_LEN);
 
     res = prot_txn_res_new();
@@ -54,13 +70,16 @@ static void req_recv_handle(struct prot_main *pmain, struct prot_recv_handler *p
     pmain->current_recv_done = 1;
 }
 
-// Allocate new prot transaction request handler
-struct prot_txn_req * prot_txn_req_new(void) {
+// Allocate new prot transaction request handler, request offers given protocol
+// version, peer which speaks older one answers with it, version is ignored by
+// handler receiving the request
+struct prot_txn_req * prot_txn_req_new(int version) {
     struct prot_txn_req *msg;
     debug("Creating transaction request message object");
 
-    msg = safe_malloc( sizeof(struct prot_txn_req), 
-        "Failed to allocate transaction request msg");
+    msg = free_list_get(&req_free_list);
+    memset(msg, 0, sizeof(struct prot_txn_req));
+    msg->version = version;
 
     msg->hrecv.msg = msg;
     msg->hrecv.msg_code = PROT_TRANSACTION_REQUEST;
@@ -70,24 +89,27 @@ struct prot_txn_req * prot_txn_req_new(void) {
 
     msg->htran.msg = msg;
     msg->htran.msg_code = PROT_TRANSACTION_REQUEST;
+    msg->htran.priority = PROT_PRIO_CONTROL;
     msg->htran.done_cb = req_tran_done;
     msg->htran.setup_cb = req_tran_setup;
     msg->htran.cleanup_cb = req_tran_cleanup;
-    msg->htran.buffer = evbuffer_new();
+    msg->htran.buffer = NULL;
 
     return msg;
 }
 
 // Free given transaction request handler
 void prot_txn_req_free(struct prot_txn_req *msg) {
-    evbuffer_free(msg->htran.buffer);
-    free(msg);
+    free_list_put(&req_free_list, msg);
 }
 
 /**
  * Transaction RESPONSE message
  */
 
+// Unused handler objects, reused by next allocation
+static struct free_list res_free_list = FREE_LIST_INIT(struct prot_txn_res, FREE_LIST_MAX_FREE);
+
 // Callback functions
 static void res_tran_cleanup(struct prot_main *pmain, struct prot_tran_handler *phand) {
     struct prot_txn_res *msg = phand->msg;
@@ -104,7 +126,7 @@ static void res_tran_setup(struct prot_main *pmain, struct prot_tran_handler *ph
             ERR_error_string(ERR_get_error(), NULL));
     }
 
-    evbuffer_add(phand->buffer, prot_header(PROT_TRANSACTION_RESPONSE), PROT_HEADER_LEN);
+    evbuffer_add(phand->buffer, prot_header_version(PROT_TRANSACTION_RESPONSE, pmain->version), PROT_HEADER_LEN);
     evbuffer_add(phand->buffer, msg->txn_id, TRANSACTION_ID_LEN);
 }
 
@@ -112,8 +134,8 @@ static void res_tran_done(struct prot_main *pmain, struct prot_tran_handler *pha
     struct prot_txn_res *msg = phand->msg;
     debug("Transaction response transmission finished");
 
-    pmain->transaction_started = 1;
-    memcpy(pmain->transaction_id, msg->txn_id, TRANSACTION_ID_LEN);
+    prot_main_transaction_start(pmain, msg->txn_id);
+    pmain->transaction_fresh = 1;
 }
 
 static void res_recv_cleanup(struct prot_main *pmain, struct prot_recv_handler *phand) {
@@ -123,6 +145,7 @@ static void res_recv_cleanup(struct prot_main *pmain, struct prot_recv_handler *
 
 static void res_recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand) {
     struct evbuffer *buff;
+    uint8_t txn_id[TRANSACTION_ID_LEN];
     debug("Received transaction response");
 
     buff = bufferevent_get_input(pmain->bev);
@@ -130,9 +153,16 @@ static void res_recv_handle(struct prot_main *pmain, struct prot_recv_handler *p
     if (evbuffer_get_length(buff) < PROT_HEADER_LEN + TRANSACTION_ID_LEN)
         return;
 
+    // Peer answers with version it speaks, it can't be newer than the offered one
+    pmain->version = evbuffer_pullup(buff, PROT_HEADER_LEN)[0];
+    if (pmain->version > pmain->version_offered) {
+        prot_main_set_error(pmain, PROT_ERR_PROTOCOL);
+        return;
+    }
+
     evbuffer_drain(buff, PROT_HEADER_LEN);
-    evbuffer_remove(buff, pmain->transaction_id, TRANSACTION_ID_LEN);
-    pmain->transaction_started = 1;
+    evbuffer_remove(buff, txn_id, TRANSACTION_ID_LEN);
+    prot_main_transaction_start(pmain, txn_id);
     prot_main_tran_enable(pmain, 1);
     pmain->current_recv_done = 1;
 }
@@ -142,15 +172,16 @@ struct prot_txn_res * prot_txn_res_new(void) {
     struct prot_txn_res *msg;
     debug("Creating transaction response message object");
 
-    msg = safe_malloc(sizeof(struct prot_txn_res), 
-        "Failed to allocate transaction response msg");
+    msg = free_list_get(&res_free_list);
+    memset(msg, 0, sizeof(struct prot_txn_res));
 
     msg->htran.msg = msg;
     msg->htran.msg_code = PROT_TRANSACTION_RESPONSE;
+    msg->htran.priority = PROT_PRIO_CONTROL;
     msg->htran.done_cb = res_tran_done;
     msg->htran.setup_cb = res_tran_setup;
     msg->htran.cleanup_cb = res_tran_cleanup;
-    msg->htran.buffer = evbuffer_new();
+    msg->htran.buffer = NULL;
 
     msg->hrecv.msg = msg;
     msg->hrecv.msg_code = PROT_TRANSACTION_RESPONSE;
@@ -163,6 +194,282 @@ struct prot_txn_res * prot_txn_res_new(void) {
 
 // Free given transaction response header
 void prot_txn_res_free(struct prot_txn_res *msg) {
-    evbuffer_free(msg->htran.buffer);
-    free(msg);
-}
\ No newline at end of file
+    free_list_put(&res_free_list, msg);
+}
+
+/**
+ * Transaction 0RTT message
+ */
+
+// Number of one second slots nonces are kept in, two timestamps within the window
+// never share a slot, so nonces found in a slot of other second are expired
+#define TXN_NONCE_SECONDS (2 * PROT_TXN_0RTT_WINDOW + 1)
+
+// Nonce accepted within the time window
+struct txn_nonce {
+    uint8_t nonce[TRANSACTION_ID_LEN];
+    int64_t timestamp;
+    int next_hash;   // Next nonce in the same hash bucket, or in the free list
+    int next_second; // Next nonce accepted in the same second
+};
+
+// Unused handler objects, reused by next allocation
+static struct free_list zrtt_free_list = FREE_LIST_INIT(struct prot_txn_0rtt, FREE_LIST_MAX_FREE);
+
+// Nonces seen within the time window, shared by all threads, nonces are found
+// through the hash table and grouped by second, so whole second can be forgotten
+static pthread_mutex_t nonce_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct txn_nonce *nonces = NULL;
+static int nonce_hash[PROT_TXN_0RTT_MAX_NONCES];
+static int nonce_seconds[TXN_NONCE_SECONDS];
+static int64_t nonce_second_ts[TXN_NONCE_SECONDS];
+static int nonce_free;
+// Nonces with timestamp up to this one were forgotten before they expired,
+// so they can't be checked anymore
+static int64_t nonce_horizon = 0;
+// Random key of the hash function, so peer can't pick nonces which end up in the same bucket
+static uint64_t nonce_key[2];
+
+// Allocate nonce table, called with the lock held
+static void txn_nonce_init(void) {
+    int i;
+
+    nonces = safe_malloc(sizeof(struct txn_nonce) * PROT_TXN_0RTT_MAX_NONCES,
+        "Failed to allocate 0RTT nonce table");
+
+    for (i = 0; i < PROT_TXN_0RTT_MAX_NONCES; i++) {
+        nonce_hash[i] = -1;
+        nonces[i].next_hash = i + 1;
+    }
+    nonces[PROT_TXN_0RTT_MAX_NONCES - 1].next_hash = -1;
+    nonce_free = 0;
+
+    for (i = 0; i < TXN_NONCE_SECONDS; i++)
+        nonce_seconds[i] = -1;
+
+    if (RAND_bytes((uint8_t *)nonce_key, sizeof(nonce_key)) != 1)
+        sys_openssl_crash("Failed to generate 0RTT nonce key");
+}
+
+// Get hash bucket of given nonce
+static int txn_nonce_bucket(const uint8_t *nonce) {
+    uint64_t lo, hi, h;
+
+    memcpy(&lo, nonce, sizeof(lo));
+    memcpy(&hi, nonce + sizeof(lo), sizeof(hi));
+
+    h = (lo ^ nonce_key[0]) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 32;
+    h = (h ^ hi ^ nonce_key[1]) * 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 29;
+
+    return h & (PROT_TXN_0RTT_MAX_NONCES - 1);
+}
+
+// Forget all nonces accepted in the second kept in given slot
+static void txn_nonce_second_drop(int slot) {
+    int i, *p;
+
+    while ((i = nonce_seconds[slot]) >= 0) {
+        nonce_seconds[slot] = nonces[i].next_second;
+
+        p = &nonce_hash[txn_nonce_bucket(nonces[i].nonce)];
+        while (*p != i)
+            p = &(nonces[*p].next_hash);
+        *p = nonces[i].next_hash;
+
+        nonces[i].next_hash = nonce_free;
+        nonce_free = i;
+    }
+}
+
+// Make room for a new nonce by forgetting the oldest second, nonces from that
+// second or earlier are refused from now on since their replay can't be detected
+static void txn_nonce_evict(void) {
+    int i, oldest = -1;
+
+    for (i = 0; i < TXN_NONCE_SECONDS; i++) {
+        if (nonce_seconds[i] < 0)
+            continue;
+        if (oldest < 0 || nonce_second_ts[i] < nonce_second_ts[oldest])
+            oldest = i;
+    }
+
+    if (nonce_second_ts[oldest] > nonce_horizon)
+        nonce_horizon = nonce_second_ts[oldest];
+    txn_nonce_second_drop(oldest);
+}
+
+// Check if 0RTT nonce with given timestamp is fresh and remember it, returns 0 if
+// nonce is accepted and 1 if it is too old or replayed, or if it can't be checked
+// because too many nonces arrived within the window (peer should use normal handshake)
+static int txn_nonce_check(const uint8_t *nonce, int64_t timestamp) {
+    int i, slot, rc = 1;
+    int64_t now = time(NULL);
+
+    // Timestamp check makes it enough to remember nonces within the window
+    if (timestamp < now - PROT_TXN_0RTT_WINDOW || timestamp > now + PROT_TXN_0RTT_WINDOW)
+        return 1;
+
+    pthread_mutex_lock(&nonce_lock);
+
+    if (!nonces)
+        txn_nonce_init();
+
+    if (timestamp <= nonce_horizon)
+        goto out;
+
+    // Slot still holds expired second
+    slot = timestamp % TXN_NONCE_SECONDS;
+    if (nonce_second_ts[slot] != timestamp) {
+        txn_nonce_second_drop(slot);
+        nonce_second_ts[slot] = timestamp;
+    }
+
+    for (i = nonce_hash[txn_nonce_bucket(nonce)]; i >= 0; i = nonces[i].next_hash) {
+        if (!memcmp(nonces[i].nonce, nonce, TRANSACTION_ID_LEN))
+            goto out;
+    }
+
+    if (nonce_free < 0) {
+        txn_nonce_evict();
+        // Own second was the oldest one
+        if (timestamp <= nonce_horizon)
+            goto out;
+    }
+
+    i = nonce_free;
+    nonce_free = nonces[i].next_hash;
+
+    memcpy(nonces[i].nonce, nonce, TRANSACTION_ID_LEN);
+    nonces[i].timestamp = timestamp;
+    nonces[i].next_second = nonce_seconds[slot];
+    nonce_seconds[slot] = i;
+    slot = txn_nonce_bucket(nonce);
+    nonces[i].next_hash = nonce_hash[slot];
+    nonce_hash[slot] = i;
+    rc = 0;
+
+out:
+    pthread_mutex_unlock(&nonce_lock);
+    return rc;
+}
+
+// Derive transaction ID from 0RTT nonce and timestamp, every message signed within
+// the transaction covers the timestamp, so the flight can't be replayed as fresh
+static void txn_0rtt_id(const uint8_t *nonce, uint64_t timestamp, uint8_t *txn_id) {
+    EVP_MD_CTX *ctx;
+    uint8_t hash[EVP_MAX_MD_SIZE];
+
+    timestamp = htobe64(timestamp);
+    ctx = crypto_ctx_md_get();
+    if (
+        !ctx ||
+        !EVP_DigestInit_ex2(ctx, crypto_ctx_md(CRYPTO_CTX_SHA256), NULL) ||
+        !EVP_DigestUpdate(ctx, nonce, TRANSACTION_ID_LEN) ||
+        !EVP_DigestUpdate(ctx, &timestamp, sizeof(timestamp)) ||
+        !EVP_DigestFinal_ex(ctx, hash, NULL)
+    ) {
+        sys_openssl_crash("Failed to derive 0RTT transaction ID");
+    }
+    crypto_ctx_md_put(ctx);
+
+    memcpy(txn_id, hash, TRANSACTION_ID_LEN);
+}
+
+// Callback functions
+static void zrtt_tran_cleanup(struct prot_main *pmain, struct prot_tran_handler *phand) {
+    struct prot_txn_0rtt *msg = phand->msg;
+    prot_txn_0rtt_free(msg);
+}
+
+static void zrtt_tran_setup(struct prot_main *pmain, struct prot_tran_handler *phand) {
+    uint64_t timestamp;
+    uint8_t txn_id[TRANSACTION_ID_LEN];
+    struct prot_txn_0rtt *msg = phand->msg;
+    debug("Setting up 0RTT transaction");
+
+    // Generate random client nonce
+    if (RAND_bytes(msg->nonce, TRANSACTION_ID_LEN) != 1) {
+        sys_crash("openssl", "Failed to generate random bytes with error: %s",
+            ERR_error_string(ERR_get_error(), NULL));
+    }
+    msg->timestamp = time(NULL);
+    timestamp = htobe64(msg->timestamp);
+
+    // There is no response, so peer must be known to speak version with 0RTT
+    pmain->version = pmain->version_offered = prot_code_version(PROT_TRANSACTION_0RTT);
+
+    evbuffer_add(phand->buffer, prot_header(PROT_TRANSACTION_0RTT), PROT_HEADER_LEN);
+    evbuffer_add(phand->buffer, msg->nonce, TRANSACTION_ID_LEN);
+    evbuffer_add(phand->buffer, &timestamp, sizeof(timestamp));
+
+    // Messages set up after this one already belong to the transaction
+    txn_0rtt_id(msg->nonce, msg->timestamp, txn_id);
+    prot_main_transaction_start(pmain, txn_id);
+    pmain->transaction_fresh = 1;
+}
+
+static void zrtt_recv_cleanup(struct prot_main *pmain, struct prot_recv_handler *phand) {
+    struct prot_txn_0rtt *msg = phand->msg;
+    prot_txn_0rtt_free(msg);
+}
+
+static void zrtt_recv_handle(struct prot_main *pmain, struct prot_recv_handler *phand) {
+    struct evbuffer *buff;
+    uint8_t txn_id[TRANSACTION_ID_LEN];
+    struct prot_txn_0rtt *msg = phand->msg;
+    debug("Received 0RTT transaction");
+
+    buff = bufferevent_get_input(pmain->bev);
+
+    if (evbuffer_get_length(buff) < PROT_TXN_0RTT_LEN)
+        return;
+
+    pmain->version = evbuffer_pullup(buff, PROT_HEADER_LEN)[0];
+    evbuffer_drain(buff, PROT_HEADER_LEN);
+    evbuffer_remove(buff, msg->nonce, TRANSACTION_ID_LEN);
+    evbuffer_remove(buff, &(msg->timestamp), sizeof(msg->timestamp));
+    msg->timestamp = be64toh(msg->timestamp);
+
+    // Reject replayed or stale first flight
+    if (pmain->transaction_started || txn_nonce_check(msg->nonce, (int64_t)msg->timestamp)) {
+        prot_main_set_error(pmain, PROT_ERR_TRANSACTION);
+        return;
+    }
+
+    // Nonce was checked above, so signed messages of this transaction are new
+    txn_0rtt_id(msg->nonce, msg->timestamp, txn_id);
+    prot_main_transaction_start(pmain, txn_id);
+    pmain->transaction_fresh = 1;
+    pmain->current_recv_done = 1;
+}
+
+// Allocate new prot zero round trip transaction handler
+struct prot_txn_0rtt * prot_txn_0rtt_new(void) {
+    struct prot_txn_0rtt *msg;
+    debug("Creating 0RTT transaction message object");
+
+    msg = free_list_get(&zrtt_free_list);
+    memset(msg, 0, sizeof(struct prot_txn_0rtt));
+
+    msg->hrecv.msg = msg;
+    msg->hrecv.msg_code = PROT_TRANSACTION_0RTT;
+    msg->hrecv.require_transaction = 0;
+    msg->hrecv.handle_cb = zrtt_recv_handle;
+    msg->hrecv.cleanup_cb = zrtt_recv_cleanup;
+
+    msg->htran.msg = msg;
+    msg->htran.msg_code = PROT_TRANSACTION_0RTT;
+    msg->htran.priority = PROT_PRIO_CONTROL;
+    msg->htran.setup_cb = zrtt_tran_setup;
+    msg->htran.cleanup_cb = zrtt_tran_cleanup;
+    msg->htran.buffer = NULL;
+
+    return msg;
+}
+
+// Free given zero round trip transaction handler
+void prot_txn_0rtt_free(struct prot_txn_0rtt *msg) {
+    free_list_put(&zrtt_free_list, msg);
+}
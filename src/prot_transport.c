@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <event2/bufferevent.h>
+#include <prot_transport.h>
+#include <socks5.h>
+#include <helpers.h>
+#include <sys_memory.h>
+#include <debug.h>
+
+// Connection in progress, passed to the callbacks of the backend
+struct prot_transport_conn {
+    prot_transport_cb cb;
+    void *attr;
+};
+
+// Allocate connection state for given callback
+static struct prot_transport_conn * prot_transport_conn_new(prot_transport_cb cb, void *attr) {
+    struct prot_transport_conn *conn;
+
+    conn = safe_malloc(sizeof(struct prot_transport_conn), "Failed to allocate transport connection");
+    conn->cb = cb;
+    conn->attr = attr;
+
+    return conn;
+}
+
+// Call the callback and free connection state
+static void prot_transport_conn_done(struct prot_transport_conn *conn, struct bufferevent *bev, int err) {
+    prot_transport_cb cb = conn->cb;
+    void *attr = conn->attr;
+
+    free(conn);
+    cb(err ? NULL : bev, err, attr);
+}
+
+// Connect bufferevent to given host and port, returns 0 on success
+static int prot_transport_connect_host(struct bufferevent *bev, const char *host, const char *port) {
+    int rc;
+    struct addrinfo hints, *servinfo, *aip;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((rc = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
+        debug("getaddrinfo: %s", gai_strerror(rc));
+        return 1;
+    }
+
+    for (aip = servinfo; aip != NULL; aip = aip->ai_next) {
+        if (bufferevent_socket_connect(bev, aip->ai_addr, aip->ai_addrlen) == 0)
+            break;
+    }
+    freeaddrinfo(servinfo);
+
+    return aip == NULL;
+}
+
+// Called once socks server connected us to the onion service
+static void tor_socks5_cb(struct bufferevent *bev, enum socks5_errors err, void *attr) {
+    if (err > 0)
+        debug("Socks5 connect failed: %s", socks5_error_string(err));
+
+    prot_transport_conn_done(attr, bev, err > 0);
+}
+
+// Connect to the onion service through Tor socks server
+static int tor_connect(
+    struct bufferevent *bev,
+    const struct prot_route *route,
+    const char *onion_address,
+    const char *onion_port,
+    prot_transport_cb cb,
+    void *attr
+) {
+    int port;
+
+    if (sscanf(onion_port, "%d", &port) != 1 || port <= 0 || port > UINT16_MAX)
+        return 1;
+    if (prot_transport_connect_host(bev, route->address, route->port))
+        return 1;
+
+    debug("Connecting to onion");
+    socks5_connect_onion(bev, (const uint8_t *)onion_address, port,
+        tor_socks5_cb, prot_transport_conn_new(cb, attr));
+    return 0;
+}
+
+// Called once direct connection is made or fails
+static void direct_event_cb(struct bufferevent *bev, short events, void *arg) {
+    if (events & BEV_EVENT_CONNECTED) {
+        bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+        prot_transport_conn_done(arg, bev, 0);
+        return;
+    }
+    if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
+        bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+        prot_transport_conn_done(arg, bev, 1);
+    }
+}
+
+// Connect straight to the peer over TCP
+static int tcp_connect(
+    struct bufferevent *bev,
+    const struct prot_route *route,
+    const char *onion_address,
+    const char *onion_port,
+    prot_transport_cb cb,
+    void *attr
+) {
+    struct prot_transport_conn *conn;
+
+    // Peer is reached directly, onion address is not used
+    (void)onion_address;
+    (void)onion_port;
+
+    conn = prot_transport_conn_new(cb, attr);
+    bufferevent_setcb(bev, NULL, NULL, direct_event_cb, conn);
+
+    if (prot_transport_connect_host(bev, route->address, route->port)) {
+        bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+        free(conn);
+        return 1;
+    }
+
+    debug("Connecting to %s:%s over TCP", route->address, route->port);
+    return 0;
+}
+
+// Connect straight to the peer over unix domain socket
+static int unix_connect(
+    struct bufferevent *bev,
+    const struct prot_route *route,
+    const char *onion_address,
+    const char *onion_port,
+    prot_transport_cb cb,
+    void *attr
+) {
+    struct sockaddr_un sun;
+    struct prot_transport_conn *conn;
+
+    // Peer is reached directly, onion address is not used
+    (void)onion_address;
+    (void)onion_port;
+
+    if (strlen(route->address) >= sizeof(sun.sun_path))
+        return 1;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, route->address);
+
+    conn = prot_transport_conn_new(cb, attr);
+    bufferevent_setcb(bev, NULL, NULL, direct_event_cb, conn);
+
+    if (bufferevent_socket_connect(bev, (struct sockaddr *)&sun, sizeof(sun))) {
+        bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+        free(conn);
+        return 1;
+    }
+
+    debug("Connecting to %s", route->address);
+    return 0;
+}
+
+// Available backends, indexed by transport type
+static const struct prot_transport transports[PROT_TRANSPORT_N] = {
+    [PROT_TRANSPORT_TOR]  = {"tor",  tor_connect},
+    [PROT_TRANSPORT_TCP]  = {"tcp",  tcp_connect},
+    [PROT_TRANSPORT_UNIX] = {"unix", unix_connect},
+};
+
+// Get backend for given transport type
+const struct prot_transport * prot_transport_get(enum prot_transport_types type) {
+    return &(transports[type]);
+}
+
+// Parse route specification, one of "tor", "tor:<host>:<port>", "tcp:<host>:<port>"
+// or "unix:<path>", address and port are copied into given buffers (port buffer
+// must hold MAX_PORT_STR_LEN bytes), returns 0 on success and 1 if spec is invalid
+int prot_transport_parse(
+    const char *spec,
+    enum prot_transport_types *type,
+    char *address,
+    size_t address_len,
+    char *port
+) {
+    int i, port_num;
+    size_t len;
+    const char *rest, *colon;
+
+    address[0] = '\0';
+    port[0] = '\0';
+
+    for (i = 0; i < PROT_TRANSPORT_N; i++) {
+        len = strlen(transports[i].name);
+        if (!strncmp(spec, transports[i].name, len) && (spec[len] == ':' || spec[len] == '\0'))
+            break;
+    }
+    if (i == PROT_TRANSPORT_N)
+        return 1;
+
+    *type = i;
+    rest = spec + len;
+
+    // Tor can use the default socks server
+    if (*rest == '\0')
+        return *type != PROT_TRANSPORT_TOR;
+    ++rest;
+
+    if (*type == PROT_TRANSPORT_UNIX) {
+        if (*rest == '\0' || strlen(rest) >= address_len)
+            return 1;
+        strcpy(address, rest);
+        return 0;
+    }
+
+    // Host may contain colons (IPv6), port is after the last one
+    if (!(colon = strrchr(rest, ':')) || colon == rest || (size_t)(colon - rest) >= address_len)
+        return 1;
+    if (sscanf(colon + 1, "%d", &port_num) != 1 || port_num <= 0 || port_num > UINT16_MAX)
+        return 1;
+
+    memcpy(address, rest, colon - rest);
+    address[colon - rest] = '\0';
+    snprintf(port, MAX_PORT_STR_LEN, "%d", port_num);
+    return 0;
+}
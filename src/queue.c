@@ -1,24 +1,43 @@
 #include <queue.h>
 #include <sys_memory.h>
 #include <stdlib.h>
+#include <string.h>
 
+// Queue node, data is stored right after the node
 struct queue_node {
-    void *data;
     struct queue_node *next;
 };
 
-// Allocate new queue node with given size and copy data to it
-struct queue_node * queue_node_new(void *data, size_t size) {
+// Returns pointer to data stored in given node
+#define queue_node_data(node) ((void *)((node) + 1))
+
+// Get node for given data, unused nodes kept by the queue are reused
+static struct queue_node * queue_node_new(struct queue *q, void *data) {
     struct queue_node *node;
 
-    node = safe_malloc(sizeof(struct queue_node), "Failed to allocate queue node");
-    node->data = safe_malloc(size, "Failed to allocate memory for queue data");
+    if (node = q->spare) {
+        q->spare = node->next;
+        --q->n_spare;
+    } else {
+        node = safe_malloc(sizeof(struct queue_node) + q->item_size, "Failed to allocate queue node");
+    }
     node->next = NULL;
 
-    memcpy(node->data, data, size);
+    memcpy(queue_node_data(node), data, q->item_size);
     return node;
 }
 
+// Keep node for reuse if queue doesn't have enough unused nodes, free it otherwise
+static void queue_node_free(struct queue *q, struct queue_node *node) {
+    if (q->n_spare < QUEUE_MAX_SPARE) {
+        node->next = q->spare;
+        q->spare = node;
+        ++q->n_spare;
+    } else {
+        free(node);
+    }
+}
+
 // Allocate new queue
 struct queue * queue_new(size_t item_size) {
     struct queue *q;
@@ -28,21 +47,26 @@ struct queue * queue_new(size_t item_size) {
     q->length = 0;
     q->item_size = item_size;
     q->front = q->rear = NULL;
+    q->n_spare = 0;
+    q->spare = NULL;
 
     return q;
 }
 
 // Free given queue and all it's elements (nodes)
 void queue_free(struct queue *q) {
-    
-    if (q->length > 0) {
-        while (q->front != NULL) {
-            struct queue_node *next = q->front->next;
-
-            free(q->front->data);
-            free(q->front);
-            q->front = next;
-        }
+    struct queue_node *next;
+
+    while (q->front != NULL) {
+        next = q->front->next;
+        free(q->front);
+        q->front = next;
+    }
+
+    while (q->spare != NULL) {
+        next = q->spare->next;
+        free(q->spare);
+        q->spare = next;
     }
 
     free(q);
@@ -51,10 +75,10 @@ void queue_free(struct queue *q) {
 // Insert given data into queue
 void queue_enqueue(struct queue *q, void *data) {
     if (q->length == 0) {
-        q->front = queue_node_new(data, q->item_size);
+        q->front = queue_node_new(q, data);
         q->rear = q->front;
     } else {
-        q->rear->next = queue_node_new(data, q->item_size);
+        q->rear->next = queue_node_new(q, data);
         q->rear = q->rear->next;
     }
 
@@ -70,11 +94,10 @@ int queue_dequeue(struct queue *q, void *data) {
         return 1;
 
     if (data != NULL)
-        memcpy(data, q->front->data, q->item_size);
+        memcpy(data, queue_node_data(q->front), q->item_size);
 
     next = q->front->next;
-    free(q->front->data);
-    free(q->front);
+    queue_node_free(q, q->front);
     q->front = next;
 
     if (q->length == 1)
@@ -84,6 +107,31 @@ int queue_dequeue(struct queue *q, void *data) {
     return 0;
 }
 
+// Remove element at given index from the queue, returns 0 on success
+// and 1 if there is no such element
+int queue_remove(struct queue *q, int index) {
+    int i;
+    struct queue_node *prev, *node;
+
+    if (index < 0 || index > q->length - 1)
+        return 1;
+    if (index == 0)
+        return queue_dequeue(q, NULL);
+
+    prev = q->front;
+    for (i = 1; i < index; i++)
+        prev = prev->next;
+
+    node = prev->next;
+    prev->next = node->next;
+    if (node == q->rear)
+        q->rear = prev;
+
+    queue_node_free(q, node);
+    --q->length;
+    return 0;
+}
+
 // Get a pointer to the queue element at given index
 void * queue_peek(struct queue *q, int index) {
     int i;
@@ -95,7 +143,15 @@ void * queue_peek(struct queue *q, int index) {
     for (i = 0; i < index; i++)
         node = node->next;
 
-    return node->data;
+    return queue_node_data(node);
+}
+
+// Get a pointer to the last element in the queue, NULL if queue is empty
+void * queue_peek_last(struct queue *q) {
+    if (q->length == 0)
+        return NULL;
+
+    return queue_node_data(q->rear);
 }
 
 // Get the number of elements in the queue
@@ -106,4 +162,4 @@ int queue_get_length(struct queue *q) {
 // Checks if given queue is empty
 int queue_is_empty(struct queue *q) {
     return q->length == 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,176 @@
+#include <time.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <event2/event.h>
+#include <timer_wheel.h>
+#include <sys_memory.h>
+#include <debug.h>
+
+// List of wheels shared by event base, each event loop thread has its own
+static struct timer_wheel *shared_wheels = NULL;
+static pthread_mutex_t shared_wheels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Current time in ticks
+static uint64_t timer_wheel_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_WHEEL_TICK_MS;
+}
+
+// Remove timer from its slot
+static void timer_wheel_unlink(struct timer_wheel *wheel, struct timer_wheel_entry *entry) {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        wheel->slots[entry->expires % TIMER_WHEEL_SLOTS] = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+
+    entry->next = entry->prev = NULL;
+    entry->active = 0;
+
+    // Don't keep the event loop alive while there is nothing to wait for
+    if (--wheel->n_entries == 0)
+        event_del(wheel->tick_ev);
+}
+
+// Called on every tick, runs all timers which expired since last tick
+static void timer_wheel_tick_cb(evutil_socket_t fd, short what, void *arg) {
+    struct timer_wheel *wheel = arg;
+    struct timer_wheel_entry *entry;
+    uint64_t now = timer_wheel_now();
+
+    while (wheel->current_tick < now && wheel->n_entries > 0) {
+        ++wheel->current_tick;
+
+        // Callback may stop other timers, so start from the slot
+        // head after each expired timer
+        entry = wheel->slots[wheel->current_tick % TIMER_WHEEL_SLOTS];
+        while (entry) {
+            if (entry->expires > wheel->current_tick) {
+                entry = entry->next;
+                continue;
+            }
+
+            timer_wheel_unlink(wheel, entry);
+            entry->cb(entry->arg);
+            entry = wheel->slots[wheel->current_tick % TIMER_WHEEL_SLOTS];
+        }
+    }
+
+    if (wheel->n_entries == 0)
+        wheel->current_tick = now;
+}
+
+// Allocate new timer wheel which uses given event base
+struct timer_wheel * timer_wheel_new(struct event_base *base) {
+    struct timer_wheel *wheel;
+
+    wheel = safe_malloc(sizeof(struct timer_wheel), "Failed to allocate memory for timer wheel");
+    memset(wheel, 0, sizeof(struct timer_wheel));
+
+    wheel->base = base;
+    wheel->current_tick = timer_wheel_now();
+    wheel->tick_ev = event_new(base, -1, EV_PERSIST, timer_wheel_tick_cb, wheel);
+
+    return wheel;
+}
+
+// Free given timer wheel, timers in the wheel are left inactive
+void timer_wheel_free(struct timer_wheel *wheel) {
+    int i;
+    struct timer_wheel **wp;
+    struct timer_wheel_entry *entry, *next;
+
+    if (!wheel)
+        return;
+
+    pthread_mutex_lock(&shared_wheels_lock);
+    for (wp = &shared_wheels; *wp; wp = &((*wp)->next)) {
+        if (*wp == wheel) {
+            *wp = wheel->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shared_wheels_lock);
+
+    for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        for (entry = wheel->slots[i]; entry; entry = next) {
+            next = entry->next;
+            entry->next = entry->prev = NULL;
+            entry->active = 0;
+        }
+    }
+
+    event_free(wheel->tick_ev);
+    free(wheel);
+}
+
+// Get wheel shared by everyone using given event base, wheel
+// is created on first use
+struct timer_wheel * timer_wheel_get(struct event_base *base) {
+    struct timer_wheel *wheel;
+
+    pthread_mutex_lock(&shared_wheels_lock);
+    for (wheel = shared_wheels; wheel; wheel = wheel->next) {
+        if (wheel->base == base)
+            break;
+    }
+
+    if (!wheel) {
+        wheel = timer_wheel_new(base);
+        wheel->next = shared_wheels;
+        shared_wheels = wheel;
+    }
+    pthread_mutex_unlock(&shared_wheels_lock);
+
+    return wheel;
+}
+
+// Initialize timer, must be called before timer is used
+void timer_wheel_entry_init(struct timer_wheel_entry *entry, timer_wheel_cb cb, void *arg) {
+    memset(entry, 0, sizeof(struct timer_wheel_entry));
+    entry->cb = cb;
+    entry->arg = arg;
+}
+
+// Start given timer, it will expire after timeout_ms milliseconds,
+// if timer is already active it is restarted
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_wheel_entry *entry, unsigned int timeout_ms) {
+    int slot;
+    uint64_t ticks;
+    uint64_t now = timer_wheel_now();
+    struct timeval tv = { 0, TIMER_WHEEL_TICK_MS * 1000 };
+
+    if (entry->active)
+        timer_wheel_unlink(wheel, entry);
+
+    // Wheel was idle, nothing to catch up with
+    if (wheel->n_entries == 0) {
+        wheel->current_tick = now;
+        event_add(wheel->tick_ev, &tv);
+    }
+
+    // Round up, so timer never expires early
+    ticks = (timeout_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    entry->expires = now + (ticks ? ticks : 1);
+    entry->active = 1;
+
+    slot = entry->expires % TIMER_WHEEL_SLOTS;
+    entry->prev = NULL;
+    entry->next = wheel->slots[slot];
+    if (entry->next)
+        entry->next->prev = entry;
+    wheel->slots[slot] = entry;
+
+    ++wheel->n_entries;
+}
+
+// Stop given timer, nothing happens if timer is not active
+void timer_wheel_del(struct timer_wheel *wheel, struct timer_wheel_entry *entry) {
+    if (entry->active)
+        timer_wheel_unlink(wheel, entry);
+}
@@ -0,0 +1,174 @@
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <event2/event.h>
+#include <worker_pool.h>
+#include <sys_memory.h>
+#include <sys_crash.h>
+#include <db_init.h>
+#include <array.h>
+#include <debug.h>
+
+// How long worker waits for database locked by other workers (ms)
+#define WORKER_POOL_DB_BUSY_TIMEOUT 5000
+
+// Called in the worker thread once listener handed it new sockets
+static void worker_notify_cb(evutil_socket_t fd, short what, void *arg) {
+    evutil_socket_t sock;
+    struct worker *worker = arg;
+
+    for (;;) {
+        // Take one pending socket, don't hold the lock while handling it
+        pthread_mutex_lock(&(worker->lock));
+        if (worker->n_pending == 0) {
+            pthread_mutex_unlock(&(worker->lock));
+            break;
+        }
+        sock = worker->pending[--worker->n_pending];
+        pthread_mutex_unlock(&(worker->lock));
+
+        __atomic_add_fetch(&(worker->n_conns), 1, __ATOMIC_RELAXED);
+        worker->pool->conn_cb(worker, sock, worker->pool->cb_arg);
+    }
+}
+
+// Worker thread, runs event loop until pool is freed
+static void * worker_run(void *arg) {
+    struct worker *worker = arg;
+
+    debug("Worker %d started", worker->id);
+    event_base_loop(worker->base, EVLOOP_NO_EXIT_ON_EMPTY);
+    debug("Worker %d stopped", worker->id);
+
+    return NULL;
+}
+
+// Allocate new worker pool with n_workers threads, each thread opens its
+// own connection to the database at db_path, threads are not started yet
+struct worker_pool * worker_pool_new(
+    int n_workers,
+    const char *db_path,
+    enum worker_pool_balance balance,
+    worker_pool_conn_cb conn_cb,
+    void *cb_arg
+) {
+    int i;
+    struct worker_pool *pool;
+
+    if (n_workers > WORKER_POOL_MAX_WORKERS)
+        n_workers = WORKER_POOL_MAX_WORKERS;
+
+    pool = safe_malloc(sizeof(struct worker_pool), "Failed to allocate memory for worker pool");
+    memset(pool, 0, sizeof(struct worker_pool));
+
+    pool->n_workers = n_workers;
+    pool->balance = balance;
+    pool->conn_cb = conn_cb;
+    pool->cb_arg = cb_arg;
+    pool->db_path = array(char);
+    array_strcpy(pool->db_path, db_path, -1);
+
+    pool->workers = safe_malloc(sizeof(struct worker) * n_workers, "Failed to allocate memory for workers");
+    memset(pool->workers, 0, sizeof(struct worker) * n_workers);
+
+    for (i = 0; i < n_workers; i++) {
+        struct worker *worker = &(pool->workers[i]);
+
+        worker->id = i;
+        worker->pool = pool;
+        worker->base = event_base_new();
+        worker->notify_ev = event_new(worker->base, -1, 0, worker_notify_cb, worker);
+        worker->pending = array(evutil_socket_t);
+        pthread_mutex_init(&(worker->lock), NULL);
+
+        if (sqlite3_open(pool->db_path, &(worker->db)))
+            sys_db_crash(worker->db, "Worker failed to open the database");
+
+        // Workers write concurrently, wait for each other instead of failing
+        sqlite3_busy_timeout(worker->db, WORKER_POOL_DB_BUSY_TIMEOUT);
+        if (i == 0 && sqlite3_exec(worker->db, "PRAGMA journal_mode = WAL", NULL, NULL, NULL) != SQLITE_OK)
+            sys_db_crash(worker->db, "Failed to enable write ahead log");
+        db_init_schema(worker->db);
+    }
+
+    return pool;
+}
+
+// Start all worker threads
+void worker_pool_start(struct worker_pool *pool) {
+    int i;
+
+    for (i = 0; i < pool->n_workers; i++) {
+        if (pthread_create(&(pool->workers[i].thread), NULL, worker_run, &(pool->workers[i])) != 0)
+            sys_crash("Worker pool", "Failed to start worker thread");
+    }
+}
+
+// Hand given socket to one of the workers, called from the listener thread
+void worker_pool_dispatch(struct worker_pool *pool, evutil_socket_t sock) {
+    int i, load, min_load = -1;
+    struct worker *worker = NULL;
+
+    // Start from next worker in line so equally loaded workers take turns
+    for (i = 0; i < pool->n_workers; i++) {
+        struct worker *w = &(pool->workers[(pool->next + i) % pool->n_workers]);
+
+        if (pool->balance == WORKER_POOL_ROUND_ROBIN) {
+            worker = w;
+            break;
+        }
+
+        pthread_mutex_lock(&(w->lock));
+        load = __atomic_load_n(&(w->n_conns), __ATOMIC_RELAXED) + w->n_pending;
+        pthread_mutex_unlock(&(w->lock));
+
+        if (min_load < 0 || load < min_load) {
+            min_load = load;
+            worker = w;
+        }
+    }
+    pool->next = (worker->id + 1) % pool->n_workers;
+
+    pthread_mutex_lock(&(worker->lock));
+    array_set(worker->pending, worker->n_pending, sock);
+    ++worker->n_pending;
+    pthread_mutex_unlock(&(worker->lock));
+
+    event_active(worker->notify_ev, EV_READ, 0);
+}
+
+// Called from the worker thread once connection it handled is closed
+void worker_pool_conn_done(struct worker *worker) {
+    __atomic_sub_fetch(&(worker->n_conns), 1, __ATOMIC_RELAXED);
+}
+
+// Stop all worker threads and free the pool
+void worker_pool_free(struct worker_pool *pool) {
+    int i, j;
+
+    if (!pool)
+        return;
+
+    for (i = 0; i < pool->n_workers; i++) {
+        struct worker *worker = &(pool->workers[i]);
+
+        if (worker->thread) {
+            event_base_loopbreak(worker->base);
+            pthread_join(worker->thread, NULL);
+        }
+
+        for (j = 0; j < worker->n_pending; j++)
+            evutil_closesocket(worker->pending[j]);
+        array_free(worker->pending);
+
+        event_free(worker->notify_ev);
+        event_base_free(worker->base);
+        sqlite3_close(worker->db);
+        pthread_mutex_destroy(&(worker->lock));
+    }
+
+    array_free(pool->db_path);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,131 @@
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <event2/buffer.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <debug.h>
+#include <constants.h>
+#include <crypto_ctx.h>
+#include <buffer_crypto.h>
+#include <helpers_crypto.h>
+
+// Number of times each operation is repeated
+#define N_ROUNDS 200000
+// Length of data each operation works on, small like most protocol fields
+#define DATA_LEN 64
+
+static uint8_t data[DATA_LEN];
+static uint8_t key[32], iv[16];
+
+// Get current time in microseconds
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// SHA-512 digest with new context and implicit fetch, as it was done before
+static void sha512_old(uint8_t *out) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+    EVP_DigestInit_ex2(ctx, EVP_sha512(), NULL);
+    EVP_DigestUpdate(ctx, data, DATA_LEN);
+    EVP_DigestFinal_ex(ctx, out, NULL);
+    EVP_MD_CTX_free(ctx);
+}
+
+// SHA-512 digest with reused context and prefetched algorithm
+static void sha512_new(uint8_t *out) {
+    EVP_MD_CTX *ctx = crypto_ctx_md_get();
+
+    EVP_DigestInit_ex2(ctx, crypto_ctx_md(CRYPTO_CTX_SHA512), NULL);
+    EVP_DigestUpdate(ctx, data, DATA_LEN);
+    EVP_DigestFinal_ex(ctx, out, NULL);
+    crypto_ctx_md_put(ctx);
+}
+
+// AES-256-CBC encryption with new context and implicit fetch
+static void aes_old(uint8_t *out) {
+    int len;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+    EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv);
+    EVP_EncryptUpdate(ctx, out, &len, data, DATA_LEN);
+    EVP_EncryptFinal_ex(ctx, out + len, &len);
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+// AES-256-CBC encryption with reused context and prefetched algorithm
+static void aes_new(uint8_t *out) {
+    int len;
+    EVP_CIPHER_CTX *ctx = crypto_ctx_cipher_get();
+
+    EVP_EncryptInit_ex(ctx, crypto_ctx_cipher(CRYPTO_CTX_AES_256_CBC), NULL, key, iv);
+    EVP_EncryptUpdate(ctx, out, &len, data, DATA_LEN);
+    EVP_EncryptFinal_ex(ctx, out + len, &len);
+    crypto_ctx_cipher_put(ctx);
+}
+
+// Run operation N_ROUNDS times and print average time of a single call
+static double bench(const char *name, void (*op)(uint8_t *)) {
+    int i;
+    double start, per_op;
+    uint8_t out[EVP_MAX_MD_SIZE + DATA_LEN];
+
+    start = now_us();
+    for (i = 0; i < N_ROUNDS; i++)
+        op(out);
+    per_op = (now_us() - start) / N_ROUNDS;
+
+    debug("%-12s %8.3f us/op", name, per_op);
+    return per_op;
+}
+
+int main(void) {
+    int i, n_bad = 0;
+    double old_op, new_op;
+    uint8_t out_old[EVP_MAX_MD_SIZE + DATA_LEN], out_new[EVP_MAX_MD_SIZE + DATA_LEN];
+    uint8_t pub_key[ED25519_PUB_KEY_LEN], priv_key[ED25519_PRIV_KEY_LEN];
+    struct evbuffer *buff;
+
+    debug_set_fp(stdout);
+    crypto_ctx_init();
+
+    RAND_bytes(data, DATA_LEN);
+    RAND_bytes(key, sizeof(key));
+    RAND_bytes(iv, sizeof(iv));
+
+    // Both ways must give the same result
+    sha512_old(out_old);
+    sha512_new(out_new);
+    n_bad += memcmp(out_old, out_new, 64) != 0;
+    aes_old(out_old);
+    aes_new(out_new);
+    n_bad += memcmp(out_old, out_new, DATA_LEN + 16) != 0;
+
+    old_op = bench("sha512 old", sha512_old);
+    new_op = bench("sha512 new", sha512_new);
+    debug("sha512 overhead reduced by %.1f%%", 100 * (old_op - new_op) / old_op);
+
+    old_op = bench("aes-cbc old", aes_old);
+    new_op = bench("aes-cbc new", aes_new);
+    debug("aes-cbc overhead reduced by %.1f%%", 100 * (old_op - new_op) / old_op);
+
+    // Signed buffers go through the prehash contexts
+    buff = evbuffer_new();
+    ed25519_keygen(pub_key, priv_key);
+    for (i = 0; i < 1000; i++) {
+        evbuffer_add(buff, data, DATA_LEN);
+        if (ed25519_buffer_sign(buff, 0, priv_key) ||
+            !ed25519_buffer_validate(buff, evbuffer_get_length(buff), pub_key))
+            n_bad++;
+        evbuffer_drain(buff, evbuffer_get_length(buff));
+    }
+    evbuffer_free(buff);
+
+    debug("Mismatched results: %d", n_bad);
+    return n_bad != 0;
+}
@@ -123,7 +123,7 @@ int main() {
     prot_main_assign(pmain, bev);
     hook_add(pmain->hooks, PROT_MAIN_EV_DONE, pmain_done_cb, NULL);
 
-    treq = prot_txn_req_new();
+    treq = prot_txn_req_new(DEEP_MESSENGER_PROTOCOL_VER_MIN);
     prot_main_push_tran(pmain, &(treq->htran));
 
     //freq = prot_friend_req_new(dbg, "scddeoyfwo2nbioc55fd5hys4voln4qbm3xu65ffhhvzl6rnv7h2aeid.onion");
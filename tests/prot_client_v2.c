@@ -126,7 +126,7 @@ void init_operation() {
     //prot_main_assign(pmain, bev);
     hook_add(pmain->hooks, PROT_MAIN_EV_DONE, pmain_done_event, NULL);
 
-    treq = prot_txn_req_new();
+    treq = prot_txn_req_new(DEEP_MESSENGER_PROTOCOL_VER_MIN);
     prot_main_push_tran(pmain, &(treq->htran));
 
     // Mailbox register
@@ -21,6 +21,19 @@ int main() {
         debug("value[%d] = %d", i, value);
     }
 
+    for (i = 0; i < 4; i++)
+        queue_enqueue(q, &i);
+    // Remove from the middle and from the end
+    queue_remove(q, 1);
+    queue_remove(q, 2);
+    value = 5;
+    queue_enqueue(q, &value);
+
+    for (i = 0; !queue_is_empty(q); i++) {
+        queue_dequeue(q, &value);
+        debug("value[%d] = %d", i, value);
+    }
+
     value = 22;
     queue_enqueue(q, &value);
 